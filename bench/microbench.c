@@ -0,0 +1,284 @@
+// Microbenchmarks for the hot functions of the daemon.
+// Build with 'make microbench' (not part of the default build), run as './microbench'.
+//
+// Runs get_address(), PDOval2string(), dtype2string(), writeMapping(), the per-cycle decode
+// of all inputs (one PDOval2double() per PDO versus decode_update(), see DECODE), and the command
+// dispatch in chatCommand() (including the 'meta all' and 'dump' formatters) over synthetic
+// mapping tables of BENCH_MINSIZE .. BENCH_MAXSIZE entries per direction, and reports
+// the time and the number of heap allocations per operation.
+// Responses are written to /dev/null, so the cost of write() is included but no network.
+// Allocations are counted by wrapping malloc/calloc/realloc at link time (see CMakeLists.txt).
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "ethercat.h" // The 'dump' formatter reads ec_slave[]
+
+#include "EtherCatDaemon.h"
+#include "ecatDriver.h"
+#include "networkServer.h"
+#include "mappingTable.h"
+#include "decodedImage.h"
+
+// Configuration    ************************************************************************
+#define BENCH_MINSIZE 10
+#define BENCH_MAXSIZE 10000
+#define BENCH_MINTIME 200000000 // Run each benchmark for at least this long [ns]
+
+#define BENCH_PDOSPERSLAVE 8    // Synthetic slaves have this many input and output PDOs
+#define BENCH_PDOBYTES     4    // Bytes reserved in the IOmap for each PDO
+
+// Data types       ************************************************************************
+
+struct bench_result {
+    uint64 ops;
+    double ns_per_op;
+    double allocs_per_op;
+};
+
+// File-global data ************************************************************************
+
+volatile uint64 bench_allocs = 0; // Counted by the __wrap_ functions below
+
+int bench_tableSize = 0;
+struct IPserverThreads bench_thread;
+
+char bench_buff_in [BUFFLEN];
+char bench_buff_out[BUFFLEN];
+char bench_hstr    [BUFFLEN];
+uint64 bench_counter = 0;       // Cycles through the table between operations
+volatile double bench_sink;     // Keeps results which are otherwise unused
+
+// Data types which PDOval2string() supports with bitoff=0 and at most BENCH_PDOBYTES bytes
+const uint16 bench_dataTypes[] = {
+    ECT_UNSIGNED8, ECT_INTEGER8, ECT_UNSIGNED16, ECT_INTEGER16,
+    ECT_UNSIGNED32, ECT_INTEGER32, ECT_REAL32
+};
+const uint8 bench_bitLens[] = { 8, 8, 16, 16, 32, 32, 32 };
+#define BENCH_NUMTYPES (sizeof(bench_dataTypes)/sizeof(bench_dataTypes[0]))
+
+// Functions        ************************************************************************
+
+// Count the heap allocations made by the daemon's code
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t nmemb, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+
+void* __wrap_malloc(size_t size) {
+    __atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+    return __real_malloc(size);
+}
+void* __wrap_calloc(size_t nmemb, size_t size) {
+    __atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+    return __real_calloc(nmemb, size);
+}
+void* __wrap_realloc(void* ptr, size_t size) {
+    __atomic_add_fetch(&bench_allocs, 1, __ATOMIC_RELAXED);
+    return __real_realloc(ptr, size);
+}
+
+void bench_freeTable() {
+    if (mapping_in == NULL) return;
+    mappings_free(mapping_out);
+    mappings_free(mapping_in);
+    free(IOmap);
+    mapping_out = NULL;
+    mapping_in  = NULL;
+    IOmap       = NULL;
+}
+
+struct mapping_arena* bench_makeArena(int size, int ioOffset, const char* dirName) {
+    //Build the mappings of one direction, laid out as if they were scanned from the bus.
+    struct mapping_builder builder;
+    mappings_builderInit(&builder);
+    char name[EC_MAXNAME+1];
+    for (int i = 0; i < size; i++) {
+        int type = i % BENCH_NUMTYPES;
+        snprintf(name, EC_MAXNAME+1, "%s channel %d", dirName, i);
+        mappings_add(&builder, 1 + i / BENCH_PDOSPERSLAVE, 0x6000 + 0x10*(i % BENCH_PDOSPERSLAVE), 1,
+                     ioOffset + i*BENCH_PDOBYTES, 0, bench_bitLens[type], bench_dataTypes[type], name);
+    }
+    return mappings_finish(&builder);
+}
+
+void bench_makeTable(int size) {
+    //Synthetic mapping_in and mapping_out with 'size' entries each, an IOmap with some
+    // non-zero content, and the ec_slave[] entries needed by 'dump'.
+    bench_freeTable();
+    bench_tableSize = size;
+
+    mapping_out = bench_makeArena(size, 0,                   "Output");
+    mapping_in  = bench_makeArena(size, size*BENCH_PDOBYTES, "Input");
+    IOmap       = calloc(2*size, BENCH_PDOBYTES);
+    if (mapping_out == NULL || mapping_in == NULL || IOmap == NULL) {
+        fprintf(stderr, "ERROR: could not allocate a table of size %d\n", size);
+        exit(1);
+    }
+    for (int i = 0; i < 2*size*BENCH_PDOBYTES; i++) {
+        IOmap[i] = (char) (i*7 + 3);
+    }
+
+    // 'dump' is limited by the number of slaves that SOEM can hold
+    int numSlaves = (size + BENCH_PDOSPERSLAVE - 1) / BENCH_PDOSPERSLAVE;
+    if (numSlaves > EC_MAXSLAVE-1) numSlaves = EC_MAXSLAVE-1;
+    memset(ec_slave, 0, sizeof(ec_slave));
+    ec_slavecount = numSlaves;
+    for (int slave = 1; slave <= numSlaves; slave++) {
+        int first = (slave-1)*BENCH_PDOSPERSLAVE;
+        int num   = size - first < BENCH_PDOSPERSLAVE ? size - first : BENCH_PDOSPERSLAVE;
+        snprintf(ec_slave[slave].name, EC_MAXNAME+1, "BENCH%d", slave);
+        ec_slave[slave].outputs = (uint8*) (IOmap + mapping_out->offsets[first]);
+        ec_slave[slave].Obytes  = num*BENCH_PDOBYTES;
+        ec_slave[slave].Obits   = num*BENCH_PDOBYTES*8;
+        ec_slave[slave].inputs  = (uint8*) (IOmap + mapping_in->offsets[first]);
+        ec_slave[slave].Ibytes  = num*BENCH_PDOBYTES;
+        ec_slave[slave].Ibits   = num*BENCH_PDOBYTES*8;
+    }
+    ec_DCtime = 123456789;
+    if (!maptable_boot(0)) exit(1);
+
+    config_file.decodeInputs = 1;
+    if (!decode_setup()) exit(1);
+}
+
+// The operations; each one is a single call of the function under test
+
+void bench_getAddressFirst() {
+    struct mappings_PDO* m = &(mapping_in->records[0]);
+    if (get_address(m->slaveIdx, m->idx, m->subidx, mapping_in) != m) exit(2);
+}
+void bench_getAddressLast() {
+    struct mappings_PDO* m = &(mapping_in->records[bench_tableSize-1]);
+    if (get_address(m->slaveIdx, m->idx, m->subidx, mapping_in) != m) exit(2);
+}
+void bench_getAddressMiss() {
+    if (get_address(0xFFFF, 0xFFFF, 0xFF, mapping_in) != NULL) exit(2);
+}
+void bench_PDOval2string() {
+    struct mappings_PDO* m = &(mapping_in->records[bench_counter++ % bench_tableSize]);
+    if (!PDOval2string(m, bench_hstr, BUFFLEN)) exit(2);
+}
+void bench_decodeEach() {
+    double sum = 0.0;
+    for (int i = 0; i < bench_tableSize; i++) {
+        double value;
+        if (PDOval2double(&(mapping_in->records[i]), &value)) sum += value;
+    }
+    bench_sink = sum;
+}
+void bench_decodeAll() {
+    decode_update();
+}
+void bench_dtype2string() {
+    dtype2string(bench_dataTypes[bench_counter++ % BENCH_NUMTYPES], bench_hstr, BUFFLEN);
+}
+void bench_writeMapping() {
+    struct mappings_PDO* m = &(mapping_in->records[bench_counter++ % bench_tableSize]);
+    writeMapping(bench_buff_out, m, bench_thread.connfd);
+}
+
+void bench_command(const char* command) {
+    //Same buffer handling as chatThread()
+    strncpy(bench_buff_in, command, BUFFLEN-1);
+    if (chatCommand(&bench_thread, bench_buff_in, bench_buff_out, bench_hstr)) exit(2);
+    memset(bench_buff_in, 0, BUFFLEN);
+}
+void bench_cmdGetLast() {
+    char command[BUFFLEN];
+    struct mappings_PDO* m = &(mapping_in->records[bench_tableSize-1]);
+    snprintf(command, BUFFLEN, "get %d:%x:%x\n", m->slaveIdx, m->idx, m->subidx);
+    bench_command(command);
+}
+void bench_cmdHelp()    { bench_command("help\n"); }
+void bench_cmdUnknown() { bench_command("frobnicate\n"); }
+void bench_cmdMetaAll() { bench_command("meta all\n"); }
+void bench_cmdDump()    { bench_command("dump\n"); }
+
+struct bench_result bench_run(void (*operation)()) {
+    //Run the operation in batches of doubling size until BENCH_MINTIME has passed
+    struct bench_result result;
+    memset(&result, 0, sizeof(result));
+
+    operation(); // Warm up caches and any lazy initialization
+
+    uint64 allocsStart = __atomic_load_n(&bench_allocs, __ATOMIC_RELAXED);
+    int64  timeStart   = monotonicTime_ns();
+    int64  elapsed     = 0;
+    uint64 batch       = 1;
+    while (elapsed < BENCH_MINTIME) {
+        for (uint64 i = 0; i < batch; i++) {
+            operation();
+        }
+        result.ops += batch;
+        batch *= 2;
+        elapsed = monotonicTime_ns() - timeStart;
+    }
+    uint64 allocs = __atomic_load_n(&bench_allocs, __ATOMIC_RELAXED) - allocsStart;
+
+    result.ns_per_op     = elapsed / (double) result.ops;
+    result.allocs_per_op = allocs  / (double) result.ops;
+    return result;
+}
+
+void bench_report(const char* name, int size, void (*operation)()) {
+    struct bench_result result = bench_run(operation);
+    printf("  %-22s %7d %14.1f %12.2f %12" PRIu64 "\n",
+           name, size, result.ns_per_op, result.allocs_per_op, result.ops);
+    fflush(stdout);
+}
+
+int main(void) {
+    printf("EtherCat IP daemon microbenchmarks\n");
+
+    // Quiet logger; some commands log errors when misused
+    log_level = LOG_LEVEL_ERROR;
+    log_setup();
+
+    if (pthread_mutex_init(&IOmap_lock, NULL) != 0) {
+        perror("ERROR pthread_mutex_init has failed for IOmap_lock");
+        exit(1);
+    }
+    inOP     = TRUE;
+    updating = TRUE;
+
+    memset(&bench_thread, 0, sizeof(bench_thread));
+    bench_thread.connfd = open("/dev/null", O_WRONLY);
+    if (bench_thread.connfd < 0) {
+        perror("ERROR could not open /dev/null");
+        exit(1);
+    }
+    memset(bench_buff_in,  0, BUFFLEN);
+    memset(bench_buff_out, 0, BUFFLEN);
+    memset(bench_hstr,     0, BUFFLEN);
+
+    printf("  %-22s %7s %14s %12s %12s\n", "benchmark", "entries", "ns/op", "allocs/op", "ops");
+    for (int size = BENCH_MINSIZE; size <= BENCH_MAXSIZE; size *= 10) {
+        bench_makeTable(size);
+
+        bench_report("get_address (first)", size, bench_getAddressFirst);
+        bench_report("get_address (last)",  size, bench_getAddressLast);
+        bench_report("get_address (miss)",  size, bench_getAddressMiss);
+        bench_report("PDOval2string",       size, bench_PDOval2string);
+        bench_report("decode (each PDO)",   size, bench_decodeEach);
+        bench_report("decode_update",       size, bench_decodeAll);
+        bench_report("dtype2string",        size, bench_dtype2string);
+        bench_report("writeMapping",        size, bench_writeMapping);
+        bench_report("cmd 'get' (last)",    size, bench_cmdGetLast);
+        bench_report("cmd 'help'",          size, bench_cmdHelp);
+        bench_report("cmd unknown",         size, bench_cmdUnknown);
+        bench_report("cmd 'meta all'",      size, bench_cmdMetaAll);
+        bench_report("cmd 'dump'",          size, bench_cmdDump);
+    }
+
+    bench_freeTable();
+    close(bench_thread.connfd);
+    log_shutdown();
+
+    return 0;
+}
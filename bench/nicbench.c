@@ -0,0 +1,203 @@
+// Round trip benchmark for the EtherCAT socket: SOEM's plain raw socket versus the packet
+// rings of NIC_RING YES, with and without NIC_BUSYPOLL (see src/packetRing.h).
+// Build with 'make nicbench' (not part of the default build), run as root on a veth pair:
+//
+//   ip link add vtest0 type veth peer name vtest1
+//   ip link set vtest0 up; ip link set vtest1 up
+//   ./nicbench vtest0 vtest1 [frames] [busypoll_us]
+//
+// A thread on the peer interface plays the slaves: it sends every frame straight back, with
+// the locally administered bit set in the source MAC, as the first EtherCAT slave does.
+// The main thread sends a frame and calls recv() until it is back, through the same
+// send()/recv() wrappers which SOEM's nicdrv goes through in the daemon, and reports the
+// distribution of the round trip times and the number of recv() calls per frame.
+// On a real bus, use a cable loop between two ports instead of the veth pair.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <sys/socket.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+
+#include "EtherCatDaemon.h"
+#include "packetRing.h"
+
+// Configuration    ************************************************************************
+#define NICBENCH_FRAMES    20000   // Round trips per mode, unless given
+#define NICBENCH_BUSYPOLL  50      // [us], unless given
+#define NICBENCH_FRAMELEN  128     // Ethernet header plus one small datagram
+#define NICBENCH_TIMEOUT   10000000 // Give up on a frame after this long [ns]
+#define NICBENCH_ETHERTYPE 0x88A4  // EtherCAT
+
+// File-global data ************************************************************************
+
+volatile int nicbench_stop = 0;
+int nicbench_peerfd = -1;
+
+// Functions        ************************************************************************
+
+int nicbench_socket(const char* ifname) {
+    //A raw socket set up as SOEM's ecx_setupnic() does
+    int fd = socket(PF_PACKET, SOCK_RAW, htons(NICBENCH_ETHERTYPE));
+    if (fd < 0) {
+        perror("ERROR could not open a raw socket (root?)");
+        exit(1);
+    }
+    struct timeval timeout = { .tv_sec = 0, .tv_usec = 1 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    int dontroute = 1;
+    setsockopt(fd, SOL_SOCKET, SO_DONTROUTE, &dontroute, sizeof(dontroute));
+
+    struct sockaddr_ll sll;
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family   = AF_PACKET;
+    sll.sll_ifindex  = if_nametoindex(ifname);
+    sll.sll_protocol = htons(NICBENCH_ETHERTYPE);
+    if (sll.sll_ifindex == 0 || bind(fd, (struct sockaddr*)&sll, sizeof(sll)) != 0) {
+        fprintf(stderr, "ERROR could not bind to interface %s: %s\n", ifname, strerror(errno));
+        exit(1);
+    }
+    return fd;
+}
+
+void* nicbench_reflector(void* arg) {
+    (void)arg; // Not used
+    //Send every unmarked frame back, marked
+    char frame[ETH_FRAME_LEN];
+    while (!nicbench_stop) {
+        ssize_t len = recv(nicbench_peerfd, frame, sizeof(frame), 0);
+        if (len < ETH_HLEN || (frame[6] & 0x02)) {
+            continue; // Timeout, or our own frame going out
+        }
+        frame[6] |= 0x02;
+        send(nicbench_peerfd, frame, len, 0);
+    }
+    return NULL;
+}
+
+int nicbench_compare(const void* a, const void* b) {
+    int64 x = *(const int64*)a;
+    int64 y = *(const int64*)b;
+    return (x > y) - (x < y);
+}
+
+void nicbench_run(const char* name, const char* ifname, int ring, int busyPoll_us, int frames) {
+    int fd = nicbench_socket(ifname);
+    if (ring && !ring_setup(fd, busyPoll_us)) {
+        exit(1);
+    }
+
+    int64* rtt = malloc(frames * sizeof(int64));
+    if (rtt == NULL) {
+        fprintf(stderr, "ERROR out of memory\n");
+        exit(1);
+    }
+
+    char frame[NICBENCH_FRAMELEN];
+    char back [ETH_FRAME_LEN];
+    memset(frame, 0, sizeof(frame));
+    memset(frame,     0xFF, 6);             // Broadcast, as SOEM
+    memset(frame + 6, 0x01, 6);             // SOEM's primary source MAC
+    frame[12] = NICBENCH_ETHERTYPE >> 8;
+    frame[13] = NICBENCH_ETHERTYPE & 0xFF;
+
+    struct ring_counters before, after;
+    ring_read(&before);
+
+    uint64 recvCalls = 0;
+    int lost = 0;
+    int done = 0;
+    for (int i = 0; i < frames; i++) {
+        memcpy(frame + ETH_HLEN, &i, sizeof(i)); // Sequence number, to skip stale frames
+        int64 start = monotonicTime_ns();
+        if (send(fd, frame, sizeof(frame), 0) != sizeof(frame)) {
+            lost++;
+            continue;
+        }
+        int got = 0;
+        while (!got && monotonicTime_ns() - start < NICBENCH_TIMEOUT) {
+            ssize_t len = recv(fd, back, sizeof(back), 0);
+            recvCalls++;
+            int seq;
+            memcpy(&seq, back + ETH_HLEN, sizeof(seq));
+            got = len >= ETH_HLEN + (ssize_t)sizeof(seq) && (back[6] & 0x02) && seq == i;
+        }
+        if (got) {
+            rtt[done++] = monotonicTime_ns() - start;
+        }
+        else {
+            lost++;
+        }
+    }
+    ring_read(&after);
+
+    if (done > 0) {
+        qsort(rtt, done, sizeof(int64), nicbench_compare);
+        printf("  %-16s %9.1f %9.1f %9.1f %9.1f %10.1f %7d\n", name,
+               rtt[0]/1e3, rtt[done/2]/1e3, rtt[(int)(done*0.99)]/1e3, rtt[done-1]/1e3,
+               (double)recvCalls / frames, lost);
+    }
+    else {
+        printf("  %-16s no frame came back\n", name);
+    }
+    if (ring) {
+        printf("  %-16s rx %" PRIu64 " tx %" PRIu64 " spun %" PRIu64 " waited %" PRIu64
+               " empty %" PRIu64 " tx busy %" PRIu64 " drops %" PRIu64 "\n", "",
+               after.rxFrames - before.rxFrames, after.txFrames - before.txFrames,
+               after.rxSpins - before.rxSpins, after.rxWaits - before.rxWaits,
+               after.rxEmpty - before.rxEmpty, after.txBusy - before.txBusy, after.drops - before.drops);
+    }
+
+    free(rtt);
+    //The rings of this socket stay mapped; the next ring_setup() takes over
+    if (!ring) close(fd);
+}
+
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s <interface> <peer interface> [frames] [busypoll_us]\n", argv[0]);
+        return 1;
+    }
+    int frames      = argc > 3 ? atoi(argv[3]) : NICBENCH_FRAMES;
+    int busyPoll_us = argc > 4 ? atoi(argv[4]) : NICBENCH_BUSYPOLL;
+    if (frames <= 0 || busyPoll_us <= 0) {
+        fprintf(stderr, "ERROR frames and busypoll_us must be > 0\n");
+        return 1;
+    }
+
+    printf("EtherCat IP daemon NIC benchmark: %s <-> %s, %d frames of %d bytes\n",
+           argv[1], argv[2], frames, NICBENCH_FRAMELEN);
+    log_level = LOG_LEVEL_ERROR;
+    log_setup();
+
+    nicbench_peerfd = nicbench_socket(argv[2]);
+    struct timeval peerTimeout = { .tv_sec = 0, .tv_usec = 100000 }; // Blocks, but notices nicbench_stop
+    setsockopt(nicbench_peerfd, SOL_SOCKET, SO_RCVTIMEO, &peerTimeout, sizeof(peerTimeout));
+    pthread_t reflector;
+    if (pthread_create(&reflector, NULL, nicbench_reflector, NULL) != 0) {
+        perror("ERROR could not start the reflector thread");
+        return 1;
+    }
+
+    char busyName[32];
+    snprintf(busyName, sizeof(busyName), "ring+busy %dus", busyPoll_us);
+    printf("  %-16s %9s %9s %9s %9s %10s %7s\n", "mode", "min[us]", "med[us]", "p99[us]", "max[us]", "recv/frame", "lost");
+    nicbench_run("plain socket", argv[1], 0, 0,           frames);
+    nicbench_run("ring",         argv[1], 1, 0,           frames);
+    nicbench_run(busyName,       argv[1], 1, busyPoll_us, frames);
+
+    nicbench_stop = 1;
+    pthread_join(reflector, NULL);
+    close(nicbench_peerfd);
+    log_shutdown();
+    return 0;
+}
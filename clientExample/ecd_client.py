@@ -1,4 +1,6 @@
 import socket
+import mmap
+import struct
 
 class ecd_client(object):
     "Simple class which handles connections to an EtherCat daemon"
@@ -6,20 +8,30 @@ class ecd_client(object):
     sock = None
     host = None
     port = None
+    unix_path = None
 
     isReady = None #Ready for next command
 
+    events = None #Pending 'evt ...' lines (alarms), as lists of words
+
     __BUFFLEN = 1024
 
-    def __init__(self, host=socket._LOCALHOST, port=4200):
+    def __init__(self, host=socket._LOCALHOST, port=4200, unix_path=None):
+        "Connect over TCP, or to the daemon's UNIX_SOCKET if unix_path is given"
         self.host = host
         self.port = port
+        self.unix_path = unix_path
 
         self.isReady = False
+        self.events = []
 
-        self.sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
         try:
-            self.sock.connect((self.host,self.port))
+            if self.unix_path is not None:
+                self.sock = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+                self.sock.connect(self.unix_path)
+            else:
+                self.sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+                self.sock.connect((self.host,self.port))
         except Exception as err:
             print("Socket exception on connect():", err)
             self.sock = None
@@ -28,9 +40,9 @@ class ecd_client(object):
         self.doRead()
         assert self.isReady
 
-    def doRead(self):
-        "Read from the socket until an ok is found"
-        istr_complete = b''
+    def doRead(self, istr_complete=b''):
+        "Read from the socket until an ok is found; istr_complete is anything already received"
+        istr_complete = istr_complete.rstrip(b'\0')
 
         while True: #Recieve data untill 'ok\n'
             istr = self.sock.recv(self.__BUFFLEN)
@@ -41,12 +53,16 @@ class ecd_client(object):
                 break
         self.isReady = True
 
-        ilines = istr_complete.split(b'\n')
+        ilines = istr_complete.replace(b'\0', b'').split(b'\n') # Records of many-line replies are padded
         ilines_filtered = []
 
         for l in ilines:
             if l == b'ok' or l == b'':
                 continue
+            if l[:4] == b'evt ':
+                #Asynchronous event, sent while we were idle
+                self.events.append(l.decode('ascii').split()[1:])
+                continue
             if l[:3] == b'err':
                 raise ecd_error
             assert l[:2] == b'  ', "Expect first two chars of response to be blank, got '{}'".format(l)
@@ -63,19 +79,222 @@ class ecd_client(object):
 
         # TODO: Parse it in a meaningfull way...
 
-    def call_get(self, slave, idx, subidx):
+    def call_mcast(self):
+        "Description of the multicast group and payload layout, see ecd_mcast.py"
+        self.sock.send(b'mcast')
+        return self.doRead()
+
+    def call_stats(self, slave, idx, subidx):
+        "Windowed aggregates of a channel; returns a list of dicts, one per configured window"
         address = bytes("{:d}:0x{:04x}:0x{:02x}".format(slave,idx,subidx), 'ascii')
-        self.sock.send(b'get '+address)
+        self.sock.send(b'stats '+address)
+
+        windows = []
+        for line in self.doRead():
+            rs = line.decode('ascii').split()
+            windows.append({rs[i]: float(rs[i+1]) for i in range(0, len(rs)-1, 2)})
+        return windows
+
+    def call_history(self, slave, idx, subidx, span, points=1000):
+        "Downsampled history of a HISTORY channel over the last span [s]; returns (resolution [s], rows of (time [ns], min, max, mean))"
+        address = "{:d}:0x{:04x}:0x{:02x}".format(slave,idx,subidx)
+        self.sock.send(bytes("history {} {} {:d}".format(address, span, points), 'ascii'))
+        resp = self.doRead()
+        resolution = float(resp[0].split()[4])
+        rows = []
+        for line in resp[1:]:
+            rs = line.split()
+            rows.append((int(rs[0]), float(rs[1]), float(rs[2]), float(rs[3])))
+        return (resolution, rows)
+
+    def call_allocStats(self):
+        "Heap allocations per thread (instrumented build only); returns (cycle allocations since OP, {thread: allocs})"
+        self.sock.send(b'stats alloc')
+        rs = self.doRead()
+        threads = {l.split()[1].decode('ascii'): int(l.split()[3]) for l in rs[1:]}
+        return (int(rs[0].split()[2]), threads)
+
+    def call_health(self):
+        "Communication health counters; returns (totals, slaves), a dict and a list of dicts (slave 1 first)"
+        self.sock.send(b'health')
+        rs = self.doRead()
+        totals = rs[0].decode('ascii').split()
+        totals = {totals[i]: int(totals[i+1]) for i in range(1, len(totals)-1, 2)}
+        slaves = []
+        for line in rs[1:]:
+            line, name = line.decode('ascii').split(' name ', 1)
+            words = line.split()
+            slave = {'name': name}
+            for i in range(0, len(words)-1, 2):
+                key, value = words[i], words[i+1]
+                if '/' in value:   # successes/attempts
+                    slave[key] = tuple(int(v) for v in value.split('/'))
+                elif '.' in value:
+                    slave[key] = float(value)
+                else:
+                    slave[key] = int(value, 0)
+            slaves.append(slave)
+        return (totals, slaves)
+
+    def call_trigger(self, args=''):
+        "Arm/disarm/show the triggered capture, e.g. args='arm above 2:0x6000:0x11 1000'; returns the state line(s)"
+        self.sock.send(bytes('trigger '+args, 'ascii'))
+        return self.doRead()
+
+    def call_capture(self):
+        "Retrieve a finished capture; returns (column names, rows), each row a list of floats starting with offset, cycle, wkc"
+        self.sock.send(b'capture')
+        resp = self.doRead()
+        columns = resp[1].decode('ascii').split()[1:]
+        rows = [[float(v) for v in l.split()] for l in resp[2:]]
+        return (columns, rows)
+
+    def call_shm(self):
+        "Map the shared memory process image (UNIX socket and UNIX_SHM YES only); returns an ecd_shm"
+        self.sock.send(b'shm')
+        istr, fds, flags, addr = socket.recv_fds(self.sock, self.__BUFFLEN, 1)
+        try:
+            resp = self.doRead(istr)
+        except ecd_error:
+            for fd in fds:
+                socket.close(fd)
+            raise
+        rs = resp[0].decode('ascii').split()
+        desc = {rs[i]: rs[i+1] for i in range(0, len(rs)-1, 2)}
+        return ecd_shm(fds[0], int(desc['header']), int(desc['image']))
+
+    def call_alarm_add(self, mode, slave, idx, subidx, level, hysteresis=0.0):
+        "Add an alarm condition (mode above, below, rising or falling); returns its id"
+        address = "{:d}:0x{:04x}:0x{:02x}".format(slave,idx,subidx)
+        self.sock.send(bytes('alarm add {} {} {!r} {!r}'.format(mode, address, float(level), float(hysteresis)), 'ascii'))
+        return int(self.doRead()[0].split()[1])
+
+    def call_alarm_del(self, alarmId):
+        self.sock.send(bytes('alarm del {:d}'.format(alarmId), 'ascii'))
+        self.doRead()
+
+    def wait_event(self, timeout=None):
+        "Return the next event, e.g. ['alarm', '3', 'on', '2:0x6000:0x11', 'value', '151', 'cycle', '1234'], or None on timeout"
+        self.sock.settimeout(timeout)
+        try:
+            while len(self.events) == 0:
+                istr = self.sock.recv(self.__BUFFLEN).rstrip(b'\0')
+                if istr == b'':
+                    break
+                for l in istr.split(b'\n'):
+                    if l[:4] == b'evt ':
+                        self.events.append(l.decode('ascii').split()[1:])
+        except socket.timeout:
+            pass
+        finally:
+            self.sock.settimeout(None)
+
+        if len(self.events) == 0:
+            return None
+        return self.events.pop(0)
+
+    def call_get(self, slave, idx, subidx, fresh=False):
+        "Current value of a PDO; with fresh=True, wait for the next cycle and return (value, cycle number)"
+        address = bytes("{:d}:0x{:04x}:0x{:02x}".format(slave,idx,subidx), 'ascii')
+        self.sock.send(b'get '+address+(b' fresh' if fresh else b''))
         
         resp = self.doRead()
         assert len(resp) == 1
 
         rs = resp[0].split()
+        cycle = None
+        if fresh:
+            cycle = int(rs[-1])
+            rs = rs[:-2]
         typeName = rs[-1]
         if typeName.startswith(b'INTEGER') or typeName.startswith(b'UNSIGNED'): 
-            return int(rs[1])
+            value = int(rs[1])
         elif typeName.startswith(b'REAL'):
-            return float(rs[0])
+            value = float(rs[0])
+        else:
+            value = None
+
+        if fresh:
+            return (value, cycle)
+        return value
+
+    def call_nodes(self):
+        "State of the upstreams of an aggregator (daemon --aggregate); returns a list of dicts"
+        self.sock.send(b'nodes')
+        nodes = []
+        for line in self.doRead():
+            rs = line.decode('ascii').split()
+            node = {rs[i]: rs[i+1] for i in range(4, len(rs)-1, 2)}
+            node.update({'name': rs[1], 'address': rs[2], 'state': rs[3]})
+            nodes.append(node)
+        return nodes
+
+    def call_get_node(self, node, slave, idx, subidx):
+        "Cached value of an input PDO of an upstream, on an aggregator; returns (value, cycle, time_ns)"
+        address = bytes("{}/{:d}:0x{:04x}:0x{:02x}".format(node,slave,idx,subidx), 'ascii')
+        self.sock.send(b'get '+address)
+
+        rs = self.doRead()[0].split()
+        cycle   = int(rs[-3])
+        time_ns = int(rs[-1])
+        rs = rs[:-4]
+        typeName = rs[-1]
+        if typeName.startswith(b'INTEGER') or typeName.startswith(b'UNSIGNED'):
+            value = int(rs[1])
+        elif typeName.startswith(b'REAL'):
+            value = float(rs[0])
+        else:
+            value = None
+        return (value, cycle, time_ns)
+
+    def call_rescan(self):
+        "Re-read the PDO mappings from the slaves; returns a dict with slaves, entries, changed and generation"
+        self.sock.send(b'rescan')
+        rs = self.doRead()[0].decode('ascii').split()
+        return {rs[i]: rs[i+1] for i in range(1, len(rs)-1, 2)}
+
+    def call_waitcycle(self, numCycles=1):
+        "Wait until numCycles more cycles are done; returns (cycle number, DC time)"
+        self.sock.send(bytes('waitcycle {:d}'.format(numCycles), 'ascii'))
+        rs = self.doRead()[0].split()
+        return (int(rs[1]), int(rs[2][2:].rstrip(b';')))
+
+    def call_wave_channels(self, channels):
+        "Take over the waveform player and select the outputs, a list of (slave, idx, subidx)"
+        addresses = ["{:d}:0x{:04x}:0x{:02x}".format(*c) for c in channels]
+        self.sock.send(bytes('wave channels ' + ' '.join(addresses), 'ascii'))
+        self.doRead()
+
+    def call_wave_load(self, rows, loop=False):
+        "Upload rows (one value per channel) as one segment and queue it; waits while two segments are queued"
+        cmd = 'wave data'
+        for row in rows:
+            rowStr = ' ' + ' '.join(repr(float(v)) for v in row) + ';'
+            if len(cmd) + len(rowStr) >= self.__BUFFLEN:
+                self.sock.send(bytes(cmd, 'ascii'))
+                self.doRead()
+                cmd = 'wave data'
+            cmd += rowStr
+        self.sock.send(bytes(cmd, 'ascii'))
+        self.doRead()
+        self.sock.send(b'wave commit loop' if loop else b'wave commit')
+        self.doRead()
+
+    def call_wave_start(self):
+        self.sock.send(b'wave start')
+        self.doRead()
+
+    def call_wave_stop(self):
+        self.sock.send(b'wave stop')
+        self.doRead()
+
+    def call_wave_status(self):
+        "Returns a dict with the state of the player (state, owner, channels, row, queued, played, ...)"
+        self.sock.send(b'wave')
+        rs = self.doRead()[0].decode('ascii').split()
+        status = {rs[i]: rs[i+1] for i in range(2, len(rs)-1, 2)}
+        status['state'] = rs[1]
+        return status
 
     def __del__(self):
         if self.sock == None:
@@ -84,10 +303,38 @@ class ecd_client(object):
         self.sock.send(b'bye')
         istr = self.sock.recv(self.__BUFFLEN)
 
-        if (istr != b'bye\n'):
+        if (istr.strip(b'\0') != b'bye\n'):
             print("WARNING: Got unexpected close message '{}'".format(istr))
 
         self.sock.close()
 
+class ecd_shm(object):
+    "Read-only view of the daemon's shared memory process image, see src/shmImage.h"
+
+    # struct shm_header, native byte order
+    __HEADER = struct.Struct('=4sHHIIQqqii')
+
+    def __init__(self, fd, headerSize, imageSize):
+        self.headerSize = headerSize
+        self.imageSize  = imageSize
+        self.mem = mmap.mmap(fd, headerSize+imageSize, prot=mmap.PROT_READ)
+        socket.close(fd)
+
+        magic = self.__HEADER.unpack_from(self.mem, 0)[0]
+        assert magic == b'ECDS', "Unexpected shared memory magic {}".format(magic)
+
+    def read(self):
+        "Consistent snapshot; returns (cycle, DCtime, wkc, expectedWKC, image bytes). Offsets are as in 'meta all'."
+        while True:
+            seq1 = self.__HEADER.unpack_from(self.mem, 0)[4]
+            if seq1 & 1:
+                continue
+            (magic, version, headerSize, imageSize, seq, cycle, DCtime, time_ns, wkc, expectedWKC) = \
+                self.__HEADER.unpack_from(self.mem, 0)
+            image = self.mem[self.headerSize:self.headerSize+self.imageSize]
+            seq2 = self.__HEADER.unpack_from(self.mem, 0)[4]
+            if seq1 == seq2:
+                return (cycle, DCtime, wkc, expectedWKC, image)
+
 class ecd_error(Exception):
     pass
\ No newline at end of file
@@ -0,0 +1,108 @@
+#! /usr/bin/env python3
+
+# Receiver for the process image datagrams published by the EtherCatDaemon (MCAST_GROUP in config.txt)
+
+import socket
+import struct
+import sys
+
+class ecd_mcast(object):
+    "Receives and decodes the multicast datagrams from an EtherCat daemon"
+
+    # Must match struct mcast_header in src/mcastPublisher.h
+    __HEADER = struct.Struct('<4sHHIQQqiiI')
+
+    FLAG_SUBSET   = 0x0001
+    FLAG_WKCERROR = 0x0002
+
+    # Type name (as given by 'mcast' and 'meta all') -> struct format
+    __TYPES = { b'INTEGER8'  : '<b', b'INTEGER16'  : '<h', b'INTEGER32'  : '<i', b'INTEGER64'  : '<q',
+                b'UNSIGNED8' : '<B', b'UNSIGNED16' : '<H', b'UNSIGNED32' : '<I', b'UNSIGNED64' : '<Q',
+                b'REAL32'    : '<f', b'REAL64'     : '<d' }
+
+    sock   = None
+    layout = None # List of (offset, bitoff, bitlen, (slave,idx,subidx), typeName, name)
+    layoutId = None
+
+    lastSeq = None
+    lost    = 0   # Number of datagrams missed, according to the sequence numbers
+
+    def __init__(self, group='239.255.42.1', port=4201, iface='0.0.0.0'):
+        self.sock = socket.socket(socket.AF_INET, socket.SOCK_DGRAM, socket.IPPROTO_UDP)
+        self.sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        self.sock.bind(('', port))
+        mreq = struct.pack('4s4s', socket.inet_aton(group), socket.inet_aton(iface))
+        self.sock.setsockopt(socket.IPPROTO_IP, socket.IP_ADD_MEMBERSHIP, mreq)
+
+    def setLayout(self, mcastLines):
+        "Set the payload layout from the response lines of the 'mcast' command, e.g. ecd_client.call_mcast()"
+        head = mcastLines[0].split()
+        self.layoutId = int(head[head.index(b'layout')+1], 16)
+
+        self.layout = []
+        for l in mcastLines[1:]:
+            ls = l.split(None, 4)
+            offset, bitoff = ls[0].strip(b'[]').split(b'.')
+            slave, idx, subidx = ls[1].split(b':')
+            self.layout.append( (int(offset,16), int(bitoff), int(ls[2],16),
+                                 (int(slave), int(idx,16), int(subidx,16)),
+                                 ls[3], ls[4] if len(ls) > 4 else b'') )
+
+    def recv(self):
+        "Wait for the next datagram; returns (header dict, payload bytes)"
+        while True:
+            data = self.sock.recv(65536)
+            if len(data) < self.__HEADER.size:
+                continue
+            (magic, version, flags, layoutId, seq, cycle, DCtime, wkc, expectedWKC, payloadLen) = \
+                self.__HEADER.unpack_from(data)
+            if magic != b'ECDM':
+                continue
+
+            if self.lastSeq is not None and seq > self.lastSeq + 1:
+                self.lost += seq - self.lastSeq - 1
+            self.lastSeq = seq
+
+            header = { 'version' : version, 'flags' : flags, 'layoutId' : layoutId,
+                       'seq' : seq, 'cycle' : cycle, 'DCtime' : DCtime,
+                       'wkc' : wkc, 'expectedWKC' : expectedWKC }
+            return header, data[self.__HEADER.size : self.__HEADER.size+payloadLen]
+
+    def decode(self, header, payload):
+        "Decode a payload into a dict {(slave,idx,subidx) : value}, using the layout from setLayout()"
+        assert self.layout is not None, "Call setLayout() first"
+        if header['layoutId'] != self.layoutId:
+            raise ecd_mcast_error("Layout changed, please call setLayout() again")
+
+        values = {}
+        for (offset, bitoff, bitlen, address, typeName, name) in self.layout:
+            if typeName in self.__TYPES:
+                values[address] = struct.unpack_from(self.__TYPES[typeName], payload, offset)[0]
+            else: # Bits and booleans
+                raw = int.from_bytes(payload[offset:offset+(bitoff+bitlen+7)//8], 'little')
+                values[address] = (raw >> bitoff) & ((1 << bitlen) - 1)
+        return values
+
+    def __del__(self):
+        if self.sock is not None:
+            self.sock.close()
+
+class ecd_mcast_error(Exception):
+    pass
+
+if __name__ == "__main__":
+    "Print the decoded datagrams; usage: ecd_mcast.py [daemon host] [group] [port] [interface address]"
+    from ecd_client import ecd_client
+
+    host  = sys.argv[1] if len(sys.argv) > 1 else 'localhost'
+    group = sys.argv[2] if len(sys.argv) > 2 else '239.255.42.1'
+    port  = int(sys.argv[3]) if len(sys.argv) > 3 else 4201
+    iface = sys.argv[4] if len(sys.argv) > 4 else '0.0.0.0' # e.g. 127.0.0.1 for loopback
+
+    rcv = ecd_mcast(group, port, iface)
+    cli = ecd_client(host)
+    rcv.setLayout(cli.call_mcast())
+
+    while True:
+        header, payload = rcv.recv()
+        print(header['seq'], header['cycle'], header['DCtime'], 'lost:', rcv.lost, rcv.decode(header, payload))
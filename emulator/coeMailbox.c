@@ -0,0 +1,287 @@
+#include "coeMailbox.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "ethercat.h" // ECT_* data types
+
+// Configuration    ************************************************************************
+
+#define COE_MBXHDR      6      // Mailbox header: length, address, channel/priority, type/counter
+#define COE_MBXT_ERR    0x00
+#define COE_MBXT_COE    0x03
+#define COE_SDOREQ      0x02   // CoE services
+#define COE_SDORES      0x03
+#define COE_SDOINFO     0x08
+#define COE_GET_OE_REQ  0x05   // SDO information opcodes
+#define COE_GET_OE_RES  0x06
+#define COE_INFO_ERROR  0x07
+
+// SDO abort codes
+#define COE_ABORT_COMMAND  0x05040001 // Command specifier not valid
+#define COE_ABORT_ACCESS   0x06010000 // Unsupported access (complete access)
+#define COE_ABORT_READONLY 0x06010002
+#define COE_ABORT_NOOBJECT 0x06020000
+#define COE_ABORT_LENGTH   0x06070010 // Length of service parameter does not match
+#define COE_ABORT_NOSUB    0x06090011
+
+// Object access bits, as in the entry description
+#define COE_ACCESS_READ    0x0007 // In PRE-OP, SAFE-OP and OP
+#define COE_ACCESS_WRITE   0x0038
+#define COE_ACCESS_RXPDO   0x0040
+#define COE_ACCESS_TXPDO   0x0080
+
+// Data types       ************************************************************************
+
+struct coe_object {
+    uint8  data[8];     // Little endian
+    int    size;        // [bytes]
+    uint16 dataType;
+    uint16 bitlen;
+    uint16 access;
+    char   name[ESC_MAXNAME+1];
+    struct esc_entry* entry; // Mapped output, which may be written; or NULL
+};
+
+// Functions        ************************************************************************
+
+static inline uint16 coe_get16(const uint8* p) { return p[0] | (p[1] << 8); }
+static inline uint32 coe_get32(const uint8* p) { return coe_get16(p) | ((uint32)coe_get16(p+2) << 16); }
+static inline void   coe_put16(uint8* p, uint16 v) { p[0] = v & 0xFF; p[1] = v >> 8; }
+static inline void   coe_put32(uint8* p, uint32 v) { coe_put16(p, v & 0xFFFF); coe_put16(p+2, v >> 16); }
+
+static void coe_unsigned(struct coe_object* obj, uint16 dataType, int size, uint32 value, const char* name) {
+    //Helper function for coe_find(): a read-only communication object
+    memset(obj->data, 0, sizeof(obj->data));
+    for (int i = 0; i < size; i++) obj->data[i] = (value >> (8*i)) & 0xFF;
+    obj->size     = size;
+    obj->dataType = dataType;
+    obj->bitlen   = 8*size;
+    obj->access   = COE_ACCESS_READ;
+    obj->entry    = NULL;
+    snprintf(obj->name, sizeof(obj->name), "%s", name);
+}
+
+static uint32 coe_findSub(struct esc_slave* slave, uint16 idx, uint8 subidx, struct coe_object* obj) {
+    //Helper function for coe_find(): PDO assignment, PDO mapping and application objects
+    struct esc_direction* dirs[2] = { &slave->out, &slave->in };
+    char name[ESC_MAXNAME+1];
+    snprintf(name, sizeof(name), "SubIndex %03d", subidx);
+
+    for (int d = 0; d < 2; d++) {
+        struct esc_direction* dir = dirs[d];
+
+        if (idx == 0x1C12 + d) { // PDO assignment
+            if (subidx == 0) coe_unsigned(obj, ECT_UNSIGNED8, 1, dir->numPDOs, name);
+            else if (subidx <= dir->numPDOs) coe_unsigned(obj, ECT_UNSIGNED16, 2, dir->PDOs[subidx-1].idx, name);
+            else return COE_ABORT_NOSUB;
+            return 0;
+        }
+
+        for (int p = 0; p < dir->numPDOs; p++) { // PDO mapping
+            struct esc_PDO* PDO = &(dir->PDOs[p]);
+            if (PDO->idx != idx) continue;
+            if (subidx == 0) {
+                coe_unsigned(obj, ECT_UNSIGNED8, 1, PDO->num, name);
+                return 0;
+            }
+            if (subidx > PDO->num) return COE_ABORT_NOSUB;
+            struct esc_entry* entry = &(dir->entries[PDO->first + subidx - 1]);
+            coe_unsigned(obj, ECT_UNSIGNED32, 4, (uint32)entry->idx << 16 | entry->subidx << 8 | entry->bitlen, name);
+            return 0;
+        }
+    }
+
+    int found = 0;
+    int maxSub = 0;
+    for (int d = 0; d < 2; d++) { // Application objects
+        for (int i = 0; i < dirs[d]->numEntries; i++) {
+            struct esc_entry* entry = &(dirs[d]->entries[i]);
+            if (entry->idx != idx || entry->dataType == 0) continue;
+            found = 1;
+            if (entry->subidx > maxSub) maxSub = entry->subidx;
+            if (entry->subidx != subidx || subidx == 0) continue;
+
+            uint64 raw = esc_getBits(esc_processData(slave, d), entry->bitoff, entry->bitlen);
+            memset(obj->data, 0, sizeof(obj->data));
+            for (int b = 0; b < 8; b++) obj->data[b] = (raw >> (8*b)) & 0xFF;
+            obj->size     = (entry->bitlen + 7) / 8;
+            obj->dataType = entry->dataType;
+            obj->bitlen   = entry->bitlen;
+            obj->access   = d == 0 ? COE_ACCESS_READ | COE_ACCESS_WRITE | COE_ACCESS_RXPDO
+                                   : COE_ACCESS_READ | COE_ACCESS_TXPDO;
+            obj->entry    = d == 0 ? entry : NULL;
+            snprintf(obj->name, sizeof(obj->name), "%s", entry->name);
+            return 0;
+        }
+    }
+    if (!found) return COE_ABORT_NOOBJECT;
+    if (subidx != 0) return COE_ABORT_NOSUB;
+    coe_unsigned(obj, ECT_UNSIGNED8, 1, maxSub, name);
+    return 0;
+}
+
+static uint32 coe_find(struct esc_slave* slave, uint16 idx, uint8 subidx, struct coe_object* obj) {
+    //Look up an object of the dictionary; returns 0 if found, else the SDO abort code
+    if (idx == 0x1018) { // Identity
+        switch (subidx) {
+        case 0:  coe_unsigned(obj, ECT_UNSIGNED8,  1, 4,               "Number of entries"); return 0;
+        case 1:  coe_unsigned(obj, ECT_UNSIGNED32, 4, slave->vendor,   "Vendor ID");         return 0;
+        case 2:  coe_unsigned(obj, ECT_UNSIGNED32, 4, slave->product,  "Product code");      return 0;
+        case 3:  coe_unsigned(obj, ECT_UNSIGNED32, 4, slave->sii[0x0C], "Revision");         return 0;
+        case 4:  coe_unsigned(obj, ECT_UNSIGNED32, 4, slave->sii[0x0E], "Serial number");    return 0;
+        default: return COE_ABORT_NOSUB;
+        }
+    }
+    if (idx == 0x1C00) { // Sync manager types: mailbox out, in, outputs, inputs
+        if (subidx > 4) return COE_ABORT_NOSUB;
+        char name[ESC_MAXNAME+1];
+        snprintf(name, sizeof(name), "SubIndex %03d", subidx);
+        coe_unsigned(obj, ECT_UNSIGNED8, 1, subidx == 0 ? 4 : subidx, name);
+        return 0;
+    }
+    return coe_findSub(slave, idx, subidx, obj);
+}
+
+static int coe_header(uint8* response, const uint8* request, int type, int length) {
+    //Mailbox header of the response; returns the offset of the data
+    coe_put16(response, length);
+    coe_put16(response + 2, 0);
+    response[4] = 0;
+    response[5] = type | (request[5] & 0x70); // Same counter
+    return COE_MBXHDR;
+}
+
+static void coe_abort(uint8* response, const uint8* request, uint16 idx, uint8 subidx, uint32 code) {
+    uint8* p = response + coe_header(response, request, COE_MBXT_COE, 10);
+    coe_put16(p, COE_SDOREQ << 12); // An abort is a request
+    p[2] = 0x80;
+    coe_put16(p + 3, idx);
+    p[5] = subidx;
+    coe_put32(p + 6, code);
+}
+
+static void coe_sdo(struct esc_slave* slave, const uint8* request, uint8* response) {
+    //SDO upload or download
+    const uint8* q = request + COE_MBXHDR;
+    int    command = q[2];
+    uint16 idx     = coe_get16(q + 3);
+    uint8  subidx  = q[5];
+
+    if (command & 0x10) {
+        coe_abort(response, request, idx, subidx, COE_ABORT_ACCESS);
+        return;
+    }
+    struct coe_object obj;
+    uint32 code = coe_find(slave, idx, subidx, &obj);
+    if (code != 0) {
+        coe_abort(response, request, idx, subidx, code);
+        return;
+    }
+
+    if ((command >> 5) == 2) { // Upload
+        int expedited = obj.size <= 4;
+        uint8* p = response + coe_header(response, request, COE_MBXT_COE, expedited ? 10 : 10 + obj.size);
+        coe_put16(p, COE_SDORES << 12);
+        coe_put16(p + 3, idx);
+        p[5] = subidx;
+        if (expedited) {
+            p[2] = 0x43 | ((4 - obj.size) << 2);
+            memcpy(p + 6, obj.data, obj.size);
+        }
+        else {
+            p[2] = 0x41;
+            coe_put32(p + 6, obj.size);
+            memcpy(p + 10, obj.data, obj.size);
+        }
+        return;
+    }
+
+    if ((command >> 5) == 1) { // Download
+        const uint8* data;
+        int size;
+        if (command & 0x02) { // Expedited
+            data = q + 6;
+            size = (command & 0x01) ? 4 - ((command >> 2) & 0x03) : 4;
+        }
+        else {
+            data = q + 10;
+            size = coe_get32(q + 6);
+            if (size > ESC_MBXSIZE - COE_MBXHDR - 10) size = -1;
+        }
+        if (obj.entry == NULL) {
+            coe_abort(response, request, idx, subidx, COE_ABORT_READONLY);
+            return;
+        }
+        if (size != obj.size) {
+            coe_abort(response, request, idx, subidx, COE_ABORT_LENGTH);
+            return;
+        }
+        uint64 raw = 0;
+        for (int b = 0; b < size; b++) raw |= (uint64)data[b] << (8*b);
+        esc_putBits(esc_processData(slave, 0), obj.entry->bitoff, obj.entry->bitlen, raw);
+
+        uint8* p = response + coe_header(response, request, COE_MBXT_COE, 10);
+        coe_put16(p, COE_SDORES << 12);
+        p[2] = 0x60;
+        coe_put16(p + 3, idx);
+        p[5] = subidx;
+        return;
+    }
+
+    coe_abort(response, request, idx, subidx, COE_ABORT_COMMAND);
+}
+
+static void coe_info(struct esc_slave* slave, const uint8* request, uint8* response) {
+    //SDO information: entry descriptions only
+    const uint8* q = request + COE_MBXHDR;
+    int    opcode = q[2] & 0x7F;
+    uint16 idx    = coe_get16(q + 6);
+    uint8  subidx = q[8];
+
+    struct coe_object obj;
+    uint32 code = opcode == COE_GET_OE_REQ ? coe_find(slave, idx, subidx, &obj) : COE_ABORT_COMMAND;
+    if (code != 0) {
+        uint8* p = response + coe_header(response, request, COE_MBXT_COE, 10);
+        coe_put16(p, COE_SDOINFO << 12);
+        p[2] = COE_INFO_ERROR;
+        coe_put32(p + 6, code);
+        return;
+    }
+
+    int nameLen = strlen(obj.name);
+    uint8* p = response + coe_header(response, request, COE_MBXT_COE, 16 + nameLen);
+    coe_put16(p, COE_SDOINFO << 12);
+    p[2] = COE_GET_OE_RES;
+    coe_put16(p + 6, idx);
+    p[8] = subidx;
+    p[9] = q[9];                // Value info, as requested
+    coe_put16(p + 10, obj.dataType);
+    coe_put16(p + 12, obj.bitlen);
+    coe_put16(p + 14, obj.access);
+    memcpy(p + 16, obj.name, nameLen);
+}
+
+int coe_request(struct esc_slave* slave, const uint8* request, uint8* response) {
+    int length = coe_get16(request);
+    if ((request[5] & 0x0F) != COE_MBXT_COE) {
+        uint8* p = response + coe_header(response, request, COE_MBXT_ERR, 4);
+        coe_put16(p, 0x0001);   // Mailbox service error
+        coe_put16(p + 2, 0x0002); // Unsupported protocol
+        return 1;
+    }
+    if (length < 10 || length > ESC_MBXSIZE - COE_MBXHDR) {
+        return 0;
+    }
+
+    switch (coe_get16(request + COE_MBXHDR) >> 12) {
+    case COE_SDOREQ:
+        coe_sdo(slave, request, response);
+        return 1;
+    case COE_SDOINFO:
+        coe_info(slave, request, response);
+        return 1;
+    default:
+        return 0; // Emergencies, PDOs over the mailbox: nothing to answer
+    }
+}
@@ -0,0 +1,22 @@
+#ifndef coeMailbox_h
+#define coeMailbox_h
+
+#include "escEmulator.h"
+
+// The mailbox of an emulated slave, see escEmulator.h: CoE only.
+//  - SDO upload (expedited, or normal for up to 8 bytes) and download (expedited or normal,
+//    in one mailbox) of the objects of the slave's object dictionary;
+//  - SDO information: get entry description, which the daemon uses for names and data types.
+// The object dictionary is made from the configuration of the slave:
+//   0x1018 identity, 0x1C00 sync manager types, 0x1C12/0x1C13 PDO assignment,
+//   0x16xx/0x1Axx PDO mapping, and the mapped application objects (e.g. 0x6000:11), which read
+//   from and write to the process data. Complete access and segmented transfers are not supported.
+// Other mailbox protocols get a mailbox error.
+
+// Functions        ************************************************************************
+
+// Answer the request in the write mailbox 'request' (ESC_MBXSIZE bytes), into 'response'.
+// Returns 1 if there is a response, 0 if not.
+int coe_request(struct esc_slave* slave, const uint8* request, uint8* response);
+
+#endif
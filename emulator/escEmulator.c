@@ -0,0 +1,634 @@
+#include "escEmulator.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "ethercat.h" // ECT_* data types, EC_STATE_*
+
+#include "coeMailbox.h"
+
+// Configuration    ************************************************************************
+
+// Datagram commands
+enum { ESC_NOP = 0, ESC_APRD, ESC_APWR, ESC_APRW, ESC_FPRD, ESC_FPWR, ESC_FPRW, ESC_BRD, ESC_BWR, ESC_BRW,
+       ESC_LRD, ESC_LWR, ESC_LRW, ESC_ARMW, ESC_FRMW };
+
+#define ESC_ETHERTYPE 0x88A4
+#define ESC_ETHHDR    14
+#define ESC_DGHDR     10      // Datagram header, before the data
+#define ESC_EEP_R64   0x0040  // EEPROM status: reads 8 bytes at a time
+#define ESC_SM_FULL   0x08    // SM status: mailbox full
+
+// SII
+#define ESC_SII_START   0x0040 // First category [words]
+#define ESC_SII_STRINGS 10
+#define ESC_SII_GENERAL 30
+#define ESC_SII_FMMU    40
+#define ESC_SII_SM      41
+#define ESC_COE_DETAILS 0x03   // SDO, SDO information; no complete access
+
+// AL status codes
+#define ESC_AL_BADSTATE 0x0011 // Invalid requested state change
+#define ESC_AL_BADMBX   0x0016 // Invalid mailbox configuration
+#define ESC_AL_BADOUT   0x001D // Invalid output configuration
+#define ESC_AL_BADIN    0x001E // Invalid input configuration
+
+// File-global data ************************************************************************
+
+static const struct {
+    const char* name;
+    uint16 dataType;
+    uint8  bitlen;
+} esc_types[] = {
+    { "BOOLEAN",    ECT_BOOLEAN,    1 },
+    { "BIT1",       ECT_BIT1,       1 }, { "BIT2", ECT_BIT2, 2 }, { "BIT3", ECT_BIT3, 3 }, { "BIT4", ECT_BIT4, 4 },
+    { "BIT5",       ECT_BIT5,       5 }, { "BIT6", ECT_BIT6, 6 }, { "BIT7", ECT_BIT7, 7 }, { "BIT8", ECT_BIT8, 8 },
+    { "INTEGER8",   ECT_INTEGER8,   8 }, { "INTEGER16",  ECT_INTEGER16,  16 },
+    { "INTEGER32",  ECT_INTEGER32, 32 }, { "INTEGER64",  ECT_INTEGER64,  64 },
+    { "UNSIGNED8",  ECT_UNSIGNED8,  8 }, { "UNSIGNED16", ECT_UNSIGNED16, 16 },
+    { "UNSIGNED32", ECT_UNSIGNED32,32 }, { "UNSIGNED64", ECT_UNSIGNED64, 64 },
+    { "REAL32",     ECT_REAL32,    32 }, { "REAL64",     ECT_REAL64,     64 },
+};
+
+// Functions        ************************************************************************
+
+static inline uint16 esc_get16(const uint8* p) { return p[0] | (p[1] << 8); }
+static inline uint32 esc_get32(const uint8* p) { return esc_get16(p) | ((uint32)esc_get16(p+2) << 16); }
+static inline void   esc_put16(uint8* p, uint16 v) { p[0] = v & 0xFF; p[1] = v >> 8; }
+
+int esc_typeByName(const char* name, uint16* dataType, uint8* bitlen) {
+    for (size_t i = 0; i < sizeof(esc_types)/sizeof(esc_types[0]); i++) {
+        if (strcmp(name, esc_types[i].name) == 0) {
+            *dataType = esc_types[i].dataType;
+            *bitlen   = esc_types[i].bitlen;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+uint64 esc_encode(const struct esc_entry* entry, double value) {
+    if (entry->dataType == ECT_REAL32) {
+        float  f = (float) value;
+        uint32 raw;
+        memcpy(&raw, &f, sizeof(raw));
+        return raw;
+    }
+    if (entry->dataType == ECT_REAL64) {
+        uint64 raw;
+        memcpy(&raw, &value, sizeof(raw));
+        return raw;
+    }
+    return (uint64) llround(value); // Truncated to the bit length when put
+}
+
+uint64 esc_getBits(const uint8* base, int bitoff, int bitlen) {
+    uint64 raw = 0;
+    if (bitoff % 8 == 0 && bitlen % 8 == 0) {
+        for (int i = 0; i < bitlen/8; i++) {
+            raw |= (uint64)base[bitoff/8 + i] << (8*i);
+        }
+        return raw;
+    }
+    for (int i = 0; i < bitlen; i++) {
+        int bit = bitoff + i;
+        if ((base[bit/8] >> (bit%8)) & 1) raw |= (uint64)1 << i;
+    }
+    return raw;
+}
+
+void esc_putBits(uint8* base, int bitoff, int bitlen, uint64 raw) {
+    if (bitoff % 8 == 0 && bitlen % 8 == 0) {
+        for (int i = 0; i < bitlen/8; i++) {
+            base[bitoff/8 + i] = (raw >> (8*i)) & 0xFF;
+        }
+        return;
+    }
+    for (int i = 0; i < bitlen; i++) {
+        int bit = bitoff + i;
+        if ((raw >> i) & 1) base[bit/8] |=  (1 << (bit%8));
+        else                base[bit/8] &= ~(1 << (bit%8));
+    }
+}
+
+static void esc_copyBits(uint8* dst, int dstBit, const uint8* src, int srcBit, int bits) {
+    //Helper function for esc_logical()
+    if (dstBit % 8 == 0 && srcBit % 8 == 0 && bits % 8 == 0) {
+        memcpy(dst + dstBit/8, src + srcBit/8, bits/8);
+        return;
+    }
+    for (int i = 0; i < bits; i++) {
+        int s = srcBit + i;
+        int d = dstBit + i;
+        if ((src[s/8] >> (s%8)) & 1) dst[d/8] |=  (1 << (d%8));
+        else                         dst[d/8] &= ~(1 << (d%8));
+    }
+}
+
+static int esc_touches(int ado, int len, int reg, int reglen) {
+    //Does the access [ado, ado+len) cover any byte of the register?
+    return ado < reg + reglen && reg < ado + len;
+}
+
+static int esc_smActive(const struct esc_slave* slave, int sm, int* start, int* len) {
+    const uint8* reg = slave->mem + ESC_REG_SM0 + 8*sm;
+    *start = esc_get16(reg);
+    *len   = esc_get16(reg + 2);
+    return *len > 0 && (reg[6] & 0x01);
+}
+
+static int esc_mailboxSM(const struct esc_slave* slave, int sm, int* start, int* len) {
+    //The mailbox SMs, if the master has configured them as such
+    return slave->mailbox && esc_smActive(slave, sm, start, len) && (slave->mem[ESC_REG_SM0 + 8*sm + 4] & 0x03) == 0x02;
+}
+
+uint8* esc_processData(struct esc_slave* slave, int inputs) {
+    int start, len;
+    if (esc_smActive(slave, inputs ? 3 : 2, &start, &len)) {
+        return slave->mem + start;
+    }
+    return slave->mem + (inputs ? ESC_PDIN : ESC_PDOUT);
+}
+
+// SII ************************************************************************************
+
+struct esc_siiWriter {
+    uint16* sii;
+    int     pos;        // [bytes]
+    int     catStart;   // Of the current category [bytes]
+};
+
+static void esc_siiByte(struct esc_siiWriter* w, uint8 b) {
+    if (w->pos/2 >= ESC_SIIWORDS) return; // Checked by esc_setup()
+    if (w->pos % 2 == 0) w->sii[w->pos/2] = b;
+    else                 w->sii[w->pos/2] |= (uint16)b << 8;
+    w->pos++;
+}
+
+static void esc_siiWord(struct esc_siiWriter* w, uint16 v) {
+    esc_siiByte(w, v & 0xFF);
+    esc_siiByte(w, v >> 8);
+}
+
+static void esc_siiCategory(struct esc_siiWriter* w, uint16 type) {
+    esc_siiWord(w, type);
+    esc_siiWord(w, 0);      // Length, set by esc_siiEnd()
+    w->catStart = w->pos;
+}
+
+static void esc_siiEnd(struct esc_siiWriter* w) {
+    if (w->pos % 2) esc_siiByte(w, 0);
+    w->sii[w->catStart/2 - 1] = (w->pos - w->catStart) / 2;
+}
+
+static void esc_siiSM(struct esc_siiWriter* w, uint16 start, uint16 len, uint8 control, uint8 type) {
+    esc_siiWord(w, start);
+    esc_siiWord(w, len);
+    esc_siiByte(w, control);
+    esc_siiByte(w, 0);          // Status
+    esc_siiByte(w, len > 0);    // Enable
+    esc_siiByte(w, type);
+}
+
+static int esc_buildSII(struct esc_slave* slave, int position) {
+    //Helper function for esc_setup(); the parts of the SII which a master reads
+    uint16* sii = slave->sii;
+    memset(sii, 0, sizeof(slave->sii));
+    sii[0x0008] = slave->vendor  & 0xFFFF; sii[0x0009] = slave->vendor  >> 16;
+    sii[0x000A] = slave->product & 0xFFFF; sii[0x000B] = slave->product >> 16;
+    sii[0x000C] = 1;            // Revision
+    sii[0x000E] = position;     // Serial number
+    if (slave->mailbox) {
+        sii[0x0014] = ESC_MBXOUT; sii[0x0015] = ESC_MBXSIZE; // Bootstrap mailbox
+        sii[0x0016] = ESC_MBXIN;  sii[0x0017] = ESC_MBXSIZE;
+        sii[0x0018] = ESC_MBXOUT; sii[0x0019] = ESC_MBXSIZE; // Standard mailbox
+        sii[0x001A] = ESC_MBXIN;  sii[0x001B] = ESC_MBXSIZE;
+        sii[0x001C] = 0x0004;     // Mailbox protocols: CoE
+    }
+    sii[0x003E] = ESC_SIIWORDS*2/1024 - 1; // Size [kB] - 1
+    sii[0x003F] = 1;            // Version
+
+    struct esc_siiWriter w = { sii, ESC_SII_START*2, 0 };
+
+    esc_siiCategory(&w, ESC_SII_STRINGS);
+    esc_siiByte(&w, 1);         // Number of strings; the name is string 1
+    esc_siiByte(&w, strlen(slave->name));
+    for (const char* c = slave->name; *c; c++) esc_siiByte(&w, *c);
+    esc_siiEnd(&w);
+
+    esc_siiCategory(&w, ESC_SII_GENERAL);
+    uint8 general[32];
+    memset(general, 0, sizeof(general));
+    general[0] = 1;             // Group: string 1
+    general[2] = 1;             // Order
+    general[3] = 1;             // Name
+    general[5] = slave->mailbox ? ESC_COE_DETAILS : 0;
+    for (size_t i = 0; i < sizeof(general); i++) esc_siiByte(&w, general[i]);
+    esc_siiEnd(&w);
+
+    if (slave->mailbox) {
+        esc_siiCategory(&w, ESC_SII_FMMU);
+        esc_siiByte(&w, 1);     // Outputs
+        esc_siiByte(&w, 2);     // Inputs
+        esc_siiByte(&w, 3);     // Mailbox state
+        esc_siiEnd(&w);
+
+        esc_siiCategory(&w, ESC_SII_SM);
+        esc_siiSM(&w, ESC_MBXOUT, ESC_MBXSIZE, 0x26, 1);
+        esc_siiSM(&w, ESC_MBXIN,  ESC_MBXSIZE, 0x22, 2);
+        esc_siiSM(&w, ESC_PDOUT,  slave->out.bits/8, 0x24, 3);
+        esc_siiSM(&w, ESC_PDIN,   slave->in.bits/8,  0x20, 4);
+        esc_siiEnd(&w);
+    }
+    esc_siiWord(&w, 0xFFFF);    // End
+
+    if (w.pos/2 >= ESC_SIIWORDS) {
+        fprintf(stderr, "Error in esc_setup(), slave %d: the SII does not fit into %d words\n", position, ESC_SIIWORDS);
+        return 0;
+    }
+    return 1;
+}
+
+// Setup **********************************************************************************
+
+static int esc_layout(struct esc_direction* dir, const char* what, int position, int maxBytes) {
+    //Helper function for esc_setup()
+    dir->bits = 0;
+    for (int i = 0; i < dir->numEntries; i++) {
+        dir->entries[i].bitoff = dir->bits;
+        dir->bits += dir->entries[i].bitlen;
+    }
+    if (dir->bits % 8 != 0) {
+        fprintf(stderr, "Error in esc_setup(), slave %d: the %s are %d bits, not whole bytes; add a PAD\n",
+                position, what, dir->bits);
+        return 0;
+    }
+    if (dir->bits/8 > maxBytes) {
+        fprintf(stderr, "Error in esc_setup(), slave %d: the %s are %d bytes, at most %d fit\n",
+                position, what, dir->bits/8, maxBytes);
+        return 0;
+    }
+    return 1;
+}
+
+int esc_setup(struct esc_slave* slave, int position, int num) {
+    if (!esc_layout(&slave->out, "outputs", position, ESC_PDIN - ESC_PDOUT) ||
+        !esc_layout(&slave->in,  "inputs",  position, ESC_MEMSIZE - ESC_PDIN)) {
+        return 0;
+    }
+    slave->mailbox = slave->out.numEntries > 0 || slave->in.numEntries > 0;
+
+    for (int i = 0; i < slave->in.numEntries; i++) {
+        struct esc_entry* entry = &(slave->in.entries[i]);
+        entry->raw  = esc_encode(entry, entry->value);
+        entry->echo = -1;
+        for (int o = 0; o < slave->out.numEntries && entry->signal == ESC_ECHO; o++) {
+            struct esc_entry* source = &(slave->out.entries[o]);
+            if (source->dataType != 0 && source->idx == entry->echoIdx && source->subidx == entry->echoSubidx) {
+                entry->echo = o;
+                break;
+            }
+        }
+        if (entry->signal == ESC_ECHO && entry->echo < 0) {
+            fprintf(stderr, "Error in esc_setup(), slave %d: input 0x%4.4X:0x%2.2X echoes 0x%4.4X:0x%2.2X, which is not an output\n",
+                    position, entry->idx, entry->subidx, entry->echoIdx, entry->echoSubidx);
+            return 0;
+        }
+    }
+
+    if (!esc_buildSII(slave, position)) return 0;
+
+    if (slave->mem == NULL) slave->mem = malloc(ESC_MEMSIZE);
+    if (slave->mem == NULL) {
+        fprintf(stderr, "Error in esc_setup(), out of memory\n");
+        return 0;
+    }
+    memset(slave->mem, 0, ESC_MEMSIZE);
+    uint8* mem = slave->mem;
+    mem[ESC_REG_TYPE]     = 0x11;       // ET1100
+    mem[0x0004]           = ESC_NUMFMMU;
+    mem[0x0005]           = ESC_NUMSM;
+    mem[0x0006]           = 8;          // Process RAM [kB]
+    mem[0x0007]           = 0x0F;       // Ports 0 and 1: MII
+    int last = position == num;
+    // PDI operational; port 0 link, open, communication; port 1 likewise unless last; ports 2, 3 closed
+    esc_put16(mem + ESC_REG_DLSTAT, 0x0001 | 0x0010 | 0x0200 | (last ? 0x0400 : 0x0020 | 0x0800) | 0x1000 | 0x4000);
+    mem[ESC_REG_ALSTAT]   = EC_STATE_INIT;
+    mem[ESC_REG_PDICTL]   = 0x05;       // 16 bit asynchronous microcontroller
+    esc_put16(mem + ESC_REG_EEPCTL, ESC_EEP_R64);
+    slave->frames = 0;
+    return 1;
+}
+
+// Registers ******************************************************************************
+
+static uint16 esc_checkState(struct esc_slave* slave, int current, int requested) {
+    //Helper function for esc_alControl(); returns the AL status code, 0 if the change is OK
+    int start, len;
+    switch (requested) {
+    case EC_STATE_INIT:
+        return 0;
+    case EC_STATE_PRE_OP:
+        if (slave->mailbox && (!esc_mailboxSM(slave, 0, &start, &len) || !esc_mailboxSM(slave, 1, &start, &len))) {
+            return ESC_AL_BADMBX;
+        }
+        return 0;
+    case EC_STATE_SAFE_OP:
+        if (current == EC_STATE_INIT) return ESC_AL_BADSTATE;
+        if (slave->out.bits > 0 && (!esc_smActive(slave, 2, &start, &len) || len != slave->out.bits/8)) {
+            return ESC_AL_BADOUT;
+        }
+        if (slave->in.bits > 0 && (!esc_smActive(slave, 3, &start, &len) || len != slave->in.bits/8)) {
+            return ESC_AL_BADIN;
+        }
+        return 0;
+    case EC_STATE_OPERATIONAL:
+        if (current != EC_STATE_SAFE_OP && current != EC_STATE_OPERATIONAL) return ESC_AL_BADSTATE;
+        return 0;
+    default:
+        return ESC_AL_BADSTATE; // No bootstrap either
+    }
+}
+
+static void esc_alControl(struct esc_slave* slave) {
+    //The master wrote AL control
+    uint8* mem = slave->mem;
+    int requested = mem[ESC_REG_ALCTL] & 0x0F;
+    int current   = mem[ESC_REG_ALSTAT] & 0x0F;
+    if ((mem[ESC_REG_ALSTAT] & EC_STATE_ERROR) && !(mem[ESC_REG_ALCTL] & EC_STATE_ACK)) {
+        return; // The error has to be acknowledged first
+    }
+    uint16 code = esc_checkState(slave, current, requested);
+    if (code != 0) {
+        mem[ESC_REG_ALSTAT] = current | EC_STATE_ERROR;
+        esc_put16(mem + ESC_REG_ALCODE, code);
+    }
+    else {
+        mem[ESC_REG_ALSTAT] = requested;
+        esc_put16(mem + ESC_REG_ALCODE, 0);
+    }
+}
+
+static void esc_eeprom(struct esc_slave* slave) {
+    //The master wrote EEPROM control; reads complete at once, writes are not supported
+    uint8* mem = slave->mem;
+    int command = (esc_get16(mem + ESC_REG_EEPCTL) >> 8) & 0x07;
+    if (command == 1) {
+        uint32 address = esc_get32(mem + ESC_REG_EEPADR);
+        for (int i = 0; i < 4; i++) {
+            uint16 word = address + i < ESC_SIIWORDS ? slave->sii[address + i] : 0xFFFF;
+            esc_put16(mem + ESC_REG_EEPDAT + 2*i, word);
+        }
+    }
+    esc_put16(mem + ESC_REG_EEPCTL, ESC_EEP_R64); // Idle, no error
+}
+
+static void esc_mailbox(struct esc_slave* slave, struct esc_counters* counters) {
+    //The master filled the write mailbox
+    int outStart, outLen, inStart, inLen;
+    esc_mailboxSM(slave, 0, &outStart, &outLen);
+    if (!esc_mailboxSM(slave, 1, &inStart, &inLen) || outLen < ESC_MBXSIZE || inLen < ESC_MBXSIZE) {
+        return; // Nowhere to answer
+    }
+    counters->mailbox++;
+    uint8 response[ESC_MBXSIZE];
+    memset(response, 0, sizeof(response));
+    if (coe_request(slave, slave->mem + outStart, response)) {
+        memcpy(slave->mem + inStart, response, ESC_MBXSIZE);
+        slave->mem[ESC_REG_SM0 + 8 + 5] |= ESC_SM_FULL;
+    }
+}
+
+static int esc_read(struct esc_slave* slave, int ado, uint8* data, int len) {
+    //Physical read by the master; returns 1 if it counts (work counter), 0 if refused
+    if (ado + len > ESC_MEMSIZE) return 0;
+    int start, smLen;
+    int mailboxIn = esc_mailboxSM(slave, 1, &start, &smLen) && esc_touches(ado, len, start, smLen);
+    if (mailboxIn && !(slave->mem[ESC_REG_SM0 + 8 + 5] & ESC_SM_FULL)) {
+        return 0; // Nothing to read
+    }
+    memcpy(data, slave->mem + ado, len);
+    if (mailboxIn && esc_touches(ado, len, start + smLen - 1, 1)) {
+        slave->mem[ESC_REG_SM0 + 8 + 5] &= ~ESC_SM_FULL; // Read to the end: emptied
+    }
+    return 1;
+}
+
+static int esc_write(struct esc_slave* slave, int ado, const uint8* data, int len, struct esc_counters* counters) {
+    //Physical write by the master; returns 1 if it counts (work counter), 0 if refused
+    if (ado + len > ESC_MEMSIZE) return 0;
+    uint8* mem = slave->mem;
+
+    //Read-only registers: keep them
+    uint8 info[0x10], dlStatus[2], alStatus[6], smStatus[ESC_NUMSM];
+    memcpy(info,     mem + ESC_REG_TYPE,   sizeof(info));
+    memcpy(dlStatus, mem + ESC_REG_DLSTAT, sizeof(dlStatus));
+    memcpy(alStatus, mem + ESC_REG_ALSTAT, sizeof(alStatus));
+    for (int sm = 0; sm < ESC_NUMSM; sm++) smStatus[sm] = mem[ESC_REG_SM0 + 8*sm + 5];
+
+    memcpy(mem + ado, data, len);
+
+    memcpy(mem + ESC_REG_TYPE,   info,     sizeof(info));
+    memcpy(mem + ESC_REG_DLSTAT, dlStatus, sizeof(dlStatus));
+    memcpy(mem + ESC_REG_ALSTAT, alStatus, sizeof(alStatus));
+    for (int sm = 0; sm < ESC_NUMSM; sm++) mem[ESC_REG_SM0 + 8*sm + 5] = smStatus[sm];
+
+    if (esc_touches(ado, len, ESC_REG_ALCTL, 2))  esc_alControl(slave);
+    if (esc_touches(ado, len, ESC_REG_EEPCTL, 2)) esc_eeprom(slave);
+
+    int start, smLen;
+    if (esc_mailboxSM(slave, 0, &start, &smLen) && esc_touches(ado, len, start + smLen - 1, 1)) {
+        esc_mailbox(slave, counters); // Written to the end: full, and taken at once
+    }
+    return 1;
+}
+
+// Process data ***************************************************************************
+
+static void esc_updateInputs(struct esc_slave* slave) {
+    //The emulated application, once per process data frame
+    int state = slave->mem[ESC_REG_ALSTAT] & 0x0F;
+    if (state != EC_STATE_SAFE_OP && state != EC_STATE_OPERATIONAL) return;
+
+    slave->frames++;
+    uint8* inputs  = esc_processData(slave, 1);
+    uint8* outputs = esc_processData(slave, 0);
+    for (int i = 0; i < slave->in.numEntries; i++) {
+        struct esc_entry* entry = &(slave->in.entries[i]);
+        if (entry->dataType == 0) continue;
+        uint64 raw;
+        switch (entry->signal) {
+        case ESC_COUNT:
+            raw = esc_encode(entry, (double)slave->frames);
+            break;
+        case ESC_SINE:
+            raw = esc_encode(entry, entry->value * sin(2*M_PI*(slave->frames % entry->period) / entry->period));
+            break;
+        case ESC_ECHO: {
+            struct esc_entry* source = &(slave->out.entries[entry->echo]);
+            raw = esc_getBits(outputs, source->bitoff, source->bitlen);
+            break;
+        }
+        default:
+            raw = entry->raw;
+        }
+        esc_putBits(inputs, entry->bitoff, entry->bitlen, raw);
+    }
+}
+
+static int esc_logical(struct esc_slave* slave, int cmd, uint32 address, uint8* data, int len) {
+    //Logical access through the FMMUs; returns the work counter increment
+    int didRead = 0, didWrite = 0;
+    int64 dgStart = (int64)address * 8;
+    int64 dgEnd   = dgStart + (int64)len * 8; // Exclusive [bits]
+
+    for (int f = 0; f < ESC_NUMFMMU; f++) {
+        const uint8* reg = slave->mem + ESC_REG_FMMU0 + 16*f;
+        if (!(reg[12] & 0x01)) continue;
+        uint32 logStart  = esc_get32(reg);
+        uint16 logLen    = esc_get16(reg + 4);
+        int64  fmmuStart = (int64)logStart * 8 + reg[6];
+        int64  fmmuEnd   = ((int64)logStart + logLen - 1) * 8 + reg[7] + 1;
+        int    physStart = esc_get16(reg + 8) * 8 + reg[10];
+        int    type      = reg[11];
+        if (logLen == 0) continue;
+
+        int64 lo = fmmuStart > dgStart ? fmmuStart : dgStart;
+        int64 hi = fmmuEnd   < dgEnd   ? fmmuEnd   : dgEnd;
+        if (lo >= hi) continue;
+        int physBit = physStart + (int)(lo - fmmuStart);
+        if (physBit + (hi - lo) > (int64)ESC_MEMSIZE * 8) continue;
+
+        if ((type & 0x01) && (cmd == ESC_LRD || cmd == ESC_LRW)) {
+            esc_copyBits(data, (int)(lo - dgStart), slave->mem, physBit, (int)(hi - lo));
+            didRead = 1;
+        }
+        if ((type & 0x02) && (cmd == ESC_LWR || cmd == ESC_LRW)) {
+            esc_copyBits(slave->mem, physBit, data, (int)(lo - dgStart), (int)(hi - lo));
+            didWrite = 1;
+        }
+    }
+    return didRead + 2*didWrite;
+}
+
+// Frames *********************************************************************************
+
+static uint16 esc_datagram(struct esc_slave* slaves, int num, uint8* dg, uint8* data, int len,
+                           struct esc_counters* counters) {
+    //One datagram through all slaves; returns the work counter increment
+    int    cmd = dg[0];
+    uint16 adp = esc_get16(dg + 2);
+    uint16 ado = esc_get16(dg + 4);
+    uint16 wkc = 0;
+    uint8  tmp[2048];
+
+    for (int s = 0; s < num; s++) {
+        struct esc_slave* slave = &slaves[s];
+        int addressed = 0;
+        switch (cmd) {
+        case ESC_APRD: case ESC_APWR: case ESC_APRW: case ESC_ARMW:
+            addressed = adp == 0;
+            adp++; // Auto increment: every slave counts up
+            break;
+        case ESC_FPRD: case ESC_FPWR: case ESC_FPRW: case ESC_FRMW:
+            addressed = adp == esc_get16(slave->mem + ESC_REG_STADR);
+            break;
+        case ESC_BRD: case ESC_BWR: case ESC_BRW:
+            addressed = 1;
+            adp++;
+            break;
+        }
+
+        switch (cmd) {
+        case ESC_APRD: case ESC_FPRD:
+            if (addressed) wkc += esc_read(slave, ado, data, len);
+            break;
+        case ESC_APWR: case ESC_FPWR: case ESC_BWR:
+            if (addressed) wkc += esc_write(slave, ado, data, len, counters);
+            break;
+        case ESC_BRD:
+            if (esc_read(slave, ado, tmp, len)) {
+                for (int i = 0; i < len; i++) data[i] |= tmp[i];
+                wkc++;
+            }
+            break;
+        case ESC_APRW: case ESC_FPRW: case ESC_BRW:
+            if (addressed && esc_read(slave, ado, tmp, len)) {
+                wkc += 1 + 2*esc_write(slave, ado, data, len, counters);
+                if (cmd == ESC_BRW) for (int i = 0; i < len; i++) data[i] |= tmp[i];
+                else                memcpy(data, tmp, len);
+            }
+            break;
+        case ESC_ARMW: case ESC_FRMW:
+            if (addressed) wkc += esc_read(slave, ado, data, len);
+            else           wkc += esc_write(slave, ado, data, len, counters);
+            break;
+        case ESC_LRD: case ESC_LWR: case ESC_LRW:
+            wkc += esc_logical(slave, cmd, esc_get32(dg + 2), data, len);
+            break;
+        }
+    }
+    if (cmd != ESC_LRD && cmd != ESC_LWR && cmd != ESC_LRW) {
+        esc_put16(dg + 2, adp);
+    }
+    return wkc;
+}
+
+int esc_processFrame(struct esc_slave* slaves, int num, uint8* frame, int len, struct esc_counters* counters) {
+    if (len < ESC_ETHHDR + 2 || frame[12] != (ESC_ETHERTYPE >> 8) || frame[13] != (ESC_ETHERTYPE & 0xFF)) {
+        return 0;
+    }
+    if (frame[6] & 0x02) {
+        return 0; // Already went through slaves (a loop, or our own frame)
+    }
+    uint16 header = esc_get16(frame + ESC_ETHHDR);
+    int    ecatLen = header & 0x07FF;
+    uint8* dg  = frame + ESC_ETHHDR + 2;
+    uint8* end = dg + ecatLen;
+    if ((header >> 12) != 1 || end > frame + len) {
+        counters->malformed++;
+        return 0;
+    }
+
+    //Check the whole frame first, so that a bad one is not half processed
+    int logical = 0;
+    for (uint8* p = dg; ; ) {
+        if (p + ESC_DGHDR + 2 > end) {
+            counters->malformed++;
+            return 0;
+        }
+        uint16 lenField = esc_get16(p + 6);
+        int    dataLen  = lenField & 0x07FF;
+        if (p + ESC_DGHDR + dataLen + 2 > end) {
+            counters->malformed++;
+            return 0;
+        }
+        if (p[0] == ESC_LRD || p[0] == ESC_LWR || p[0] == ESC_LRW) logical = 1;
+        if (!(lenField & 0x8000)) break;
+        p += ESC_DGHDR + dataLen + 2;
+    }
+
+    //The inputs are sampled as the frame arrives
+    if (logical) {
+        for (int s = 0; s < num; s++) esc_updateInputs(&slaves[s]);
+        counters->logical++;
+    }
+
+    for (;;) {
+        uint16 lenField = esc_get16(dg + 6);
+        int    dataLen  = lenField & 0x07FF;
+        uint8* data     = dg + ESC_DGHDR;
+        uint16 wkc = esc_get16(data + dataLen);
+        wkc += esc_datagram(slaves, num, dg, data, dataLen, counters);
+        esc_put16(data + dataLen, wkc);
+        counters->datagrams++;
+        if (!(lenField & 0x8000)) break;
+        dg = data + dataLen + 2;
+    }
+
+    frame[6] |= 0x02; // Locally administered source address: has passed the slaves
+    counters->frames++;
+    return 1;
+}
@@ -0,0 +1,133 @@
+#ifndef escEmulator_h
+#define escEmulator_h
+
+#include "osal.h" //typedefs for uint8 etc.
+
+// A chain of emulated EtherCAT slave controllers (ESCs), answering the frames of a master on
+// the wire (see slaveEmulator.c). Every slave has the 64 kB physical address space of an ESC:
+//  - the registers the master uses to bring up a bus: ESC information, station address,
+//    DL status (a line topology), AL control/status with the INIT/PRE-OP/SAFE-OP/OP state
+//    machine, the SII EEPROM interface, FMMUs and sync managers;
+//  - a mailbox (SM0/SM1) with CoE, see coeMailbox.h, on every slave with process data;
+//  - the process data, at the SM2 (outputs) and SM3 (inputs) areas, which the datagrams
+//    reach through the FMMUs.
+// The inputs are refreshed by the emulated application once per frame with logical datagrams,
+// in SAFE-OP and OP. Distributed clocks are not emulated (no DC support in the ESC features).
+//
+// Slaves with PDOs always have CoE, which the daemon needs to discover the mappings; slaves
+// without PDOs (couplers) have no mailbox.
+
+// Configuration    ************************************************************************
+#define ESC_MEMSIZE    0x10000 // Physical address space of one ESC [bytes]
+#define ESC_SIIWORDS   1024    // SII EEPROM size [16 bit words]
+#define ESC_MAXPDOS    16      // Per direction and slave
+#define ESC_MAXENTRIES 64      // Per direction and slave
+#define ESC_MAXNAME    40      // As EC_MAXNAME in SOEM
+#define ESC_NUMFMMU    8
+#define ESC_NUMSM      8
+
+#define ESC_MBXSIZE    128     // Mailbox size, both directions [bytes]
+#define ESC_MBXOUT     0x1000  // Default start of SM0 (write mailbox, master -> slave)
+#define ESC_MBXIN      0x1080  // Default start of SM1 (read mailbox, slave -> master)
+#define ESC_PDOUT      0x1100  // Default start of SM2 (outputs)
+#define ESC_PDIN       0x1400  // Default start of SM3 (inputs)
+
+// Registers
+#define ESC_REG_TYPE      0x0000
+#define ESC_REG_STADR     0x0010
+#define ESC_REG_DLSTAT    0x0110
+#define ESC_REG_ALCTL     0x0120
+#define ESC_REG_ALSTAT    0x0130
+#define ESC_REG_ALCODE    0x0134
+#define ESC_REG_PDICTL    0x0140
+#define ESC_REG_EEPCTL    0x0502  // Control/status
+#define ESC_REG_EEPADR    0x0504
+#define ESC_REG_EEPDAT    0x0508
+#define ESC_REG_FMMU0     0x0600  // 16 bytes each
+#define ESC_REG_SM0       0x0800  // 8 bytes each
+
+// Data types       ************************************************************************
+
+enum esc_signal {
+    ESC_CONST = 0, // Inputs: 'value', or what was written over CoE
+    ESC_COUNT,     // Inputs: the number of process data frames the slave has seen
+    ESC_SINE,      // Inputs: value * sin(2 pi frames / period)
+    ESC_ECHO       // Inputs: a copy of an output entry of the same slave
+};
+
+struct esc_entry {
+    uint16 idx;      // Object; 0 (and subidx 0) for a gap
+    uint8  subidx;
+    uint16 dataType; // ECT_*; 0 for a gap
+    uint8  bitlen;
+    int    bitoff;   // From the start of the SM area
+    char   name[ESC_MAXNAME+1];
+
+    enum esc_signal signal;
+    double value;
+    int    period;
+    uint16 echoIdx;  // ESC_ECHO: the output entry of the same slave
+    uint8  echoSubidx;
+    int    echo;     // Index into its outputs, set by esc_setup()
+    uint64 raw;      // ESC_CONST, encoded by esc_setup()
+};
+
+struct esc_PDO {
+    uint16 idx;      // 0x16xx (outputs) or 0x1Axx (inputs)
+    int    first;    // Into esc_direction.entries
+    int    num;
+};
+
+struct esc_direction {
+    int numPDOs;
+    struct esc_PDO PDOs[ESC_MAXPDOS];
+    int numEntries;
+    struct esc_entry entries[ESC_MAXENTRIES];
+    int bits;        // Total, set by esc_setup()
+};
+
+struct esc_slave {
+    char   name[ESC_MAXNAME+1];
+    uint32 vendor;
+    uint32 product;
+    struct esc_direction out;
+    struct esc_direction in;
+
+    int    mailbox;  // Has a mailbox (and CoE), set by esc_setup()
+    uint16 sii[ESC_SIIWORDS];
+    uint8* mem;      // ESC_MEMSIZE
+    uint64 frames;   // Process data frames seen, for ESC_COUNT and ESC_SINE
+};
+
+struct esc_counters {
+    uint64 frames;       // EtherCAT frames answered
+    uint64 datagrams;
+    uint64 logical;      // Frames with logical (process data) datagrams
+    uint64 mailbox;      // Mailbox requests, over all slaves
+    uint64 malformed;    // Frames ignored because they did not parse
+};
+
+// Functions        ************************************************************************
+
+// Data type name (e.g. "INTEGER16") to ECT_* and bit length. Returns 1 if known, 0 if not.
+int esc_typeByName(const char* name, uint16* dataType, uint8* bitlen);
+
+// Encode a value as the raw bits of an entry (two's complement or IEEE 754, little endian).
+uint64 esc_encode(const struct esc_entry* entry, double value);
+
+// Get and put the raw bits of an entry, at base + bitoff
+uint64 esc_getBits(const uint8* base, int bitoff, int bitlen);
+void   esc_putBits(uint8* base, int bitoff, int bitlen, uint64 raw);
+
+// The process data area of a slave: where the master configured SM2/SM3, else the default.
+uint8* esc_processData(struct esc_slave* slave, int inputs);
+
+// Lay out the PDOs, build the SII contents and reset the registers of slave 'position' (1..num).
+// Returns 1 if all OK, 0 (with a message on stderr) if the slave can not be emulated.
+int esc_setup(struct esc_slave* slave, int position, int num);
+
+// Process one received Ethernet frame in place, as it passes through all slaves in order.
+// Returns 1 if it is an EtherCAT frame which should be sent back, 0 if it should be dropped.
+int esc_processFrame(struct esc_slave* slaves, int num, uint8* frame, int len, struct esc_counters* counters);
+
+#endif
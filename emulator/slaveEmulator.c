@@ -0,0 +1,383 @@
+// EtherCAT slave emulator: answers the frames of a master on one end of a veth pair (or on a
+// spare NIC) as a chain of slaves, so that the daemon runs end to end through SOEM's real NIC
+// path without hardware:
+//
+//   ip link add veth0 type veth peer name veth1
+//   ip link set veth0 up; ip link set veth1 up
+//   ./slave_emulator veth1 ../emulator/slaves.txt &
+//   ./daemon veth0
+//
+// The slaves are described in a configuration file, see emulator/slaves.txt.
+// Built with 'make slave_emulator' (not part of the default build); needs root for the raw socket.
+// Prints the state changes of the slaves, and every STATS seconds (and at exit) the frame rate,
+// the process data period as seen on the wire, and the time spent on each frame.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <inttypes.h>
+
+#include <sys/socket.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <linux/if_packet.h>
+
+#include "ethercat.h" // ECT_* data types, EC_STATE_*
+
+#include "escEmulator.h"
+
+// Configuration    ************************************************************************
+#define EMU_MAXSLAVES 64
+#define EMU_ETHERTYPE 0x88A4
+#define EMU_FRAMELEN  1536
+
+// Data types       ************************************************************************
+
+struct emu_stats {
+    int64  start;       // Of the interval [ns]
+    uint64 frames;
+    uint64 logical;
+    int64  lastLogical; // Arrival of the last process data frame [ns]
+    int64  periodMin;
+    int64  periodMax;
+    int64  periodSum;
+    uint64 periods;
+    int64  workMax;     // From receive to send [ns]
+    int64  workSum;
+};
+
+// File-global data ************************************************************************
+
+struct esc_slave emu_slaves[EMU_MAXSLAVES];
+int emu_numSlaves = 0;
+int emu_statsInterval = -1; // [s]
+
+volatile sig_atomic_t emu_stop = 0;
+
+// Functions        ************************************************************************
+
+int64 emu_now() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (int64)t.tv_sec * 1000000000 + t.tv_nsec;
+}
+
+void emu_signal(int sig) {
+    (void)sig; // Not used
+    emu_stop = 1;
+}
+
+int emu_parseEntry(const char* tmp, struct esc_direction* dir, int inputs, int lineNum) {
+    //Helper function for emu_parseConfig(): an ENTRY or PAD line
+    struct esc_entry* entry = &(dir->entries[dir->numEntries]);
+    memset(entry, 0, sizeof(struct esc_entry));
+
+    unsigned int idx = 0, subidx = 0, bits = 0;
+    char type[20], signal[20], args[64];
+    memset(signal, 0, sizeof(signal));
+    memset(args, 0, sizeof(args));
+
+    if (sscanf(tmp, "PAD %u", &bits) == 1) {
+        if (bits < 1 || bits > 64) {
+            fprintf(stderr, "Error in emu_parseConfig(), line %d: PAD of %u bits, expected 1..64\n", lineNum, bits);
+            return 0;
+        }
+        entry->bitlen = bits;
+    }
+    else if (sscanf(tmp, "ENTRY %x %x %19s %40s %19s %63[^\n]", &idx, &subidx, type, entry->name, signal, args) >= 4) {
+        if (idx == 0 || idx > 0xFFFF || subidx == 0 || subidx > 0xFF) {
+            fprintf(stderr, "Error in emu_parseConfig(), line %d: invalid object 0x%X:0x%X\n", lineNum, idx, subidx);
+            return 0;
+        }
+        if (!esc_typeByName(type, &entry->dataType, &entry->bitlen)) {
+            fprintf(stderr, "Error in emu_parseConfig(), line %d: unknown data type '%s'\n", lineNum, type);
+            return 0;
+        }
+        entry->idx    = idx;
+        entry->subidx = subidx;
+
+        if (signal[0] != '\0' && !inputs) {
+            fprintf(stderr, "Error in emu_parseConfig(), line %d: only inputs (TXPDO) have a signal\n", lineNum);
+            return 0;
+        }
+        if (signal[0] == '\0') {
+            entry->signal = ESC_CONST;
+        }
+        else if (strcmp(signal, "CONST") == 0 && sscanf(args, "%lf", &entry->value) == 1) {
+            entry->signal = ESC_CONST;
+        }
+        else if (strcmp(signal, "COUNT") == 0) {
+            entry->signal = ESC_COUNT;
+        }
+        else if (strcmp(signal, "SINE") == 0 && sscanf(args, "%lf %d", &entry->value, &entry->period) == 2 && entry->period > 0) {
+            entry->signal = ESC_SINE;
+        }
+        else if (strcmp(signal, "ECHO") == 0 && sscanf(args, "%x %x", &idx, &subidx) == 2) {
+            entry->signal     = ESC_ECHO;
+            entry->echoIdx    = idx;
+            entry->echoSubidx = subidx;
+        }
+        else {
+            fprintf(stderr, "Error in emu_parseConfig(), line %d: invalid signal '%s %s', expected "
+                    "CONST <value>, COUNT, SINE <amplitude> <period>, or ECHO <index> <subindex>\n", lineNum, signal, args);
+            return 0;
+        }
+    }
+    else {
+        return 0;
+    }
+
+    if (dir->numEntries >= ESC_MAXENTRIES) {
+        fprintf(stderr, "Error in emu_parseConfig(), line %d: more than %d entries\n", lineNum, ESC_MAXENTRIES);
+        return 0;
+    }
+    dir->numEntries++;
+    dir->PDOs[dir->numPDOs-1].num++;
+    return 1;
+}
+
+int emu_parseConfig(const char* fileName) {
+    //Returns 0 if all OK, 1 in case of error
+    printf("Parsing config file '%s'...\n", fileName);
+
+    errno = 0;
+    FILE* iFile = fopen(fileName, "r");
+    if (iFile == NULL || errno) {
+        perror("Error on opening file");
+        return 1;
+    }
+
+    struct esc_slave*     slave = NULL;
+    struct esc_direction* dir   = NULL; // Of the last PDO
+    int inputs = 0;
+    int lineNum = 0;
+
+    char*  line = NULL;
+    size_t line_len = 0;
+    while (getline(&line, &line_len, iFile) != -1) {
+        lineNum++;
+        // Delete the final '\n' from a line
+        char* tmp = strrchr(line,'\n');
+        if (tmp != NULL) *tmp='\0';
+        // Find first non-whitespace character
+        tmp = line + strspn(line," \t");
+        // Skip blank lines and comments
+        if(tmp[0]=='\0' || tmp[0]=='!') continue;
+
+        int parseInt = 0;
+        unsigned int vendor = 0, product = 0, idx = 0;
+        char name[ESC_MAXNAME+1];
+        memset(name, 0, sizeof(name));
+
+        if (sscanf(tmp, "STATS %d", &parseInt) == 1) {
+            if (emu_statsInterval != -1 || parseInt < 0) {
+                fprintf(stderr, "Error in emu_parseConfig(), line %d: got two STATS, or STATS < 0\n", lineNum);
+                return 1;
+            }
+            emu_statsInterval = parseInt;
+            continue;
+        }
+
+        if (sscanf(tmp, "SLAVE %x %x %40[^\n]", &vendor, &product, name) == 3) {
+            if (emu_numSlaves >= EMU_MAXSLAVES) {
+                fprintf(stderr, "Error in emu_parseConfig(), line %d: more than %d slaves\n", lineNum, EMU_MAXSLAVES);
+                return 1;
+            }
+            slave = &emu_slaves[emu_numSlaves++];
+            memset(slave, 0, sizeof(struct esc_slave));
+            slave->vendor  = vendor;
+            slave->product = product;
+            strcpy(slave->name, name);
+            dir = NULL;
+            continue;
+        }
+
+        if (sscanf(tmp, "RXPDO %x", &idx) == 1 || sscanf(tmp, "TXPDO %x", &idx) == 1) {
+            if (slave == NULL) {
+                fprintf(stderr, "Error in emu_parseConfig(), line %d: PDO before the first SLAVE\n", lineNum);
+                return 1;
+            }
+            inputs = tmp[0] == 'T';
+            dir = inputs ? &slave->in : &slave->out;
+            if (dir->numPDOs >= ESC_MAXPDOS || idx < 0x1600 || idx > 0x1BFF) {
+                fprintf(stderr, "Error in emu_parseConfig(), line %d: more than %d PDOs, or index 0x%X not 0x1600..0x1BFF\n",
+                        lineNum, ESC_MAXPDOS, idx);
+                return 1;
+            }
+            dir->PDOs[dir->numPDOs].idx   = idx;
+            dir->PDOs[dir->numPDOs].first = dir->numEntries;
+            dir->PDOs[dir->numPDOs].num   = 0;
+            dir->numPDOs++;
+            continue;
+        }
+
+        if (strncmp(tmp, "ENTRY", 5) == 0 || strncmp(tmp, "PAD", 3) == 0) {
+            if (dir == NULL) {
+                fprintf(stderr, "Error in emu_parseConfig(), line %d: entry before the first PDO of the slave\n", lineNum);
+                return 1;
+            }
+            if (!emu_parseEntry(tmp, dir, inputs, lineNum)) {
+                fprintf(stderr, "Error in emu_parseConfig(), line %d: could not parse '%s'\n", lineNum, tmp);
+                return 1;
+            }
+            continue;
+        }
+
+        fprintf(stderr, "Error in emu_parseConfig(), line %d: unknown line '%s'\n", lineNum, tmp);
+        return 1;
+    }
+    free(line);
+    fclose(iFile);
+
+    if (emu_numSlaves == 0) {
+        fprintf(stderr, "Error in emu_parseConfig(), no SLAVE\n");
+        return 1;
+    }
+    if (emu_statsInterval == -1) {
+        emu_statsInterval = 10;
+    }
+    return 0;
+}
+
+int emu_socket(const char* ifname) {
+    int fd = socket(PF_PACKET, SOCK_RAW, htons(EMU_ETHERTYPE));
+    if (fd < 0) {
+        perror("ERROR could not open a raw socket (root?)");
+        return -1;
+    }
+    struct sockaddr_ll sll;
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family   = AF_PACKET;
+    sll.sll_ifindex  = if_nametoindex(ifname);
+    sll.sll_protocol = htons(EMU_ETHERTYPE);
+    if (sll.sll_ifindex == 0 || bind(fd, (struct sockaddr*)&sll, sizeof(sll)) != 0) {
+        fprintf(stderr, "ERROR could not bind to interface %s: %s\n", ifname, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    //Wake up now and then for the statistics and signals
+    struct timeval timeout = { .tv_sec = 0, .tv_usec = 100000 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    return fd;
+}
+
+const char* emu_stateName(int state) {
+    switch (state & 0x0F) {
+    case EC_STATE_INIT:        return "INIT";
+    case EC_STATE_PRE_OP:      return "PRE-OP";
+    case EC_STATE_BOOT:        return "BOOT";
+    case EC_STATE_SAFE_OP:     return "SAFE-OP";
+    case EC_STATE_OPERATIONAL: return "OP";
+    default:                   return "?";
+    }
+}
+
+void emu_printStats(struct emu_stats* stats, const struct esc_counters* counters, int64 now) {
+    double seconds = (now - stats->start) / 1e9;
+    printf("%.1f s: %" PRIu64 " frames (%.0f/s), %" PRIu64 " with process data (%.0f/s)",
+           seconds, stats->frames, stats->frames / seconds, stats->logical, stats->logical / seconds);
+    if (stats->periods > 0) {
+        printf("; period min/avg/max %.1f/%.1f/%.1f us",
+               stats->periodMin/1e3, stats->periodSum/1e3/stats->periods, stats->periodMax/1e3);
+    }
+    if (stats->frames > 0) {
+        printf("; work avg/max %.2f/%.2f us", stats->workSum/1e3/stats->frames, stats->workMax/1e3);
+    }
+    printf("; total mailbox %" PRIu64 ", malformed %" PRIu64 "\n", counters->mailbox, counters->malformed);
+    fflush(stdout);
+
+    int64 last = stats->lastLogical;
+    memset(stats, 0, sizeof(struct emu_stats));
+    stats->start       = now;
+    stats->lastLogical = last;
+}
+
+int main(int argc, char *argv[]) {
+    printf("EtherCAT slave emulator\n");
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <interface> <config file>\n", argv[0]);
+        return 1;
+    }
+    if (emu_parseConfig(argv[2])) return 1;
+
+    for (int s = 0; s < emu_numSlaves; s++) {
+        if (!esc_setup(&emu_slaves[s], s+1, emu_numSlaves)) return 1;
+        printf("  - slave %d: %-12s 0x%8.8X:0x%8.8X, %d output and %d input bits%s\n", s+1, emu_slaves[s].name,
+               emu_slaves[s].vendor, emu_slaves[s].product, emu_slaves[s].out.bits, emu_slaves[s].in.bits,
+               emu_slaves[s].mailbox ? ", CoE" : "");
+    }
+
+    int fd = emu_socket(argv[1]);
+    if (fd < 0) return 1;
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = emu_signal;
+    sigaction(SIGINT,  &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    printf("Emulating %d slaves on %s\n", emu_numSlaves, argv[1]);
+    fflush(stdout);
+
+    uint8 frame[EMU_FRAMELEN];
+    uint8 states[EMU_MAXSLAVES];
+    for (int s = 0; s < emu_numSlaves; s++) states[s] = emu_slaves[s].mem[ESC_REG_ALSTAT];
+    struct esc_counters counters;
+    memset(&counters, 0, sizeof(counters));
+    struct emu_stats stats;
+    memset(&stats, 0, sizeof(stats));
+    stats.start = emu_now();
+
+    while (!emu_stop) {
+        ssize_t len = recv(fd, frame, sizeof(frame), 0);
+        int64 arrived = emu_now();
+
+        if (len > 0) {
+            uint64 logical = counters.logical;
+            if (esc_processFrame(emu_slaves, emu_numSlaves, frame, len, &counters)) {
+                if (send(fd, frame, len, 0) != len) {
+                    perror("WARNING: could not send a frame back");
+                }
+                int64 work = emu_now() - arrived;
+                stats.frames++;
+                stats.workSum += work;
+                if (work > stats.workMax) stats.workMax = work;
+            }
+            if (counters.logical != logical) {
+                if (stats.lastLogical != 0) {
+                    int64 period = arrived - stats.lastLogical;
+                    if (stats.periods == 0 || period < stats.periodMin) stats.periodMin = period;
+                    if (period > stats.periodMax) stats.periodMax = period;
+                    stats.periodSum += period;
+                    stats.periods++;
+                }
+                stats.lastLogical = arrived;
+                stats.logical++;
+            }
+            for (int s = 0; s < emu_numSlaves; s++) {
+                uint8 state = emu_slaves[s].mem[ESC_REG_ALSTAT];
+                if (state == states[s]) continue;
+                printf("slave %d %s: %s -> %s%s\n", s+1, emu_slaves[s].name, emu_stateName(states[s]), emu_stateName(state),
+                       (state & EC_STATE_ERROR) ? " (error)" : "");
+                states[s] = state;
+            }
+        }
+        else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            perror("ERROR on receive");
+            break;
+        }
+
+        if (emu_statsInterval > 0 && arrived - stats.start >= (int64)emu_statsInterval * 1000000000) {
+            emu_printStats(&stats, &counters, arrived);
+        }
+    }
+
+    emu_printStats(&stats, &counters, emu_now());
+    close(fd);
+    for (int s = 0; s < emu_numSlaves; s++) free(emu_slaves[s].mem);
+    return 0;
+}
@@ -27,18 +27,20 @@
 
 #include <pwd.h>
 #include <errno.h>
+#include <time.h>
 
 #include "networkServer.h"
 #include "ecatDriver.h"
+#include "metricsServer.h"
+#include "aggregator.h"
+#include "lockTrace.h"
+#include "tsLogger.h"
 
 // Global data      ************************************************************************
 
 // Set to 1 if we got a control+C interupt or if an IP client calls 'quit'
 volatile sig_atomic_t gotCtrlC = 0;
 
-// Lock for stdin/stdout/stderr (used once we get into threading)
-pthread_mutex_t printf_lock;
-
 // Lock for rootprivs; cannot start IP server before this is released.
 pthread_mutex_t rootprivs_lock;
 
@@ -48,17 +50,33 @@ struct config_file_data config_file;
 // File-global data ************************************************************************
 
 pthread_t thread_communicate; // TCP/IP communications persistent thread
+pthread_t thread_metrics;     // HTTP metrics endpoint persistent thread
 
 // Functions        ************************************************************************
 
+#ifndef ECD_MICROBENCH // The benchmarks (bench/microbench.c, bench/nicbench.c) have their own main()
 int main(int argc, char *argv[]) {
     printf("EtherCat IP daemon, using SOEM\n");
     printf("*** For research purposes ONLY ***\n");
 
-    if (argc == 2) {
+    // Replay a recording instead of running a bus?
+    char*  replayFile  = NULL;
+    double replaySpeed = 1.0;
+    if ((argc == 3 || argc == 4) && !strcmp(argv[1], "--replay")) {
+        replayFile = argv[2];
+        if (argc == 4 && sscanf(argv[3], "%lf", &replaySpeed) != 1) {
+            fprintf(stderr, "Error: could not parse replay speed '%s'\n", argv[3]);
+            exit(1);
+        }
+    }
+
+    // Aggregate other daemons instead of running a bus?
+    int aggregate = argc == 2 && !strcmp(argv[1], "--aggregate");
+
+    if (argc == 2 || replayFile != NULL) {
 
         if (pthread_mutex_init(&rootprivs_lock, NULL) != 0) {
-            perror("ERROR pthread_mutex_init has failed for printf_lock");
+            perror("ERROR pthread_mutex_init has failed for rootprivs_lock");
             exit(1);
         }
         pthread_mutex_lock(&rootprivs_lock);
@@ -69,18 +87,28 @@ int main(int argc, char *argv[]) {
             exit(1);
         }
 
-        if (pthread_mutex_init(&printf_lock, NULL) != 0) {
-            perror("ERROR pthread_mutex_init has failed for printf_lock");
-            exit(1);
-        }
+        // From here on, all output goes through the logger (used once we get into threading)
+        log_level = config_file.log_level;
+        log_setup();
 
         pthread_create(&thread_communicate, NULL, (void*) &mainIPserver, (void*) &ctime);
+        if (config_file.metrics_port > 0) {
+            pthread_create(&thread_metrics, NULL, (void*) &mainMetricsServer, NULL);
+        }
 
         //Interupt handler for Control+c
         signal(SIGINT, ctrlC_handler);
 
-        // Start the EtherCAT driver
-        ecat_driver(argv[1]);
+        // Start the EtherCAT driver, replay a recording, or aggregate other daemons
+        if (replayFile != NULL) {
+            ecat_replay(replayFile, replaySpeed);
+        }
+        else if (aggregate) {
+            agg_run();
+        }
+        else {
+            ecat_driver(argv[1]);
+        }
 
         // TODO: Shutdown all networkServer threads
 
@@ -93,20 +121,24 @@ int main(int argc, char *argv[]) {
         //    exit(1);
         //}
 
-
-        if (pthread_mutex_destroy(&printf_lock) != 0) {
-            perror("ERROR pthread_mutex_destroy has failed for printf_lock");
-            exit(1);
-        }
+        // Flush the logger; after this, printf is safe again
+        log_shutdown();
+        locktrace_dump(stdout);
     }
     else {
         printf("Usage:    daemon ifname\n");
+        printf("          daemon --replay file [speed]\n");
+        printf("          daemon --aggregate\n");
         printf("  ifname:   Communication interface, e.g. eth1\n");
+        printf("  file:     Recording made with RECORD_FILE, replayed instead of using a bus\n");
+        printf("  speed:    Replay speed relative to the recording (default 1, 0 = as fast as possible)\n");
+        printf("  --aggregate: Serve the data of the UPSTREAM daemons in config.txt, instead of using a bus\n");
     }
 
-    printf("Done\n"); // Some threads may still be running here; mutex would probably be good.
+    printf("Done\n"); // Some threads may still be running here, but they can only log.
     return (0);
 }
+#endif
 
 int parseConfigFile() {
     const size_t str_bufflen = 100; // !!!ALSO HARDCODED IN SSCANF (str_bufflen-1)!!!
@@ -124,14 +156,69 @@ int parseConfigFile() {
     config_file.dropPrivs_username = NULL;
     config_file.allowQuit          = 2; //On a rPI, -1 -> 256; 256 != -1
     config_file.iomap_size         = -1;
+    config_file.nic_ring           = 2;
+    config_file.nic_busypoll       = -1;
     config_file.slaveInit          = malloc(sizeof(struct slave_init_cmd));
     memset(config_file.slaveInit, 0, sizeof(struct slave_init_cmd));
     config_file.slaveInit->next = NULL;
+    config_file.metrics_port       = -1;
+    config_file.metricsPDOs        = malloc(sizeof(struct pdo_address));
+    memset(config_file.metricsPDOs, 0, sizeof(struct pdo_address));
 
     struct slave_init_cmd* slaveInit_tail = config_file.slaveInit;
+    struct pdo_address* metricsPDO_tail   = config_file.metricsPDOs;
+    config_file.mcast_addr         = NULL;
+    config_file.mcast_port         = -1;
+    config_file.mcast_decimate     = -1;
+    config_file.mcast_ttl          = -1;
+    config_file.mcast_interface    = NULL;
+    config_file.mcastPDOs          = malloc(sizeof(struct pdo_address));
+    memset(config_file.mcastPDOs, 0, sizeof(struct pdo_address));
+    struct pdo_address* mcastPDO_tail     = config_file.mcastPDOs;
+    config_file.derived            = malloc(sizeof(struct derived_def));
+    memset(config_file.derived, 0, sizeof(struct derived_def));
+    struct derived_def* derived_tail      = config_file.derived;
+    config_file.decodeInputs       = 2;
+    config_file.stats              = malloc(sizeof(struct stats_def));
+    memset(config_file.stats, 0, sizeof(struct stats_def));
+    struct stats_def* stats_tail          = config_file.stats;
+    config_file.historyPDOs        = malloc(sizeof(struct pdo_address));
+    memset(config_file.historyPDOs, 0, sizeof(struct pdo_address));
+    struct pdo_address* historyPDO_tail   = config_file.historyPDOs;
+    config_file.historyTiers       = malloc(sizeof(struct history_tierDef));
+    memset(config_file.historyTiers, 0, sizeof(struct history_tierDef));
+    struct history_tierDef* historyTier_tail = config_file.historyTiers;
+    config_file.log_level          = -1;
+    config_file.unix_socket        = NULL;
+    config_file.unix_shm           = 2;
+    config_file.client_rate        = -1;
+    config_file.client_burst       = -1;
+    config_file.expensive_rate     = -1;
+    config_file.expensive_burst    = -1;
+    config_file.shed_holdoff       = -1;
+    config_file.client_stack       = -1;
+    config_file.tcp_port           = -1;
+    config_file.upstreams          = malloc(sizeof(struct upstream_def));
+    memset(config_file.upstreams, 0, sizeof(struct upstream_def));
+    struct upstream_def* upstream_tail    = config_file.upstreams;
+    config_file.allowWaveform      = 2;
+    config_file.waveform_len       = -1;
+    config_file.record_file        = NULL;
+    config_file.tslog_dir          = NULL;
+    config_file.tslog_chunk        = -1;
+    config_file.tslog_decimate     = -1;
+    config_file.tslogPDOs          = malloc(sizeof(struct pdo_address));
+    memset(config_file.tslogPDOs, 0, sizeof(struct pdo_address));
+    struct pdo_address* tslogPDO_tail     = config_file.tslogPDOs;
+    config_file.capture_pre        = -1;
+    config_file.capture_post       = -1;
+    config_file.capturePDOs        = malloc(sizeof(struct pdo_address));
+    memset(config_file.capturePDOs, 0, sizeof(struct pdo_address));
+    struct pdo_address* capturePDO_tail   = config_file.capturePDOs;
 
     char* parseBuff = malloc(str_bufflen*sizeof(char));
     int   parseInt = 0;
+    int   parseInt2 = 0;
 
     char*  line = NULL;
     size_t line_len = 0;
@@ -149,6 +236,7 @@ int parseConfigFile() {
 
         memset(parseBuff,0,str_bufflen);
         parseInt = 0;
+        parseInt2 = 0;
 
 
         printf("Parsing: '%s'\n",tmp);
@@ -187,6 +275,69 @@ int parseConfigFile() {
             continue;
         }
 
+        gotHits = sscanf(tmp, "LOG_LEVEL %s", parseBuff);
+        if (gotHits>0) {
+            if (config_file.log_level != -1) {
+                fprintf(stderr, "Error in parseConfigFile(), got two LOG_LEVEL!\n");
+                return 1;
+            }
+
+            if      ( strncmp(parseBuff, "ERROR", str_bufflen) == 0 ) {
+                config_file.log_level = LOG_LEVEL_ERROR;
+            }
+            else if ( strncmp(parseBuff, "WARN",  str_bufflen) == 0 ) {
+                config_file.log_level = LOG_LEVEL_WARN;
+            }
+            else if ( strncmp(parseBuff, "INFO",  str_bufflen) == 0 ) {
+                config_file.log_level = LOG_LEVEL_INFO;
+            }
+            else if ( strncmp(parseBuff, "DEBUG", str_bufflen) == 0 ) {
+                config_file.log_level = LOG_LEVEL_DEBUG;
+            }
+            else {
+                fprintf(stderr, "Error in parseConfigFile(), got invalid LOG_LEVEL '%s', expected 'ERROR', 'WARN', 'INFO' or 'DEBUG'\n", parseBuff);
+                return 1;
+            }
+            continue;
+        }
+
+        gotHits = sscanf(tmp, "NIC_RING %s", parseBuff);
+        if (gotHits>0) {
+            if (config_file.nic_ring != 2) {
+                fprintf(stderr, "Error in parseConfigFile(), got two NIC_RING!\n");
+                return 1;
+            }
+
+            if      ( strncmp(parseBuff, "YES", str_bufflen) == 0 ) {
+                config_file.nic_ring = 1;
+            }
+            else if ( strncmp(parseBuff, "NO",  str_bufflen) == 0 ) {
+                config_file.nic_ring = 0;
+            }
+            else {
+                fprintf(stderr, "Error in parseConfigFile(), got invalid NIC_RING '%s', expected 'YES' or 'NO'\n", parseBuff);
+                return 1;
+            }
+            continue;
+        }
+
+        gotHits = sscanf(tmp, "NIC_BUSYPOLL %d", &parseInt);
+        if (gotHits>0) {
+            if (config_file.nic_busypoll != -1) {
+                fprintf(stderr, "Error in parseConfigFile(), got two NIC_BUSYPOLL!\n");
+                return 1;
+            }
+
+            if (parseInt >= 0) {
+                config_file.nic_busypoll = parseInt;
+            }
+            else {
+                fprintf(stderr, "Error in parseConfigFile(), got invalid NIC_BUSYPOLL %d, expected >= 0\n", parseInt);
+                return 1;
+            }
+            continue;
+        }
+
         gotHits = sscanf(tmp, "IOMAP_SIZE %d", &parseInt);
         if (gotHits>0) {
             if (config_file.iomap_size != -1) {
@@ -204,6 +355,493 @@ int parseConfigFile() {
             continue;
         }
 
+        gotHits = sscanf(tmp, "TCP_PORT %d", &parseInt);
+        if (gotHits>0) {
+            if (config_file.tcp_port != -1) {
+                fprintf(stderr, "Error in parseConfigFile(), got two TCP_PORT!\n");
+                return 1;
+            }
+
+            if (parseInt > 0 && parseInt <= 65535) {
+                config_file.tcp_port = parseInt;
+            }
+            else {
+                fprintf(stderr, "Error in parseConfigFile(), got invalid TCP_PORT %d, expected 1..65535\n", parseInt);
+                return 1;
+            }
+            continue;
+        }
+
+        gotHits = sscanf(tmp, "METRICS_PORT %d", &parseInt);
+        if (gotHits>0) {
+            if (config_file.metrics_port != -1) {
+                fprintf(stderr, "Error in parseConfigFile(), got two METRICS_PORT!\n");
+                return 1;
+            }
+
+            if (parseInt >= 0 && parseInt <= 65535) {
+                config_file.metrics_port = parseInt;
+            }
+            else {
+                fprintf(stderr, "Error in parseConfigFile(), got invalid METRICS_PORT %d, expected 0..65535\n", parseInt);
+                return 1;
+            }
+            continue;
+        }
+
+        gotHits = sscanf(tmp,"METRICS_PDO %hi:%hx:%hhx",
+                         &(metricsPDO_tail->slaveIdx), &(metricsPDO_tail->idx), &(metricsPDO_tail->subidx)
+                        );
+        if (gotHits == 3) {
+            metricsPDO_tail->next = malloc(sizeof(struct pdo_address));
+            metricsPDO_tail = metricsPDO_tail->next;
+            memset(metricsPDO_tail, 0, sizeof(struct pdo_address));
+            continue;
+        }
+        else if (gotHits > 0) {
+            fprintf(stderr, "Error in parseConfigFile(), got invalid METRICS_PDO '%s', expected slave:idx:subidx\n", tmp);
+            return 1;
+        }
+
+        gotHits = sscanf(tmp, "MCAST_GROUP %99[^:]:%d", parseBuff, &parseInt);
+        if (gotHits>0) {
+            if (config_file.mcast_addr != NULL) {
+                fprintf(stderr, "Error in parseConfigFile(), got two MCAST_GROUP!\n");
+                return 1;
+            }
+            if (gotHits != 2 || parseInt <= 0 || parseInt > 65535) {
+                fprintf(stderr, "Error in parseConfigFile(), got invalid MCAST_GROUP '%s', expected address:port\n", tmp);
+                return 1;
+            }
+            config_file.mcast_addr = parseBuff;
+            config_file.mcast_port = parseInt;
+            parseBuff = malloc(str_bufflen*sizeof(char));
+            continue;
+        }
+
+        gotHits = sscanf(tmp, "MCAST_DECIMATE %d", &parseInt);
+        if (gotHits>0) {
+            if (config_file.mcast_decimate != -1) {
+                fprintf(stderr, "Error in parseConfigFile(), got two MCAST_DECIMATE!\n");
+                return 1;
+            }
+
+            if (parseInt > 0) {
+                config_file.mcast_decimate = parseInt;
+            }
+            else {
+                fprintf(stderr, "Error in parseConfigFile(), got invalid MCAST_DECIMATE %d, expected > 0\n", parseInt);
+                return 1;
+            }
+            continue;
+        }
+
+        gotHits = sscanf(tmp, "MCAST_TTL %d", &parseInt);
+        if (gotHits>0) {
+            if (config_file.mcast_ttl != -1) {
+                fprintf(stderr, "Error in parseConfigFile(), got two MCAST_TTL!\n");
+                return 1;
+            }
+
+            if (parseInt >= 0 && parseInt <= 255) {
+                config_file.mcast_ttl = parseInt;
+            }
+            else {
+                fprintf(stderr, "Error in parseConfigFile(), got invalid MCAST_TTL %d, expected 0..255\n", parseInt);
+                return 1;
+            }
+            continue;
+        }
+
+        gotHits = sscanf(tmp, "UNIX_SOCKET %99s", parseBuff);
+        if (gotHits>0) {
+            if (config_file.unix_socket != NULL) {
+                fprintf(stderr, "Error in parseConfigFile(), got two UNIX_SOCKET!\n");
+                return 1;
+            }
+            config_file.unix_socket = parseBuff;
+            parseBuff = malloc(str_bufflen*sizeof(char));
+            continue;
+        }
+
+        gotHits = sscanf(tmp, "UNIX_SHM %s", parseBuff);
+        if (gotHits>0) {
+            if (config_file.unix_shm != 2) {
+                fprintf(stderr, "Error in parseConfigFile(), got two UNIX_SHM!\n");
+                return 1;
+            }
+
+            if      ( strncmp(parseBuff, "YES", str_bufflen) == 0 ) {
+                config_file.unix_shm = 1;
+            }
+            else if ( strncmp(parseBuff, "NO",  str_bufflen) == 0 ) {
+                config_file.unix_shm = 0;
+            }
+            else {
+                fprintf(stderr, "Error in parseConfigFile(), got invalid UNIX_SHM '%s', expected 'YES' or 'NO'\n", parseBuff);
+                return 1;
+            }
+            continue;
+        }
+
+        gotHits = sscanf(tmp, "CLIENT_RATE %d %d", &parseInt, &parseInt2);
+        if (gotHits>0) {
+            if (config_file.client_rate != -1) {
+                fprintf(stderr, "Error in parseConfigFile(), got two CLIENT_RATE!\n");
+                return 1;
+            }
+
+            if (gotHits == 2 && parseInt >= 0 && parseInt2 > 0) {
+                config_file.client_rate  = parseInt;
+                config_file.client_burst = parseInt2;
+            }
+            else {
+                fprintf(stderr, "Error in parseConfigFile(), got invalid CLIENT_RATE '%s', expected rate (>= 0) burst (> 0)\n", tmp);
+                return 1;
+            }
+            continue;
+        }
+
+        gotHits = sscanf(tmp, "EXPENSIVE_RATE %d %d", &parseInt, &parseInt2);
+        if (gotHits>0) {
+            if (config_file.expensive_rate != -1) {
+                fprintf(stderr, "Error in parseConfigFile(), got two EXPENSIVE_RATE!\n");
+                return 1;
+            }
+
+            if (gotHits == 2 && parseInt >= 0 && parseInt2 > 0) {
+                config_file.expensive_rate  = parseInt;
+                config_file.expensive_burst = parseInt2;
+            }
+            else {
+                fprintf(stderr, "Error in parseConfigFile(), got invalid EXPENSIVE_RATE '%s', expected rate (>= 0) burst (> 0)\n", tmp);
+                return 1;
+            }
+            continue;
+        }
+
+        gotHits = sscanf(tmp, "SHED_HOLDOFF %d", &parseInt);
+        if (gotHits>0) {
+            if (config_file.shed_holdoff != -1) {
+                fprintf(stderr, "Error in parseConfigFile(), got two SHED_HOLDOFF!\n");
+                return 1;
+            }
+
+            if (parseInt >= 0) {
+                config_file.shed_holdoff = parseInt;
+            }
+            else {
+                fprintf(stderr, "Error in parseConfigFile(), got invalid SHED_HOLDOFF %d, expected >= 0\n", parseInt);
+                return 1;
+            }
+            continue;
+        }
+
+        gotHits = sscanf(tmp, "CLIENT_STACK %d", &parseInt);
+        if (gotHits>0) {
+            if (config_file.client_stack != -1) {
+                fprintf(stderr, "Error in parseConfigFile(), got two CLIENT_STACK!\n");
+                return 1;
+            }
+
+            if (parseInt >= 64) {
+                config_file.client_stack = parseInt;
+            }
+            else {
+                fprintf(stderr, "Error in parseConfigFile(), got invalid CLIENT_STACK %d, expected >= 64\n", parseInt);
+                return 1;
+            }
+            continue;
+        }
+
+        gotHits = sscanf(tmp, "RECORD_FILE %99s", parseBuff);
+        if (gotHits>0) {
+            if (config_file.record_file != NULL) {
+                fprintf(stderr, "Error in parseConfigFile(), got two RECORD_FILE!\n");
+                return 1;
+            }
+            config_file.record_file = parseBuff;
+            parseBuff = malloc(str_bufflen*sizeof(char));
+            continue;
+        }
+
+        gotHits = sscanf(tmp, "TSLOG_DIR %99s", parseBuff);
+        if (gotHits>0) {
+            if (config_file.tslog_dir != NULL) {
+                fprintf(stderr, "Error in parseConfigFile(), got two TSLOG_DIR!\n");
+                return 1;
+            }
+            config_file.tslog_dir = parseBuff;
+            parseBuff = malloc(str_bufflen*sizeof(char));
+            continue;
+        }
+
+        gotHits = sscanf(tmp, "TSLOG_CHUNK %d", &parseInt);
+        if (gotHits>0) {
+            if (config_file.tslog_chunk != -1) {
+                fprintf(stderr, "Error in parseConfigFile(), got two TSLOG_CHUNK!\n");
+                return 1;
+            }
+
+            if (parseInt > 0 && parseInt % TSLOG_CHUNKALIGN == 0) {
+                config_file.tslog_chunk = parseInt;
+            }
+            else {
+                fprintf(stderr, "Error in parseConfigFile(), got invalid TSLOG_CHUNK %d, expected a multiple of %d (> 0)\n",
+                        parseInt, TSLOG_CHUNKALIGN);
+                return 1;
+            }
+            continue;
+        }
+
+        gotHits = sscanf(tmp, "TSLOG_DECIMATE %d", &parseInt);
+        if (gotHits>0) {
+            if (config_file.tslog_decimate != -1) {
+                fprintf(stderr, "Error in parseConfigFile(), got two TSLOG_DECIMATE!\n");
+                return 1;
+            }
+
+            if (parseInt > 0) {
+                config_file.tslog_decimate = parseInt;
+            }
+            else {
+                fprintf(stderr, "Error in parseConfigFile(), got invalid TSLOG_DECIMATE %d, expected > 0\n", parseInt);
+                return 1;
+            }
+            continue;
+        }
+
+        gotHits = sscanf(tmp,"TSLOG_PDO %hi:%hx:%hhx",
+                         &(tslogPDO_tail->slaveIdx), &(tslogPDO_tail->idx), &(tslogPDO_tail->subidx)
+                        );
+        if (gotHits == 3) {
+            tslogPDO_tail->next = malloc(sizeof(struct pdo_address));
+            tslogPDO_tail = tslogPDO_tail->next;
+            memset(tslogPDO_tail, 0, sizeof(struct pdo_address));
+            continue;
+        }
+        else if (gotHits > 0) {
+            fprintf(stderr, "Error in parseConfigFile(), got invalid TSLOG_PDO '%s', expected slave:idx:subidx\n", tmp);
+            return 1;
+        }
+
+        gotHits = sscanf(tmp, "MCAST_INTERFACE %99s", parseBuff);
+        if (gotHits>0) {
+            if (config_file.mcast_interface != NULL) {
+                fprintf(stderr, "Error in parseConfigFile(), got two MCAST_INTERFACE!\n");
+                return 1;
+            }
+            config_file.mcast_interface = parseBuff;
+            parseBuff = malloc(str_bufflen*sizeof(char));
+            continue;
+        }
+
+        gotHits = sscanf(tmp,"MCAST_PDO %hi:%hx:%hhx",
+                         &(mcastPDO_tail->slaveIdx), &(mcastPDO_tail->idx), &(mcastPDO_tail->subidx)
+                        );
+        if (gotHits == 3) {
+            mcastPDO_tail->next = malloc(sizeof(struct pdo_address));
+            mcastPDO_tail = mcastPDO_tail->next;
+            memset(mcastPDO_tail, 0, sizeof(struct pdo_address));
+            continue;
+        }
+        else if (gotHits > 0) {
+            fprintf(stderr, "Error in parseConfigFile(), got invalid MCAST_PDO '%s', expected slave:idx:subidx\n", tmp);
+            return 1;
+        }
+
+        parseInt2 = 1;
+        gotHits = sscanf(tmp, "UPSTREAM %31s %63[^: ]:%d %d",
+                         upstream_tail->name, upstream_tail->host, &(upstream_tail->port), &parseInt2);
+        if (gotHits>0) {
+            if (gotHits < 3 || upstream_tail->port <= 0 || upstream_tail->port > 65535 || parseInt2 <= 0 ||
+                strchr(upstream_tail->name, '/') != NULL) {
+                fprintf(stderr, "Error in parseConfigFile(), got invalid UPSTREAM '%s', expected name host:port [decimate]\n", tmp);
+                return 1;
+            }
+            for (struct upstream_def* other = config_file.upstreams; other != upstream_tail; other = other->next) {
+                if (!strcmp(other->name, upstream_tail->name)) {
+                    fprintf(stderr, "Error in parseConfigFile(), got two UPSTREAM named '%s'!\n", other->name);
+                    return 1;
+                }
+            }
+            upstream_tail->decimate = parseInt2;
+            upstream_tail->next = malloc(sizeof(struct upstream_def));
+            upstream_tail = upstream_tail->next;
+            memset(upstream_tail, 0, sizeof(struct upstream_def));
+            continue;
+        }
+
+        gotHits = sscanf(tmp, "DECODE %s", parseBuff);
+        if (gotHits>0) {
+            if (config_file.decodeInputs != 2) {
+                fprintf(stderr, "Error in parseConfigFile(), got two DECODE!\n");
+                return 1;
+            }
+
+            if      ( strncmp(parseBuff, "YES", str_bufflen) == 0 ) {
+                config_file.decodeInputs = 1;
+            }
+            else if ( strncmp(parseBuff, "NO",  str_bufflen) == 0 ) {
+                config_file.decodeInputs = 0;
+            }
+            else {
+                fprintf(stderr, "Error in parseConfigFile(), got invalid DECODE '%s', expected 'YES' or 'NO'\n", parseBuff);
+                return 1;
+            }
+            continue;
+        }
+
+        gotHits = sscanf(tmp, "ALLOWWAVEFORM %s", parseBuff);
+        if (gotHits>0) {
+            if (config_file.allowWaveform != 2) {
+                fprintf(stderr, "Error in parseConfigFile(), got two ALLOWWAVEFORM!\n");
+                return 1;
+            }
+
+            if      ( strncmp(parseBuff, "YES", str_bufflen) == 0 ) {
+                config_file.allowWaveform = 1;
+            }
+            else if ( strncmp(parseBuff, "NO",  str_bufflen) == 0 ) {
+                config_file.allowWaveform = 0;
+            }
+            else {
+                fprintf(stderr, "Error in parseConfigFile(), got invalid ALLOWWAVEFORM '%s', expected 'YES' or 'NO'\n", parseBuff);
+                return 1;
+            }
+            continue;
+        }
+
+        gotHits = sscanf(tmp, "WAVEFORM_LEN %d", &parseInt);
+        if (gotHits>0) {
+            if (config_file.waveform_len != -1) {
+                fprintf(stderr, "Error in parseConfigFile(), got two WAVEFORM_LEN!\n");
+                return 1;
+            }
+
+            if (parseInt > 0) {
+                config_file.waveform_len = parseInt;
+            }
+            else {
+                fprintf(stderr, "Error in parseConfigFile(), got invalid WAVEFORM_LEN %d, expected > 0\n", parseInt);
+                return 1;
+            }
+            continue;
+        }
+
+        gotHits = sscanf(tmp, "CAPTURE_PRE %d", &parseInt);
+        if (gotHits>0) {
+            if (config_file.capture_pre != -1) {
+                fprintf(stderr, "Error in parseConfigFile(), got two CAPTURE_PRE!\n");
+                return 1;
+            }
+
+            if (parseInt >= 0) {
+                config_file.capture_pre = parseInt;
+            }
+            else {
+                fprintf(stderr, "Error in parseConfigFile(), got invalid CAPTURE_PRE %d, expected >= 0\n", parseInt);
+                return 1;
+            }
+            continue;
+        }
+
+        gotHits = sscanf(tmp, "CAPTURE_POST %d", &parseInt);
+        if (gotHits>0) {
+            if (config_file.capture_post != -1) {
+                fprintf(stderr, "Error in parseConfigFile(), got two CAPTURE_POST!\n");
+                return 1;
+            }
+
+            if (parseInt > 0) {
+                config_file.capture_post = parseInt;
+            }
+            else {
+                fprintf(stderr, "Error in parseConfigFile(), got invalid CAPTURE_POST %d, expected > 0\n", parseInt);
+                return 1;
+            }
+            continue;
+        }
+
+        gotHits = sscanf(tmp,"CAPTURE_PDO %hi:%hx:%hhx",
+                         &(capturePDO_tail->slaveIdx), &(capturePDO_tail->idx), &(capturePDO_tail->subidx)
+                        );
+        if (gotHits == 3) {
+            capturePDO_tail->next = malloc(sizeof(struct pdo_address));
+            capturePDO_tail = capturePDO_tail->next;
+            memset(capturePDO_tail, 0, sizeof(struct pdo_address));
+            continue;
+        }
+        else if (gotHits > 0) {
+            fprintf(stderr, "Error in parseConfigFile(), got invalid CAPTURE_PDO '%s', expected slave:idx:subidx\n", tmp);
+            return 1;
+        }
+
+        int exprPos = 0;
+        gotHits = sscanf(tmp, "DERIVED %hx %40s %n", &(derived_tail->idx), parseBuff, &exprPos);
+        if (gotHits>0) {
+            if (gotHits != 2 || exprPos == 0 || tmp[exprPos] == '\0' || tmp[exprPos] == '!') {
+                fprintf(stderr, "Error in parseConfigFile(), got invalid DERIVED '%s', expected idx name expression\n", tmp);
+                return 1;
+            }
+            //The expression runs until the end of the line or a '!' comment
+            char* exprEnd = strchr(tmp+exprPos, '!');
+            if (exprEnd != NULL) *exprEnd = '\0';
+            exprEnd = tmp + strlen(tmp);
+            while (exprEnd > tmp+exprPos && (exprEnd[-1] == ' ' || exprEnd[-1] == '\t')) *(--exprEnd) = '\0';
+
+            derived_tail->name = parseBuff;
+            derived_tail->expr = strdup(tmp+exprPos);
+            parseBuff = malloc(str_bufflen*sizeof(char));
+
+            derived_tail->next = malloc(sizeof(struct derived_def));
+            derived_tail = derived_tail->next;
+            memset(derived_tail, 0, sizeof(struct derived_def));
+            continue;
+        }
+
+        gotHits = sscanf(tmp,"STATS %hi:%hx:%hhx %d",
+                         &(stats_tail->slaveIdx), &(stats_tail->idx), &(stats_tail->subidx), &(stats_tail->window)
+                        );
+        if (gotHits == 4 && stats_tail->window > 0) {
+            stats_tail->next = malloc(sizeof(struct stats_def));
+            stats_tail = stats_tail->next;
+            memset(stats_tail, 0, sizeof(struct stats_def));
+            continue;
+        }
+        else if (gotHits > 0) {
+            fprintf(stderr, "Error in parseConfigFile(), got invalid STATS '%s', expected slave:idx:subidx window (> 0)\n", tmp);
+            return 1;
+        }
+
+        gotHits = sscanf(tmp,"HISTORY_TIER %d %d",
+                         &(historyTier_tail->resolution_ms), &(historyTier_tail->span_s)
+                        );
+        if (gotHits == 2 && historyTier_tail->resolution_ms > 0 && historyTier_tail->span_s > 0) {
+            historyTier_tail->next = malloc(sizeof(struct history_tierDef));
+            historyTier_tail = historyTier_tail->next;
+            memset(historyTier_tail, 0, sizeof(struct history_tierDef));
+            continue;
+        }
+        else if (gotHits > 0) {
+            fprintf(stderr, "Error in parseConfigFile(), got invalid HISTORY_TIER '%s', expected resolution [ms] (> 0) span [s] (> 0)\n", tmp);
+            return 1;
+        }
+
+        gotHits = sscanf(tmp,"HISTORY %hi:%hx:%hhx",
+                         &(historyPDO_tail->slaveIdx), &(historyPDO_tail->idx), &(historyPDO_tail->subidx)
+                        );
+        if (gotHits == 3) {
+            historyPDO_tail->next = malloc(sizeof(struct pdo_address));
+            historyPDO_tail = historyPDO_tail->next;
+            memset(historyPDO_tail, 0, sizeof(struct pdo_address));
+            continue;
+        }
+        else if (gotHits > 0) {
+            fprintf(stderr, "Error in parseConfigFile(), got invalid HISTORY '%s', expected slave:idx:subidx\n", tmp);
+            return 1;
+        }
+
         gotHits = sscanf(tmp,"INITIALIZE %hi:%hx:%hhx %hx",
                          &(slaveInit_tail->slaveIdx), &(slaveInit_tail->idx),
                          &(slaveInit_tail->subidx),   &(slaveInit_tail->value)
@@ -255,6 +893,95 @@ int parseConfigFile() {
         config_file.iomap_size = 4096;
     }
 
+    if (config_file.nic_ring == 2) {
+        config_file.nic_ring = 0; // Default: SOEM's plain socket
+    }
+    if (config_file.nic_busypoll == -1) {
+        config_file.nic_busypoll = 0;
+    }
+    if (config_file.nic_busypoll > 0 && !config_file.nic_ring) {
+        fprintf(stderr, "Error in parseConfigFile(), NIC_BUSYPOLL requires NIC_RING YES\n");
+        return 1;
+    }
+
+    if (config_file.log_level == -1) {
+        config_file.log_level = LOG_LEVEL_INFO;
+    }
+
+    if (config_file.unix_shm == 2) {
+        config_file.unix_shm = 0; // Default: no shared memory
+    }
+    if (config_file.unix_shm == 1 && config_file.unix_socket == NULL) {
+        fprintf(stderr, "Error in parseConfigFile(), UNIX_SHM YES requires a UNIX_SOCKET\n");
+        return 1;
+    }
+
+    if (config_file.client_rate == -1) {
+        config_file.client_rate     = 1000; // Default: generous, only stops clients in a tight loop
+        config_file.client_burst    = 2000;
+    }
+    if (config_file.expensive_rate == -1) {
+        config_file.expensive_rate  = 20;
+        config_file.expensive_burst = 40;
+    }
+    if (config_file.tcp_port == -1) {
+        config_file.tcp_port = TCPPORT;
+    }
+    if (config_file.client_stack == -1) {
+        config_file.client_stack = 256; // Default: plenty for chatThread(), which needs a few BUFFLEN buffers
+    }
+    if (config_file.shed_holdoff == -1) {
+        config_file.shed_holdoff = 1000;
+    }
+
+    if (config_file.decodeInputs == 2) {
+        config_file.decodeInputs = 0; // Default: decode on demand
+    }
+
+    if (config_file.allowWaveform == 2) {
+        config_file.allowWaveform = 0; // Default: clients can not drive the outputs
+    }
+    if (config_file.waveform_len == -1) {
+        config_file.waveform_len = 2000; // Default: 10 seconds at PLC_waittime = 5 ms
+    }
+
+    if (config_file.metrics_port == -1) {
+        config_file.metrics_port = 0; // Default: no metrics endpoint
+    }
+
+    if (config_file.mcast_decimate == -1) {
+        config_file.mcast_decimate = 1; // Default: publish every cycle
+    }
+    if (config_file.mcast_ttl == -1) {
+        config_file.mcast_ttl = 1;      // Default: stay on the local network
+    }
+
+    if (config_file.capture_pre == -1) {
+        config_file.capture_pre = 1000;  // Default: 5 seconds at PLC_waittime = 5 ms
+    }
+    if (config_file.capture_post == -1) {
+        config_file.capture_post = 1000;
+    }
+
+    if (config_file.tslog_chunk == -1) {
+        config_file.tslog_chunk = 4096;  // Default: 32 kB per column and chunk
+    }
+    if (config_file.tslog_decimate == -1) {
+        config_file.tslog_decimate = 1;  // Default: every cycle
+    }
+
+    if (config_file.historyPDOs->next != NULL && config_file.historyTiers->next == NULL) {
+        // Default: every cycle for 10 s, 100 ms for 1 hour, 10 s for 7 days
+        const int defaultTiers[3][2] = {{PLC_waittime/1000, 10}, {100, 3600}, {10000, 7*24*3600}};
+        for (int i = 0; i < 3; i++) {
+            historyTier_tail->resolution_ms = defaultTiers[i][0];
+            historyTier_tail->span_s        = defaultTiers[i][1];
+            historyTier_tail->next = malloc(sizeof(struct history_tierDef));
+            historyTier_tail = historyTier_tail->next;
+            memset(historyTier_tail, 0, sizeof(struct history_tierDef));
+        }
+    }
+
     // Done!
     printf("  Parse result:\n");
     printf("  - dropPrivs_username = '%s'\n", config_file.dropPrivs_username);
@@ -262,6 +989,31 @@ int parseConfigFile() {
     printf("  - dropPrivs_gid      = '%d'\n", config_file.dropPrivs_gid);
     printf("  - allowQuit          =  %s\n",  config_file.allowQuit==1 ? "YES" : "NO");
     printf("  - iomap_size         =  %d\n",  config_file.iomap_size);
+    printf("  - nic_ring           =  %s\n",  config_file.nic_ring==1 ? "YES" : "NO");
+    printf("  - nic_busypoll       =  %d\n",  config_file.nic_busypoll);
+    printf("  - log_level          =  %d\n",  config_file.log_level);
+    printf("  - record_file        = '%s'\n", config_file.record_file != NULL ? config_file.record_file : "(disabled)");
+    printf("  - tslog_dir          = '%s'\n", config_file.tslog_dir != NULL ? config_file.tslog_dir : "(disabled)");
+    printf("  - tslog_chunk        =  %d\n",  config_file.tslog_chunk);
+    printf("  - tslog_decimate     =  %d\n",  config_file.tslog_decimate);
+    printf("  - TSLOG_PDOs:\n");
+    tslogPDO_tail = config_file.tslogPDOs;
+    while(tslogPDO_tail->next != NULL){
+        printf("    -> %d:%x:%x\n",
+               tslogPDO_tail->slaveIdx,
+               tslogPDO_tail->idx,
+               tslogPDO_tail->subidx
+              );
+        tslogPDO_tail = tslogPDO_tail->next;
+    }
+    printf("  - unix_socket        = '%s'\n", config_file.unix_socket != NULL ? config_file.unix_socket : "(disabled)");
+    printf("  - unix_shm           =  %s\n",  config_file.unix_shm==1 ? "YES" : "NO");
+    printf("  - client_rate        =  %d (burst %d)\n", config_file.client_rate, config_file.client_burst);
+    printf("  - expensive_rate     =  %d (burst %d)\n", config_file.expensive_rate, config_file.expensive_burst);
+    printf("  - shed_holdoff       =  %d\n",  config_file.shed_holdoff);
+    printf("  - client_stack       =  %d\n",  config_file.client_stack);
+    printf("  - allowWaveform      =  %s\n",  config_file.allowWaveform==1 ? "YES" : "NO");
+    printf("  - waveform_len       =  %d\n",  config_file.waveform_len);
     printf("  - INITIALIZErs:\n");
     slaveInit_tail = config_file.slaveInit;
     while(slaveInit_tail->next != NULL){
@@ -273,10 +1025,111 @@ int parseConfigFile() {
               );
         slaveInit_tail = slaveInit_tail->next;
     }
+    printf("  - tcp_port           =  %d\n",  config_file.tcp_port);
+    printf("  - metrics_port       =  %d\n",  config_file.metrics_port);
+    printf("  - METRICS_PDOs:\n");
+    metricsPDO_tail = config_file.metricsPDOs;
+    while(metricsPDO_tail->next != NULL){
+        printf("    -> %d:%x:%x\n",
+               metricsPDO_tail->slaveIdx,
+               metricsPDO_tail->idx,
+               metricsPDO_tail->subidx
+              );
+        metricsPDO_tail = metricsPDO_tail->next;
+    }
+    if (config_file.mcast_addr != NULL) {
+        printf("  - mcast_group        = '%s:%d'\n", config_file.mcast_addr, config_file.mcast_port);
+        printf("  - mcast_decimate     =  %d\n",  config_file.mcast_decimate);
+        printf("  - mcast_ttl          =  %d\n",  config_file.mcast_ttl);
+        printf("  - mcast_interface    = '%s'\n", config_file.mcast_interface != NULL ? config_file.mcast_interface : "(default)");
+        printf("  - MCAST_PDOs:\n");
+        mcastPDO_tail = config_file.mcastPDOs;
+        while(mcastPDO_tail->next != NULL){
+            printf("    -> %d:%x:%x\n",
+                   mcastPDO_tail->slaveIdx,
+                   mcastPDO_tail->idx,
+                   mcastPDO_tail->subidx
+                  );
+            mcastPDO_tail = mcastPDO_tail->next;
+        }
+    }
+    else {
+        printf("  - mcast_group        =  (disabled)\n");
+    }
+    printf("  - UPSTREAMs:\n");
+    upstream_tail = config_file.upstreams;
+    while(upstream_tail->next != NULL){
+        printf("    -> %s = %s:%d (every %d cycles)\n",
+               upstream_tail->name,
+               upstream_tail->host,
+               upstream_tail->port,
+               upstream_tail->decimate
+              );
+        upstream_tail = upstream_tail->next;
+    }
+    printf("  - decodeInputs       =  %s\n",  config_file.decodeInputs==1 ? "YES" : "NO");
+    printf("  - DERIVEDs:\n");
+    derived_tail = config_file.derived;
+    while(derived_tail->next != NULL){
+        printf("    -> 0:%x:0 %s = %s\n",
+               derived_tail->idx,
+               derived_tail->name,
+               derived_tail->expr
+              );
+        derived_tail = derived_tail->next;
+    }
+    printf("  - STATS:\n");
+    stats_tail = config_file.stats;
+    while(stats_tail->next != NULL){
+        printf("    -> %d:%x:%x window %d\n",
+               stats_tail->slaveIdx,
+               stats_tail->idx,
+               stats_tail->subidx,
+               stats_tail->window
+              );
+        stats_tail = stats_tail->next;
+    }
+    printf("  - HISTORY:\n");
+    historyPDO_tail = config_file.historyPDOs;
+    while(historyPDO_tail->next != NULL){
+        printf("    -> %d:%x:%x\n",
+               historyPDO_tail->slaveIdx,
+               historyPDO_tail->idx,
+               historyPDO_tail->subidx
+              );
+        historyPDO_tail = historyPDO_tail->next;
+    }
+    printf("  - HISTORY_TIERs:\n");
+    historyTier_tail = config_file.historyTiers;
+    while(historyTier_tail->next != NULL){
+        printf("    -> %d ms for %d s\n",
+               historyTier_tail->resolution_ms,
+               historyTier_tail->span_s
+              );
+        historyTier_tail = historyTier_tail->next;
+    }
+    printf("  - capture_pre        =  %d\n",  config_file.capture_pre);
+    printf("  - capture_post       =  %d\n",  config_file.capture_post);
+    printf("  - CAPTURE_PDOs:\n");
+    capturePDO_tail = config_file.capturePDOs;
+    while(capturePDO_tail->next != NULL){
+        printf("    -> %d:%x:%x\n",
+               capturePDO_tail->slaveIdx,
+               capturePDO_tail->idx,
+               capturePDO_tail->subidx
+              );
+        capturePDO_tail = capturePDO_tail->next;
+    }
 
     return 0; //success
 }
 
+int64 monotonicTime_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
 void ctrlC_handler(int signal){
     if(gotCtrlC==1) {
         //User is desperate. Kill it NOW.
@@ -8,6 +8,11 @@
 
 #include "osal.h" //typedefs for uint8 etc.
 
+#include "logger.h"
+#include "derivedChannels.h"
+#include "channelStats.h"
+#include "channelHistory.h"
+
 // Configuration    ************************************************************************
 
 #define CONFIGFILE_NAME "config.txt"
@@ -26,6 +31,28 @@ struct slave_init_cmd {
     struct slave_init_cmd* next;
 };
 
+// Address of a PDO given in the config file, e.g. for METRICS_PDO.
+// These are resolved against mapping_in/mapping_out once the mappings are set up.
+struct pdo_address {
+    uint16 slaveIdx;
+    uint16 idx;
+    uint8  subidx;
+
+    //It's a linked list -> Pointer to the next one
+    struct pdo_address* next;
+};
+
+// Upstream daemon for the aggregator mode (daemon --aggregate), see aggregator.h
+struct upstream_def {
+    char name[32];     // Namespace of its PDOs, as in 'get name/slave:idx:subidx'
+    char host[64];
+    int  port;
+    int  decimate;     // Stream every N cycles of the upstream
+
+    //It's a linked list -> Pointer to the next one
+    struct upstream_def* next;
+};
+
 struct config_file_data {
     //char wasParsed; // true (1) or false (0)
 
@@ -40,9 +67,89 @@ struct config_file_data {
     //Size of IOmap allocation [bytes]
     int iomap_size;
 
+    //Memory-mapped packet rings on the EtherCAT socket, see packetRing.h: true(1), false(0), uninitialized(2)
+    char nic_ring;
+    int  nic_busypoll;   // Spin on the RX ring for up to this long before sleeping [us] (0: never)
+
+    //TCP port of the line protocol
+    int tcp_port;
+
     //Head of linked list for slave initialization
     // Last element is all-zeros, like for mapping_in and mapping_out.
     struct slave_init_cmd* slaveInit;
+
+    //TCP port for the HTTP metrics endpoint (0 = disabled)
+    int metrics_port;
+    //Head of linked list of PDOs to export as metrics gauges
+    // Last element is all-zeros, like for slaveInit.
+    struct pdo_address* metricsPDOs;
+
+    //Multicast publication of the process image (mcast_addr == NULL: disabled)
+    char* mcast_addr;
+    int   mcast_port;
+    int   mcast_decimate;  // Publish every N cycles
+    int   mcast_ttl;
+    char* mcast_interface; // IP address of the interface to send from, or NULL for the default
+    //Head of linked list of PDOs to publish instead of the full input image
+    // Last element is all-zeros, like for slaveInit.
+    struct pdo_address* mcastPDOs;
+
+    //Head of linked list of derived channel definitions
+    // Last element is all-zeros, like for slaveInit.
+    struct derived_def* derived;
+
+    //Decode all inputs into one array after every cycle, see decodedImage.h: true(1), false(0), uninitialized(2)
+    char decodeInputs;
+
+    //Head of linked list of windowed statistics definitions
+    // Last element is all-zeros, like for slaveInit.
+    struct stats_def* stats;
+
+    //Downsampled history: the channels, and the tiers (finest first)
+    // Last element of both lists is all-zeros, like for slaveInit; no channels -> history disabled.
+    struct pdo_address*     historyPDOs;
+    struct history_tierDef* historyTiers;
+
+    //Triggered capture: cycles kept before and after the trigger, and the PDOs to capture
+    // Last element of capturePDOs is all-zeros, like for slaveInit; empty -> capture disabled.
+    int   capture_pre;
+    int   capture_post;
+    struct pdo_address* capturePDOs;
+
+    //Record the raw process image of every cycle to this file (NULL: disabled)
+    char* record_file;
+
+    //Columnar time-series log, see tsLogger.h: the directory (NULL: disabled), the rows per
+    // chunk, the cycles per row, and the channels
+    // Last element of tslogPDOs is all-zeros, like for slaveInit.
+    char* tslog_dir;
+    int   tslog_chunk;
+    int   tslog_decimate;
+    struct pdo_address* tslogPDOs;
+
+    //Messages above this level are not logged (enum log_level)
+    int log_level;
+
+    //Path of the AF_UNIX listener for local clients (NULL: disabled)
+    char* unix_socket;
+    //Offer the process image in shared memory on the AF_UNIX listener: true(1), false(0), uninitialized(2)
+    char unix_shm;
+
+    //Admission control for line protocol clients, see loadControl.h (rate 0: unlimited)
+    int client_rate;     // Commands per second per connection
+    int client_burst;
+    int expensive_rate;  // Expensive commands per second, shared by all connections
+    int expensive_burst;
+    int shed_holdoff;    // Shed expensive commands for this long after a cycle overrun [ms] (0: never)
+    int client_stack;    // Stack of each client thread, preallocated for all slots at startup [kB]
+
+    //Head of linked list of upstream daemons for the aggregator mode
+    // Last element is all-zeros, like for slaveInit.
+    struct upstream_def* upstreams;
+
+    //Setpoint waveform playback on outputs ('wave' command): true(1), false(0), uninitialized(2)
+    char allowWaveform;
+    int  waveform_len;   // Rows per segment buffer
 };
 
 // Global data      ************************************************************************
@@ -53,12 +160,6 @@ extern struct config_file_data config_file;
 // Set to 1 if we got a control+C interupt or if an IP client calls 'quit'
 extern volatile sig_atomic_t gotCtrlC;
 
-//Lock for printf;
-// Note: If used together with IOmap_lock,
-// the IOmap lock should always be the "outer" lock in order to avoid deadlocks.
-// Ideally, printf_lock should be grabbed just before printing and released just after.
-extern pthread_mutex_t printf_lock;
-
 //Barrier for "has dropped root privs";
 //This is set during initialization, and dropped once the RAW socket is opened.
 extern pthread_mutex_t rootprivs_lock;
@@ -69,4 +170,7 @@ void ctrlC_handler(int signal);
 
 int parseConfigFile();
 
+// Monotonic clock in nanoseconds, for timing measurements
+int64 monotonicTime_ns();
+
 #endif
\ No newline at end of file
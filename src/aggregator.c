@@ -0,0 +1,556 @@
+#include "aggregator.h"
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include <stdlib.h>
+#include <endian.h>
+#include <time.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include "ethercat.h" // ec_group[] and ec_DCtime, for the upstream side
+
+#include "EtherCatDaemon.h"
+#include "networkServer.h"
+#include "allocStats.h"
+#include "lockTrace.h"
+#include "mappingTable.h"
+
+// Data types       ************************************************************************
+
+// Buffered reader for the replies of an upstream; lines are '\n'-terminated, NUL padding is skipped
+struct agg_reader {
+    int  fd;
+    char buff[BUFFLEN];
+    int  used;
+    int  pos;
+};
+
+// File-global data ************************************************************************
+
+// Upstream side: one buffer per concurrent 'subscribe' stream
+char*  agg_subBuffers[AGG_MAXSUBSCRIBERS];
+uint32 agg_subBusy[AGG_MAXSUBSCRIBERS];
+int    agg_imageSize = 0;
+
+// Aggregator side
+struct agg_node* agg_nodes    = NULL;
+int              agg_numNodes = 0;
+
+// Functions        ************************************************************************
+
+int64 agg_realTime_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64)ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+int agg_writeAll(int fd, const char* data, int size) {
+    //Helper function; returns 1 on success, 0 if the connection is gone.
+    // MSG_NOSIGNAL: a peer which went away gives EPIPE here, instead of SIGPIPE for the process.
+    while (size > 0) {
+        ssize_t written = send(fd, data, size, MSG_NOSIGNAL);
+        if (written <= 0) return 0;
+        data += written;
+        size -= written;
+    }
+    return 1;
+}
+
+int agg_setup() {
+    agg_imageSize = (ec_group[0].inputs - (uint8*) &IOmap[0]) + ec_group[0].Ibytes;
+    for (int i = 0; i < AGG_MAXSUBSCRIBERS; i++) {
+        agg_subBusy[i]    = 0;
+        agg_subBuffers[i] = malloc(sizeof(struct agg_frame) + agg_imageSize);
+        if (agg_subBuffers[i] == NULL) {
+            log_error("ERROR in agg_setup(): could not allocate the subscriber buffers\n");
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void agg_subscribe(int connfd, int decimate) {
+    char buff_out[BUFFLEN];
+    memset(buff_out, 0, BUFFLEN);
+
+    //Claim a buffer
+    int sub;
+    for (sub = 0; sub < AGG_MAXSUBSCRIBERS; sub++) {
+        uint32 expected = 0;
+        if (__atomic_compare_exchange_n(&(agg_subBusy[sub]), &expected, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) break;
+    }
+    if (sub == AGG_MAXSUBSCRIBERS || agg_imageSize == 0) {
+        snprintf(buff_out, BUFFLEN, "err: too many subscribers (max %d), or no process image\n", AGG_MAXSUBSCRIBERS);
+        write(connfd, buff_out, BUFFLEN);
+        if (sub < AGG_MAXSUBSCRIBERS) __atomic_store_n(&(agg_subBusy[sub]), 0, __ATOMIC_RELEASE);
+        return;
+    }
+    struct agg_frame* frame = (struct agg_frame*) agg_subBuffers[sub];
+    char* image = agg_subBuffers[sub] + sizeof(struct agg_frame);
+
+    snprintf(buff_out, BUFFLEN, "  subscribe image %d\n", agg_imageSize);
+    write(connfd, buff_out, BUFFLEN);
+
+    memcpy(frame->magic, AGG_MAGIC, 4);
+    frame->imageSize = htole32(agg_imageSize);
+    while (!gotCtrlC) {
+        //Anything from the peer (or a hangup) ends the stream
+        struct pollfd peer = { .fd = connfd, .events = POLLIN };
+        if (poll(&peer, 1, 0) != 0) break;
+
+        if (ecat_waitCycles(decimate, (int64)decimate*PLC_deadline*1000 + 1000000000LL, NULL) == 0) {
+            continue; // Not updating; keep the stream open
+        }
+
+        struct cycle_stats stats;
+        locktrace_lock(&IOmap_lock, "subscribe");
+        memcpy(image, IOmap, agg_imageSize);
+        uint64 cycle  = imageCycle;
+        int64  DCtime = ec_DCtime;
+        locktrace_unlock(&IOmap_lock);
+        cycleStats_read(&stats);
+
+        frame->cycle       = htole64(cycle);
+        frame->DCtime      = htole64(DCtime);
+        frame->time_ns     = htole64(agg_realTime_ns());
+        frame->wkc         = htole32(stats.lastWKC);
+        frame->expectedWKC = htole32(stats.expectedWKC);
+        if (!agg_writeAll(connfd, agg_subBuffers[sub], sizeof(struct agg_frame) + agg_imageSize)) break;
+    }
+
+    __atomic_store_n(&(agg_subBusy[sub]), 0, __ATOMIC_RELEASE);
+}
+
+// Aggregator side **************************************************************************
+
+int agg_read(struct agg_reader* reader, char* dest, int size) {
+    //Helper function; read exactly size bytes. Returns 1 on success, 0 if the connection is gone
+    while (size > 0) {
+        if (reader->pos == reader->used) {
+            ssize_t got = read(reader->fd, reader->buff, BUFFLEN);
+            if (got <= 0) return 0;
+            reader->used = got;
+            reader->pos  = 0;
+        }
+        int chunk = reader->used - reader->pos;
+        if (chunk > size) chunk = size;
+        if (dest != NULL) {
+            memcpy(dest, reader->buff + reader->pos, chunk);
+            dest += chunk;
+        }
+        reader->pos += chunk;
+        size        -= chunk;
+    }
+    return 1;
+}
+
+int agg_readLine(struct agg_reader* reader, char* line, int size) {
+    //Helper function; read the next line, without the two leading blanks of a response.
+    // After an 'ok' line, the padding of its record is skipped, so that the stream stays aligned.
+    // Returns 1 on success, 0 if the connection is gone or the line is too long
+    int len = 0;
+    while (1) {
+        char c;
+        if (!agg_read(reader, &c, 1)) return 0;
+        if (c == '\0') continue;
+        if (c == '\n') break;
+        if (len == size-1) return 0;
+        line[len++] = c;
+    }
+    line[len] = '\0';
+
+    if (!strcmp(line, "ok")) {
+        return agg_read(reader, NULL, BUFFLEN - 3);
+    }
+    if (!strncmp(line, "  ", 2)) memmove(line, line+2, len-1);
+    return 1;
+}
+
+int agg_command(struct agg_reader* reader, const char* command) {
+    //Helper function; send a command. Returns 1 on success, 0 if the connection is gone
+    return agg_writeAll(reader->fd, command, strlen(command));
+}
+
+int agg_string2dtype(const char* typeStr, int* typeLen) {
+    //Helper function for agg_readMappings(); inverse of dtype2string(). Returns -1 if unknown
+    char hstr[BUFFLEN];
+    unsigned int dtype;
+    if (sscanf(typeStr, "Type 0x%4x%n", &dtype, typeLen) == 1) return dtype;
+
+    *typeLen = strcspn(typeStr, " ");
+    for (dtype = 0; dtype < 0x100; dtype++) {
+        dtype2string(dtype, hstr, BUFFLEN);
+        if ((int)strlen(hstr) == *typeLen && !strncmp(hstr, typeStr, *typeLen)) return dtype;
+    }
+    return -1;
+}
+
+struct mapping_arena* agg_readMappings(struct agg_node* node, struct agg_reader* reader) {
+    //Helper function for agg_stream(); the inputs from 'meta all', rebased into the IOmap region
+    struct mapping_builder builder;
+    mappings_builderInit(&builder);
+    int ok = agg_command(reader, "meta all");
+    int inInputs = 0;
+    char line[BUFFLEN];
+    while (ok && (ok = agg_readLine(reader, line, BUFFLEN))) {
+        if (!strcmp(line, "ok")) break;
+        if (!strncmp(line, "err", 3)) {
+            log_warn("WARNING: upstream '%s' answered 'meta all' with '%s'\n", node->def->name, line);
+            ok = 0;
+            break;
+        }
+        if (line[0] != '[') {
+            inInputs = !strcmp(line, "INPUTS:");
+            continue;
+        }
+        if (!inInputs) continue;
+
+        unsigned int offset;
+        int    bitoff;
+        uint16 slave, idx;
+        uint8  subidx, bitlen;
+        int    pos = 0;
+        int    typeLen = 0;
+        if (sscanf(line, "[0x%x.%d] %hi:%hx:%hhx 0x%hhx %n", &offset, &bitoff, &slave, &idx, &subidx, &bitlen, &pos) < 6 ||
+            pos == 0) {
+            log_warn("WARNING: upstream '%s' sent an unexpected mapping '%s'\n", node->def->name, line);
+            ok = 0;
+            break;
+        }
+        int dataType = agg_string2dtype(line+pos, &typeLen);
+        if (dataType < 0 || (int)offset + (bitoff + bitlen + 7)/8 > node->size) {
+            log_warn("WARNING: upstream '%s' sent an unknown type or an offset beyond its region: '%s'\n", node->def->name, line);
+            ok = 0;
+            break;
+        }
+        const char* name = line + pos + typeLen;
+        while (*name == ' ') name++;
+        mappings_add(&builder, slave, idx, subidx, node->base + offset, bitoff, bitlen, dataType, name);
+    }
+
+    struct mapping_arena* arena = mappings_finish(&builder);
+    if (!ok) {
+        mappings_free(arena);
+        return NULL;
+    }
+    return arena;
+}
+
+int agg_measureOffset(struct agg_node* node, struct agg_reader* reader, int64* offset_ns, int64* rtt_ns) {
+    //Helper function for agg_stream(); keep the round trip with the shortest time
+    char line[BUFFLEN];
+    *rtt_ns = -1;
+    for (int i = 0; i < AGG_TIMEPINGS; i++) {
+        int64 upstream_ns = 0;
+        int64 sent_ns     = agg_realTime_ns();
+        if (!agg_command(reader, "time") || !agg_readLine(reader, line, BUFFLEN)) return 0;
+        int64 received_ns = agg_realTime_ns();
+        if (sscanf(line, "time %" SCNd64, &upstream_ns) != 1) {
+            log_warn("WARNING: upstream '%s' answered 'time' with '%s'\n", node->def->name, line);
+            return 0;
+        }
+        if (!agg_readLine(reader, line, BUFFLEN)) return 0; // 'ok'
+
+        if (*rtt_ns < 0 || received_ns - sent_ns < *rtt_ns) {
+            *rtt_ns    = received_ns - sent_ns;
+            *offset_ns = upstream_ns - (sent_ns + received_ns)/2;
+        }
+    }
+    return 1;
+}
+
+void agg_stream(struct agg_node* node, int fd, char* image) {
+    //Helper function for agg_nodeLoop(); set up a subscription and copy its frames until it fails
+    struct agg_reader reader;
+    memset(&reader, 0, sizeof(reader));
+    reader.fd = fd;
+    char line[BUFFLEN];
+
+    if (!agg_readLine(&reader, line, BUFFLEN) || strcmp(line, "ok")) return; // Greeting
+
+    int64 offset_ns, rtt_ns;
+    if (!agg_measureOffset(node, &reader, &offset_ns, &rtt_ns)) return;
+
+    struct mapping_arena* inputs = agg_readMappings(node, &reader);
+    if (inputs == NULL) return;
+    struct mapping_text* text = maptext_new(NULL, inputs);
+    if (text == NULL) {
+        mappings_free(inputs);
+        return;
+    }
+
+    //The reply is one record, followed by the frames
+    int imageSize = 0;
+    snprintf(line, BUFFLEN, "subscribe %d", node->def->decimate);
+    if (!agg_command(&reader, line) || !agg_read(&reader, line, BUFFLEN) ||
+        sscanf(line, "  subscribe image %d", &imageSize) != 1 || imageSize > node->size) {
+        line[BUFFLEN-1] = '\0';
+        log_warn("WARNING: upstream '%s' did not start the stream ('%.60s'), or its image does not fit into %d bytes\n",
+                 node->def->name, line, node->size);
+        mappings_free(inputs);
+        maptext_release(text);
+        return;
+    }
+
+    locktrace_lock(&IOmap_lock, "upstream");
+    struct mapping_arena* old = node->inputs;
+    struct mapping_text*  oldText = node->text;
+    node->inputs    = inputs;
+    node->text      = text;
+    node->offset_ns = offset_ns;
+    node->rtt_ns    = rtt_ns;
+    node->connected = 1;
+    node->connects++;
+    locktrace_unlock(&IOmap_lock);
+    mappings_free(old); // Readers only use it with IOmap_lock grabbed
+    maptext_release(oldText);
+    log_info("Upstream '%s' streaming: %d PDOs, %d bytes, clock offset %" PRId64 " ns (round trip %" PRId64 " ns)\n",
+             node->def->name, inputs->num, imageSize, offset_ns, rtt_ns);
+
+    struct agg_frame frame;
+    while (!gotCtrlC) {
+        if (!agg_read(&reader, (char*) &frame, sizeof(frame))) break;
+        if (memcmp(frame.magic, AGG_MAGIC, 4) || (int)le32toh(frame.imageSize) != imageSize) {
+            log_warn("WARNING: upstream '%s' sent a bad frame\n", node->def->name);
+            break;
+        }
+        if (!agg_read(&reader, image, imageSize)) break;
+
+        int64 received_ns = monotonicTime_ns();
+        locktrace_lock(&IOmap_lock, "upstream");
+        memcpy(IOmap + node->base, image, imageSize);
+        node->frames++;
+        node->cycle       = le64toh(frame.cycle);
+        node->DCtime      = le64toh(frame.DCtime);
+        node->time_ns     = (int64)le64toh(frame.time_ns) - node->offset_ns;
+        node->received_ns = received_ns;
+        node->wkc         = (int32)le32toh(frame.wkc);
+        node->expectedWKC = (int32)le32toh(frame.expectedWKC);
+        locktrace_unlock(&IOmap_lock);
+    }
+}
+
+void* agg_nodeLoop(void* ptr) {
+    //One thread per upstream; (re)connects until control+c
+    struct agg_node* node = (struct agg_node*) ptr;
+    alloc_setThread(ALLOC_UPSTREAM);
+
+    char* image = malloc(node->size); // Frames are received here, then copied under IOmap_lock
+    if (image == NULL) {
+        log_error("ERROR in agg_nodeLoop(): could not allocate the image of upstream '%s'\n", node->def->name);
+        return NULL;
+    }
+    char  portStr[16];
+    snprintf(portStr, sizeof(portStr), "%d", node->def->port);
+
+    while (!gotCtrlC) {
+        struct addrinfo  hints;
+        struct addrinfo* addr = NULL;
+        memset(&hints, 0, sizeof(hints));
+        hints.ai_family   = AF_INET;
+        hints.ai_socktype = SOCK_STREAM;
+
+        int fd = -1;
+        if (getaddrinfo(node->def->host, portStr, &hints, &addr) == 0) {
+            fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+            if (fd >= 0 && connect(fd, addr->ai_addr, addr->ai_addrlen) != 0) {
+                close(fd);
+                fd = -1;
+            }
+            freeaddrinfo(addr);
+        }
+
+        if (fd >= 0) {
+            int noDelay = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+            agg_stream(node, fd, image);
+            close(fd);
+
+            locktrace_lock(&IOmap_lock, "upstream");
+            int wasConnected = node->connected;
+            node->connected = 0;
+            locktrace_unlock(&IOmap_lock);
+            if (wasConnected) log_warn("WARNING: lost upstream '%s', reconnecting\n", node->def->name);
+        }
+        osal_usleep(AGG_RETRY);
+    }
+
+    free(image);
+    return NULL;
+}
+
+void agg_run() {
+    inOP = FALSE;
+
+    log_setMayWait(1);
+
+    if (pthread_mutex_init(&IOmap_lock, NULL) != 0) {
+        log_fatal("ERROR pthread_mutex_init has failed for IOmap_lock: %m\n");
+    }
+
+    //No raw socket is needed, but behave like ecat_driver() if started as root
+    if (geteuid() == 0) {
+        log_info("Dropping root privilegies...\n");
+        if (setgid(config_file.dropPrivs_gid) == -1) {
+            log_fatal("Error during setgit(): %m\n");
+        }
+        if (setuid(config_file.dropPrivs_uid) == -1) {
+            log_fatal("Error during setuid(): %m\n");
+        }
+        log_info("Now running as '%s'.\n",config_file.dropPrivs_username);
+    }
+    pthread_mutex_unlock(&rootprivs_lock);
+
+    for (struct upstream_def* def = config_file.upstreams; def->next != NULL; def = def->next) {
+        agg_numNodes++;
+    }
+    if (agg_numNodes == 0) {
+        log_fatal("ERROR: the aggregator needs at least one UPSTREAM\n");
+    }
+
+    //Every upstream gets an equal region of the IOmap
+    IOmap     = malloc(config_file.iomap_size*sizeof(char));
+    agg_nodes = malloc(agg_numNodes*sizeof(struct agg_node));
+    if (IOmap == NULL || agg_nodes == NULL) {
+        log_fatal("ERROR: could not allocate the IOmap\n");
+    }
+    memset(IOmap, 0, config_file.iomap_size);
+    memset(agg_nodes, 0, agg_numNodes*sizeof(struct agg_node));
+
+    int regionSize = config_file.iomap_size / agg_numNodes;
+    struct upstream_def* def = config_file.upstreams;
+    for (int i = 0; i < agg_numNodes; i++, def = def->next) {
+        agg_nodes[i].def  = def;
+        agg_nodes[i].base = i*regionSize;
+        agg_nodes[i].size = regionSize;
+    }
+
+    log_info("Aggregating %d upstreams, %d bytes of IOmap each\n", agg_numNodes, regionSize);
+    for (int i = 0; i < agg_numNodes; i++) {
+        pthread_create(&(agg_nodes[i].thread), NULL, agg_nodeLoop, &(agg_nodes[i]));
+    }
+
+    while (!gotCtrlC) {
+        osal_usleep(PLC_waittime_checkAlive);
+    }
+    log_info("Caught a control+c signal, shutting down now.\n");
+}
+
+struct agg_node* agg_findNode(const char* name) {
+    //Helper function; NULL if not found
+    for (int i = 0; i < agg_numNodes; i++) {
+        if (!strcmp(agg_nodes[i].def->name, name)) return &(agg_nodes[i]);
+    }
+    return NULL;
+}
+
+void agg_get(int connfd, const char* address) {
+    char buff_out[BUFFLEN];
+    char hstr[BUFFLEN];
+    char tstr[BUFFLEN];
+    memset(buff_out, 0, BUFFLEN);
+
+    char   name[32];
+    uint16 slave  = 0;
+    uint16 idx    = 0;
+    uint8  subidx = 0;
+    struct agg_node* node = NULL;
+    if (sscanf(address, " %31[^/]/%hi:%hx:%hhx", name, &slave, &idx, &subidx) != 4 ||
+        (node = agg_findNode(name)) == NULL) {
+        strncpy(buff_out, "err: get got bad args, or unknown node (see 'nodes')\n", BUFFLEN);
+        write(connfd, buff_out, BUFFLEN);
+        return;
+    }
+
+    locktrace_lock(&IOmap_lock, "get");
+    int known = node->inputs != NULL;
+    struct mappings_PDO* mapping = known ? get_address(slave, idx, subidx, node->inputs) : NULL;
+    int fresh = node->connected && monotonicTime_ns() - node->received_ns < AGG_STALE;
+    if (mapping != NULL && fresh) {
+        PDOval2string(mapping, hstr, BUFFLEN);
+        //The value string is bounded so that the cycle and time always fit
+        snprintf(buff_out, BUFFLEN, "  %.*s  %.32s  cycle %" PRIu64 " time %" PRId64 "\n",
+                 BUFFLEN/2, hstr, dtype2string(mapping->dataType, tstr, BUFFLEN), node->cycle, node->time_ns);
+    }
+    locktrace_unlock(&IOmap_lock);
+
+    if (!known) {
+        snprintf(buff_out, BUFFLEN, "err: node %s not yet connected\n", name);
+    }
+    else if (mapping == NULL) {
+        snprintf(buff_out, BUFFLEN, "err: PDO address %s/%d:%x:%x not recognized (searched for inputs)\n",
+                 name, slave, idx, subidx);
+    }
+    else if (!fresh) {
+        snprintf(buff_out, BUFFLEN, "err: node %s is not connected or not updating\n", name);
+    }
+    write(connfd, buff_out, BUFFLEN);
+}
+
+void agg_meta(int connfd, const char* nodeName) {
+    char buff_out[BUFFLEN];
+    memset(buff_out, 0, BUFFLEN);
+
+    char name[32];
+    struct agg_node* node = NULL;
+    if (sscanf(nodeName, " %31[^/]/all", name) != 1 || (node = agg_findNode(name)) == NULL) {
+        strncpy(buff_out, "err: meta got bad args, or unknown node (see 'nodes')\n", BUFFLEN);
+        write(connfd, buff_out, BUFFLEN);
+        return;
+    }
+
+    //The text is replaced when the node reconnects; hold it under the lock, and write it
+    // after it, so that a slow client does not hold up the receive threads
+    locktrace_lock(&IOmap_lock, "meta");
+    struct mapping_text* text = maptext_hold(node->text);
+    locktrace_unlock(&IOmap_lock);
+
+    if (text == NULL) {
+        strncpy(buff_out, "err: mappings not yet known\n", BUFFLEN);
+        write(connfd, buff_out, BUFFLEN);
+        return;
+    }
+    strncpy(buff_out, "  INPUTS:\n", BUFFLEN);
+    write(connfd, buff_out, BUFFLEN);
+    write(connfd, text->lines + text->outLen, text->inLen);
+    maptext_release(text);
+}
+
+void agg_describe(int connfd) {
+    char buff_out[BUFFLEN];
+    memset(buff_out, 0, BUFFLEN);
+
+    if (agg_numNodes == 0) {
+        strncpy(buff_out, "err: not running as an aggregator (daemon --aggregate)\n", BUFFLEN);
+        write(connfd, buff_out, BUFFLEN);
+        return;
+    }
+
+    for (int i = 0; i < agg_numNodes; i++) {
+        struct agg_node* node = &(agg_nodes[i]);
+
+        locktrace_lock(&IOmap_lock, "nodes");
+        struct agg_node copy = *node;
+        int numPDOs = node->inputs != NULL ? node->inputs->num : 0;
+        locktrace_unlock(&IOmap_lock);
+
+        int64 age_ns = monotonicTime_ns() - copy.received_ns;
+        const char* state = !copy.connected ? "connecting" : age_ns < AGG_STALE ? "streaming" : "stale";
+        snprintf(buff_out, BUFFLEN,
+                 "  node %s %s:%d %s pdos %d frames %" PRIu64 " cycle %" PRIu64 " age_ms %" PRId64
+                 " offset_ns %" PRId64 " rtt_ns %" PRId64 " wkc %d/%d connects %" PRIu64 "\n",
+                 copy.def->name, copy.def->host, copy.def->port, state, numPDOs, copy.frames, copy.cycle,
+                 copy.frames > 0 ? age_ns/1000000 : -1, copy.offset_ns, copy.rtt_ns,
+                 copy.wkc, copy.expectedWKC, copy.connects);
+        write(connfd, buff_out, BUFFLEN);
+        memset(buff_out, 0, BUFFLEN);
+    }
+}
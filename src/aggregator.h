@@ -0,0 +1,91 @@
+#ifndef aggregator_h
+#define aggregator_h
+
+#include "ecatDriver.h"
+
+// Aggregator mode (daemon --aggregate): instead of running a bus, keep one persistent
+// subscription to each UPSTREAM daemon, and serve their data to clients from a local cache,
+// namespaced as 'get node/slave:idx:subidx'. Every upstream then serves one connection,
+// however many HMIs there are.
+//
+// Upstream side: 'subscribe [N]' turns a line protocol connection into a stream. After one
+// '  subscribe image <bytes>' record, the daemon sends a struct agg_frame followed by the
+// process image (as in 'meta all' and 'shm') every N cycles, until the peer closes the
+// connection or sends anything. The image is copied under IOmap_lock into one of
+// AGG_MAXSUBSCRIBERS preallocated buffers, and written without the lock.
+//
+// Aggregator side: one thread per upstream connects, estimates the clock offset with
+// AGG_TIMEPINGS 'time' round trips (keeping the one with the shortest round trip),
+// reads the input mappings with 'meta all', and then subscribes. Each upstream gets
+// IOMAP_SIZE / (number of upstreams) bytes of the local IOmap, into which its frames are
+// copied under IOmap_lock, so the usual conversion functions work on the cache.
+// Upstream times are corrected by the offset into the aggregator's CLOCK_REALTIME.
+// A lost upstream is reconnected every AGG_RETRY; meanwhile, its PDOs are reported as stale.
+
+// Configuration    ************************************************************************
+#define AGG_MAGIC          "ECDF"
+#define AGG_MAXSUBSCRIBERS 4          // 'subscribe' streams served at the same time
+#define AGG_TIMEPINGS      8          // Round trips for each clock offset estimate
+#define AGG_RETRY          1000000    // Wait before reconnecting to a lost upstream [us]
+#define AGG_STALE          1000000000 // Data older than this is stale [ns]
+
+// Data types       ************************************************************************
+
+// Header of every frame of a 'subscribe' stream. All fields are little-endian.
+struct __attribute__((__packed__)) agg_frame {
+    char   magic[4];      // AGG_MAGIC
+    uint32 imageSize;     // [bytes], follows the header
+    uint64 cycle;         // Cycle number of the image
+    int64  DCtime;        // ec_DCtime after the exchange [ns]
+    int64  time_ns;       // CLOCK_REALTIME of the upstream when the image was copied [ns]
+    int32  wkc;
+    int32  expectedWKC;
+};
+
+// One upstream daemon, as seen by the aggregator. Everything except the configuration
+// is protected by IOmap_lock.
+struct agg_node {
+    struct upstream_def* def;
+    int base;                      // Region of the IOmap for the image [bytes]
+    int size;
+
+    struct mapping_arena* inputs;  // Input mappings, with offsets into the IOmap region; NULL until known
+    struct mapping_text*  text;    // Their lines for 'meta', see mappingTable.h
+    pthread_t thread;
+
+    int    connected;              // Streaming
+    uint64 frames;
+    uint64 connects;
+    uint64 cycle;                  // Of the last frame
+    int64  DCtime;
+    int64  time_ns;                // Of the last frame, corrected into the local CLOCK_REALTIME
+    int64  received_ns;            // monotonicTime_ns() when the last frame was received
+    int64  offset_ns;              // Upstream CLOCK_REALTIME minus local
+    int64  rtt_ns;                 // Round trip of the offset estimate
+    int    wkc;
+    int    expectedWKC;
+};
+
+// Functions        ************************************************************************
+
+// Upstream side: allocate the subscriber buffers; must be called after the mappings are set up.
+// Returns 1 on success, 0 in case of error.
+int agg_setup();
+
+// Upstream side: serve a 'subscribe' stream on a connection, every decimate cycles.
+// Returns when the stream ends; the connection should then be closed.
+void agg_subscribe(int connfd, int decimate);
+
+// Run the aggregator instead of a bus; returns after control+c.
+void agg_run();
+
+// Aggregator side: write the value of a PDO given as 'node/slave:idx:subidx' to a connection.
+void agg_get(int connfd, const char* address);
+
+// Aggregator side: write the input mappings of a node ('meta node/all') to a connection.
+void agg_meta(int connfd, const char* node);
+
+// Aggregator side: write the state of all upstreams ('nodes') to a connection.
+void agg_describe(int connfd);
+
+#endif
@@ -0,0 +1,87 @@
+#include "allocStats.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+// Global data      ************************************************************************
+
+const char* alloc_threadNames[ALLOC_NUMTHREADS] = {
+    "other", "cycle", "watch", "client", "metrics", "logger", "recorder", "upstream"
+};
+
+// File-global data ************************************************************************
+
+__thread int alloc_myThread = ALLOC_OTHER;
+
+// Only written with atomic adds, by whichever thread allocates
+struct alloc_counters alloc_counters;
+uint64 alloc_cycleAtOP  = 0; // alloc_counters.allocs[ALLOC_CYCLE] when alloc_markOP() was called
+uint64 alloc_clientAtOP = 0; // alloc_counters.allocs[ALLOC_CLIENT] at the same time
+
+// Functions        ************************************************************************
+
+void alloc_setThread(enum alloc_thread thread) {
+    alloc_myThread = thread;
+}
+
+void alloc_markOP() {
+    alloc_myThread = ALLOC_CYCLE;
+    __atomic_store_n(&alloc_cycleAtOP, __atomic_load_n(&(alloc_counters.allocs[ALLOC_CYCLE]), __ATOMIC_RELAXED),
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&alloc_clientAtOP, __atomic_load_n(&(alloc_counters.allocs[ALLOC_CLIENT]), __ATOMIC_RELAXED),
+                     __ATOMIC_RELAXED);
+    __atomic_store_n(&(alloc_counters.inOP), 1, __ATOMIC_RELEASE);
+}
+
+#ifdef ECD_ALLOCSTATS
+
+int alloc_read(struct alloc_counters* copy) {
+    for (int i = 0; i < ALLOC_NUMTHREADS; i++) {
+        copy->allocs[i] = __atomic_load_n(&(alloc_counters.allocs[i]), __ATOMIC_RELAXED);
+        copy->frees[i]  = __atomic_load_n(&(alloc_counters.frees[i]),  __ATOMIC_RELAXED);
+        copy->bytes[i]  = __atomic_load_n(&(alloc_counters.bytes[i]),  __ATOMIC_RELAXED);
+    }
+    copy->inOP      = __atomic_load_n(&(alloc_counters.inOP), __ATOMIC_ACQUIRE);
+    copy->cycleInOP  = copy->inOP ? copy->allocs[ALLOC_CYCLE]  - __atomic_load_n(&alloc_cycleAtOP,  __ATOMIC_RELAXED) : 0;
+    copy->clientInOP = copy->inOP ? copy->allocs[ALLOC_CLIENT] - __atomic_load_n(&alloc_clientAtOP, __ATOMIC_RELAXED) : 0;
+    return 1;
+}
+
+// The wrappers, see -Wl,--wrap in CMakeLists.txt
+void* __real_malloc(size_t size);
+void* __real_calloc(size_t nmemb, size_t size);
+void* __real_realloc(void* ptr, size_t size);
+void  __real_free(void* ptr);
+
+void alloc_count(size_t size) {
+    //Helper function for the wrappers
+    __atomic_add_fetch(&(alloc_counters.allocs[alloc_myThread]), 1,    __ATOMIC_RELAXED);
+    __atomic_add_fetch(&(alloc_counters.bytes[alloc_myThread]),  size, __ATOMIC_RELAXED);
+}
+
+void* __wrap_malloc(size_t size) {
+    alloc_count(size);
+    return __real_malloc(size);
+}
+void* __wrap_calloc(size_t nmemb, size_t size) {
+    alloc_count(nmemb*size);
+    return __real_calloc(nmemb, size);
+}
+void* __wrap_realloc(void* ptr, size_t size) {
+    alloc_count(size);
+    return __real_realloc(ptr, size);
+}
+void __wrap_free(void* ptr) {
+    if (ptr != NULL) __atomic_add_fetch(&(alloc_counters.frees[alloc_myThread]), 1, __ATOMIC_RELAXED);
+    __real_free(ptr);
+}
+
+#else
+
+int alloc_read(struct alloc_counters* copy) {
+    memset(copy, 0, sizeof(struct alloc_counters));
+    return 0;
+}
+
+#endif
@@ -0,0 +1,53 @@
+#ifndef allocStats_h
+#define allocStats_h
+
+#include "osal.h" //typedefs for uint8 etc.
+
+// Heap allocation accounting per thread, to check that the daemon does not touch the heap
+// in steady state: everything the cycle and the clients need is preallocated at startup
+// (IOmap, capture/record rings, waveform segments, client thread stacks, see CLIENT_STACK).
+// Only the instrumented build counts (cmake -DECD_ALLOCSTATS=ON): it wraps malloc/calloc/
+// realloc/free at link time, so calls made by the daemon and by SOEM are counted, but not
+// those made inside the C library itself (e.g. by printf() or getline()).
+// Every thread tags itself with alloc_setThread(); untagged threads count as "other".
+// Read with 'stats alloc', or as ecd_heap_allocations_total on /metrics.
+
+// Data types       ************************************************************************
+
+enum alloc_thread {
+    ALLOC_OTHER,    // Startup, and untagged threads
+    ALLOC_CYCLE,    // ecat_PLCdaemon() / the replay loop, once in OP
+    ALLOC_WATCH,    // ecat_check()
+    ALLOC_CLIENT,   // chatThread()
+    ALLOC_METRICS,
+    ALLOC_LOGGER,
+    ALLOC_RECORDER,
+    ALLOC_UPSTREAM, // agg_nodeLoop(), in the aggregator mode
+    ALLOC_NUMTHREADS
+};
+
+struct alloc_counters {
+    uint64 allocs[ALLOC_NUMTHREADS]; // malloc, calloc and realloc calls
+    uint64 frees [ALLOC_NUMTHREADS];
+    uint64 bytes [ALLOC_NUMTHREADS]; // Requested
+    uint64 cycleInOP;                // Allocations by the cycle thread since it reached OP
+    uint64 clientInOP;               // By the client threads since then; only 'rescan' should allocate
+    int    inOP;                     // alloc_markOP() was called
+};
+
+// Global data      ************************************************************************
+
+extern const char* alloc_threadNames[ALLOC_NUMTHREADS];
+
+// Functions        ************************************************************************
+
+// Tag the calling thread; allocations are counted under this name from now on.
+void alloc_setThread(enum alloc_thread thread);
+
+// Tag the calling thread as the cycle thread, and start counting cycleInOP and clientInOP.
+void alloc_markOP();
+
+// Get a copy of the counters. Returns 1, or 0 if this is not an instrumented build.
+int alloc_read(struct alloc_counters* copy);
+
+#endif
@@ -0,0 +1,289 @@
+#include "channelAlarms.h"
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+
+#include "EtherCatDaemon.h"
+#include "networkServer.h"
+#include "lockTrace.h"
+
+// File-global data ************************************************************************
+
+// The condition table; modified by client threads and evaluated by the cycle thread, both with IOmap_lock grabbed
+struct alarm_condition alarm_table[ALARM_MAX];
+int alarm_numUsed = 0; // Entries at and above this index are all unused
+
+// Event queues, one per IPservers slot
+struct alarm_queue alarm_queues[NUMIPSERVERS];
+int alarm_queuesInitialized = 0;
+pthread_mutex_t alarm_queuesLock = PTHREAD_MUTEX_INITIALIZER;
+
+const char* alarm_modeNames[]  = {"above", "below", "rising", "falling"};
+const char* alarm_eventNames[] = {"off", "on", "edge"};
+
+// Functions        ************************************************************************
+
+int alarm_openQueue(int slot) {
+    pthread_mutex_lock(&alarm_queuesLock);
+    if (!alarm_queuesInitialized) {
+        for (int i = 0; i < NUMIPSERVERS; i++) {
+            alarm_queues[i].eventfd = -1;
+        }
+        alarm_queuesInitialized = 1;
+    }
+    pthread_mutex_unlock(&alarm_queuesLock);
+
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0) {
+        log_error("ERROR in alarm_openQueue(): eventfd failed: %m\n");
+        return -1;
+    }
+
+    struct alarm_queue* queue = &(alarm_queues[slot]);
+    locktrace_lock(&IOmap_lock, "alarm");
+    queue->head            = 0;
+    queue->tail            = 0;
+    queue->dropped         = 0;
+    queue->droppedReported = 0;
+    queue->eventfd         = fd;
+    locktrace_unlock(&IOmap_lock);
+
+    return fd;
+}
+
+void alarm_closeQueue(int slot) {
+    struct alarm_queue* queue = &(alarm_queues[slot]);
+
+    locktrace_lock(&IOmap_lock, "alarm");
+    for (int i = 0; i < alarm_numUsed; i++) {
+        if (alarm_table[i].inUse && alarm_table[i].owner == slot) alarm_table[i].inUse = 0;
+    }
+    while (alarm_numUsed > 0 && !alarm_table[alarm_numUsed-1].inUse) alarm_numUsed--;
+    int fd = queue->eventfd;
+    queue->eventfd = -1;
+    locktrace_unlock(&IOmap_lock);
+
+    if (fd >= 0) close(fd);
+}
+
+int alarm_add(int slot, enum alarm_mode mode, uint16 slave, uint16 idx, uint8 subidx,
+              double level, double hysteresis) {
+    struct alarm_condition cond;
+    memset(&cond, 0, sizeof(cond));
+    if (!valueSource_resolve(slave, idx, subidx, &(cond.src))) {
+        return -1;
+    }
+    cond.level      = level;
+    cond.hysteresis = hysteresis;
+    cond.inUse      = 1;
+    cond.mode       = mode;
+    cond.state      = ALARM_OFF;
+    cond.valid      = 0;
+    cond.owner      = slot;
+    cond.slaveIdx   = slave;
+    cond.idx        = idx;
+    cond.subidx     = subidx;
+
+    int id = -1;
+    int numOwned = 0;
+    locktrace_lock(&IOmap_lock, "alarm");
+    for (int i = 0; i < ALARM_MAX; i++) {
+        if (alarm_table[i].inUse) {
+            if (alarm_table[i].owner == slot) numOwned++;
+        }
+        else if (id == -1) {
+            id = i;
+        }
+    }
+    if (id >= 0 && numOwned < ALARM_MAXPERCLIENT) {
+        alarm_table[id] = cond;
+        if (id >= alarm_numUsed) alarm_numUsed = id+1;
+    }
+    else {
+        id = -1;
+    }
+    locktrace_unlock(&IOmap_lock);
+
+    return id;
+}
+
+int alarm_delete(int slot, int id) {
+    if (id < 0 || id >= ALARM_MAX) return 0;
+
+    int found = 0;
+    locktrace_lock(&IOmap_lock, "alarm");
+    if (alarm_table[id].inUse && alarm_table[id].owner == slot) {
+        alarm_table[id].inUse = 0;
+        found = 1;
+    }
+    while (alarm_numUsed > 0 && !alarm_table[alarm_numUsed-1].inUse) alarm_numUsed--;
+    locktrace_unlock(&IOmap_lock);
+
+    return found;
+}
+
+void alarm_push(int id, struct alarm_condition* cond, uint8 state, double value, uint64 cycle) {
+    //Helper function for alarm_update(); queue an event for the owner and wake it up
+    struct alarm_queue* queue = &(alarm_queues[cond->owner]);
+    if (queue->eventfd < 0) return;
+
+    uint32 head = queue->head;
+    uint32 tail = __atomic_load_n(&(queue->tail), __ATOMIC_ACQUIRE);
+    if (head - tail >= ALARM_QUEUELEN) {
+        __atomic_store_n(&(queue->dropped), queue->dropped + 1, __ATOMIC_RELAXED);
+    }
+    else {
+        struct alarm_event* event = &(queue->events[head & (ALARM_QUEUELEN-1)]);
+        event->cycle    = cycle;
+        event->value    = value;
+        event->id       = id;
+        event->state    = state;
+        event->mode     = cond->mode;
+        event->slaveIdx = cond->slaveIdx;
+        event->idx      = cond->idx;
+        event->subidx   = cond->subidx;
+        __atomic_store_n(&(queue->head), head + 1, __ATOMIC_RELEASE);
+    }
+
+    uint64 one = 1;
+    write(queue->eventfd, &one, sizeof(one)); // Never blocks; the counter just saturates
+}
+
+void alarm_update(uint64 cycle) {
+    for (int i = 0; i < alarm_numUsed; i++) {
+        struct alarm_condition* cond = &(alarm_table[i]);
+        if (!cond->inUse) continue;
+
+        double value = valueSource_read(&(cond->src));
+        if (isnan(value)) continue;
+
+        switch (cond->mode) {
+        case ALARM_ABOVE:
+            if      (cond->state == ALARM_OFF && value > cond->level)                    cond->state = ALARM_ON;
+            else if (cond->state == ALARM_ON  && value < cond->level - cond->hysteresis) cond->state = ALARM_OFF;
+            else break;
+            alarm_push(i, cond, cond->state, value, cycle);
+            break;
+        case ALARM_BELOW:
+            if      (cond->state == ALARM_OFF && value < cond->level)                    cond->state = ALARM_ON;
+            else if (cond->state == ALARM_ON  && value > cond->level + cond->hysteresis) cond->state = ALARM_OFF;
+            else break;
+            alarm_push(i, cond, cond->state, value, cycle);
+            break;
+        case ALARM_RISING:
+            //ALARM_ON = armed; the first value only decides whether to arm
+            if (!cond->valid) {
+                cond->state = value <= cond->level ? ALARM_ON : ALARM_OFF;
+            }
+            else if (cond->state == ALARM_ON && value > cond->level) {
+                cond->state = ALARM_OFF;
+                alarm_push(i, cond, ALARM_EDGE, value, cycle);
+            }
+            else if (cond->state == ALARM_OFF && value < cond->level - cond->hysteresis) {
+                cond->state = ALARM_ON;
+            }
+            break;
+        case ALARM_FALLING:
+            if (!cond->valid) {
+                cond->state = value >= cond->level ? ALARM_ON : ALARM_OFF;
+            }
+            else if (cond->state == ALARM_ON && value < cond->level) {
+                cond->state = ALARM_OFF;
+                alarm_push(i, cond, ALARM_EDGE, value, cycle);
+            }
+            else if (cond->state == ALARM_OFF && value > cond->level + cond->hysteresis) {
+                cond->state = ALARM_ON;
+            }
+            break;
+        }
+        cond->valid = 1;
+    }
+}
+
+void alarm_sendEvents(int slot, int connfd) {
+    struct alarm_queue* queue = &(alarm_queues[slot]);
+    if (queue->eventfd < 0) return;
+
+    uint64 count;
+    read(queue->eventfd, &count, sizeof(count)); // Reset; EAGAIN if nothing is pending
+
+    char buff_out[BUFFLEN];
+    char line[BUFFLEN];
+    memset(buff_out, 0, BUFFLEN);
+    int buffUsed = 0;
+
+    uint32 head = __atomic_load_n(&(queue->head), __ATOMIC_ACQUIRE);
+    uint32 tail = queue->tail;
+    while (1) {
+        int lineLen;
+        if (tail != head) {
+            struct alarm_event* event = &(queue->events[tail & (ALARM_QUEUELEN-1)]);
+            lineLen = snprintf(line, BUFFLEN, "evt alarm %d %s %d:0x%4.4X:0x%2.2X value %.10g cycle %" PRIu64 "\n",
+                               event->id, alarm_eventNames[event->state],
+                               event->slaveIdx, event->idx, event->subidx, event->value, event->cycle);
+            tail++;
+        }
+        else {
+            uint64 dropped = __atomic_load_n(&(queue->dropped), __ATOMIC_RELAXED);
+            if (dropped == queue->droppedReported) break;
+            lineLen = snprintf(line, BUFFLEN, "evt dropped %" PRIu64 "\n", dropped - queue->droppedReported);
+            queue->droppedReported = dropped;
+        }
+
+        //Fill each record as much as possible
+        if (buffUsed + lineLen >= BUFFLEN) {
+            write(connfd, buff_out, BUFFLEN);
+            memset(buff_out, 0, BUFFLEN);
+            buffUsed = 0;
+        }
+        memcpy(buff_out+buffUsed, line, lineLen);
+        buffUsed += lineLen;
+    }
+    __atomic_store_n(&(queue->tail), tail, __ATOMIC_RELEASE);
+
+    if (buffUsed > 0) {
+        write(connfd, buff_out, BUFFLEN);
+    }
+}
+
+void alarm_describe(int slot, int connfd) {
+    char buff_out[BUFFLEN];
+    memset(buff_out, 0, BUFFLEN);
+
+    //Consistent copy of this client's conditions
+    struct alarm_condition conds[ALARM_MAXPERCLIENT];
+    int ids[ALARM_MAXPERCLIENT];
+    int numConds = 0;
+    locktrace_lock(&IOmap_lock, "alarm");
+    for (int i = 0; i < alarm_numUsed && numConds < ALARM_MAXPERCLIENT; i++) {
+        if (!alarm_table[i].inUse || alarm_table[i].owner != slot) continue;
+        conds[numConds] = alarm_table[i];
+        ids[numConds]   = i;
+        numConds++;
+    }
+    locktrace_unlock(&IOmap_lock);
+
+    snprintf(buff_out, BUFFLEN, "  alarms %d max %d\n", numConds, ALARM_MAXPERCLIENT);
+    write(connfd, buff_out, BUFFLEN);
+    memset(buff_out, 0, BUFFLEN);
+
+    for (int i = 0; i < numConds; i++) {
+        const char* stateName;
+        if (!conds[i].valid)                                             stateName = "unknown";
+        else if (conds[i].mode == ALARM_ABOVE || conds[i].mode == ALARM_BELOW) stateName = alarm_eventNames[conds[i].state];
+        else                                                             stateName = conds[i].state == ALARM_ON ? "armed" : "waiting";
+
+        snprintf(buff_out, BUFFLEN, "  alarm %d %s %d:0x%4.4X:0x%2.2X level %.10g hysteresis %.10g state %s\n",
+                 ids[i], alarm_modeNames[conds[i].mode], conds[i].slaveIdx, conds[i].idx, conds[i].subidx,
+                 conds[i].level, conds[i].hysteresis, stateName);
+        write(connfd, buff_out, BUFFLEN);
+        memset(buff_out, 0, BUFFLEN);
+    }
+}
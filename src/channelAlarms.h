@@ -0,0 +1,95 @@
+#ifndef channelAlarms_h
+#define channelAlarms_h
+
+#include "ecatDriver.h"
+#include "derivedChannels.h"
+
+// Alarm conditions on channels (PDO or DERIVED), registered by clients with 'alarm add'.
+// The cycle thread evaluates the whole condition table after every cycle, and queues an event
+// for the owning client only when a condition changes state; the client thread is woken through
+// an eventfd and writes the event as an 'evt ' line while the client is idle.
+// A client's alarms are deleted when it disconnects.
+
+// Configuration    ************************************************************************
+#define ALARM_MAX          256 // Conditions in the table, for all clients together
+#define ALARM_MAXPERCLIENT 32
+#define ALARM_QUEUELEN     64  // Pending events per client; must be a power of 2
+
+// Data types       ************************************************************************
+
+enum alarm_mode {
+    ALARM_ABOVE,   // On while value > level, off again when value < level - hysteresis
+    ALARM_BELOW,   // On while value < level, off again when value > level + hysteresis
+    ALARM_RISING,  // Event when value crosses upwards through level; re-armed below level - hysteresis
+    ALARM_FALLING  // Event when value crosses downwards through level; re-armed above level + hysteresis
+};
+
+enum alarm_state {
+    ALARM_OFF,     // Condition not met (ABOVE/BELOW), or waiting to be re-armed (RISING/FALLING)
+    ALARM_ON,      // Condition met (ABOVE/BELOW), or armed (RISING/FALLING)
+    ALARM_EDGE     // Only in events: the edge of a RISING/FALLING condition
+};
+
+// One entry of the condition table; kept small since all of them are evaluated every cycle
+struct alarm_condition {
+    struct value_source src;
+    double level;
+    double hysteresis;
+    uint8  inUse;
+    uint8  mode;     // enum alarm_mode
+    uint8  state;    // enum alarm_state
+    uint8  valid;    // A value has been seen since the condition was added
+    int16  owner;    // IPservers slot of the client
+    uint16 slaveIdx;
+    uint16 idx;
+    uint8  subidx;
+};
+
+struct alarm_event {
+    uint64 cycle;    // As returned by 'waitcycle'
+    double value;
+    uint16 id;       // Index in the condition table
+    uint8  state;    // enum alarm_state
+    uint8  mode;
+    uint16 slaveIdx;
+    uint16 idx;
+    uint8  subidx;
+};
+
+// Single producer (cycle thread), single consumer (client thread)
+struct alarm_queue {
+    volatile uint32 head;    // Written by the cycle thread
+    volatile uint32 tail;    // Written by the client thread
+    volatile uint64 dropped; // Events lost because the queue was full
+    uint64 droppedReported;
+    int    eventfd;          // -1 when the slot is not connected
+    struct alarm_event events[ALARM_QUEUELEN];
+};
+
+// Functions        ************************************************************************
+
+// Create the event queue of a client slot; returns its eventfd (readable when events are pending),
+// or -1 in case of error.
+int alarm_openQueue(int slot);
+
+// Delete the alarms of a client slot, and close its queue.
+void alarm_closeQueue(int slot);
+
+// Add a condition for a client slot; returns the alarm id, or -1 if the address can not be resolved
+// or the table is full.
+int alarm_add(int slot, enum alarm_mode mode, uint16 slave, uint16 idx, uint8 subidx,
+              double level, double hysteresis);
+
+// Delete a condition of a client slot; returns 1 on success, 0 if it does not exist.
+int alarm_delete(int slot, int id);
+
+// Evaluate all conditions; called by the cycle thread with IOmap_lock grabbed, after derived_evaluate().
+void alarm_update(uint64 cycle);
+
+// Write the pending events of a client slot to its connection, as 'evt ' lines.
+void alarm_sendEvents(int slot, int connfd);
+
+// Write the conditions of a client slot to its connection.
+void alarm_describe(int slot, int connfd);
+
+#endif
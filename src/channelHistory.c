@@ -0,0 +1,245 @@
+#include "channelHistory.h"
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+
+#include <unistd.h>
+
+#include "EtherCatDaemon.h"
+#include "ecatDriver.h"
+#include "networkServer.h"
+
+// File-global data ************************************************************************
+
+struct history_tier*    history_tiers = NULL;
+int history_numTiers = 0;
+
+struct history_channel* history_channels = NULL;
+int history_numChannels = 0;
+
+// Functions        ************************************************************************
+
+int history_setup() {
+    struct pdo_address* addr;
+    struct history_tierDef* def;
+
+    for (addr = config_file.historyPDOs; addr->next != NULL; addr = addr->next) {
+        history_numChannels++;
+    }
+    if (history_numChannels == 0) return 1;
+
+    for (def = config_file.historyTiers; def->next != NULL; def = def->next) {
+        history_numTiers++;
+    }
+    history_tiers = malloc(history_numTiers*sizeof(struct history_tier));
+    if (history_tiers == NULL) {
+        log_error("Error in history_setup(): out of memory for the HISTORY_TIERs\n");
+        return 0;
+    }
+    memset(history_tiers, 0, history_numTiers*sizeof(struct history_tier));
+
+    int t = 0;
+    for (def = config_file.historyTiers; def->next != NULL; def = def->next) {
+        struct history_tier* tier = &(history_tiers[t]);
+
+        tier->cyclesPerPoint = (int)((def->resolution_ms*1000LL + PLC_waittime/2) / PLC_waittime);
+        if (tier->cyclesPerPoint < 1) tier->cyclesPerPoint = 1;
+        int64 slots = (def->span_s*1000000LL + (int64)tier->cyclesPerPoint*PLC_waittime - 1)
+                      / ((int64)tier->cyclesPerPoint*PLC_waittime);
+        if (slots < 1 || slots > 100000000) {
+            log_error("Error in history_setup(): HISTORY_TIER %d %d gives %" PRId64 " points\n",
+                      def->resolution_ms, def->span_s, slots);
+            return 0;
+        }
+        tier->numSlots = (int)slots;
+        if (t > 0 && tier->cyclesPerPoint <= history_tiers[t-1].cyclesPerPoint) {
+            log_error("Error in history_setup(): HISTORY_TIERs must be listed finest first, with different resolutions\n");
+            return 0;
+        }
+        tier->times = malloc(tier->numSlots*sizeof(int64));
+        if (tier->times == NULL) {
+            log_error("Error in history_setup(): out of memory for HISTORY_TIER %d %d\n",
+                      def->resolution_ms, def->span_s);
+            return 0;
+        }
+        memset(tier->times, 0, tier->numSlots*sizeof(int64));
+        t++;
+    }
+
+    history_channels = malloc(history_numChannels*sizeof(struct history_channel));
+    if (history_channels == NULL) {
+        log_error("Error in history_setup(): out of memory for the HISTORY channels\n");
+        return 0;
+    }
+    memset(history_channels, 0, history_numChannels*sizeof(struct history_channel));
+
+    int64 bytes = 0;
+    int c = 0;
+    for (addr = config_file.historyPDOs; addr->next != NULL; addr = addr->next) {
+        struct history_channel* ch = &(history_channels[c++]);
+
+        ch->slaveIdx = addr->slaveIdx;
+        ch->idx      = addr->idx;
+        ch->subidx   = addr->subidx;
+        if (!valueSource_resolve(addr->slaveIdx, addr->idx, addr->subidx, &(ch->src))) {
+            log_error("Error in history_setup(): HISTORY %d:%x:%x is not a numeric PDO or DERIVED channel\n",
+                      addr->slaveIdx, addr->idx, addr->subidx);
+            return 0;
+        }
+
+        ch->series = malloc(history_numTiers*sizeof(struct history_series));
+        memset(ch->series, 0, history_numTiers*sizeof(struct history_series));
+        for (t = 0; t < history_numTiers; t++) {
+            struct history_series* ser = &(ch->series[t]);
+            int numSlots = history_tiers[t].numSlots;
+
+            ser->means = malloc(numSlots*sizeof(float));
+            bytes += numSlots*sizeof(float);
+            if (history_tiers[t].cyclesPerPoint > 1) {
+                ser->mins = malloc(numSlots*sizeof(float));
+                ser->maxs = malloc(numSlots*sizeof(float));
+                bytes += 2*numSlots*sizeof(float);
+            }
+            if (ser->means == NULL || (history_tiers[t].cyclesPerPoint > 1 && (ser->mins == NULL || ser->maxs == NULL))) {
+                log_error("Error in history_setup(): out of memory for the HISTORY of %d:%x:%x\n",
+                          addr->slaveIdx, addr->idx, addr->subidx);
+                return 0;
+            }
+            //Touch all pages now, so that the cycle thread never takes a page fault on them
+            memset(ser->means, 0, numSlots*sizeof(float));
+            if (ser->mins != NULL) {
+                memset(ser->mins, 0, numSlots*sizeof(float));
+                memset(ser->maxs, 0, numSlots*sizeof(float));
+            }
+        }
+    }
+    for (t = 0; t < history_numTiers; t++) {
+        bytes += history_tiers[t].numSlots*sizeof(int64);
+    }
+    log_info("HISTORY: %d channels in %d tiers, %.0f kB\n", history_numChannels, history_numTiers, bytes/1024.0);
+
+    return 1;
+}
+
+void history_update(int64 time_ns) {
+    if (history_numChannels == 0) return;
+
+    for (int t = 0; t < history_numTiers; t++) {
+        if (history_tiers[t].inPoint == 0) history_tiers[t].pointStart_ns = time_ns;
+        history_tiers[t].inPoint++;
+    }
+
+    for (int c = 0; c < history_numChannels; c++) {
+        struct history_channel* ch = &(history_channels[c]);
+
+        double value = valueSource_read(&(ch->src));
+        if (isnan(value)) continue;
+        for (int t = 0; t < history_numTiers; t++) {
+            struct history_series* ser = &(ch->series[t]);
+            if (ser->count == 0 || value < ser->min) ser->min = value;
+            if (ser->count == 0 || value > ser->max) ser->max = value;
+            ser->sum += value;
+            ser->count++;
+        }
+    }
+
+    //Complete the points which are full
+    for (int t = 0; t < history_numTiers; t++) {
+        struct history_tier* tier = &(history_tiers[t]);
+        if (tier->inPoint < tier->cyclesPerPoint) continue;
+
+        int slot = tier->numPoints % tier->numSlots;
+        tier->times[slot] = tier->pointStart_ns;
+        for (int c = 0; c < history_numChannels; c++) {
+            struct history_series* ser = &(history_channels[c].series[t]);
+            ser->means[slot] = ser->count > 0 ? ser->sum / ser->count : NAN;
+            if (ser->mins != NULL) {
+                ser->mins[slot] = ser->count > 0 ? ser->min : NAN;
+                ser->maxs[slot] = ser->count > 0 ? ser->max : NAN;
+            }
+            ser->sum   = 0.0;
+            ser->count = 0;
+        }
+        __atomic_store_n(&(tier->numPoints), tier->numPoints + 1, __ATOMIC_RELEASE);
+        tier->inPoint = 0;
+    }
+}
+
+int history_pickTier(double span_s, int maxPoints) {
+    //Helper function for history_describe(); the finest tier which covers the span in at most
+    // maxPoints points, else the one covering the longest time
+    for (int t = 0; t < history_numTiers; t++) {
+        double pointTime_s = history_tiers[t].cyclesPerPoint * PLC_waittime * 1e-6;
+        if (span_s <= history_tiers[t].numSlots * pointTime_s && span_s / pointTime_s <= maxPoints) return t;
+    }
+    return history_numTiers-1;
+}
+
+int history_describe(uint16 slave, uint16 idx, uint8 subidx, double span_s, int maxPoints, int connfd) {
+    struct history_channel* ch = NULL;
+    for (int c = 0; c < history_numChannels; c++) {
+        if (history_channels[c].slaveIdx == slave && history_channels[c].idx == idx && history_channels[c].subidx == subidx) {
+            ch = &(history_channels[c]);
+            break;
+        }
+    }
+    if (ch == NULL) return 0;
+
+    char buff_out[BUFFLEN];
+    memset(buff_out, 0, BUFFLEN);
+
+    int t = history_pickTier(span_s, maxPoints);
+    struct history_tier*   tier = &(history_tiers[t]);
+    struct history_series* ser  = &(ch->series[t]);
+
+    //Points are reported with CLOCK_REALTIME times, like 'time'
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    int64 now = monotonicTime_ns();
+    int64 toRealtime = ts.tv_sec*1000000000LL + ts.tv_nsec - now;
+    int64 from = now - (int64)(span_s*1e9);
+
+    //Newest points which fit, oldest first
+    uint64 numPoints = __atomic_load_n(&(tier->numPoints), __ATOMIC_ACQUIRE);
+    uint64 first = numPoints > (uint64)tier->numSlots ? numPoints - tier->numSlots : 0;
+    if (numPoints - first > (uint64)maxPoints) first = numPoints - maxPoints;
+    while (first < numPoints && tier->times[first % tier->numSlots] < from) first++;
+
+    snprintf(buff_out, BUFFLEN, "  history tier %d resolution %.3f points %" PRIu64 "\n",
+             t, tier->cyclesPerPoint * PLC_waittime * 1e-6, numPoints - first);
+    write(connfd, buff_out, BUFFLEN);
+    memset(buff_out, 0, BUFFLEN);
+
+    //Several points per record
+    int buffUsed = 0;
+    for (uint64 n = first; n < numPoints; n++) {
+        int slot = n % tier->numSlots;
+        int64 time = tier->times[slot];
+        double mean = ser->means[slot];
+        double min  = ser->mins != NULL ? ser->mins[slot] : mean;
+        double max  = ser->maxs != NULL ? ser->maxs[slot] : mean;
+
+        //The cycle thread may have overwritten the slot while it was copied
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&(tier->numPoints), __ATOMIC_RELAXED) > n + tier->numSlots - 1) continue;
+
+        char line[128];
+        int lineLen = snprintf(line, sizeof(line), "  %" PRId64 " %.7g %.7g %.7g\n", time + toRealtime, min, max, mean);
+        if (buffUsed + lineLen >= BUFFLEN) {
+            write(connfd, buff_out, BUFFLEN);
+            memset(buff_out, 0, BUFFLEN);
+            buffUsed = 0;
+        }
+        memcpy(buff_out+buffUsed, line, lineLen);
+        buffUsed += lineLen;
+    }
+    if (buffUsed > 0) {
+        write(connfd, buff_out, BUFFLEN);
+        memset(buff_out, 0, BUFFLEN);
+    }
+    return 1;
+}
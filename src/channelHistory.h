@@ -0,0 +1,75 @@
+#ifndef channelHistory_h
+#define channelHistory_h
+
+#include "ecatDriver.h"
+#include "derivedChannels.h"
+
+// Downsampled history of selected channels (HISTORY), for trend screens, in round-robin tiers
+// of decreasing resolution (HISTORY_TIER), e.g. every cycle for 10 s, 100 ms for 1 hour and
+// 10 s for 7 days. Each point of a tier holds the min, max and mean of the cycles it covers.
+// Values are kept as float, which is plenty for trends and halves the memory.
+// All buffers are allocated at setup, so the memory is bounded (logged at startup); the cycle
+// thread updates every tier incrementally, with O(channels x tiers) work per cycle.
+// The tiers of all channels share the point boundaries and times. A completed point is
+// written once and published by incrementing the tier's point counter, so readers need no lock:
+// they check after copying that the point has not been overwritten in the meantime.
+// Read with 'history slave:idx:subidx span [points]', which picks the finest tier covering
+// the span with at most the requested number of points.
+
+// Configuration    ************************************************************************
+#define HISTORY_MAXPOINTS     10000 // Max points returned by one query
+#define HISTORY_DEFAULTPOINTS 1000  // Points returned if the query does not say
+
+// Data types       ************************************************************************
+
+// One HISTORY_TIER line from the config file; a linked list, last element all-zeros.
+struct history_tierDef {
+    int resolution_ms; // Time covered by one point; rounded to whole cycles (PLC_waittime)
+    int span_s;        // Time covered by the tier
+
+    struct history_tierDef* next;
+};
+
+// One tier, shared by all channels
+struct history_tier {
+    int     cyclesPerPoint;
+    int     numSlots;         // Points kept
+    int64*  times;            // monotonicTime_ns() at the start of each point, by slot
+    volatile uint64 numPoints; // Completed points; point n is in slot n % numSlots
+    int     inPoint;          // Cycles so far in the point being built
+    int64   pointStart_ns;
+};
+
+// Per channel and tier: the point being built, and the completed ones
+struct history_series {
+    double  min, max, sum;
+    int     count;            // Decodable samples in the point being built
+    float*  mins;             // By slot; NULL if cyclesPerPoint == 1 (min = max = mean)
+    float*  maxs;
+    float*  means;
+};
+
+struct history_channel {
+    uint16 slaveIdx;
+    uint16 idx;
+    uint8  subidx;
+    struct value_source src;
+    struct history_series* series; // One per tier
+};
+
+// Functions        ************************************************************************
+
+// Allocate the tiers and resolve the HISTORY channels; must be called after derived_setup().
+// Returns 1 on success, 0 in case of error.
+int history_setup();
+
+// Add the current values; called by the cycle thread with IOmap_lock grabbed.
+// time_ns is the monotonicTime_ns() of the exchange.
+void history_update(int64 time_ns);
+
+// Write the points of slave:idx:subidx within the last span_s seconds to a client connection,
+// from the finest tier which covers the span with at most maxPoints points.
+// Returns 1, or 0 if the channel has no history.
+int history_describe(uint16 slave, uint16 idx, uint8 subidx, double span_s, int maxPoints, int connfd);
+
+#endif
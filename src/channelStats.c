@@ -0,0 +1,165 @@
+#include "channelStats.h"
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include <unistd.h>
+#include <pthread.h>
+
+#include "EtherCatDaemon.h"
+#include "ecatDriver.h"
+#include "networkServer.h"
+#include "seqlock.h"
+
+// File-global data ************************************************************************
+
+struct stats_window* stats_windows = NULL;
+int stats_numWindows = 0;
+volatile uint32 stats_seq = 0; // Protects the 'result' of all windows
+
+// Functions        ************************************************************************
+
+int stats_setup() {
+    struct stats_def* def;
+
+    for (def = config_file.stats; def->next != NULL; def = def->next) {
+        stats_numWindows++;
+    }
+    if (stats_numWindows == 0) return 1;
+
+    stats_windows = malloc(stats_numWindows*sizeof(struct stats_window));
+    memset(stats_windows, 0, stats_numWindows*sizeof(struct stats_window));
+
+    int i = 0;
+    for (def = config_file.stats; def->next != NULL; def = def->next) {
+        struct stats_window* win = &(stats_windows[i++]);
+
+        win->slaveIdx = def->slaveIdx;
+        win->idx      = def->idx;
+        win->subidx   = def->subidx;
+        win->window   = def->window;
+        if (!valueSource_resolve(def->slaveIdx, def->idx, def->subidx, &(win->src))) {
+            log_error("Error in stats_setup(): STATS %d:%x:%x is not a numeric PDO or DERIVED channel\n",
+                      def->slaveIdx, def->idx, def->subidx);
+            return 0;
+        }
+
+        win->ring     = malloc(win->window*sizeof(double));
+        win->minDeque = malloc(win->window*sizeof(uint64));
+        win->maxDeque = malloc(win->window*sizeof(uint64));
+        memset(win->ring, 0, win->window*sizeof(double));
+    }
+
+    return 1;
+}
+
+void stats_push(struct stats_window* win, double value) {
+    //Helper function for stats_update(); add one sample to a window
+    const int W = win->window;
+    const uint64 n = win->numSamples;
+
+    //Evict the oldest sample from the sums
+    if (n >= (uint64)W) {
+        double old = win->ring[n % W];
+        win->sum   -= old;
+        win->sumSq -= old*old;
+    }
+    win->ring[n % W] = value;
+    win->sum   += value;
+    win->sumSq += value*value;
+    win->numSamples++;
+
+    //Sliding max: drop the expired candidate, then those which can never be the max again
+    if (win->maxLen > 0 && win->maxDeque[win->maxHead] + W <= n) {
+        win->maxHead = (win->maxHead + 1) % W;
+        win->maxLen--;
+    }
+    while (win->maxLen > 0 && win->ring[win->maxDeque[(win->maxHead + win->maxLen - 1) % W] % W] <= value) {
+        win->maxLen--;
+    }
+    win->maxDeque[(win->maxHead + win->maxLen) % W] = n;
+    win->maxLen++;
+
+    //Sliding min; same as above
+    if (win->minLen > 0 && win->minDeque[win->minHead] + W <= n) {
+        win->minHead = (win->minHead + 1) % W;
+        win->minLen--;
+    }
+    while (win->minLen > 0 && win->ring[win->minDeque[(win->minHead + win->minLen - 1) % W] % W] >= value) {
+        win->minLen--;
+    }
+    win->minDeque[(win->minHead + win->minLen) % W] = n;
+    win->minLen++;
+
+    //Recompute the sums once in a while, so rounding errors from the subtractions don't accumulate.
+    // This is O(W) every STATS_RESUM_INTERVAL*W samples, i.e. O(1) amortized.
+    if (++(win->sinceResum) >= STATS_RESUM_INTERVAL*W) {
+        win->sinceResum = 0;
+        int count = win->numSamples < (uint64)W ? (int)win->numSamples : W;
+        win->sum   = 0.0;
+        win->sumSq = 0.0;
+        for (int k = 0; k < count; k++) {
+            win->sum   += win->ring[k];
+            win->sumSq += win->ring[k]*win->ring[k];
+        }
+    }
+}
+
+void stats_update() {
+    if (stats_numWindows == 0) return;
+
+    seqlock_write_begin(&stats_seq);
+    for (int i = 0; i < stats_numWindows; i++) {
+        struct stats_window* win = &(stats_windows[i]);
+
+        double value = valueSource_read(&(win->src));
+        if (isnan(value)) {
+            win->result.skipped++;
+            continue;
+        }
+        stats_push(win, value);
+
+        const int W = win->window;
+        uint64 count = win->numSamples < (uint64)W ? win->numSamples : (uint64)W;
+
+        win->result.count = count;
+        win->result.total = win->numSamples;
+        win->result.last  = value;
+        win->result.min   = win->ring[win->minDeque[win->minHead] % W];
+        win->result.max   = win->ring[win->maxDeque[win->maxHead] % W];
+        win->result.mean  = win->sum / count;
+        win->result.rms   = sqrt(fmax(win->sumSq, 0.0) / count);
+    }
+    seqlock_write_end(&stats_seq);
+}
+
+int stats_describe(uint16 slave, uint16 idx, uint8 subidx, int connfd) {
+    char buff_out[BUFFLEN];
+    memset(buff_out, 0, BUFFLEN);
+    int found = 0;
+
+    for (int i = 0; i < stats_numWindows; i++) {
+        struct stats_window* win = &(stats_windows[i]);
+        if (win->slaveIdx != slave || win->idx != idx || win->subidx != subidx) continue;
+        found++;
+
+        struct stats_result result;
+        uint32 s;
+        do {
+            s = seqlock_read_begin(&stats_seq);
+            result = win->result;
+        } while (seqlock_read_retry(&stats_seq, s));
+
+        int numChars = snprintf(buff_out, BUFFLEN,
+                                "  window %d count %" PRIu64 " min %.10g max %.10g mean %.10g rms %.10g last %.10g total %" PRIu64 " skipped %" PRIu64 "\n",
+                                win->window, result.count, result.min, result.max, result.mean, result.rms,
+                                result.last, result.total, result.skipped);
+        if (numChars < 0 || numChars >= BUFFLEN) continue;
+        write(connfd, buff_out, BUFFLEN);
+        memset(buff_out, 0, BUFFLEN);
+    }
+    return found;
+}
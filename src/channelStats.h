@@ -0,0 +1,74 @@
+#ifndef channelStats_h
+#define channelStats_h
+
+#include "ecatDriver.h"
+#include "derivedChannels.h"
+
+// Running aggregates (min, max, mean, RMS) over a sliding window of the last N cycles,
+// maintained by the cycle thread with O(1) amortized work per cycle and channel.
+
+// Configuration    ************************************************************************
+#define STATS_RESUM_INTERVAL 1 // Recompute the sums from scratch every this many windows (limits rounding drift)
+
+// Data types       ************************************************************************
+
+// One STATS line from the config file; a linked list, last element all-zeros.
+struct stats_def {
+    uint16 slaveIdx;
+    uint16 idx;
+    uint8  subidx;
+    int    window; // [cycles]
+
+    struct stats_def* next;
+};
+
+// Results published after every update, read by clients under stats_seq
+struct stats_result {
+    uint64 count;       // Samples in the window (< window until it is filled)
+    uint64 total;       // Samples since startup
+    uint64 skipped;     // Cycles where the value could not be decoded (not counted)
+    double min;
+    double max;
+    double mean;
+    double rms;
+    double last;
+};
+
+// State of one window; all buffers are allocated at setup
+struct stats_window {
+    uint16 slaveIdx;
+    uint16 idx;
+    uint8  subidx;
+    struct value_source src;
+
+    int     window;
+    double* ring;       // Last 'window' samples, indexed by sample number % window
+    uint64  numSamples; // Total samples pushed
+    double  sum;
+    double  sumSq;
+    int     sinceResum;
+
+    // Monotonic deques of sample numbers, for sliding min and max.
+    // Circular buffers of 'window' entries each.
+    uint64* minDeque;
+    int     minHead, minLen;
+    uint64* maxDeque;
+    int     maxHead, maxLen;
+
+    struct stats_result result;
+};
+
+// Functions        ************************************************************************
+
+// Allocate and resolve the STATS windows; must be called after derived_setup().
+// Returns 1 on success, 0 in case of error.
+int stats_setup();
+
+// Push the current values; called by the cycle thread with IOmap_lock grabbed.
+void stats_update();
+
+// Write the aggregates of all windows on slave:idx:subidx to a client connection.
+// Returns the number of windows found.
+int stats_describe(uint16 slave, uint16 idx, uint8 subidx, int connfd);
+
+#endif
@@ -0,0 +1,268 @@
+#include "decodedImage.h"
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "ethercat.h" // ECT_* data types
+
+#include "EtherCatDaemon.h"
+#ifdef ECD_STATIC_MAPPING
+#include "staticMapping.h"
+#endif
+
+// Configuration    ************************************************************************
+
+// The groups of the plan, in this order; BOOLEAN and BIT1..BIT8 share the first one
+static const uint16 decode_groupTypes[] = {
+    ECT_BIT1,
+    ECT_INTEGER8,  ECT_INTEGER16,  ECT_INTEGER24,  ECT_INTEGER32,  ECT_INTEGER64,
+    ECT_UNSIGNED8, ECT_UNSIGNED16, ECT_UNSIGNED24, ECT_UNSIGNED32, ECT_UNSIGNED64,
+    ECT_REAL32,    ECT_REAL64
+};
+#define DECODE_NUMGROUPS ((int)(sizeof(decode_groupTypes)/sizeof(decode_groupTypes[0])))
+
+// File-global data ************************************************************************
+
+// The plan: group g is decode_srcOffs[decode_groupStart[g] ... decode_groupStart[g+1]-1],
+// and is decoded into the same range of decode_values. All in one allocation.
+union decode_value* decode_values  = NULL;
+int*                decode_srcOffs = NULL; // Into the IOmap [bytes]
+int*                decode_slots   = NULL; // Per PDO of mapping_in: index into decode_values, or -1
+uint8*              decode_bitoffs = NULL; // Bit group only
+uint8*              decode_bitlens = NULL;
+int decode_groupStart[DECODE_NUMGROUPS+1];
+int decode_num = 0;
+int decode_static = 0; // Decoded by the generated staticmap_decodeInputs(), in table order
+
+// Functions        ************************************************************************
+
+int decode_group(int dataType, int bitoff, int bitlen) {
+    //Helper function for decode_setup(); the group of a PDO, or -1 if it is not decoded
+    switch(dataType) {
+    case ECT_BOOLEAN:
+    case ECT_BIT1:
+    case ECT_BIT2:
+    case ECT_BIT3:
+    case ECT_BIT4:
+    case ECT_BIT5:
+    case ECT_BIT6:
+    case ECT_BIT7:
+    case ECT_BIT8:
+        return bitoff + bitlen <= 16 ? 0 : -1; // At most two bytes, as in PDOval2double()
+    default:
+        break;
+    }
+
+    if (bitoff != 0) return -1;
+    for (int g = 1; g < DECODE_NUMGROUPS; g++) {
+        if (decode_groupTypes[g] == dataType) return g;
+    }
+    return -1;
+}
+
+int decode_setup() {
+    if (!config_file.decodeInputs) return 1;
+
+    free(decode_values); // Only when set up again, e.g. by the microbenchmarks
+    decode_num = 0;
+
+    int num = mapping_in->num;
+    size_t size = num * (sizeof(union decode_value) + 2*sizeof(int) + 2*sizeof(uint8));
+    char* mem = malloc(size > 0 ? size : 1);
+    if (mem == NULL) {
+        log_error("ERROR in decode_setup(): out of memory\n");
+        return 0;
+    }
+    decode_values  = (union decode_value*) mem;
+    decode_srcOffs = (int*) (decode_values + num);
+    decode_slots   = decode_srcOffs + num;
+    decode_bitoffs = (uint8*) (decode_slots + num);
+    decode_bitlens = decode_bitoffs + num;
+
+    //Counting sort by group, keeping the IOmap order within each group
+    int counts[DECODE_NUMGROUPS];
+    memset(counts, 0, sizeof(counts));
+    for (int i = 0; i < num; i++) {
+        int g = decode_group(mapping_in->dataTypes[i], mapping_in->bitoffs[i], mapping_in->bitlens[i]);
+        if (g >= 0) counts[g]++;
+    }
+    decode_groupStart[0] = 0;
+    for (int g = 0; g < DECODE_NUMGROUPS; g++) {
+        decode_groupStart[g+1] = decode_groupStart[g] + counts[g];
+    }
+    decode_num = decode_groupStart[DECODE_NUMGROUPS];
+
+    int fill[DECODE_NUMGROUPS];
+    memcpy(fill, decode_groupStart, sizeof(fill));
+    for (int i = 0; i < num; i++) {
+        int g = decode_group(mapping_in->dataTypes[i], mapping_in->bitoffs[i], mapping_in->bitlens[i]);
+        if (g < 0) {
+            decode_slots[i] = -1;
+            continue;
+        }
+        int slot = fill[g]++;
+        decode_slots[i]      = slot;
+        decode_srcOffs[slot] = mapping_in->offsets[i];
+        decode_bitoffs[slot] = mapping_in->bitoffs[i];
+        decode_bitlens[slot] = mapping_in->bitlens[i];
+        decode_values[slot].i = 0;
+    }
+
+#ifdef ECD_STATIC_MAPPING
+    decode_static = staticmap_inUse();
+    if (decode_static) {
+        for (int i = 0; i < num; i++) {
+            if (decode_slots[i] >= 0) decode_slots[i] = i;
+        }
+        log_info("Decoding %d of %d inputs after every cycle, with the static mapping\n", decode_num, num);
+        return 1;
+    }
+#endif
+
+    int numGroups = 0;
+    for (int g = 0; g < DECODE_NUMGROUPS; g++) {
+        if (counts[g] > 0) numGroups++;
+    }
+    log_info("Decoding %d of %d inputs after every cycle, in %d type groups\n", decode_num, num, numGroups);
+    return 1;
+}
+
+// One group of a byte-aligned type: load, convert, store contiguously
+#define DECODE_LOOP(ctype, member)                                       \
+    for (int k = start; k < end; k++) {                                  \
+        ctype v;                                                         \
+        memcpy(&v, &(IOmap[decode_srcOffs[k]]), sizeof(v));              \
+        decode_values[k].member = v;                                     \
+    }
+
+void decode_update() {
+    if (decode_num == 0) return;
+#ifdef ECD_STATIC_MAPPING
+    if (decode_static) {
+        staticmap_decodeInputs(decode_values, IOmap);
+        return;
+    }
+#endif
+
+    for (int g = 0; g < DECODE_NUMGROUPS; g++) {
+        int start = decode_groupStart[g];
+        int end   = decode_groupStart[g+1];
+        if (start == end) continue;
+
+        switch(decode_groupTypes[g]) {
+        case ECT_BIT1:
+            for (int k = start; k < end; k++) {
+                const uint8* ptr = (const uint8*) &(IOmap[decode_srcOffs[k]]);
+                uint16 raw = ptr[0];
+                if (decode_bitoffs[k] + decode_bitlens[k] > 8) raw |= ((uint16)ptr[1]) << 8;
+                decode_values[k].i = (raw >> decode_bitoffs[k]) & ((1 << decode_bitlens[k]) - 1);
+            }
+            break;
+        case ECT_INTEGER24:
+            for (int k = start; k < end; k++) {
+                uint32 v = 0;
+                memcpy(&v, &(IOmap[decode_srcOffs[k]]), 3);
+                decode_values[k].i = ((int32)(v << 8)) >> 8; // Sign extension
+            }
+            break;
+        case ECT_UNSIGNED24:
+            for (int k = start; k < end; k++) {
+                uint32 v = 0;
+                memcpy(&v, &(IOmap[decode_srcOffs[k]]), 3);
+                decode_values[k].i = v;
+            }
+            break;
+        case ECT_INTEGER8:   DECODE_LOOP(int8,   i); break;
+        case ECT_INTEGER16:  DECODE_LOOP(int16,  i); break;
+        case ECT_INTEGER32:  DECODE_LOOP(int32,  i); break;
+        case ECT_INTEGER64:  DECODE_LOOP(int64,  i); break;
+        case ECT_UNSIGNED8:  DECODE_LOOP(uint8,  i); break;
+        case ECT_UNSIGNED16: DECODE_LOOP(uint16, i); break;
+        case ECT_UNSIGNED32: DECODE_LOOP(uint32, i); break;
+        case ECT_UNSIGNED64: DECODE_LOOP(uint64, i); break; // Bit pattern
+        case ECT_REAL32:     DECODE_LOOP(float,  d); break;
+        case ECT_REAL64:     DECODE_LOOP(double, d); break;
+        }
+    }
+}
+
+int decode_slotOf(struct mappings_PDO* mapping) {
+    //Helper function; index into decode_values, or -1 if the PDO is not decoded
+    if (decode_num == 0) return -1;
+
+    if (mapping >= mapping_out->records && mapping < mapping_out->records + mapping_out->num) return -1;
+
+    struct mappings_PDO* startup = mapping;
+    if (mapping < mapping_in->records || mapping >= mapping_in->records + mapping_in->num) {
+        //A copy, or a record of a rescanned table
+        startup = get_address(mapping->slaveIdx, mapping->idx, mapping->subidx, mapping_in);
+        if (startup == NULL || startup->offset != mapping->offset || startup->bitoff != mapping->bitoff ||
+            startup->bitlen != mapping->bitlen || startup->dataType != mapping->dataType) {
+            return -1;
+        }
+    }
+    return decode_slots[startup - mapping_in->records];
+}
+
+int decode_double(struct mappings_PDO* mapping, double* value) {
+    int slot = decode_slotOf(mapping);
+    if (slot < 0) return PDOval2double(mapping, value);
+
+    switch(mapping->dataType) {
+    case ECT_REAL32:
+    case ECT_REAL64:
+        *value = decode_values[slot].d;
+        break;
+    case ECT_UNSIGNED64:
+        *value = (uint64) decode_values[slot].i;
+        break;
+    default:
+        *value = decode_values[slot].i;
+    }
+    return 1;
+}
+
+int decode_string(struct mappings_PDO* mapping, char* buff, int bufflen) {
+    int slot = decode_slotOf(mapping);
+    if (slot < 0) return 0;
+
+    int64 v = decode_values[slot].i;
+    //Same formats as PDOval2string()
+    switch(mapping->dataType) {
+    case ECT_INTEGER8:
+        snprintf(buff, bufflen, "0x%2.2x %d", (int)v, (int)v);
+        break;
+    case ECT_INTEGER16:
+        snprintf(buff, bufflen, "0x%4.4x %d", (int)v, (int)v);
+        break;
+    case ECT_INTEGER24:
+    case ECT_INTEGER32:
+        snprintf(buff, bufflen, "0x%8.8x %d", (int32)v, (int32)v);
+        break;
+    case ECT_INTEGER64:
+        snprintf(buff, bufflen, "0x%16.16"PRIx64" %"PRId64, v, v);
+        break;
+    case ECT_UNSIGNED8:
+        snprintf(buff, bufflen, "0x%2.2x %u", (uint32)v, (uint32)v);
+        break;
+    case ECT_UNSIGNED16:
+        snprintf(buff, bufflen, "0x%4.4x %u", (uint32)v, (uint32)v);
+        break;
+    case ECT_UNSIGNED24:
+    case ECT_UNSIGNED32:
+        snprintf(buff, bufflen, "0x%8.8x %u", (uint32)v, (uint32)v);
+        break;
+    case ECT_UNSIGNED64:
+        snprintf(buff, bufflen, "0x%16.16"PRIx64" %"PRIu64, (uint64)v, (uint64)v);
+        break;
+    case ECT_REAL32:
+    case ECT_REAL64:
+        snprintf(buff, bufflen, "%f", decode_values[slot].d);
+        break;
+    default:
+        return 0; // Bit types; PDOval2string() has its own notion of these
+    }
+    return 1;
+}
@@ -0,0 +1,43 @@
+#ifndef decodedImage_h
+#define decodedImage_h
+
+#include "ecatDriver.h"
+
+// Bulk decode of all inputs (DECODE YES): right after every exchange, the cycle thread decodes
+// every input PDO of the startup table (mapping_in) in one pass into one contiguous array,
+// and everything that needs a value (derived channels, STATS, triggers, alarms, METRICS_PDOS,
+// 'get') reads it from there instead of decoding the IOmap again, once per user.
+// The PDOs are sorted by data type at setup, so that each type is one loop with a fixed
+// load width and conversion, and a contiguous destination; with a gather-capable target
+// (e.g. -march=haswell) the compiler vectorises these loops.
+// Integer and bit types are stored as int64 (exact, also for UNSIGNED64 as its bit pattern),
+// REAL32/REAL64 as double. PDOs of other types, or misaligned ones, are not decoded.
+// The 'subscribe', 'shm', 'mcast' and record streams stay raw, since they ship the image itself.
+
+// Data types       ************************************************************************
+
+union decode_value {
+    int64  i;
+    double d;
+};
+
+// Functions        ************************************************************************
+
+// Build the decode plan, if enabled (DECODE); must be called after ecat_setup_mappings().
+// Returns 1 on success, 0 in case of error.
+int decode_setup();
+
+// Decode all inputs; called by the cycle thread with IOmap_lock grabbed, before anything reads them.
+void decode_update();
+
+// Value of a PDO for computations, like PDOval2double(): from the decoded array if it covers
+// the PDO, else decoded from the IOmap. Call with IOmap_lock grabbed, or from the cycle thread.
+int decode_double(struct mappings_PDO* mapping, double* value);
+
+// Like PDOval2string(), but from the decoded array. The mapping may be a copy, e.g. from a
+// rescanned table; it is only used if it is at the same place as in the startup table.
+// Returns 1 on success, 0 if the PDO is not decoded (then use PDOval2string()).
+// Call with IOmap_lock grabbed.
+int decode_string(struct mappings_PDO* mapping, char* buff, int bufflen);
+
+#endif
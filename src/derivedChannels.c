@@ -0,0 +1,336 @@
+#include "derivedChannels.h"
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include <unistd.h>
+#include <pthread.h>
+
+#include "EtherCatDaemon.h"
+#include "ecatDriver.h"
+#include "networkServer.h"
+#include "decodedImage.h"
+#include "seqlock.h"
+
+// File-global data ************************************************************************
+
+// Compiled channels and their values
+struct derived_channel* derived_channels = NULL;
+double* derived_values = NULL;
+int derived_numChannels = 0;
+volatile uint32 derived_seq = 0;
+
+// Flat bytecode table for all channels, and the pool of polynomial coefficients
+struct derived_instr* derived_code = NULL;
+int derived_codeLen = 0;
+double* derived_coeffs = NULL;
+int derived_numCoeffs = 0;
+
+// PDOs used by the expressions; each is decoded once per cycle, no matter how often it is used
+struct mappings_PDO** derived_inputMappings = NULL;
+double* derived_inputs = NULL;
+int derived_numInputs = 0;
+
+// Simple operators: name, opcode, number of values popped and pushed
+struct derived_opinfo {
+    const char* name;
+    uint8 op;
+    int pops;
+    int pushes;
+};
+const struct derived_opinfo derived_ops[] = {
+    {"+",    DOP_ADD,  2, 1},
+    {"-",    DOP_SUB,  2, 1},
+    {"*",    DOP_MUL,  2, 1},
+    {"/",    DOP_DIV,  2, 1},
+    {"neg",  DOP_NEG,  1, 1},
+    {"abs",  DOP_ABS,  1, 1},
+    {"min",  DOP_MIN,  2, 1},
+    {"max",  DOP_MAX,  2, 1},
+    {">",    DOP_GT,   2, 1},
+    {"<",    DOP_LT,   2, 1},
+    {">=",   DOP_GE,   2, 1},
+    {"<=",   DOP_LE,   2, 1},
+    {"sel",  DOP_SEL,  3, 1},
+    {"dup",  DOP_DUP,  1, 2},
+    {"swap", DOP_SWAP, 2, 2},
+    {NULL,   0,        0, 0}
+};
+
+// Functions        ************************************************************************
+
+int derived_compile(struct derived_channel* channel, int channelNum) {
+    //Helper function for derived_setup(); compile one expression into derived_code.
+    // Returns 1 on success, 0 in case of error (message already printed).
+
+    char* exprCopy = strdup(channel->expr);
+    char* saveptr  = NULL;
+    int   depth    = 0;
+
+    channel->codeStart = derived_codeLen;
+
+    for (char* tok = strtok_r(exprCopy, " \t", &saveptr); tok != NULL; tok = strtok_r(NULL, " \t", &saveptr)) {
+        struct derived_instr* instr = &(derived_code[derived_codeLen]);
+        memset(instr, 0, sizeof(struct derived_instr));
+        int pops = 0, pushes = 1;
+
+        uint16 slave = 0, idx = 0;
+        uint8  subidx = 0;
+        char*  endptr = NULL;
+        int    i;
+
+        for (i = 0; derived_ops[i].name != NULL; i++) {
+            if (!strcmp(tok, derived_ops[i].name)) break;
+        }
+
+        if (derived_ops[i].name != NULL) {                        // Operator
+            instr->op = derived_ops[i].op;
+            pops      = derived_ops[i].pops;
+            pushes    = derived_ops[i].pushes;
+        }
+        else if (!strncmp(tok, "poly:", 5)) {                     // Polynomial, coefficients c0,c1,...
+            instr->op  = DOP_POLY;
+            instr->arg = derived_numCoeffs;
+            char* c = tok + 5;
+            while (1) {
+                derived_coeffs[derived_numCoeffs++] = strtod(c, &endptr);
+                instr->n++;
+                if (endptr == c || (*endptr != ',' && *endptr != '\0')) goto badToken;
+                if (*endptr == '\0') break;
+                c = endptr + 1;
+            }
+            pops = 1;
+        }
+        else if (sscanf(tok, "%hi:%hx:%hhx", &slave, &idx, &subidx) == 3) {
+            if (slave == 0) {                                     // Earlier derived channel
+                for (i = 0; i < channelNum; i++) {
+                    if (derived_channels[i].idx == idx) break;
+                }
+                if (i == channelNum || subidx != 0) {
+                    log_error("Error in derived_setup(): DERIVED 0x%4.4X uses %s, which is not an earlier DERIVED\n",
+                              channel->idx, tok);
+                    goto fail;
+                }
+                instr->op  = DOP_DERIVED;
+                instr->arg = i;
+            }
+            else {                                                // PDO
+                struct mappings_PDO* mapping = get_address(slave, idx, subidx, mapping_in);
+                if (mapping == NULL) {
+                    mapping = get_address(slave, idx, subidx, mapping_out);
+                }
+                double dummy;
+                if (mapping == NULL || !PDOval2double(mapping, &dummy)) {
+                    log_error("Error in derived_setup(): DERIVED 0x%4.4X uses %s, which is not a numeric PDO\n",
+                              channel->idx, tok);
+                    goto fail;
+                }
+                for (i = 0; i < derived_numInputs; i++) {
+                    if (derived_inputMappings[i] == mapping) break;
+                }
+                if (i == derived_numInputs) {
+                    derived_inputMappings[derived_numInputs++] = mapping;
+                }
+                instr->op  = DOP_INPUT;
+                instr->arg = i;
+            }
+        }
+        else {                                                    // Constant
+            instr->op = DOP_CONST;
+            instr->c  = strtod(tok, &endptr);
+            if (endptr == tok || *endptr != '\0') goto badToken;
+        }
+
+        if (depth < pops) {
+            log_error("Error in derived_setup(): DERIVED 0x%4.4X, stack underflow at '%s'\n", channel->idx, tok);
+            goto fail;
+        }
+        depth += pushes - pops;
+        if (depth > DERIVED_MAXSTACK) {
+            log_error("Error in derived_setup(): DERIVED 0x%4.4X, stack deeper than %d\n", channel->idx, DERIVED_MAXSTACK);
+            goto fail;
+        }
+        derived_codeLen++;
+    }
+
+    if (depth != 1) {
+        log_error("Error in derived_setup(): DERIVED 0x%4.4X leaves %d values on the stack, expected 1\n",
+                  channel->idx, depth);
+        goto fail;
+    }
+
+    channel->codeLen = derived_codeLen - channel->codeStart;
+    free(exprCopy);
+    return 1; //Success
+
+badToken:
+    log_error("Error in derived_setup(): DERIVED 0x%4.4X, did not understand '%s'\n", channel->idx, channel->expr);
+fail:
+    free(exprCopy);
+    return 0; //Failure
+}
+
+int derived_setup() {
+    struct derived_def* def;
+    int maxTokens = 0;
+
+    for (def = config_file.derived; def->next != NULL; def = def->next) {
+        derived_numChannels++;
+        maxTokens += strlen(def->expr)/2 + 1; // Tokens are separated by whitespace; this is an upper bound
+    }
+    if (derived_numChannels == 0) return 1;
+
+    // Allocate everything up front; nothing is allocated while running
+    derived_channels      = malloc(derived_numChannels*sizeof(struct derived_channel));
+    derived_values        = malloc(derived_numChannels*sizeof(double));
+    derived_code          = malloc(maxTokens*sizeof(struct derived_instr));
+    derived_coeffs        = malloc(maxTokens*sizeof(double));
+    derived_inputMappings = malloc(maxTokens*sizeof(struct mappings_PDO*));
+    derived_inputs        = malloc(maxTokens*sizeof(double));
+    memset(derived_channels, 0, derived_numChannels*sizeof(struct derived_channel));
+    memset(derived_values,   0, derived_numChannels*sizeof(double));
+
+    int channelNum = 0;
+    for (def = config_file.derived; def->next != NULL; def = def->next) {
+        struct derived_channel* channel = &(derived_channels[channelNum]);
+        for (int i = 0; i < channelNum; i++) {
+            if (derived_channels[i].idx == def->idx) {
+                log_error("Error in derived_setup(): got two DERIVED 0x%4.4X\n", def->idx);
+                return 0;
+            }
+        }
+        channel->idx  = def->idx;
+        channel->expr = def->expr;
+        strncpy(channel->name, def->name, DERIVED_MAXNAME);
+
+        if (!derived_compile(channel, channelNum)) return 0;
+        channelNum++;
+    }
+
+    log_info("Compiled %d derived channels: %d instructions, %d PDOs\n",
+             derived_numChannels, derived_codeLen, derived_numInputs);
+
+    return 1;
+}
+
+void derived_evaluate() {
+    if (derived_numChannels == 0) return;
+
+    // Decode every PDO used by the expressions once
+    for (int i = 0; i < derived_numInputs; i++) {
+        if (!decode_double(derived_inputMappings[i], &(derived_inputs[i]))) {
+            derived_inputs[i] = NAN;
+        }
+    }
+
+    double stack[DERIVED_MAXSTACK];
+
+    seqlock_write_begin(&derived_seq);
+    for (int ch = 0; ch < derived_numChannels; ch++) {
+        int sp = 0; // Number of values on the stack; depth was checked at compile time
+        const struct derived_instr* instr = &(derived_code[derived_channels[ch].codeStart]);
+        const struct derived_instr* end   = instr + derived_channels[ch].codeLen;
+
+        for ( ; instr < end; instr++) {
+            double tmp;
+            switch(instr->op) {
+            case DOP_CONST:   stack[sp++] = instr->c;                            break;
+            case DOP_INPUT:   stack[sp++] = derived_inputs[instr->arg];          break;
+            case DOP_DERIVED: stack[sp++] = derived_values[instr->arg];          break;
+            case DOP_ADD:     sp--; stack[sp-1] = stack[sp-1] + stack[sp];       break;
+            case DOP_SUB:     sp--; stack[sp-1] = stack[sp-1] - stack[sp];       break;
+            case DOP_MUL:     sp--; stack[sp-1] = stack[sp-1] * stack[sp];       break;
+            case DOP_DIV:     sp--; stack[sp-1] = stack[sp-1] / stack[sp];       break;
+            case DOP_NEG:     stack[sp-1] = -stack[sp-1];                        break;
+            case DOP_ABS:     stack[sp-1] = fabs(stack[sp-1]);                   break;
+            case DOP_MIN:     sp--; stack[sp-1] = fmin(stack[sp-1], stack[sp]);  break;
+            case DOP_MAX:     sp--; stack[sp-1] = fmax(stack[sp-1], stack[sp]);  break;
+            case DOP_GT:      sp--; stack[sp-1] = stack[sp-1] >  stack[sp];      break;
+            case DOP_LT:      sp--; stack[sp-1] = stack[sp-1] <  stack[sp];      break;
+            case DOP_GE:      sp--; stack[sp-1] = stack[sp-1] >= stack[sp];      break;
+            case DOP_LE:      sp--; stack[sp-1] = stack[sp-1] <= stack[sp];      break;
+            case DOP_SEL:     sp -= 2; stack[sp-1] = stack[sp-1] != 0.0 ? stack[sp] : stack[sp+1]; break;
+            case DOP_DUP:     stack[sp] = stack[sp-1]; sp++;                     break;
+            case DOP_SWAP:    tmp = stack[sp-1]; stack[sp-1] = stack[sp-2]; stack[sp-2] = tmp; break;
+            case DOP_POLY: {
+                // Horner's scheme
+                const double* coeffs = &(derived_coeffs[instr->arg]);
+                double x   = stack[sp-1];
+                double acc = coeffs[instr->n-1];
+                for (int k = instr->n-2; k >= 0; k--) {
+                    acc = acc*x + coeffs[k];
+                }
+                stack[sp-1] = acc;
+                break;
+            }
+            }
+        }
+        derived_values[ch] = stack[0];
+    }
+    seqlock_write_end(&derived_seq);
+}
+
+struct derived_channel* derived_get(uint16 idx, double* value) {
+    for (int ch = 0; ch < derived_numChannels; ch++) {
+        if (derived_channels[ch].idx != idx) continue;
+
+        uint32 s;
+        do {
+            s = seqlock_read_begin(&derived_seq);
+            *value = derived_values[ch];
+        } while (seqlock_read_retry(&derived_seq, s));
+        return &(derived_channels[ch]);
+    }
+    return NULL; // Nothing was found.
+}
+
+int valueSource_resolve(uint16 slave, uint16 idx, uint8 subidx, struct value_source* src) {
+    memset(src, 0, sizeof(struct value_source));
+
+    if (slave == 0) {
+        if (subidx != 0) return 0;
+        for (int ch = 0; ch < derived_numChannels; ch++) {
+            if (derived_channels[ch].idx == idx) {
+                src->derivedNum = ch;
+                return 1;
+            }
+        }
+        return 0; // Nothing was found.
+    }
+
+    src->mapping = get_address(slave, idx, subidx, mapping_in);
+    if (src->mapping == NULL) {
+        src->mapping = get_address(slave, idx, subidx, mapping_out);
+    }
+    double dummy;
+    if (src->mapping == NULL || !PDOval2double(src->mapping, &dummy)) return 0;
+
+    return 1;
+}
+
+double valueSource_read(struct value_source* src) {
+    if (src->mapping == NULL) {
+        return derived_values[src->derivedNum];
+    }
+
+    double value;
+    if (!decode_double(src->mapping, &value)) return NAN;
+    return value;
+}
+
+void derived_describe(int connfd) {
+    char buff_out[BUFFLEN];
+    memset(buff_out, 0, BUFFLEN);
+
+    for (int ch = 0; ch < derived_numChannels; ch++) {
+        int numChars = snprintf(buff_out, BUFFLEN, "  [DERIVED] 0:0x%4.4X:0x00 %-12s %s = %s\n",
+                                derived_channels[ch].idx, "REAL64",
+                                derived_channels[ch].name, derived_channels[ch].expr);
+        if (numChars < 0 || numChars >= BUFFLEN) continue;
+        write(connfd, buff_out, BUFFLEN);
+        memset(buff_out, 0, BUFFLEN);
+    }
+}
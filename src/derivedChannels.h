@@ -0,0 +1,87 @@
+#ifndef derivedChannels_h
+#define derivedChannels_h
+
+#include "ecatDriver.h"
+
+// Derived ("virtual") channels, computed from PDOs after every cycle.
+// They are defined in the config file by expressions in reverse polish notation,
+// compiled once into a flat bytecode table, and read by clients as 'get 0:idx:0'.
+
+// Configuration    ************************************************************************
+#define DERIVED_MAXSTACK 16 // Max evaluation stack depth of one expression
+#define DERIVED_MAXNAME  40 // Max length of a channel name
+
+// Data types       ************************************************************************
+
+// One DERIVED line from the config file; a linked list, last element all-zeros.
+struct derived_def {
+    uint16 idx;      // Address is 0:idx:0
+    char*  name;
+    char*  expr;     // Expression in reverse polish notation
+
+    struct derived_def* next;
+};
+
+// Opcodes of the bytecode
+enum derived_op {
+    DOP_CONST,       // push c
+    DOP_INPUT,       // push derived_inputs[arg] (a PDO, decoded once per cycle)
+    DOP_DERIVED,     // push value of derived channel arg (must be defined earlier)
+    DOP_ADD, DOP_SUB, DOP_MUL, DOP_DIV,
+    DOP_NEG, DOP_ABS, DOP_MIN, DOP_MAX,
+    DOP_GT,  DOP_LT,  DOP_GE,  DOP_LE,  // push 1.0 or 0.0
+    DOP_SEL,         // c a b sel -> a if c != 0 else b
+    DOP_DUP, DOP_SWAP,
+    DOP_POLY         // x -> sum_k coeffs[arg+k] * x^k, k = 0..n-1
+};
+
+struct derived_instr {
+    uint8  op;       // enum derived_op
+    uint16 n;        // DOP_POLY: number of coefficients
+    int    arg;      // Index into inputs, channels or the coefficient pool
+    double c;        // DOP_CONST: the constant
+};
+
+// A compiled channel; its code is derived_code[codeStart ... codeStart+codeLen-1]
+struct derived_channel {
+    uint16 idx;
+    char   name[DERIVED_MAXNAME+1];
+    char*  expr;
+    int    codeStart;
+    int    codeLen;
+};
+
+// Something which has a value every cycle: either a PDO, or a derived channel (slave 0).
+// Used by the features which follow selected channels from the cycle thread.
+struct value_source {
+    struct mappings_PDO* mapping; // NULL for a derived channel
+    int derivedNum;               // Index of the derived channel
+};
+
+// Functions        ************************************************************************
+
+// Compile the DERIVED definitions from the config file; must be called after ecat_setup_mappings().
+// Returns 1 on success, 0 in case of error.
+int derived_setup();
+
+// Decode the referenced PDOs and evaluate all channels;
+// called by the cycle thread with IOmap_lock grabbed.
+void derived_evaluate();
+
+// Get the latest value of derived channel 0:idx:0, without grabbing IOmap_lock.
+// Returns a pointer to the channel on success, NULL if there is no such channel.
+struct derived_channel* derived_get(uint16 idx, double* value);
+
+// Resolve slave:idx:subidx (a PDO in mapping_in or mapping_out, or a derived channel 0:idx:0)
+// into a value source; must be called after derived_setup().
+// Returns 1 on success, 0 if the address was not found or is not numeric.
+int valueSource_resolve(uint16 slave, uint16 idx, uint8 subidx, struct value_source* src);
+
+// Read the value of a source; called by the cycle thread with IOmap_lock grabbed,
+// after derived_evaluate(). Returns NAN if the value can not be decoded.
+double valueSource_read(struct value_source* src);
+
+// Write a description of all derived channels to a client connection.
+void derived_describe(int connfd);
+
+#endif
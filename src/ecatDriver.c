@@ -4,26 +4,54 @@
 #include <inttypes.h>
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <math.h>
 
 #include <unistd.h>
+#include <time.h>
 
 #include "ethercat.h"
 
 #include "EtherCatDaemon.h"
+#include "metricsServer.h"
+#include "mcastPublisher.h"
+#include "derivedChannels.h"
+#include "channelStats.h"
+#include "channelHistory.h"
+#include "triggerCapture.h"
+#include "recordReplay.h"
+#include "tsLogger.h"
+#include "shmImage.h"
+#include "channelAlarms.h"
+#include "mappingTable.h"
+#include "setpointWaveform.h"
+#include "decodedImage.h"
+#include "packetRing.h"
+#ifdef ECD_STATIC_MAPPING
+#include "staticMapping.h"
+#endif
+#include "allocStats.h"
+#include "aggregator.h"
+#include "slaveHealth.h"
+#include "lockTrace.h"
+#include "seqlock.h"
 
 // Global data      ************************************************************************
+char* IOmap;                //The global IOmap; defined in ecatDriver.h
 pthread_mutex_t IOmap_lock; //Lock for the IOmap; defined in ecatDriver.h
 
 volatile boolean inOP;     // PLC is in mode OP
 volatile boolean updating; // IOmap is updating
 
-//Note about these linked lists: The last entry is always completely set to 0, acting similar to a "string terminator \0".
-// This lead to a less complex implementation than setting the last ->next==NULL.
-struct mappings_PDO* mapping_out = NULL; // Outputs, i.e. setting of voltages, actuators etc.
-struct mappings_PDO* mapping_in  = NULL; // Inputs, i.e. reading of voltages, encoders, temperatures etc.
+struct cycle_stats cycleStats; // Written by the cycle thread only
+
+volatile uint64 imageCycle = 0; // Cycle number of the data in the IOmap; protected by IOmap_lock
+
+//The mappings found at startup, see mappingArena.h
+struct mapping_arena* mapping_out = NULL; // Outputs, i.e. setting of voltages, actuators etc.
+struct mapping_arena* mapping_in  = NULL; // Inputs, i.e. reading of voltages, encoders, temperatures etc.
 
 // File-global data ************************************************************************
-char* IOmap;
 
 OSAL_THREAD_HANDLE thread_PLCwatch; // Slave error handling (disconnect etc.)
 
@@ -33,8 +61,99 @@ int expectedWKC;
 
 uint8 currentgroup = 0;
 
+int64 prevExchangeStart = 0; // For the cycle period in cycleStats
+
+// Broadcast after every completed cycle, for ecat_waitCycles()
+pthread_mutex_t cycleDone_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t  cycleDone_cond = PTHREAD_COND_INITIALIZER;
+
 // Functions        ************************************************************************
 
+void ecat_cycleDone(int64 lockStart, int64 exchangeStart, int64 exchangeEnd) {
+    //Everything that happens after a process data exchange; shared by ecat_PLCdaemon() and ecat_replay(),
+    // so that a replayed recording goes through exactly the same code.
+    //Called with IOmap_lock grabbed, and releases it.
+
+    //Post-processing of the fresh process data, while the IOmap is consistent
+    decode_update();
+    derived_evaluate();
+    stats_update();
+    history_update(exchangeStart);
+    capture_update(cycleStats.cycles, wkc, expectedWKC);
+    metrics_updatePDOs();
+    mcast_capture(cycleStats.cycles, wkc, expectedWKC);
+    record_capture(exchangeStart, wkc);
+    tslog_capture(cycleStats.cycles, exchangeStart);
+    shm_update(cycleStats.cycles, exchangeStart, wkc, expectedWKC);
+    imageCycle = cycleStats.cycles + 1;
+    alarm_update(imageCycle);
+
+    locktrace_unlock(&IOmap_lock);
+
+    mcast_send();
+
+    //Update timing and error counters
+    seqlock_write_begin(&cycleStats.seq);
+    cycleStats.cycles++;
+    cycleStats.lastWKC = wkc;
+    cycleStats.DCtime  = ec_DCtime;
+    if (wkc < expectedWKC) cycleStats.wkcErrors++;
+
+    cycleStats.lastExchange_ns = exchangeEnd - exchangeStart;
+    if (cycleStats.cycles == 1 || cycleStats.lastExchange_ns < cycleStats.minExchange_ns)
+        cycleStats.minExchange_ns = cycleStats.lastExchange_ns;
+    if (cycleStats.lastExchange_ns > cycleStats.maxExchange_ns)
+        cycleStats.maxExchange_ns = cycleStats.lastExchange_ns;
+    cycleStats.sumExchange_ns += cycleStats.lastExchange_ns;
+
+    cycleStats.lastLockWait_ns = exchangeStart - lockStart;
+    if (cycleStats.lastLockWait_ns > cycleStats.maxLockWait_ns)
+        cycleStats.maxLockWait_ns = cycleStats.lastLockWait_ns;
+
+    if (prevExchangeStart != 0) {
+        cycleStats.lastPeriod_ns = exchangeStart - prevExchangeStart;
+        if (cycleStats.lastPeriod_ns > cycleStats.maxPeriod_ns)
+            cycleStats.maxPeriod_ns = cycleStats.lastPeriod_ns;
+        if (cycleStats.lastPeriod_ns > (int64)PLC_deadline*1000) {
+            cycleStats.overruns++;
+            cycleStats.lastOverrun_ns = exchangeStart;
+        }
+    }
+    seqlock_write_end(&cycleStats.seq);
+    prevExchangeStart = exchangeStart;
+
+    //Wake up the clients waiting for fresh data; waiters hold the lock only briefly
+    pthread_mutex_lock(&cycleDone_lock);
+    pthread_cond_broadcast(&cycleDone_cond);
+    pthread_mutex_unlock(&cycleDone_lock);
+}
+
+uint64 ecat_waitCycles(uint64 numCycles, int64 timeout_ns, struct cycle_stats* statsOut) {
+    //pthread_cond_timedwait() uses CLOCK_REALTIME
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    int64 deadline_ns = deadline.tv_sec*1000000000LL + deadline.tv_nsec + timeout_ns;
+    deadline.tv_sec  = deadline_ns / 1000000000LL;
+    deadline.tv_nsec = deadline_ns % 1000000000LL;
+
+    //Read the start under the lock, so that no broadcast can come in between
+    struct cycle_stats stats;
+    pthread_mutex_lock(&cycleDone_lock);
+    cycleStats_read(&stats);
+    uint64 target = stats.cycles + numCycles;
+    while (stats.cycles < target) {
+        if (pthread_cond_timedwait(&cycleDone_cond, &cycleDone_lock, &deadline) == ETIMEDOUT) {
+            cycleStats_read(&stats);
+            break;
+        }
+        cycleStats_read(&stats);
+    }
+    pthread_mutex_unlock(&cycleDone_lock);
+
+    if (statsOut != NULL) *statsOut = stats;
+    return stats.cycles >= target ? stats.cycles : 0;
+}
+
 void ecat_PLCdaemon() {
     //This periodically synchronizes the PLC and the IOmap
 
@@ -44,13 +163,19 @@ void ecat_PLCdaemon() {
     // https://isocpp.org/wiki/faq/pointers-to-members#cant-cvt-fnptr-to-voidptr
     osal_thread_create(&thread_PLCwatch,    128000, (void*) &ecat_check,    (void*) &ctime);
 
+    alloc_markOP(); // From here on, this thread should never touch the heap
+
     /* cyclic loop */
     while(1) {
-
-        pthread_mutex_lock(&IOmap_lock);
+        int64 lockStart = monotonicTime_ns();
+        locktrace_lock(&IOmap_lock, "cycle");
+        wave_apply();
+        int64 exchangeStart = monotonicTime_ns();
         ec_send_processdata();
         wkc = ec_receive_processdata(EC_TIMEOUTRET);
-        pthread_mutex_unlock(&IOmap_lock);
+        int64 exchangeEnd = monotonicTime_ns();
+
+        ecat_cycleDone(lockStart, exchangeStart, exchangeEnd);
 
         //Here we could in principle do some controlling
 
@@ -58,9 +183,7 @@ void ecat_PLCdaemon() {
 
         if(gotCtrlC) break;
     }
-    pthread_mutex_lock(&printf_lock);
-    printf("Caught a control+c signal, shutting down now.\n");
-    pthread_mutex_unlock(&printf_lock);
+    log_info("Caught a control+c signal, shutting down now.\n");
 }
 
 // Adapted from SOEM/test/linux/slaveinfo/slaveinfo.c::dtype2string()
@@ -267,12 +390,180 @@ allignmentError:
 }
 
 
-struct mappings_PDO* fill_mapping_list (uint16 slave, struct mappings_PDO* map_tail, uint16 PDOassign, size_t IOmapoffset) {
-    // Fill the linked lists mapping_out and mapping_in; helper function for ecat_setup_mappings()
-    // This code is is very close to SOEM/test/linux/slaveinfo/slaveinfo.c::si_PDOassign()
-    // Returns the current tail of the list, or NULL if there was an error
+int PDOval2double(struct mappings_PDO* mapping, double* value) {
+    // Like PDOval2string(), but giving a number for use in computations.
+    // memcpy is used for the loads, since the IOmap offsets are generally not aligned.
+
+    uint8* ptr = (uint8*) &(IOmap[mapping->offset]);
+
+    switch(mapping->dataType) {
+    case ECT_BOOLEAN:
+    case ECT_BIT1:
+    case ECT_BIT2:
+    case ECT_BIT3:
+    case ECT_BIT4:
+    case ECT_BIT5:
+    case ECT_BIT6:
+    case ECT_BIT7:
+    case ECT_BIT8: {
+        uint16 raw = ptr[0];
+        if (mapping->bitoff + mapping->bitlen > 8) raw |= ((uint16)ptr[1]) << 8;
+        *value = (raw >> mapping->bitoff) & ((1 << mapping->bitlen) - 1);
+        return 1;
+    }
+    default:
+        break;
+    }
+
+    if(mapping->bitoff != 0) return 0; // Byte-sized types must be byte aligned
+
+    switch(mapping->dataType) {
+    case ECT_INTEGER8: {
+        int8 v;   memcpy(&v, ptr, sizeof(v)); *value = v;
+        break;
+    }
+    case ECT_INTEGER16: {
+        int16 v;  memcpy(&v, ptr, sizeof(v)); *value = v;
+        break;
+    }
+    case ECT_INTEGER24: {
+        int32 v = 0; memcpy(&v, ptr, 3);
+        if (v & 0x00800000) v |= 0xFF000000; // Sign extension
+        *value = v;
+        break;
+    }
+    case ECT_INTEGER32: {
+        int32 v;  memcpy(&v, ptr, sizeof(v)); *value = v;
+        break;
+    }
+    case ECT_INTEGER64: {
+        int64 v;  memcpy(&v, ptr, sizeof(v)); *value = v;
+        break;
+    }
+    case ECT_UNSIGNED8: {
+        uint8 v;  memcpy(&v, ptr, sizeof(v)); *value = v;
+        break;
+    }
+    case ECT_UNSIGNED16: {
+        uint16 v; memcpy(&v, ptr, sizeof(v)); *value = v;
+        break;
+    }
+    case ECT_UNSIGNED24: {
+        uint32 v = 0; memcpy(&v, ptr, 3); *value = v;
+        break;
+    }
+    case ECT_UNSIGNED32: {
+        uint32 v; memcpy(&v, ptr, sizeof(v)); *value = v;
+        break;
+    }
+    case ECT_UNSIGNED64: {
+        uint64 v; memcpy(&v, ptr, sizeof(v)); *value = v;
+        break;
+    }
+    case ECT_REAL32: {
+        float v;  memcpy(&v, ptr, sizeof(v)); *value = v;
+        break;
+    }
+    case ECT_REAL64: {
+        double v; memcpy(&v, ptr, sizeof(v)); *value = v;
+        break;
+    }
+    default:
+        return 0; //failure; unsupported type
+    }
+    return 1; //success
+}
 
-    // Note:: Assumes printf_lock to be already grabbed by the calling function
+int double2PDOraw(struct mappings_PDO* mapping, double value, uint64* raw) {
+    // Like PDOval2double(), the host is assumed to be little endian as the IOmap.
+    if (isnan(value)) return 0;
+
+    switch(mapping->dataType) {
+    case ECT_BOOLEAN:
+    case ECT_BIT1:
+    case ECT_BIT2:
+    case ECT_BIT3:
+    case ECT_BIT4:
+    case ECT_BIT5:
+    case ECT_BIT6:
+    case ECT_BIT7:
+    case ECT_BIT8:
+        if (mapping->bitlen > 8 || round(value) < 0 || round(value) > (1 << mapping->bitlen) - 1) return 0;
+        *raw = (uint64) round(value);
+        return 1;
+    default:
+        break;
+    }
+
+    if(mapping->bitoff != 0 || mapping->bitlen % 8 != 0 || mapping->bitlen > 64) return 0; // As PDOval2double()
+    int bits = mapping->bitlen;
+
+    switch(mapping->dataType) {
+    case ECT_INTEGER8:
+    case ECT_INTEGER16:
+    case ECT_INTEGER24:
+    case ECT_INTEGER32:
+    case ECT_INTEGER64: {
+        double limit = ldexp(1.0, bits-1);
+        if (round(value) < -limit || round(value) >= limit) return 0;
+        *raw = (uint64) (int64) round(value);
+        if (bits < 64) *raw &= (1ULL << bits) - 1; // Two's complement in 'bits' bits
+        break;
+    }
+    case ECT_UNSIGNED8:
+    case ECT_UNSIGNED16:
+    case ECT_UNSIGNED24:
+    case ECT_UNSIGNED32:
+    case ECT_UNSIGNED64: {
+        if (round(value) < 0 || round(value) >= ldexp(1.0, bits)) return 0;
+        *raw = (uint64) round(value);
+        break;
+    }
+    case ECT_REAL32: {
+        if (bits != 32) return 0;
+        float  v = value; uint32 r; memcpy(&r, &v, sizeof(r)); *raw = r;
+        break;
+    }
+    case ECT_REAL64: {
+        if (bits != 64) return 0;
+        memcpy(raw, &value, sizeof(value));
+        break;
+    }
+    default:
+        return 0; //failure; unsupported type
+    }
+    return 1; //success
+}
+
+void PDOrawWrite(struct mappings_PDO* mapping, uint64 raw) {
+    uint8* ptr = (uint8*) &(IOmap[mapping->offset]);
+
+    if (mapping->bitoff != 0 || mapping->bitlen % 8 != 0) {
+        //Bit field in at most two bytes, see PDOval2double()
+        uint16 mask = ((1 << mapping->bitlen) - 1) << mapping->bitoff;
+        uint16 bits = ((uint16) raw << mapping->bitoff) & mask;
+        ptr[0] = (ptr[0] & ~mask) | bits;
+        if (mapping->bitoff + mapping->bitlen > 8) {
+            ptr[1] = (ptr[1] & ~(mask >> 8)) | (bits >> 8);
+        }
+        return;
+    }
+    memcpy(ptr, &raw, mapping->bitlen / 8);
+}
+
+void cycleStats_read(struct cycle_stats* copy) {
+    uint32 s;
+    do {
+        s = seqlock_read_begin(&cycleStats.seq);
+        memcpy(copy, (void*) &cycleStats, sizeof(struct cycle_stats));
+    } while (seqlock_read_retry(&cycleStats.seq, s));
+}
+
+int fill_mapping_list (uint16 slave, struct mapping_builder* builder, uint16 PDOassign, size_t IOmapoffset, int verbose) {
+    // Add to the mappings of one direction; helper function for ecat_buildMappings()
+    // This code is is very close to SOEM/test/linux/slaveinfo/slaveinfo.c::si_PDOassign()
+    // Returns 1 if all OK, 0 if there was an error
+    // Uses a local work counter, since it may run while the cycle thread is using the global one.
 
     const int bufflen = 1024;
     char hstr[bufflen]; // String buffer for output
@@ -281,33 +572,34 @@ struct mappings_PDO* fill_mapping_list (uint16 slave, struct mappings_PDO* map_t
     int bsize = 0;   // Size of SM in bits
 
     int rdl = 0;     // Length of last read
+    int sdoWkc = 0;  // Work counter of the last mailbox transfer
 
     //How many PDOs? (index PDOassign:0)
     uint16 rdat = 0;
     rdl = sizeof(rdat);
-    wkc = ec_SDOread(slave, PDOassign, 0x00, FALSE, &rdl, &rdat, EC_TIMEOUTRXM);
+    sdoWkc = ec_SDOread(slave, PDOassign, 0x00, FALSE, &rdl, &rdat, EC_TIMEOUTRXM);
     rdat = etohs(rdat);
 
-    if ((wkc > 0) && (rdat > 0)) {
+    if ((sdoWkc > 0) && (rdat > 0)) {
         uint16 nidx = rdat;
 
         //Loop over PDOs
         for (int idx_loop = 1; idx_loop <= nidx; idx_loop++) {
             //Get the index of the PDO
             rdl = sizeof(rdat); rdat = 0;
-            wkc = ec_SDOread(slave, PDOassign, (uint8)idx_loop, FALSE, &rdl, &rdat, EC_TIMEOUTRXM);
+            sdoWkc = ec_SDOread(slave, PDOassign, (uint8)idx_loop, FALSE, &rdl, &rdat, EC_TIMEOUTRXM);
             uint16 idx = etohs(rdat);
 
             if (idx > 0) {
                 //Get the number of subindexes of this PDO
                 uint8 subcnt = 0; rdl = sizeof(subcnt);
-                wkc = ec_SDOread(slave,idx, 0x00, FALSE, &rdl, &subcnt, EC_TIMEOUTRXM);
+                sdoWkc = ec_SDOread(slave,idx, 0x00, FALSE, &rdl, &subcnt, EC_TIMEOUTRXM);
                 //uint16 subidx = subcnt;
 
                 for (int subidx_loop = 1; subidx_loop <= subcnt; subidx_loop++) {
                     //Read the metadata for the PDO (mapped from SDO)
                     int32 rdat2 = 0; rdl = sizeof(rdat2);
-                    wkc = ec_SDOread(slave, idx, (uint8)subidx_loop, FALSE, &rdl, &rdat2, EC_TIMEOUTRXM);
+                    sdoWkc = ec_SDOread(slave, idx, (uint8)subidx_loop, FALSE, &rdl, &rdat2, EC_TIMEOUTRXM);
                     rdat2 = etohl(rdat2);
                     //Bitlen of SDO
                     uint8 bitlen = LO_BYTE(rdat2);
@@ -326,33 +618,22 @@ struct mappings_PDO* fill_mapping_list (uint16 slave, struct mappings_PDO* map_t
                         ODlist.Slave = slave;
                         ODlist.Index[0] = obj_idx;
                         OElist.Entries = 0;
-                        wkc = 0;
-                        wkc = ec_readOEsingle(0, obj_subidx, &ODlist, &OElist);
-
-                        //Add data to the linked list!
-                        map_tail->slaveIdx = slave;
-                        map_tail->idx      = obj_idx;
-                        map_tail->subidx   = obj_subidx;
-
-                        map_tail->offset   = abs_offset;
-                        map_tail->bitoff   = abs_bit;
-                        map_tail->bitlen   = bitlen;
-
-                        map_tail->dataType = OElist.DataType[obj_subidx];
-
-                        size_t nameSize    = sizeof(char)*( strnlen(OElist.Name[obj_subidx],EC_MAXNAME) + 1 );
-                        map_tail->name     = malloc(nameSize);
-                        memset (map_tail->name, 0, nameSize);
-                        strncpy(map_tail->name, OElist.Name[obj_subidx], nameSize);
-
-                        //Last entry is always blank (trimmed off at the end)
-                        map_tail->next = (struct mappings_PDO*) malloc(sizeof(struct mappings_PDO));
-                        map_tail = map_tail->next;
-                        memset(map_tail, 0, sizeof(struct mappings_PDO));
+                        sdoWkc = 0;
+                        sdoWkc = ec_readOEsingle(0, obj_subidx, &ODlist, &OElist);
+
+                        //Add data to the mappings!
+                        OElist.Name[obj_subidx][EC_MAXNAME] = '\0';
+                        if (!mappings_add(builder, slave, obj_idx, obj_subidx, abs_offset, abs_bit, bitlen,
+                                          OElist.DataType[obj_subidx], OElist.Name[obj_subidx])) {
+                            log_error("ERROR in fill_mapping_list(): out of memory for the PDO mappings of slave %d\n", slave);
+                            return 0;
+                        }
 
-                        printf("[0x%4.4X.%1d] %d 0x%4.4X:0x%2.2X 0x%2.2X %-12s %s\n",
-                               abs_offset, abs_bit, slave, obj_idx, obj_subidx, bitlen,
-                               dtype2string(OElist.DataType[obj_subidx], hstr, bufflen), OElist.Name[obj_subidx]);
+                        if (verbose) {
+                            log_info("[0x%4.4X.%1d] %d 0x%4.4X:0x%2.2X 0x%2.2X %-12s %s\n",
+                                     abs_offset, abs_bit, slave, obj_idx, obj_subidx, bitlen,
+                                     dtype2string(OElist.DataType[obj_subidx], hstr, bufflen), OElist.Name[obj_subidx]);
+                        }
                     }
                     bsize += bitlen;
                 }
@@ -361,11 +642,11 @@ struct mappings_PDO* fill_mapping_list (uint16 slave, struct mappings_PDO* map_t
     }
 
     if (bsize%8 != 0) {
-        printf("ERROR: bsize = %d of slave %d not divisible by 8.\n", bsize, slave);
-        return NULL;
+        log_error("ERROR: bsize = %d of slave %d not divisible by 8.\n", bsize, slave);
+        return 0;
     }
     //printf("\n");
-    return map_tail;
+    return 1;
 }
 
 int ecat_setup_mappings() {
@@ -374,84 +655,92 @@ int ecat_setup_mappings() {
     // Return: 1 if all OK, 0 in case of error
 
     // Note: IOmapLock is assumed to be grabbed by calling thread
-    // Note: This thread grabs the printf_lock. Any called functions should NOT grab this lock!
 
-    pthread_mutex_lock(&printf_lock);
+#ifdef ECD_STATIC_MAPPING
+    return staticmap_load(&mapping_out, &mapping_in); // Generated for this bus, see staticMapping.h
+#else
+    return ecat_buildMappings(&mapping_out, &mapping_in, 1);
+#endif
+}
 
-    mapping_out = (struct mappings_PDO*) malloc(sizeof(struct mappings_PDO));
-    struct mappings_PDO* mapping_out_tail = mapping_out;
-    memset(mapping_out, 0, sizeof(struct mappings_PDO));
+int ecat_buildMappings(struct mapping_arena** out, struct mapping_arena** in, int verbose) {
+    //Build new mappings by interrogating the PLC; used at startup and by 'rescan'.
+    // Does not touch any global state, so the cycle may continue meanwhile.
+    // The arenas are returned also on failure, and must be freed by the caller.
+    // Return: 1 if all OK, 0 in case of error
+
+    int sdoWkc = 0; // Work counter of the last mailbox transfer
+    int success = 0;
 
-    mapping_in = (struct mappings_PDO*) malloc(sizeof(struct mappings_PDO));
-    struct mappings_PDO* mapping_in_tail = mapping_in;
-    memset(mapping_in, 0, sizeof(struct mappings_PDO));
+    struct mapping_builder outputs;
+    struct mapping_builder inputs;
+    mappings_builderInit(&outputs);
+    mappings_builderInit(&inputs);
 
     for(uint16 slave = 1 ; slave <= ec_slavecount ; slave++) {
         if (!(ec_slave[slave].mbx_proto & ECT_MBXPROT_COE)) {
             // Slave didn't support the CoE mailbox protocol.
             // The coupler needs this, so we can't completely ignore it.
             // This code is is very close to SOEM/test/linux/slaveinfo/slaveinfo.c::si_map_sii()
-            printf("Found SII setup of slave %d; no action.\n", slave);
+            if (verbose) log_info("Found SII setup of slave %d; no action.\n", slave);
             if (ec_slave[slave].Obytes || ec_slave[slave].Ibytes) {
-                printf("ERROR in setup_mappings: slave %d is of type SII but not zero bytes.\n", slave);
-                return 0;
+                log_error("ERROR in setup_mappings: slave %d is of type SII but not zero bytes.\n", slave);
+                goto return_fail;
             }
         }
         else {
             // Slave supports CAN over Ethernet (CoE) mailbox protocol.
             // Get number of SyncManager PDOs for this slave
             // This code is is very close to SOEM/test/linux/slaveinfo/slaveinfo.c::si_map_sdo()
-            printf("Found CoE setup of slave %d; reading PDOs...\n", slave);
+            if (verbose) log_info("Found CoE setup of slave %d; reading PDOs...\n", slave);
 
             int nSM = 0;
             int rdl = sizeof(nSM);
-            wkc = ec_SDOread(slave, ECT_SDO_SMCOMMTYPE, 0x00, FALSE, &rdl, &nSM, EC_TIMEOUTRXM);
-            if ((wkc > 0) && (nSM > 2)) { // positive result from slave?
+            sdoWkc = ec_SDOread(slave, ECT_SDO_SMCOMMTYPE, 0x00, FALSE, &rdl, &nSM, EC_TIMEOUTRXM);
+            if ((sdoWkc > 0) && (nSM > 2)) { // positive result from slave?
                 if (nSM-1 > EC_MAXSM) {
-                    printf("ERROR: nSM=%d for slave %d > EC_MAXSM = %d.\n", nSM, slave, EC_MAXSM);
-                    printf("       This is not supported by daemon.c. \n");
+                    log_error("ERROR: nSM=%d for slave %d > EC_MAXSM = %d.\n", nSM, slave, EC_MAXSM);
+                    log_error("       This is not supported by daemon.c. \n");
                     goto return_fail;
                 }
                 for (int iSM = 2 ; iSM < nSM ; iSM++) { // Only SM 2/3 are actually interesting for process data
                     // Check the communication type for this SM
                     uint8 tSM = 0; rdl = sizeof(tSM);
-                    wkc = ec_SDOread(slave, ECT_SDO_SMCOMMTYPE, iSM+1, FALSE, &rdl, &tSM, EC_TIMEOUTRXM);
-                    if (wkc > 0) {
+                    sdoWkc = ec_SDOread(slave, ECT_SDO_SMCOMMTYPE, iSM+1, FALSE, &rdl, &tSM, EC_TIMEOUTRXM);
+                    if (sdoWkc > 0) {
                         if (iSM == 2) { // OUTPUTS
                             if (tSM != 3) {
-                                fprintf(stderr,"ERROR: Got tSM=%d for iSM=%d while scanning slave %d\n",tSM,iSM,slave);
-                                fprintf(stderr,"       This was not expected!\n");
+                                log_error("ERROR: Got tSM=%d for iSM=%d while scanning slave %d\n",tSM,iSM,slave);
+                                log_error("       This was not expected!\n");
                                 goto return_fail;
                             }
                             //Read the assigned RxPDO
                             size_t  IOmapoffset = (size_t)(ec_slave[slave].outputs - (uint8 *)&IOmap[0]);
-                            printf("OUTPUTS:\n");
-                            mapping_out_tail = fill_mapping_list(slave, mapping_out_tail, ECT_SDO_PDOASSIGN + iSM, IOmapoffset);
-                            if ( mapping_out_tail == NULL  ) {
-                                printf("ERROR: unexpected behaviour of slave, implementation assumption was violated");
+                            if (verbose) log_info("OUTPUTS:\n");
+                            if (!fill_mapping_list(slave, &outputs, ECT_SDO_PDOASSIGN + iSM, IOmapoffset, verbose)) {
+                                log_error("ERROR: unexpected behaviour of slave, implementation assumption was violated\n");
                                 goto return_fail;
                             }
 
                         }
                         else if (iSM == 3) { // INPUTS
                             if (tSM != 4) {
-                                fprintf(stderr,"ERROR: Got tSM=%d for iSM=%d while scanning slave %d\n",tSM,iSM,slave);
-                                fprintf(stderr,"       This was not expected!\n");
+                                log_error("ERROR: Got tSM=%d for iSM=%d while scanning slave %d\n",tSM,iSM,slave);
+                                log_error("       This was not expected!\n");
                                 goto return_fail;
                             }
                             //Read the assigned TxPDO
                             size_t  IOmapoffset = (size_t)(ec_slave[slave].inputs - (uint8 *)&IOmap[0]);
-                            printf("INPUTS:\n");
-                            mapping_in_tail = fill_mapping_list(slave, mapping_in_tail, ECT_SDO_PDOASSIGN + iSM, IOmapoffset);
-                            if ( mapping_in_tail == NULL ) {
-                                printf("ERROR: unexpected behaviour of slave, implementation assumption was violated");
+                            if (verbose) log_info("INPUTS:\n");
+                            if (!fill_mapping_list(slave, &inputs, ECT_SDO_PDOASSIGN + iSM, IOmapoffset, verbose)) {
+                                log_error("ERROR: unexpected behaviour of slave, implementation assumption was violated\n");
                                 goto return_fail;
                             }
 
                         }
                         else { // Should never happen...
-                            fprintf(stderr,"ERROR: Got iSM=%d (tSM=%d) while scanning slave %d\n",iSM, tSM, slave);
-                            fprintf(stderr,"       This was not expected!\n");
+                            log_error("ERROR: Got iSM=%d (tSM=%d) while scanning slave %d\n",iSM, tSM, slave);
+                            log_error("       This was not expected!\n");
                             goto return_fail;
                         }
                     }
@@ -462,104 +751,96 @@ int ecat_setup_mappings() {
         }
     }
 
-    pthread_mutex_unlock(&printf_lock);
-    return 1; //Success!
+    success = 1; //Success!
 
 return_fail:
-    pthread_mutex_unlock(&printf_lock);
-    return 0; // Failure
-
+    *out = mappings_finish(&outputs);
+    *in  = mappings_finish(&inputs);
+    if (*out == NULL || *in == NULL) {
+        log_error("ERROR: out of memory for the PDO mappings\n");
+        mappings_free(*out);
+        mappings_free(*in);
+        *out = NULL;
+        *in  = NULL;
+        return 0;
+    }
+    return success;
 }
-struct mappings_PDO* get_address(uint16 slaveID, uint16 idx, uint8 subidx, struct mappings_PDO* head){
-    //Function to extract the relevant link of a mappings_PDO list,
+struct mappings_PDO* get_address(uint16 slaveID, uint16 idx, uint8 subidx, struct mapping_arena* arena){
+    //Function to extract the relevant record of a mapping arena,
     // typically either mapping_out or mapping_in,
     // which contains data on where in the IOmap the PDO is located + metadata.
     //Returns NULL if not found.
 
-    struct mappings_PDO* current = NULL;
-
-    current = head;
-    do {
-        if (slaveID == current->slaveIdx &&
-            idx == current->idx          &&
-            subidx == current->subidx      )
-            return current;
-
-        current = current->next;
-
-    } while (current->bitlen > 0);
+    uint64 key = MAPPING_KEY(slaveID, idx, subidx);
+    for (int i = 0; i < arena->num; i++) { // Only the keys are touched while searching
+        if (arena->keys[i] == key) return &(arena->records[i]);
+    }
 
     return NULL; // Nothing was found.
 }
 
+int ecat_setupHooks() {
+    //Set up everything which post-processes the process data in ecat_cycleDone();
+    // shared by ecat_driver() and ecat_replay(). Returns 1 on success, 0 in case of error.
+    return decode_setup() && derived_setup() && stats_setup() && history_setup() && capture_setup() && metrics_resolvePDOs() && mcast_setup() && shm_setup() && agg_setup();
+}
+
 void ecat_driver(char* ifname) {
     int chk;
 
     //needlf = FALSE;
     inOP = FALSE;
 
+    log_setMayWait(1); // Startup prints a lot (all PDO mappings) and is not time critical
+
     if (pthread_mutex_init(&IOmap_lock, NULL) != 0) {
-        pthread_mutex_lock(&printf_lock);
-        perror("ERROR pthread_mutex_init has failed for IOmap_lock");
-        pthread_mutex_unlock(&printf_lock);
-        exit(1);
+        log_fatal("ERROR pthread_mutex_init has failed for IOmap_lock: %m\n");
     }
 
-    pthread_mutex_lock(&printf_lock);
-    printf("Starting driver...\n");
-    pthread_mutex_unlock(&printf_lock);
+    log_info("Starting driver...\n");
 
     /* initialise SOEM, bind socket to ifname */
     if (ec_init(ifname)) {
-        pthread_mutex_lock(&printf_lock);
-        printf("ec_init on %s succeeded.\n",ifname);
-        pthread_mutex_unlock(&printf_lock);
+        log_info("ec_init on %s succeeded.\n",ifname);
+
+        //Needs the privileges we are about to drop
+        if (config_file.nic_ring && !ring_setup(ecx_port.sockhandle, config_file.nic_busypoll)) {
+            log_exit(1);
+        }
+
+        if (!record_open() || !tslog_open()) {
+            log_exit(1);
+        }
 
         /*  Drop superuser privileges in correct order */
-        pthread_mutex_lock(&printf_lock);
-        printf("Dropping root privilegies...\n");
-        pthread_mutex_unlock(&printf_lock);
+        log_info("Dropping root privilegies...\n");
         if (setgid(config_file.dropPrivs_gid) == -1) {
-            pthread_mutex_lock(&printf_lock);
-            perror("Error during setgit()");
-            pthread_mutex_unlock(&printf_lock);
-            exit(1);
+            log_fatal("Error during setgit(): %m\n");
         }
         if (setuid(config_file.dropPrivs_uid) == -1) {
-            pthread_mutex_lock(&printf_lock);
-            perror("Error during setuid()");
-            pthread_mutex_unlock(&printf_lock);
-            exit(1);
+            log_fatal("Error during setuid(): %m\n");
         }
         //Unlock the rootprivs_lock; the TCP/IP server is now safe to start
         pthread_mutex_unlock(&rootprivs_lock);
 
-        pthread_mutex_lock(&printf_lock);
-        printf("Now running as '%s'.\n",config_file.dropPrivs_username);
-        pthread_mutex_unlock(&printf_lock);
+        log_info("Now running as '%s'.\n",config_file.dropPrivs_username);
 
 
         /* find and auto-config slaves */
-        pthread_mutex_lock(&IOmap_lock); // Grab this lock untill we've done initializing
+        locktrace_lock(&IOmap_lock, "startup"); // Grab this lock untill we've done initializing
         if ( ec_config_init(FALSE) > 0 ) {
-            pthread_mutex_lock(&printf_lock);
-            printf("%d slaves found and configured.\n",ec_slavecount);
-            pthread_mutex_unlock(&printf_lock);
+            log_info("%d slaves found and configured.\n",ec_slavecount);
 
             IOmap = malloc(config_file.iomap_size*sizeof(char));
             memset(IOmap,0,config_file.iomap_size); // Expected to be initialized on first ec_send_processdata()
 
             int iomap_size = ec_config_map(IOmap); // fills ec_slave and more.
-            pthread_mutex_lock(&printf_lock);
-            printf("Generated IOmap has size %d, configured iomap_size = %d\n",
-                    iomap_size, config_file.iomap_size);
+            log_info("Generated IOmap has size %d, configured iomap_size = %d\n",
+                     iomap_size, config_file.iomap_size);
             if (iomap_size > config_file.iomap_size) {
-                fprintf(stderr,
-                    "Error in setup_mapping(): generated IOmap size  > configured iomap_size\n");
-                pthread_mutex_unlock(&printf_lock);
-                exit(1);
+                log_fatal("Error in setup_mapping(): generated IOmap size  > configured iomap_size\n");
             }
-            pthread_mutex_unlock(&printf_lock);
 
             ec_configdc();
 
@@ -571,31 +852,27 @@ void ecat_driver(char* ifname) {
                             FALSE, numBytes, &(slaveInit_tail->value), EC_TIMEOUTSAFE);
                 slaveInit_tail = slaveInit_tail->next;
             }
-            pthread_mutex_lock(&printf_lock);
-            printf("Slaves mapped, state to SAFE_OP.\n");
-            pthread_mutex_unlock(&printf_lock);
+            log_info("Slaves mapped, state to SAFE_OP.\n");
             /* wait for all slaves to reach SAFE_OP state */
             ec_statecheck(0, EC_STATE_SAFE_OP,  EC_TIMEOUTSTATE * 4);
 
             //printf("segments : %d : %d %d %d %d\n",ec_group[0].nsegments ,ec_group[0].IOsegment[0],ec_group[0].IOsegment[1],ec_group[0].IOsegment[2],ec_group[0].IOsegment[3]);
 
-            pthread_mutex_lock(&printf_lock);
-            printf("\n");
-            printf("PDO mappings:\n");
-            pthread_mutex_unlock(&printf_lock);
+            log_info("PDO mappings:\n");
             if(!ecat_setup_mappings()) {
-                pthread_mutex_lock(&printf_lock);
-                fprintf(stderr, "Error in setup_mappings()\n");
-                pthread_mutex_unlock(&printf_lock);
-                exit(1);
+                log_fatal("Error in setup_mappings()\n");
+            }
+            if(!maptable_boot(1) || !ecat_setupHooks() || !wave_setup()) {
+                log_exit(1);
             }
 
-            pthread_mutex_lock(&printf_lock);
-            printf("\n");
-            printf("Request operational state for all slaves\n");
+            log_info("Request operational state for all slaves\n");
             expectedWKC = (ec_group[0].outputsWKC * 2) + ec_group[0].inputsWKC;
-            printf("Calculated workcounter %d\n", expectedWKC);
-            pthread_mutex_unlock(&printf_lock);
+            cycleStats.expectedWKC = expectedWKC;
+            log_info("Calculated workcounter %d\n", expectedWKC);
+            if(!record_setup(iomap_size, expectedWKC) || !tslog_setup()) {
+                log_exit(1);
+            }
             ec_slave[0].state = EC_STATE_OPERATIONAL;
             /* send one valid process data to make outputs in slaves happy*/
             ec_send_processdata();
@@ -612,113 +889,204 @@ void ecat_driver(char* ifname) {
             while (chk-- && (ec_slave[0].state != EC_STATE_OPERATIONAL));
 
             if (ec_slave[0].state == EC_STATE_OPERATIONAL ) {
-                pthread_mutex_lock(&printf_lock);
-                printf("Operational state reached for all slaves.\n");
-                printf("\n");
-                pthread_mutex_unlock(&printf_lock);
+                log_info("Operational state reached for all slaves.\n");
 
                 inOP = TRUE;
                 updating = TRUE;
-                pthread_mutex_unlock(&IOmap_lock);
+                locktrace_unlock(&IOmap_lock);
 
+                log_setMayWait(0); // The cycle must never wait for the logger
                 ecat_PLCdaemon(); // !!! HERE WE ARE IN OPERATION; WILL STAY IN THIS FUNCTION UNTIL QUITTING !!!
+                log_setMayWait(1);
+                record_shutdown();
+                tslog_shutdown();
 
                 inOP = FALSE;
             }
             else {
-                pthread_mutex_lock(&printf_lock);
-                printf("Not all slaves reached operational state.\n");
-                pthread_mutex_unlock(&printf_lock);
+                log_warn("Not all slaves reached operational state.\n");
 
                 ec_readstate();
-                pthread_mutex_lock(&printf_lock);
                 for(int i = 1; i<=ec_slavecount ; i++) {
                     if(ec_slave[i].state != EC_STATE_OPERATIONAL) {
-                        printf("Slave %d State=0x%2.2x StatusCode=0x%4.4x : %s\n",
-                               i, ec_slave[i].state, ec_slave[i].ALstatuscode, ec_ALstatuscode2string(ec_slave[i].ALstatuscode));
+                        log_warn("Slave %d State=0x%2.2x StatusCode=0x%4.4x : %s\n",
+                                 i, ec_slave[i].state, ec_slave[i].ALstatuscode, ec_ALstatuscode2string(ec_slave[i].ALstatuscode));
                     }
                 }
-                pthread_mutex_unlock(&printf_lock);
 
-                pthread_mutex_unlock(&IOmap_lock);
+                locktrace_unlock(&IOmap_lock);
 
             }
 
-            pthread_mutex_lock(&printf_lock);
-            printf("\nRequest init state for all slaves\n");
-            pthread_mutex_unlock(&printf_lock);
+            log_info("Request init state for all slaves\n");
 
-            pthread_mutex_lock(&IOmap_lock);
+            locktrace_lock(&IOmap_lock, "shutdown");
             ec_slave[0].state = EC_STATE_INIT;
             /* request INIT state for all slaves */
             ec_writestate(0);
-            pthread_mutex_unlock(&IOmap_lock);
+            locktrace_unlock(&IOmap_lock);
         }
         else {
-            pthread_mutex_unlock(&IOmap_lock);
+            locktrace_unlock(&IOmap_lock);
 
-            pthread_mutex_lock(&printf_lock);
-            printf("No slaves found!\n");
-            pthread_mutex_unlock(&printf_lock);
+            log_info("No slaves found!\n");
         }
 
         // stop SOEM, close socket
-        pthread_mutex_lock(&printf_lock);
-        printf("Closing SOEM socket...\n");
-        pthread_mutex_unlock(&printf_lock);
+        log_info("Closing SOEM socket...\n");
 
         ec_close();
     }
     else {
-        pthread_mutex_lock(&printf_lock);
-        printf("No socket connection on %s\nPlease excecute as root!\n",ifname);
-        pthread_mutex_unlock(&printf_lock);
+        log_error("No socket connection on %s\nPlease excecute as root!\n",ifname);
     }
 
     if (pthread_mutex_destroy(&IOmap_lock) != 0) {
-        perror("ERROR pthread_mutex_destroy has failed for IOmap_lock");
-        exit(1);
+        log_fatal("ERROR pthread_mutex_destroy has failed for IOmap_lock: %m\n");
     }
 }
 
+void ecat_replay(char* fileName, double speed) {
+    inOP = FALSE;
+
+    log_setMayWait(1);
+
+    if (pthread_mutex_init(&IOmap_lock, NULL) != 0) {
+        log_fatal("ERROR pthread_mutex_init has failed for IOmap_lock: %m\n");
+    }
+
+    log_info("Starting replay of '%s' at speed %g...\n", fileName, speed);
+
+    //A replay may be written to TSLOG_DIR, e.g. to convert a recording
+    if (!tslog_open()) {
+        log_exit(1);
+    }
+
+    //No raw socket is needed, but behave like ecat_driver() if started as root
+    if (geteuid() == 0) {
+        log_info("Dropping root privilegies...\n");
+        if (setgid(config_file.dropPrivs_gid) == -1) {
+            log_fatal("Error during setgit(): %m\n");
+        }
+        if (setuid(config_file.dropPrivs_uid) == -1) {
+            log_fatal("Error during setuid(): %m\n");
+        }
+        log_info("Now running as '%s'.\n",config_file.dropPrivs_username);
+    }
+    pthread_mutex_unlock(&rootprivs_lock);
+
+    locktrace_lock(&IOmap_lock, "startup");
+    expectedWKC = replay_open(fileName);
+    if (expectedWKC < 0) {
+        log_exit(1);
+    }
+    cycleStats.expectedWKC = expectedWKC;
+    if (!maptable_boot(0)) {
+        log_exit(1);
+    }
+    if (config_file.record_file != NULL) {
+        log_warn("WARNING: RECORD_FILE is ignored while replaying\n");
+    }
+    if(!ecat_setupHooks() || !tslog_setup()) {
+        log_exit(1);
+    }
+
+    int   imageSize = replay_iomapSize();
+    char* image     = malloc(imageSize);
+    struct record_cycle cycle;
+
+    inOP = TRUE;
+    updating = TRUE;
+    locktrace_unlock(&IOmap_lock);
+
+    log_setMayWait(0);
+    alloc_markOP();
+
+    //Replay loop; like ecat_PLCdaemon(), but the exchange is a copy from the file
+    int64 fileStart = 0;
+    int64 replayStart = monotonicTime_ns();
+    uint64 numCycles = 0;
+    while (!gotCtrlC && replay_next(&cycle, image)) {
+        if (numCycles == 0) fileStart = cycle.time_ns;
+        numCycles++;
+
+        //Keep the original timing, scaled by speed (speed <= 0: as fast as possible)
+        if (speed > 0) {
+            int64 target = replayStart + (int64)((cycle.time_ns - fileStart) / speed);
+            struct timespec ts;
+            ts.tv_sec  = target / 1000000000;
+            ts.tv_nsec = target % 1000000000;
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        }
+
+        int64 lockStart = monotonicTime_ns();
+        locktrace_lock(&IOmap_lock, "cycle");
+        int64 exchangeStart = monotonicTime_ns();
+        memcpy(IOmap, image, imageSize);
+        ec_DCtime = cycle.DCtime;
+        wkc = cycle.wkc;
+        int64 exchangeEnd = monotonicTime_ns();
+
+        ecat_cycleDone(lockStart, exchangeStart, exchangeEnd);
+    }
+
+    //Keep serving the last image until we are told to quit, like a bus which stopped updating
+    log_setMayWait(1);
+    log_info("Replay finished after %" PRIu64 " cycles\n", numCycles);
+    tslog_shutdown();
+    updating = FALSE;
+    while (!gotCtrlC) {
+        osal_usleep(PLC_waittime_checkAlive);
+    }
+    log_info("Caught a control+c signal, shutting down now.\n");
+
+    free(image);
+    replay_close();
+    inOP = FALSE;
+
+    if (pthread_mutex_destroy(&IOmap_lock) != 0) {
+        log_fatal("ERROR pthread_mutex_destroy has failed for IOmap_lock: %m\n");
+    }
+}
 
 //Function to check that all slaves are alive, and reinitialize them if needed.
 // Copied almost verbatim from SOEM/test/linux/simple_test/simple_test.c::ecatcheck()
 OSAL_THREAD_FUNC ecat_check( void *ptr ) {
     (void)ptr; // Not used, reference it to quiet down the compiler
+    alloc_setThread(ALLOC_WATCH);
 
     while(1) {
 
-        pthread_mutex_lock(&IOmap_lock);
+        locktrace_lock(&IOmap_lock, "check");
         if( inOP && ((wkc < expectedWKC) || ec_group[currentgroup].docheckstate)) {
 
             /* one ore more slaves are not responding */
             updating = FALSE;
             ec_group[currentgroup].docheckstate = FALSE;
+            health_beginCheck();
             ec_readstate();
             for (uint16 slave = 1; slave <= ec_slavecount; slave++) {
+                if (ec_slave[slave].group == currentgroup) health_observe(slave);
                 if ((ec_slave[slave].group == currentgroup) && (ec_slave[slave].state != EC_STATE_OPERATIONAL)) {
                       ec_group[currentgroup].docheckstate = TRUE;
                     if (ec_slave[slave].state == (EC_STATE_SAFE_OP + EC_STATE_ERROR)) {
-                        pthread_mutex_lock(&printf_lock);
-                        printf("ERROR : slave %d is in SAFE_OP + ERROR, attempting ack.\n", slave);
-                        pthread_mutex_unlock(&printf_lock);
+                        log_error("ERROR : slave %d is in SAFE_OP + ERROR, attempting ack.\n", slave);
                         ec_slave[slave].state = (EC_STATE_SAFE_OP + EC_STATE_ACK);
                         ec_writestate(slave);
+                        health_action(slave, HEALTH_ACK, 0);
                     }
                     else if(ec_slave[slave].state == EC_STATE_SAFE_OP) {
-                        pthread_mutex_lock(&printf_lock);
-                        printf("WARNING : slave %d is in SAFE_OP, change to OPERATIONAL.\n", slave);
-                        pthread_mutex_unlock(&printf_lock);
+                        log_warn("WARNING : slave %d is in SAFE_OP, change to OPERATIONAL.\n", slave);
                         ec_slave[slave].state = EC_STATE_OPERATIONAL;
                         ec_writestate(slave);
+                        health_action(slave, HEALTH_OPREQUEST, 0);
                     }
                       else if(ec_slave[slave].state > EC_STATE_NONE) {
-                        if (ec_reconfig_slave(slave, EC_TIMEOUTMON)) {
+                        int reconfigured = ec_reconfig_slave(slave, EC_TIMEOUTMON);
+                        health_action(slave, HEALTH_RECONFIG, reconfigured);
+                        if (reconfigured) {
                             ec_slave[slave].islost = FALSE;
-                            pthread_mutex_lock(&printf_lock);
-                            printf("MESSAGE : slave %d reconfigured\n",slave);
-                            pthread_mutex_unlock(&printf_lock);
+                            log_info("MESSAGE : slave %d reconfigured\n",slave);
                         }
                     }
                     else if(!ec_slave[slave].islost) {
@@ -726,37 +1094,36 @@ OSAL_THREAD_FUNC ecat_check( void *ptr ) {
                         ec_statecheck(slave, EC_STATE_OPERATIONAL, EC_TIMEOUTRET);
                         if (ec_slave[slave].state == EC_STATE_NONE) {
                             ec_slave[slave].islost = TRUE;
-                            pthread_mutex_lock(&printf_lock);
-                            printf("ERROR : slave %d lost\n",slave);
-                            pthread_mutex_unlock(&printf_lock);
+                            health_lost(slave);
+                            log_error("ERROR : slave %d lost\n",slave);
                         }
                     }
                 }
                 if (ec_slave[slave].islost) {
                       if(ec_slave[slave].state == EC_STATE_NONE) {
-                            if (ec_recover_slave(slave, EC_TIMEOUTMON)) {
+                            int recovered = ec_recover_slave(slave, EC_TIMEOUTMON);
+                            health_action(slave, HEALTH_RECOVER, recovered);
+                            if (recovered) {
                                 ec_slave[slave].islost = FALSE;
-                                pthread_mutex_lock(&printf_lock);
-                                printf("MESSAGE : slave %d recovered\n",slave);
-                                pthread_mutex_unlock(&printf_lock);
+                                log_info("MESSAGE : slave %d recovered\n",slave);
                         }
                     }
                     else {
                         ec_slave[slave].islost = FALSE;
-                        pthread_mutex_lock(&printf_lock);
-                        printf("MESSAGE : slave %d found\n",slave);
-                        pthread_mutex_unlock(&printf_lock);
+                        log_info("MESSAGE : slave %d found\n",slave);
                     }
                 }
             }
             if(!ec_group[currentgroup].docheckstate) {
-                pthread_mutex_lock(&printf_lock);
-                printf("OK : all slaves resumed OPERATIONAL.\n");
-                pthread_mutex_unlock(&printf_lock);
+                log_info("OK : all slaves resumed OPERATIONAL.\n");
                 updating = TRUE;
             }
+            health_endCheck(!ec_group[currentgroup].docheckstate);
+        }
+        else if (inOP) {
+            health_noCheck();
         }
-        pthread_mutex_unlock(&IOmap_lock);
+        locktrace_unlock(&IOmap_lock);
 
         osal_usleep(PLC_waittime_checkAlive);
     }
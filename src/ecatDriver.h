@@ -3,6 +3,8 @@
 
 #include "osal.h" //typedefs for uint8 etc.
 
+#include "mappingArena.h" // struct mappings_PDO
+
 // Configuration   ************************************************************************
 #ifndef EC_TIMEOUTMON // Allow setting from CMake
 #define EC_TIMEOUTMON 500
@@ -10,44 +12,72 @@
 
 #define PLC_waittime             5000 // How many us between each poll?
 #define PLC_waittime_checkAlive 10000
+#define PLC_deadline (PLC_waittime + PLC_waittime/2) // Cycle periods longer than this [us] count as overruns
 
 // Data types       ************************************************************************
 
-// Mapping between index:subindex to offsets into the global IOmap
-struct mappings_PDO {
-    //Static name of PDO
-    uint16 slaveIdx;
-    uint16 idx;
-    uint8  subidx;
-    //Pointer into IOmap
-    int offset;
-    int bitoff;
-    uint8 bitlen;
-    //Some metadata which may be useful
-    int    dataType;
-    char*  name;
-    //it's a linked list -> pointer to the next one
-    struct mappings_PDO* next;
+// Timing and error counters for the cyclic loop in ecat_PLCdaemon().
+// Written only by the cycle thread, protected by the seqlock in 'seq' (see seqlock.h),
+// so that readers never need to grab IOmap_lock. Use cycleStats_read() to get a consistent copy.
+struct cycle_stats {
+    volatile uint32 seq;
+
+    uint64 cycles;        // Number of completed process data exchanges
+    uint64 wkcErrors;     // Number of cycles where wkc < expectedWKC
+    uint64 overruns;      // Number of cycles where the period exceeded PLC_deadline
+    int64  lastOverrun_ns; // monotonicTime_ns() at the start of the last overrunning cycle (0: never)
+
+    int    lastWKC;
+    int    expectedWKC;
+    int64  DCtime;        // ec_DCtime after the last exchange
+
+    // Duration of ec_send_processdata() + ec_receive_processdata() [ns]
+    int64  lastExchange_ns;
+    int64  minExchange_ns;
+    int64  maxExchange_ns;
+    int64  sumExchange_ns;
+
+    // Time from start of one exchange to the start of the next [ns]
+    int64  lastPeriod_ns;
+    int64  maxPeriod_ns;
+
+    // Time spent waiting for IOmap_lock before the exchange [ns]
+    int64  lastLockWait_ns;
+    int64  maxLockWait_ns;
 };
 
 // Global data      ************************************************************************
 
 //The global IOmap into which all the process data is mapped
+extern char* IOmap;
 extern pthread_mutex_t IOmap_lock; //Lock for the IOmap;
 
 extern volatile boolean inOP;     // PLC is in mode OP
 extern volatile boolean updating; // IOmap is updating
 
-//Note about these linked lists: The last entry is always completely set to 0, acting similar to a "string terminator \0".
-// This lead to a less complex implementation than setting the last ->next==NULL.
-extern struct mappings_PDO* mapping_out; // Outputs, i.e. setting of voltages, actuators etc.
-extern struct mappings_PDO* mapping_in; // Inputs, i.e. reading of voltages, encoders, temperatures etc.
+extern struct cycle_stats cycleStats; // Written by the cycle thread only
+
+// Cycle number (as in cycleStats.cycles, once the cycle is done) of the data in the IOmap.
+// Protected by IOmap_lock.
+extern volatile uint64 imageCycle;
+
+//The mappings found at startup, see mappingArena.h
+extern struct mapping_arena* mapping_out; // Outputs, i.e. setting of voltages, actuators etc.
+extern struct mapping_arena* mapping_in; // Inputs, i.e. reading of voltages, encoders, temperatures etc.
 
 // Functions        ************************************************************************
 
 // Periodically synchronize the PLC and the IOmap. Runs in it's own thread
 void ecat_PLCdaemon();
 
+// Post-processing and statistics after each exchange, for ecat_PLCdaemon() and ecat_replay().
+// Called with IOmap_lock grabbed; releases it.
+void ecat_cycleDone(int64 lockStart, int64 exchangeStart, int64 exchangeEnd);
+
+// Set up the post-processing done by ecat_cycleDone(); must be called after the mappings are known.
+// Returns 1 on success, 0 in case of error.
+int ecat_setupHooks();
+
 // Convert an EtherCAT data type index to a string into the given buffer
 // Returns *hstr.
 char* dtype2string(uint16 dtype, char* hstr, int bufflen);
@@ -56,26 +86,58 @@ char* dtype2string(uint16 dtype, char* hstr, int bufflen);
 // Returns 1 on success, 0 on failure.
 int PDOval2string(struct mappings_PDO* mapping, char* buff, int bufflen);
 
+// Given a mapping into the IOmap, extract the data and convert it to a double.
+// Returns 1 on success, 0 on failure (unsupported type or alignment).
+// IOmap_lock is assumed to be grabbed by the caller.
+int PDOval2double(struct mappings_PDO* mapping, double* value);
+
+// The inverse of PDOval2double(), for writing outputs: encode a value as the raw (little endian)
+// bits of the PDO; integers are rounded to the nearest value.
+// Returns 1 on success, 0 if the value is out of range or NaN, or the type is unsupported.
+int double2PDOraw(struct mappings_PDO* mapping, double value, uint64* raw);
+
+// Store raw bits from double2PDOraw() into the IOmap, leaving any neighbouring bits alone.
+// IOmap_lock is assumed to be grabbed by the caller.
+void PDOrawWrite(struct mappings_PDO* mapping, uint64 raw);
+
+// Block until the cycle thread has completed numCycles more cycles, or timeout_ns has passed.
+// Returns the number of completed cycles (cycleStats.cycles), or 0 on timeout.
+// If stats is not NULL, it gets the cycleStats snapshot which the returned cycle number comes from.
+uint64 ecat_waitCycles(uint64 numCycles, int64 timeout_ns, struct cycle_stats* stats);
+
+// Get a consistent copy of cycleStats without grabbing IOmap_lock.
+void cycleStats_read(struct cycle_stats* copy);
+
 
 //Function to setup the mapping from slave/indx/subindx to memory address by interrogating the PLC.
 // It is assumed that we can find everything over CoE, i.e. the slaves supprt the mailbox protocol.
 // Return: 1 if all OK, 0 in case of error
 int ecat_setup_mappings();
-// Fill the linked lists mapping_out or mapping_in by interrogating the PLC
-// Helper function for ecat_setup_mappings().
-// Returns the current tail of the list, or NULL if there was an error
-struct mappings_PDO* fill_mapping_list (uint16 slave, struct mappings_PDO* map_tail, uint16 PDOassign, size_t IOmapoffset);
+// Build new mappings (outputs, inputs) by interrogating the PLC, without touching mapping_out/mapping_in
+// or any other global state; the cycle may continue meanwhile. Logs every PDO if verbose.
+// The arenas are returned also on failure (unless out of memory: NULL), and must be freed with mappings_free().
+// Return: 1 if all OK, 0 in case of error
+int ecat_buildMappings(struct mapping_arena** out, struct mapping_arena** in, int verbose);
+// Add the PDOs of one SM to the mappings by interrogating the PLC
+// Helper function for ecat_buildMappings().
+// Returns 1 if all OK, 0 if there was an error
+int fill_mapping_list (uint16 slave, struct mapping_builder* builder, uint16 PDOassign, size_t IOmapoffset, int verbose);
 
-//Function to extract the relevant link of a mappings_PDO list,
+//Function to extract the relevant record of a mapping arena,
 // typically either mapping_out or mapping_in,
 // which contains data on where in the IOmap the PDO is located + metadata.
 //Returns NULL if not found.
-struct mappings_PDO* get_address(uint16 slaveID, uint16 idx, uint8 subidx, struct mappings_PDO* head);
+struct mappings_PDO* get_address(uint16 slaveID, uint16 idx, uint8 subidx, struct mapping_arena* arena);
 
 //Initialize the EtherCAT PLC, setup the mappings, and start the daemon.
 // Runs in it's own thread.
 void ecat_driver(char* ifname);
 
+//Instead of a bus, replay a recording made with RECORD_FILE,
+// at the original speed multiplied by 'speed' (<= 0: as fast as possible).
+// Clients see the same as with ecat_driver(). Runs in it's own thread.
+void ecat_replay(char* fileName, double speed);
+
 //Function to check that all slaves are alive, and reinitialize them if needed.
 // Runs in it's own thread.
 OSAL_THREAD_FUNC ecat_check( void *ptr );
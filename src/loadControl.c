@@ -0,0 +1,89 @@
+#include "loadControl.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <pthread.h>
+
+#include "EtherCatDaemon.h"
+#include "ecatDriver.h"
+
+// File-global data ************************************************************************
+
+// Shared budget for expensive commands
+pthread_mutex_t load_lock = PTHREAD_MUTEX_INITIALIZER;
+struct token_bucket load_expensiveBucket = {0.0, 0};
+
+struct load_counters load_counts = {0, 0, 0, 0};
+
+// Functions        ************************************************************************
+
+void load_refill(struct token_bucket* bucket, int rate, int burst, int64 now) {
+    //Helper function; add the tokens accumulated since the last refill
+    if (bucket->lastRefill_ns == 0) {
+        bucket->tokens = burst;
+    }
+    else {
+        bucket->tokens += (now - bucket->lastRefill_ns) * 1e-9 * rate;
+        if (bucket->tokens > burst) bucket->tokens = burst;
+    }
+    bucket->lastRefill_ns = now;
+}
+
+int load_shedding() {
+    if (config_file.shed_holdoff == 0) return 0;
+
+    struct cycle_stats stats;
+    cycleStats_read(&stats);
+    return stats.lastOverrun_ns != 0 &&
+           monotonicTime_ns() - stats.lastOverrun_ns < config_file.shed_holdoff*1000000LL;
+}
+
+enum load_verdict load_admit(struct token_bucket* bucket, int expensive) {
+    //Per-client limit; the bucket belongs to the calling thread, so no lock is needed
+    if (config_file.client_rate > 0) {
+        load_refill(bucket, config_file.client_rate, config_file.client_burst, monotonicTime_ns());
+        if (bucket->tokens < 1.0) {
+            int64 wait_us = (1.0 - bucket->tokens) * 1e6 / config_file.client_rate + 1;
+            if (wait_us > LOAD_MAXDEFER) {
+                __atomic_add_fetch(&load_counts.rateLimited, 1, __ATOMIC_RELAXED);
+                return LOAD_RATELIMITED;
+            }
+            __atomic_add_fetch(&load_counts.deferred, 1, __ATOMIC_RELAXED);
+            usleep(wait_us);
+            load_refill(bucket, config_file.client_rate, config_file.client_burst, monotonicTime_ns());
+        }
+        bucket->tokens -= 1.0;
+    }
+
+    if (!expensive) return LOAD_OK;
+
+    if (load_shedding()) {
+        __atomic_add_fetch(&load_counts.shed, 1, __ATOMIC_RELAXED);
+        return LOAD_SHED;
+    }
+
+    if (config_file.expensive_rate > 0) {
+        pthread_mutex_lock(&load_lock);
+        load_refill(&load_expensiveBucket, config_file.expensive_rate, config_file.expensive_burst,
+                    monotonicTime_ns());
+        int gotToken = load_expensiveBucket.tokens >= 1.0;
+        if (gotToken) load_expensiveBucket.tokens -= 1.0;
+        pthread_mutex_unlock(&load_lock);
+
+        if (!gotToken) {
+            __atomic_add_fetch(&load_counts.overBudget, 1, __ATOMIC_RELAXED);
+            return LOAD_BUDGET;
+        }
+    }
+
+    return LOAD_OK;
+}
+
+void load_getCounters(struct load_counters* copy) {
+    copy->deferred    = __atomic_load_n(&load_counts.deferred,    __ATOMIC_RELAXED);
+    copy->rateLimited = __atomic_load_n(&load_counts.rateLimited, __ATOMIC_RELAXED);
+    copy->overBudget  = __atomic_load_n(&load_counts.overBudget,  __ATOMIC_RELAXED);
+    copy->shed        = __atomic_load_n(&load_counts.shed,        __ATOMIC_RELAXED);
+}
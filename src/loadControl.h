@@ -0,0 +1,52 @@
+#ifndef loadControl_h
+#define loadControl_h
+
+#include "osal.h" //typedefs for uint8 etc.
+
+// Admission control for the commands of the line protocol clients, so that no client can
+// starve the others or the bus cycle (e.g. by sending 'dump' in a tight loop):
+//  - Every connection has a token bucket (CLIENT_RATE); when it is empty, the command is
+//    deferred until a token is available, or rejected if that would take longer than LOAD_MAXDEFER.
+//  - Expensive commands (which hold IOmap_lock or send many records) also take a token from
+//    a bucket shared by all clients (EXPENSIVE_RATE); when it is empty, they are rejected.
+//  - While the bus cycle is missing its deadline (cycleStats.overruns increased within the
+//    last SHED_HOLDOFF ms), expensive commands are rejected (shed).
+
+// Configuration    ************************************************************************
+#define LOAD_MAXDEFER 1000000 // Longest a command is deferred waiting for a token [us]
+
+// Data types       ************************************************************************
+
+struct token_bucket {
+    double tokens;
+    int64  lastRefill_ns; // 0: never used, starts full
+};
+
+enum load_verdict {
+    LOAD_OK,          // Go ahead (possibly after being deferred)
+    LOAD_RATELIMITED, // The client's own bucket is empty
+    LOAD_BUDGET,      // The shared budget for expensive commands is used up
+    LOAD_SHED         // The bus cycle is missing its deadline
+};
+
+// Counters, for metrics. Only incremented.
+struct load_counters {
+    uint64 deferred;
+    uint64 rateLimited;
+    uint64 overBudget;
+    uint64 shed;
+};
+
+// Functions        ************************************************************************
+
+// Decide whether a client may run a command now; may sleep (up to LOAD_MAXDEFER) if the
+// client's bucket is empty. 'bucket' belongs to the calling connection; all-zero when new.
+enum load_verdict load_admit(struct token_bucket* bucket, int expensive);
+
+// Whether the bus cycle is currently considered overloaded (see SHED_HOLDOFF).
+int load_shedding();
+
+// Get a copy of the counters.
+void load_getCounters(struct load_counters* copy);
+
+#endif
@@ -0,0 +1,180 @@
+#include "lockTrace.h"
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include "EtherCatDaemon.h"
+#include "networkServer.h"
+
+#ifdef ECD_LOCKTRACE
+
+// File-global data ************************************************************************
+
+// Registered call sites, newest first; only ever pushed to
+struct locktrace_site* volatile locktrace_sites = NULL;
+
+// Who holds each traced mutex; written by the holder only
+struct locktrace_holder {
+    pthread_mutex_t* volatile mutex; // NULL: unused slot
+    struct locktrace_site* site;
+    int64 acquired_ns;
+};
+struct locktrace_holder locktrace_holders[LOCKTRACE_MAXLOCKS];
+
+// Functions        ************************************************************************
+
+struct locktrace_holder* locktrace_getHolder(pthread_mutex_t* mutex) {
+    //Helper function; find the slot of a mutex, claiming a new one the first time
+    for (int i = 0; i < LOCKTRACE_MAXLOCKS; i++) {
+        pthread_mutex_t* m = __atomic_load_n(&(locktrace_holders[i].mutex), __ATOMIC_ACQUIRE);
+        if (m == mutex) return &(locktrace_holders[i]);
+        if (m == NULL) {
+            pthread_mutex_t* expected = NULL;
+            if (__atomic_compare_exchange_n(&(locktrace_holders[i].mutex), &expected, mutex, 0,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) || expected == mutex) {
+                return &(locktrace_holders[i]);
+            }
+        }
+    }
+    return NULL; // More than LOCKTRACE_MAXLOCKS mutexes; not traced
+}
+
+void locktrace_record(struct locktrace_hist* hist, int64 duration_ns) {
+    //Helper function; called by the holder of the lock
+    if (duration_ns < 0) duration_ns = 0;
+    int bucket = 0;
+    if (duration_ns >= (1LL << LOCKTRACE_MINBITS)) {
+        bucket = 63 - __builtin_clzll((uint64)duration_ns) - LOCKTRACE_MINBITS + 1;
+        if (bucket >= LOCKTRACE_BUCKETS) bucket = LOCKTRACE_BUCKETS-1;
+    }
+    hist->count++;
+    hist->sum_ns += duration_ns;
+    if ((uint64)duration_ns > hist->max_ns) hist->max_ns = duration_ns;
+    hist->buckets[bucket]++;
+}
+
+void locktrace_lockSite(pthread_mutex_t* mutex, struct locktrace_site* site) {
+    int64 start = monotonicTime_ns();
+    pthread_mutex_lock(mutex);
+    int64 acquired = monotonicTime_ns();
+
+    if (!site->registered) {
+        //Only one thread can get here at a time for a given site, since it holds the mutex
+        site->registered = 1;
+        struct locktrace_site* head = __atomic_load_n(&locktrace_sites, __ATOMIC_RELAXED);
+        do {
+            site->next = head;
+        } while (!__atomic_compare_exchange_n(&locktrace_sites, &head, site, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+    }
+    locktrace_record(&(site->wait), acquired - start);
+
+    struct locktrace_holder* holder = locktrace_getHolder(mutex);
+    if (holder != NULL) {
+        holder->site        = site;
+        holder->acquired_ns = acquired;
+    }
+}
+
+void locktrace_unlockSite(pthread_mutex_t* mutex) {
+    struct locktrace_holder* holder = locktrace_getHolder(mutex);
+    if (holder != NULL && holder->site != NULL) {
+        locktrace_record(&(holder->site->hold), monotonicTime_ns() - holder->acquired_ns);
+        holder->site = NULL;
+    }
+    pthread_mutex_unlock(mutex);
+}
+
+double locktrace_percentile(const struct locktrace_hist* hist, double fraction) {
+    //Helper function; upper edge of the bucket holding the given fraction of the events, at most the max [us]
+    if (hist->count == 0) return 0.0;
+    uint64 target = (uint64)(fraction * hist->count);
+    if (target >= hist->count) target = hist->count-1;
+    uint64 seen = 0;
+    for (int i = 0; i < LOCKTRACE_BUCKETS-1; i++) {
+        seen += hist->buckets[i];
+        if (seen > target) {
+            uint64 edge = 1ULL << (i + LOCKTRACE_MINBITS);
+            return (edge < hist->max_ns ? edge : hist->max_ns) * 1e-3;
+        }
+    }
+    return hist->max_ns * 1e-3;
+}
+
+const char* locktrace_baseName(const char* path) {
+    //Helper function; file name without the directories
+    const char* slash = strrchr(path, '/');
+    return slash != NULL ? slash+1 : path;
+}
+
+int locktrace_describe(int connfd) {
+    char buff_out[BUFFLEN];
+    memset(buff_out, 0, BUFFLEN);
+
+    for (struct locktrace_site* site = __atomic_load_n(&locktrace_sites, __ATOMIC_ACQUIRE);
+         site != NULL; site = site->next) {
+        struct locktrace_hist wait = site->wait;
+        struct locktrace_hist hold = site->hold;
+        snprintf(buff_out, BUFFLEN, "  lock %s site %s at %s:%d count %" PRIu64
+                 " waitP50 %.1f waitP99 %.1f waitMax %.1f waitMean %.2f"
+                 " holdP50 %.1f holdP99 %.1f holdMax %.1f holdMean %.2f\n",
+                 site->lock[0] == '&' ? site->lock+1 : site->lock, site->name,
+                 locktrace_baseName(site->file), site->line, wait.count,
+                 locktrace_percentile(&wait, 0.5), locktrace_percentile(&wait, 0.99), wait.max_ns*1e-3,
+                 wait.count > 0 ? wait.sum_ns*1e-3/wait.count : 0.0,
+                 locktrace_percentile(&hold, 0.5), locktrace_percentile(&hold, 0.99), hold.max_ns*1e-3,
+                 hold.count > 0 ? hold.sum_ns*1e-3/hold.count : 0.0);
+        write(connfd, buff_out, BUFFLEN);
+        memset(buff_out, 0, BUFFLEN);
+    }
+    return 1;
+}
+
+void locktrace_reset() {
+    for (struct locktrace_site* site = __atomic_load_n(&locktrace_sites, __ATOMIC_ACQUIRE);
+         site != NULL; site = site->next) {
+        memset(&(site->wait), 0, sizeof(struct locktrace_hist));
+        memset(&(site->hold), 0, sizeof(struct locktrace_hist));
+    }
+}
+
+void locktrace_dump(FILE* stream) {
+    fprintf(stream, "Lock trace (times in us; each row counts the events up to that time):\n");
+    for (struct locktrace_site* site = __atomic_load_n(&locktrace_sites, __ATOMIC_ACQUIRE);
+         site != NULL; site = site->next) {
+        fprintf(stream, "  %s, site %s at %s:%d: %" PRIu64 " times, wait mean %.2f max %.1f, hold mean %.2f max %.1f\n",
+                site->lock[0] == '&' ? site->lock+1 : site->lock, site->name,
+                locktrace_baseName(site->file), site->line, site->wait.count,
+                site->wait.count > 0 ? site->wait.sum_ns*1e-3/site->wait.count : 0.0, site->wait.max_ns*1e-3,
+                site->hold.count > 0 ? site->hold.sum_ns*1e-3/site->hold.count : 0.0, site->hold.max_ns*1e-3);
+        for (int i = 0; i < LOCKTRACE_BUCKETS; i++) {
+            if (site->wait.buckets[i] == 0 && site->hold.buckets[i] == 0) continue;
+            if (i < LOCKTRACE_BUCKETS-1) {
+                fprintf(stream, "    <%10.3f  wait %10" PRIu64 "  hold %10" PRIu64 "\n",
+                        (1LL << (i + LOCKTRACE_MINBITS)) * 1e-3, site->wait.buckets[i], site->hold.buckets[i]);
+            }
+            else {
+                fprintf(stream, "    longer       wait %10" PRIu64 "  hold %10" PRIu64 "\n",
+                        site->wait.buckets[i], site->hold.buckets[i]);
+            }
+        }
+    }
+}
+
+#else
+
+int locktrace_describe(int connfd) {
+    (void)connfd;
+    return 0;
+}
+
+void locktrace_reset() {
+}
+
+void locktrace_dump(FILE* stream) {
+    (void)stream;
+}
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef lockTrace_h
+#define lockTrace_h
+
+#include <stdio.h>
+#include <pthread.h>
+
+#include "osal.h" //typedefs for uint8 etc.
+
+// Wait and hold time histograms of IOmap_lock and the logger's drain lock, per call site, to
+// find out whether lock contention is behind the cycle jitter.
+// Only the instrumented build traces (cmake -DECD_LOCKTRACE=ON); otherwise locktrace_lock()
+// and locktrace_unlock() are plain pthread_mutex_lock() and pthread_mutex_unlock().
+// Every call site of locktrace_lock() has its own static record, registered the first time it is
+// used; the hold time is attributed to the site which grabbed the lock. The records are only
+// written by the thread holding the lock, and read without it, so a reading may be a few
+// events behind.
+// Read with 'locks' (and reset with 'locks reset'); printed in full when the daemon exits.
+
+// Configuration    ************************************************************************
+#define LOCKTRACE_BUCKETS  24 // Histogram buckets, powers of 2 from LOCKTRACE_MINBITS
+#define LOCKTRACE_MINBITS  7  // Upper edge of the first bucket is 2^7 ns = 128 ns
+#define LOCKTRACE_MAXLOCKS 8  // Distinct mutexes traced
+
+// Data types       ************************************************************************
+
+struct locktrace_hist {
+    uint64 count;
+    uint64 sum_ns;
+    uint64 max_ns;
+    uint64 buckets[LOCKTRACE_BUCKETS]; // Last bucket: everything longer
+};
+
+struct locktrace_site {
+    const char* lock;      // Expression of the mutex, e.g. "&IOmap_lock"
+    const char* name;      // Call site, e.g. "get"
+    const char* file;
+    int         line;
+    volatile int registered;
+    struct locktrace_site* next;
+
+    struct locktrace_hist wait;
+    struct locktrace_hist hold;
+};
+
+// Functions        ************************************************************************
+
+#ifdef ECD_LOCKTRACE
+
+#define locktrace_lock(mutex, siteName) do { \
+        static struct locktrace_site locktrace_site_ = \
+            {.lock = #mutex, .name = siteName, .file = __FILE__, .line = __LINE__}; \
+        locktrace_lockSite((mutex), &locktrace_site_); \
+    } while (0)
+#define locktrace_unlock(mutex) locktrace_unlockSite(mutex)
+
+void locktrace_lockSite(pthread_mutex_t* mutex, struct locktrace_site* site);
+void locktrace_unlockSite(pthread_mutex_t* mutex);
+
+#else
+
+#define locktrace_lock(mutex, siteName) pthread_mutex_lock(mutex)
+#define locktrace_unlock(mutex)         pthread_mutex_unlock(mutex)
+
+#endif
+
+// Write one line per call site to connfd, as BUFFLEN records for the line protocol.
+// Returns 1, or 0 if this is not an instrumented build.
+int locktrace_describe(int connfd);
+
+// Clear all histograms (not synchronized with the lock holders; a few events may survive).
+void locktrace_reset();
+
+// Print all histograms, e.g. at exit. Does nothing if this is not an instrumented build.
+void locktrace_dump(FILE* stream);
+
+#endif
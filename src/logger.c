@@ -0,0 +1,231 @@
+#include "logger.h"
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <pthread.h>
+
+#include "EtherCatDaemon.h"
+#include "allocStats.h"
+#include "lockTrace.h"
+
+// Global data      ************************************************************************
+
+int log_level = LOG_LEVEL_INFO;
+
+// File-global data ************************************************************************
+
+struct log_ring log_rings[LOG_MAXRINGS];
+uint64 log_droppedNoRing = 0; // Messages dropped because all rings were taken
+
+__thread struct log_ring* log_myRing = NULL; // The ring of the calling thread, once claimed
+__thread int log_mayWait = 0;                // See log_setMayWait()
+pthread_key_t  log_ringKey;                  // Releases the ring when the thread exits
+pthread_once_t log_initOnce = PTHREAD_ONCE_INIT;
+
+int64 log_startTime_ns = 0;
+
+// Consumer side only; serializes the drain thread and log_shutdown()
+pthread_mutex_t log_drainLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_t log_drainThread;
+volatile int log_running = 0;
+uint64 log_droppedReported = 0;
+volatile int log_exiting = 0; // Set by the first log_fatal(); the others must not exit() again
+
+const char* log_levelNames[] = {"ERROR", "WARN", "INFO", "DEBUG"};
+
+// Functions        ************************************************************************
+
+void log_releaseRing(void* ring) {
+    //Called when the owning thread exits; the drain thread still prints whatever is left
+    __atomic_store_n(&(((struct log_ring*) ring)->owned), 0, __ATOMIC_RELEASE);
+}
+
+void log_init() {
+    //Runs once, on the first log_msg() or log_setup(), whichever comes first
+    memset(log_rings, 0, sizeof(log_rings));
+    pthread_key_create(&log_ringKey, log_releaseRing);
+    log_startTime_ns = monotonicTime_ns();
+}
+
+struct log_ring* log_claimRing() {
+    pthread_once(&log_initOnce, log_init);
+
+    for (int i = 0; i < LOG_MAXRINGS; i++) {
+        uint32 expected = 0;
+        if (__atomic_compare_exchange_n(&(log_rings[i].owned), &expected, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            pthread_setspecific(log_ringKey, &(log_rings[i]));
+            log_myRing = &(log_rings[i]);
+            return log_myRing;
+        }
+    }
+    return NULL;
+}
+
+void log_vmsg(enum log_level level, const char* format, va_list args) {
+    //Helper function for log_msg() and log_fatal()
+    if ((int)level > log_level) return;
+    int savedErrno = errno; // Keep it for '%m'
+
+    struct log_ring* ring = log_myRing;
+    if (ring == NULL) {
+        ring = log_claimRing();
+        if (ring == NULL) {
+            __atomic_add_fetch(&log_droppedNoRing, 1, __ATOMIC_RELAXED);
+            return;
+        }
+    }
+
+    uint32 head = ring->head;
+    uint32 tail = __atomic_load_n(&(ring->tail), __ATOMIC_ACQUIRE);
+    while (log_mayWait && log_running && head - tail >= LOG_RINGSIZE) {
+        usleep(LOG_DRAINTIME/10);
+        tail = __atomic_load_n(&(ring->tail), __ATOMIC_ACQUIRE);
+    }
+    if (head - tail >= LOG_RINGSIZE) {
+        __atomic_store_n(&(ring->dropped), ring->dropped + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    struct log_entry* entry = &(ring->entries[head & (LOG_RINGSIZE-1)]);
+    entry->time_ns = monotonicTime_ns();
+    entry->level   = level;
+
+    errno = savedErrno;
+    vsnprintf(entry->msg, LOG_MSGLEN, format, args);
+
+    __atomic_store_n(&(ring->head), head + 1, __ATOMIC_RELEASE);
+    errno = savedErrno;
+}
+
+void log_msg(enum log_level level, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    log_vmsg(level, format, args);
+    va_end(args);
+}
+
+void log_setMayWait(int mayWait) {
+    log_mayWait = mayWait;
+}
+
+uint64 log_droppedTotal() {
+    uint64 dropped = __atomic_load_n(&log_droppedNoRing, __ATOMIC_RELAXED);
+    for (int i = 0; i < LOG_MAXRINGS; i++) {
+        dropped += __atomic_load_n(&(log_rings[i].dropped), __ATOMIC_RELAXED);
+    }
+    return dropped;
+}
+
+void log_print(int64 time_ns, int level, const char* msg) {
+    //Helper function for log_drain(); one line per message, whether or not it ends with '\n'
+    FILE* stream = level == LOG_LEVEL_ERROR ? stderr : stdout;
+
+    int msgLen = strnlen(msg, LOG_MSGLEN);
+    while (msgLen > 0 && msg[msgLen-1] == '\n') msgLen--;
+
+    fprintf(stream, "[%12.6f] %-5s %.*s\n",
+            (time_ns - log_startTime_ns)/1e9, log_levelNames[level], msgLen, msg);
+}
+
+int log_drain() {
+    //Print all pending messages, oldest first. Returns the number of messages printed.
+    int numPrinted = 0;
+
+    locktrace_lock(&log_drainLock, "drain");
+    while (1) {
+        //Find the oldest message at the tail of any ring
+        struct log_ring*  oldestRing  = NULL;
+        struct log_entry* oldestEntry = NULL;
+        for (int i = 0; i < LOG_MAXRINGS; i++) {
+            struct log_ring* ring = &(log_rings[i]);
+            uint32 tail = ring->tail;
+            if (__atomic_load_n(&(ring->head), __ATOMIC_ACQUIRE) == tail) continue;
+
+            struct log_entry* entry = &(ring->entries[tail & (LOG_RINGSIZE-1)]);
+            if (oldestEntry == NULL || entry->time_ns < oldestEntry->time_ns) {
+                oldestRing  = ring;
+                oldestEntry = entry;
+            }
+        }
+        if (oldestRing == NULL) break;
+
+        log_print(oldestEntry->time_ns, oldestEntry->level, oldestEntry->msg);
+        __atomic_store_n(&(oldestRing->tail), oldestRing->tail + 1, __ATOMIC_RELEASE);
+        numPrinted++;
+    }
+
+    uint64 dropped = log_droppedTotal();
+    if (dropped > log_droppedReported) {
+        char msg[LOG_MSGLEN];
+        snprintf(msg, LOG_MSGLEN, "logger dropped %" PRIu64 " messages (%" PRIu64 " in total)",
+                 dropped - log_droppedReported, dropped);
+        log_print(monotonicTime_ns(), LOG_LEVEL_WARN, msg);
+        log_droppedReported = dropped;
+        numPrinted++;
+    }
+
+    if (numPrinted > 0) {
+        fflush(stdout);
+        fflush(stderr);
+    }
+    locktrace_unlock(&log_drainLock);
+
+    return numPrinted;
+}
+
+void* log_drainLoop(void* arg) {
+    (void)arg; // Not used
+    alloc_setThread(ALLOC_LOGGER);
+    while (log_running) {
+        if (log_drain() == 0) {
+            usleep(LOG_DRAINTIME);
+        }
+    }
+    return NULL;
+}
+
+void log_setup() {
+    pthread_once(&log_initOnce, log_init);
+
+    log_running = 1;
+    if (pthread_create(&log_drainThread, NULL, log_drainLoop, NULL) != 0) {
+        perror("ERROR pthread_create has failed for the logger");
+        exit(1);
+    }
+    atexit(log_shutdown);
+}
+
+void log_shutdown() {
+    if (log_running) {
+        log_running = 0;
+        pthread_join(log_drainThread, NULL);
+    }
+    log_drain();
+}
+
+void log_fatal(const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    log_mayWait = 1;
+    log_vmsg(LOG_LEVEL_ERROR, format, args);
+    va_end(args);
+
+    log_exit(1);
+}
+
+void log_exit(int status) {
+    //Print everything now, whatever the drain thread is doing; then exit() from one thread only,
+    // since exit() runs the atexit() handlers and is not thread safe
+    log_drain();
+    if (__atomic_exchange_n(&log_exiting, 1, __ATOMIC_ACQ_REL)) {
+        while (1) pause();
+    }
+    exit(status);
+}
@@ -0,0 +1,78 @@
+#ifndef logger_h
+#define logger_h
+
+#include "osal.h" //typedefs for uint8 etc.
+
+// Asynchronous logger.
+// Every thread which logs gets its own single-producer/single-consumer ring of fixed-size messages;
+// log_msg() only formats into the ring and never blocks, takes a lock or does I/O.
+// A background thread drains all rings in timestamp order to stdout (errors to stderr).
+// If a ring is full, the message is dropped and counted; the drain thread reports the drops.
+// Threads which are not time critical (e.g. during startup) can call log_setMayWait(1)
+// to wait for space instead.
+
+// Configuration    ************************************************************************
+#define LOG_MAXRINGS   64    // Max number of threads logging at the same time (>= NUMIPSERVERS + a few)
+#define LOG_RINGSIZE   256   // Messages per ring; must be a power of 2
+#define LOG_MSGLEN     240   // Max length of one message, longer ones are truncated
+#define LOG_DRAINTIME  10000 // How long the drain thread sleeps when all rings are empty [us]
+
+// Data types       ************************************************************************
+
+enum log_level {
+    LOG_LEVEL_ERROR,
+    LOG_LEVEL_WARN,
+    LOG_LEVEL_INFO,
+    LOG_LEVEL_DEBUG
+};
+
+struct log_entry {
+    int64 time_ns; // monotonicTime_ns() when logged
+    uint8 level;   // enum log_level
+    char  msg[LOG_MSGLEN];
+};
+
+struct log_ring {
+    volatile uint32 owned;   // 1 if claimed by a thread
+    volatile uint32 head;    // Next entry to write; written by the owning thread only
+    volatile uint32 tail;    // Next entry to read; written by the drain thread only
+    volatile uint64 dropped; // Messages dropped because the ring was full
+    struct log_entry entries[LOG_RINGSIZE];
+};
+
+// Global data      ************************************************************************
+
+// Messages above this level are discarded (LOG_LEVEL in the config file)
+extern int log_level;
+
+// Functions        ************************************************************************
+
+// Start the drain thread. Before this, nothing is printed.
+void log_setup();
+
+// Log a message (printf format). Never blocks unless log_setMayWait(1); safe to call with IOmap_lock grabbed.
+void log_msg(enum log_level level, const char* format, ...) __attribute__((format(printf, 2, 3)));
+
+// Allow (1) or forbid (0, the default) the calling thread to wait for space in its ring.
+void log_setMayWait(int mayWait);
+
+// Log an error, print everything pending synchronously, and exit(1). Safe to call from any thread,
+// also from several at the same time: only the first one exits, the others never return either.
+void log_fatal(const char* format, ...) __attribute__((format(printf, 1, 2), noreturn));
+
+// Like log_fatal(), for errors which have been logged already, e.g. by a setup function.
+void log_exit(int status) __attribute__((noreturn));
+
+#define log_error(...) log_msg(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_warn(...)  log_msg(LOG_LEVEL_WARN,  __VA_ARGS__)
+#define log_info(...)  log_msg(LOG_LEVEL_INFO,  __VA_ARGS__)
+#define log_debug(...) log_msg(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+// Print everything still in the rings and stop the drain thread.
+// Also registered with atexit(), so messages logged just before exit(1) are not lost.
+void log_shutdown();
+
+// Total number of dropped messages, e.g. for metrics.
+uint64 log_droppedTotal();
+
+#endif
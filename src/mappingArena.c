@@ -0,0 +1,160 @@
+#include "mappingArena.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+// Functions        ************************************************************************
+
+void mappings_builderInit(struct mapping_builder* builder) {
+    memset(builder, 0, sizeof(struct mapping_builder));
+}
+
+uint32 mappings_hashName(const char* name) {
+    //Helper function for mappings_intern(); FNV-1a
+    uint32 hash = 2166136261u;
+    for (; *name != '\0'; name++) {
+        hash ^= (uint8) *name;
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+int mappings_rehash(struct mapping_builder* builder, int hashSize) {
+    //Helper function for mappings_intern(); grow the hash table and re-insert all names.
+    // Returns 0 if out of memory, keeping the old table.
+    uint32* nameHash = calloc(hashSize, sizeof(uint32));
+    if (nameHash == NULL) return 0;
+    free(builder->nameHash);
+    builder->nameHash = nameHash;
+    builder->hashSize = hashSize;
+
+    for (int offset = 0; offset < builder->namesUsed; offset += strlen(builder->names + offset) + 1) {
+        uint32 slot = mappings_hashName(builder->names + offset) & (hashSize-1);
+        while (builder->nameHash[slot] != 0) slot = (slot+1) & (hashSize-1);
+        builder->nameHash[slot] = offset + 1;
+    }
+    return 1;
+}
+
+int mappings_intern(struct mapping_builder* builder, const char* name, uint32* offset_out) {
+    //Helper function for mappings_add(); the offset of the name in the string block.
+    // Returns 0 if out of memory.
+    if (2*(builder->numNames+1) > builder->hashSize &&
+        !mappings_rehash(builder, builder->hashSize == 0 ? 2*MAPPING_BUILDER_MINSIZE : 2*builder->hashSize)) {
+        return 0;
+    }
+
+    uint32 slot = mappings_hashName(name) & (builder->hashSize-1);
+    while (builder->nameHash[slot] != 0) {
+        uint32 offset = builder->nameHash[slot] - 1;
+        if (!strcmp(builder->names + offset, name)) {
+            *offset_out = offset;
+            return 1;
+        }
+        slot = (slot+1) & (builder->hashSize-1);
+    }
+
+    int nameLen = strlen(name) + 1;
+    if (builder->namesUsed + nameLen > builder->namesSize) {
+        int namesSize = 2*(builder->namesUsed + nameLen);
+        char* names = realloc(builder->names, namesSize);
+        if (names == NULL) return 0;
+        builder->names     = names;
+        builder->namesSize = namesSize;
+    }
+    uint32 offset = builder->namesUsed;
+    memcpy(builder->names + offset, name, nameLen);
+    builder->namesUsed += nameLen;
+
+    builder->nameHash[slot] = offset + 1;
+    builder->numNames++;
+    *offset_out = offset;
+    return 1;
+}
+
+int mappings_add(struct mapping_builder* builder, uint16 slaveIdx, uint16 idx, uint8 subidx,
+                 int offset, int bitoff, uint8 bitlen, int dataType, const char* name) {
+    if (builder->failed) return 0;
+    if (builder->num == builder->size) {
+        //Each array is only replaced once it has been grown, so a failure keeps a consistent builder
+        int size = builder->size == 0 ? MAPPING_BUILDER_MINSIZE : 2*builder->size;
+        struct mappings_PDO* records = realloc(builder->records, size*sizeof(struct mappings_PDO));
+        if (records == NULL) goto fail;
+        builder->records = records;
+        uint32* nameOffs = realloc(builder->nameOffs, size*sizeof(uint32));
+        if (nameOffs == NULL) goto fail;
+        builder->nameOffs = nameOffs;
+        builder->size     = size;
+    }
+
+    struct mappings_PDO* record = &(builder->records[builder->num]);
+    memset(record, 0, sizeof(struct mappings_PDO));
+    record->slaveIdx = slaveIdx;
+    record->idx      = idx;
+    record->subidx   = subidx;
+    record->offset   = offset;
+    record->bitoff   = bitoff;
+    record->bitlen   = bitlen;
+    record->dataType = dataType;
+    if (!mappings_intern(builder, name != NULL ? name : "", &(builder->nameOffs[builder->num]))) goto fail;
+    builder->num++;
+    return 1;
+
+fail:
+    builder->failed = 1;
+    return 0;
+}
+
+struct mapping_arena* mappings_finish(struct mapping_builder* builder) {
+    int num = builder->num;
+
+    //Layout, in order of decreasing alignment
+    size_t recordsAt = sizeof(struct mapping_arena);
+    size_t keysAt    = recordsAt + num*sizeof(struct mappings_PDO);
+    size_t offsetsAt = keysAt    + num*sizeof(uint64);
+    size_t typesAt   = offsetsAt + num*sizeof(int);
+    size_t bitoffsAt = typesAt   + num*sizeof(uint16);
+    size_t bitlensAt = bitoffsAt + num*sizeof(uint8);
+    size_t namesAt   = bitlensAt + num*sizeof(uint8);
+    size_t arenaSize = namesAt   + builder->namesUsed;
+
+    char* mem = builder->failed ? NULL : malloc(arenaSize);
+    struct mapping_arena* arena = (struct mapping_arena*) mem;
+    if (arena != NULL) {
+        memset(arena, 0, sizeof(struct mapping_arena));
+        arena->num       = num;
+        arena->namesSize = builder->namesUsed;
+        arena->records   = (struct mappings_PDO*) (mem + recordsAt);
+        arena->keys      = (uint64*) (mem + keysAt);
+        arena->offsets   = (int*)    (mem + offsetsAt);
+        arena->dataTypes = (uint16*) (mem + typesAt);
+        arena->bitoffs   = (uint8*)  (mem + bitoffsAt);
+        arena->bitlens   = (uint8*)  (mem + bitlensAt);
+        arena->names     = mem + namesAt;
+        if (builder->namesUsed > 0) memcpy(arena->names, builder->names, builder->namesUsed);
+
+        for (int i = 0; i < num; i++) {
+            struct mappings_PDO* record = &(builder->records[i]);
+            arena->records[i]      = *record;
+            arena->records[i].name = arena->names + builder->nameOffs[i];
+            arena->keys[i]         = MAPPING_KEY(record->slaveIdx, record->idx, record->subidx);
+            arena->offsets[i]      = record->offset;
+            arena->dataTypes[i]    = record->dataType;
+            arena->bitoffs[i]      = record->bitoff;
+            arena->bitlens[i]      = record->bitlen;
+        }
+    }
+
+    free(builder->records);
+    free(builder->nameOffs);
+    free(builder->names);
+    free(builder->nameHash);
+    memset(builder, 0, sizeof(struct mapping_builder));
+
+    return arena;
+}
+
+void mappings_free(struct mapping_arena* arena) {
+    free(arena);
+}
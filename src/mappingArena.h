@@ -0,0 +1,88 @@
+#ifndef mappingArena_h
+#define mappingArena_h
+
+#include "osal.h" //typedefs for uint8 etc.
+
+// Storage for the PDO mappings of one direction (outputs or inputs), in a single allocation:
+// parallel arrays with one element per PDO in IOmap order (keys, offsets, bit offsets, lengths,
+// types), one string block with the names, interned so that identical names are stored only once,
+// and one struct mappings_PDO record per PDO.
+// Lookups and walks over all PDOs use the parallel arrays; the records are handles for code which
+// resolves a PDO once and then reads it every cycle (DERIVED, STATS, METRICS_PDOS, ...), and are
+// what PDOval2string() and friends take. The whole arena is released with one free().
+// Since the number of PDOs is only known once the bus has been scanned, arenas are built with a
+// struct mapping_builder, which is packed into the arena at the end.
+
+// Configuration    ************************************************************************
+#define MAPPING_BUILDER_MINSIZE 64 // Initial number of entries in a builder
+
+// Key for lookups by address
+#define MAPPING_KEY(slave, idx, subidx) (((uint64)(slave) << 24) | ((uint64)(idx) << 8) | (uint64)(subidx))
+
+// Data types       ************************************************************************
+
+// Mapping between index:subindex to offsets into the global IOmap
+struct mappings_PDO {
+    //Static name of PDO
+    uint16 slaveIdx;
+    uint16 idx;
+    uint8  subidx;
+    //Pointer into IOmap
+    int offset;
+    int bitoff;
+    uint8 bitlen;
+    //Some metadata which may be useful
+    int    dataType;
+    char*  name;      // Into the string block of the arena
+};
+
+struct mapping_arena {
+    int     num;         // Number of PDOs
+    int     namesSize;   // Size of the string block [bytes]
+
+    uint64* keys;        // MAPPING_KEY(slaveIdx, idx, subidx)
+    int*    offsets;     // Into the IOmap [bytes]
+    uint8*  bitoffs;
+    uint8*  bitlens;
+    uint16* dataTypes;
+    char*   names;       // String block, '\0'-separated
+
+    struct mappings_PDO* records;
+};
+
+// Growing arrays while scanning; names are kept as offsets, since the string block may move
+struct mapping_builder {
+    int num;
+    int size;                     // Allocated entries
+    struct mappings_PDO* records; // 'name' is not set
+    uint32* nameOffs;
+
+    char* names;
+    int   namesUsed;
+    int   namesSize;
+
+    uint32* nameHash;             // Open addressing; name offset + 1, or 0 if empty
+    int     hashSize;             // Power of 2, at least twice the number of distinct names
+    int     numNames;
+
+    int failed;                   // Out of memory in mappings_add(); mappings_finish() gives NULL
+};
+
+// Functions        ************************************************************************
+
+// Start building an arena.
+void mappings_builderInit(struct mapping_builder* builder);
+
+// Append one PDO.
+// Returns 1 on success, 0 if out of memory; the builder then only accepts mappings_finish().
+int mappings_add(struct mapping_builder* builder, uint16 slaveIdx, uint16 idx, uint8 subidx,
+                 int offset, int bitoff, uint8 bitlen, int dataType, const char* name);
+
+// Pack everything added so far into a new arena, and release the builder.
+// Returns NULL if out of memory, also in an earlier mappings_add().
+struct mapping_arena* mappings_finish(struct mapping_builder* builder);
+
+// Release an arena; NULL is ignored.
+void mappings_free(struct mapping_arena* arena);
+
+#endif
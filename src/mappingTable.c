@@ -0,0 +1,233 @@
+#include "mappingTable.h"
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <unistd.h>
+#include <pthread.h>
+
+#include "ethercat.h" // ec_slave[], for checking the layout, and ec_BRD() for counting the slaves
+
+#include "EtherCatDaemon.h"
+#include "networkServer.h"
+
+// Configuration    ************************************************************************
+#define MAPTABLE_DRAINPOLL 100 // How often a rescan checks whether the readers of the old table have left [us]
+
+// File-global data ************************************************************************
+
+struct mapping_table maptable_startup = {NULL, NULL, NULL, 0};
+struct mapping_table* volatile maptable_current = NULL;
+int maptable_canRescan = 0;
+
+// Readers currently in a read section, per epoch parity; readers enter the current parity,
+// and a rescan waits for both parities to drain in turn after publishing.
+volatile uint32 maptable_epoch = 0;
+volatile int    maptable_readers[2] = {0, 0};
+
+// Only one rescan at a time
+pthread_mutex_t maptable_rescanLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Functions        ************************************************************************
+
+size_t maptext_format(struct mapping_arena* arena, char* lines) {
+    //Helper function for maptext_new(); the lines of writeMapping() for a whole arena.
+    // Only counts their length if lines is NULL.
+    if (arena == NULL) return 0;
+    size_t used = 0;
+    char line[BUFFLEN];
+    for (int i = 0; i < arena->num; i++) {
+        int numChars = formatMapping(line, &(arena->records[i]));
+        if (numChars < 0) continue;
+        if (numChars >= BUFFLEN) numChars = BUFFLEN-1;
+        if (lines != NULL) memcpy(lines+used, line, numChars);
+        used += numChars;
+    }
+    return used;
+}
+
+struct mapping_text* maptext_new(struct mapping_arena* out, struct mapping_arena* in) {
+    size_t outLen = maptext_format(out, NULL);
+    size_t inLen  = maptext_format(in,  NULL);
+    struct mapping_text* text = malloc(sizeof(struct mapping_text) + outLen + inLen);
+    if (text == NULL) {
+        log_error("Error in maptext_new(): out of memory for the 'meta all' text\n");
+        return NULL;
+    }
+    text->refs   = 1;
+    text->outLen = maptext_format(out, text->lines);
+    text->inLen  = maptext_format(in,  text->lines + text->outLen);
+    return text;
+}
+
+struct mapping_text* maptext_hold(struct mapping_text* text) {
+    if (text != NULL) __atomic_add_fetch(&text->refs, 1, __ATOMIC_SEQ_CST);
+    return text;
+}
+
+void maptext_release(struct mapping_text* text) {
+    if (text != NULL && __atomic_sub_fetch(&text->refs, 1, __ATOMIC_SEQ_CST) == 0) {
+        free(text);
+    }
+}
+
+int maptable_boot(int canRescan) {
+    //The microbenchmarks boot again for every table size
+    maptext_release(maptable_startup.text);
+    maptable_startup.out        = mapping_out;
+    maptable_startup.in         = mapping_in;
+    maptable_startup.text       = maptext_new(mapping_out, mapping_in);
+    maptable_startup.generation = 0;
+    maptable_canRescan = canRescan;
+    if (maptable_startup.text == NULL) return 0;
+    __atomic_store_n(&maptable_current, &maptable_startup, __ATOMIC_SEQ_CST);
+    return 1;
+}
+
+struct mapping_table* maptable_enter(int* epoch) {
+    *epoch = __atomic_load_n(&maptable_epoch, __ATOMIC_SEQ_CST) & 1;
+    __atomic_add_fetch(&maptable_readers[*epoch], 1, __ATOMIC_SEQ_CST);
+    //Loaded after registering, so a rescan publishing later will wait for us
+    return __atomic_load_n(&maptable_current, __ATOMIC_SEQ_CST);
+}
+
+void maptable_exit(int epoch) {
+    __atomic_sub_fetch(&maptable_readers[epoch], 1, __ATOMIC_SEQ_CST);
+}
+
+void maptable_synchronize() {
+    //Helper function for maptable_rescan(); wait until no reader can still see the previous table.
+    // A reader of the previous table registered before the new one was published, in either parity;
+    // flipping the epoch first makes sure that new readers do not keep the waited-for parity busy.
+    for (int i = 0; i < 2; i++) {
+        uint32 old = __atomic_fetch_add(&maptable_epoch, 1, __ATOMIC_SEQ_CST) & 1;
+        while (__atomic_load_n(&maptable_readers[old], __ATOMIC_SEQ_CST) > 0) {
+            usleep(MAPTABLE_DRAINPOLL);
+        }
+    }
+}
+
+int maptable_fits(struct mapping_arena* arena, int outputs, char* buff_out) {
+    //Helper function for maptable_rescan(); check that every PDO is inside the IOmap area of its slave,
+    // as configured at startup. Returns 1 if all fit, else 0 with an error message in buff_out.
+    for (int i = 0; i < arena->num; i++) {
+        struct mappings_PDO* mapping = &(arena->records[i]);
+        uint16 slave = mapping->slaveIdx;
+        uint8* start = outputs ? ec_slave[slave].outputs : ec_slave[slave].inputs;
+        int    bits  = outputs ? ec_slave[slave].Obytes*8 : ec_slave[slave].Ibytes*8;
+        if (bits == 0) bits = outputs ? ec_slave[slave].Obits : ec_slave[slave].Ibits;
+
+        int endBit = bits + 1; // Does not fit, unless the slave has an area
+        if (start != NULL) {
+            endBit = (mapping->offset - (int)(start - (uint8*) &IOmap[0]))*8 + mapping->bitoff + mapping->bitlen;
+        }
+        if (endBit > bits) {
+            snprintf(buff_out, BUFFLEN,
+                     "err: rescan: %s of slave %d now need more than %d bits (at %d:0x%4.4X:0x%2.2X); "
+                     "the process image layout changed, restart the daemon\n",
+                     outputs ? "outputs" : "inputs", slave, bits, slave, mapping->idx, mapping->subidx);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int maptable_sameMapping(struct mappings_PDO* a, struct mappings_PDO* b) {
+    //Helper function for maptable_countChanged()
+    return a->offset   == b->offset   &&
+           a->bitoff   == b->bitoff   &&
+           a->bitlen   == b->bitlen   &&
+           a->dataType == b->dataType &&
+           !strcmp(a->name, b->name);
+}
+
+int maptable_countChanged(struct mapping_arena* oldArena, struct mapping_arena* newArena) {
+    //Helper function for maptable_rescan(); number of PDOs which were added, removed, or changed
+    int numChanged = 0;
+    for (int i = 0; i < newArena->num; i++) {
+        struct mappings_PDO* mapping = &(newArena->records[i]);
+        struct mappings_PDO* old = get_address(mapping->slaveIdx, mapping->idx, mapping->subidx, oldArena);
+        if (old == NULL || !maptable_sameMapping(old, mapping)) numChanged++;
+    }
+    for (int i = 0; i < oldArena->num; i++) {
+        struct mappings_PDO* mapping = &(oldArena->records[i]);
+        if (get_address(mapping->slaveIdx, mapping->idx, mapping->subidx, newArena) == NULL) numChanged++;
+    }
+    return numChanged;
+}
+
+void maptable_rescan(int connfd) {
+    char buff_out[BUFFLEN];
+    memset(buff_out, 0, BUFFLEN);
+
+    if (!maptable_canRescan || !inOP) {
+        strncpy(buff_out, "err: rescan needs a running bus (not inOP, or replaying)\n", BUFFLEN);
+        write(connfd, buff_out, BUFFLEN);
+        return;
+    }
+    if (pthread_mutex_trylock(&maptable_rescanLock) != 0) {
+        strncpy(buff_out, "err: rescan already running\n", BUFFLEN);
+        write(connfd, buff_out, BUFFLEN);
+        return;
+    }
+
+    //New or missing slaves would need a new process image
+    uint16 w = 0;
+    int slavesOnBus = ec_BRD(0x0000, ECT_REG_TYPE, sizeof(w), &w, EC_TIMEOUTSAFE);
+    if (slavesOnBus != ec_slavecount) {
+        snprintf(buff_out, BUFFLEN,
+                 "err: rescan: %d slaves on the bus but %d configured; restart the daemon\n",
+                 slavesOnBus, ec_slavecount);
+        write(connfd, buff_out, BUFFLEN);
+        pthread_mutex_unlock(&maptable_rescanLock);
+        return;
+    }
+
+    int64 start = monotonicTime_ns();
+    struct mapping_table* table = malloc(sizeof(struct mapping_table));
+    memset(table, 0, sizeof(struct mapping_table));
+    if (!ecat_buildMappings(&(table->out), &(table->in), 0)) { // The arenas may be NULL
+        strncpy(buff_out, "err: rescan: reading the PDO mappings over CoE failed, see the log\n", BUFFLEN);
+    }
+    else if (maptable_fits(table->out, 1, buff_out) && maptable_fits(table->in, 0, buff_out)) {
+        table->text = maptext_new(table->out, table->in);
+        if (table->text == NULL) {
+            strncpy(buff_out, "err: rescan: out of memory\n", BUFFLEN);
+        }
+    }
+    if (buff_out[0] != '\0') {
+        mappings_free(table->out);
+        mappings_free(table->in);
+        maptext_release(table->text);
+        free(table);
+        write(connfd, buff_out, BUFFLEN);
+        pthread_mutex_unlock(&maptable_rescanLock);
+        return;
+    }
+
+    //Only rescans modify maptable_current, so no read section is needed here
+    struct mapping_table* old = maptable_current;
+    int numChanged = maptable_countChanged(old->out, table->out) + maptable_countChanged(old->in, table->in);
+    int numEntries = table->out->num + table->in->num;
+    uint32 generation = old->generation + 1;
+    table->generation = generation;
+
+    __atomic_store_n(&maptable_current, table, __ATOMIC_SEQ_CST);
+    maptable_synchronize();
+    if (old != &maptable_startup) {
+        mappings_free(old->out);
+        mappings_free(old->in);
+        maptext_release(old->text); // Clients may still be writing it out
+        free(old);
+    }
+    pthread_mutex_unlock(&maptable_rescanLock);
+
+    log_info("Rescan: generation %" PRIu32 ", %d PDOs, %d changed, took %.1f ms\n",
+             generation, numEntries, numChanged, (monotonicTime_ns() - start)*1e-6);
+
+    snprintf(buff_out, BUFFLEN, "  rescan slaves %d/%d entries %d changed %d generation %" PRIu32 "\n",
+             slavesOnBus, ec_slavecount, numEntries, numChanged, generation);
+    write(connfd, buff_out, BUFFLEN);
+}
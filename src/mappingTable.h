@@ -0,0 +1,64 @@
+#ifndef mappingTable_h
+#define mappingTable_h
+
+#include "ecatDriver.h"
+
+// The PDO mapping table seen by the clients ('get', 'meta all'), which can be refreshed
+// with 'rescan' while the bus keeps cycling, e.g. after a terminal was replaced.
+// 'rescan' builds a complete new table over CoE in the calling client thread, and publishes it
+// with a single pointer swap (read-copy-update): readers bracket every use of the table with
+// maptable_enter() / maptable_exit(), and the replaced table is only freed once all readers
+// that could have seen it have left. A reader therefore never sees a half-built table.
+//
+// The table built at startup (mapping_out / mapping_in) is never freed: the post-processing
+// of the cycle (DERIVED, STATS, METRICS_PDOS, MCAST_PDOS, ...) resolved its addresses against it.
+// Since a new process image layout would need ec_config_map(), which reconfigures all slaves,
+// a rescan is only published if every PDO still fits into the IOmap area of its slave;
+// otherwise the daemon has to be restarted.
+
+// Data types       ************************************************************************
+
+// The lines of 'meta all' for a pair of arenas, formatted once when they are published, so that
+// the requests need no allocation. Reference counted, since a client writes it out after leaving
+// its read section: take a reference with maptext_hold() while the text cannot be replaced
+// (in a read section, or under IOmap_lock), and drop it with maptext_release() when done.
+struct mapping_text {
+    int    refs;
+    size_t outLen;  // Lines of the outputs [bytes], not '\0'-terminated
+    size_t inLen;   // Lines of the inputs, following them
+    char   lines[];
+};
+
+struct mapping_table {
+    struct mapping_arena* out;  // As mapping_out / mapping_in
+    struct mapping_arena* in;
+    struct mapping_text*  text; // One reference is held by the table
+    uint32 generation;          // 0 for the startup table, +1 for every published rescan
+};
+
+// Functions        ************************************************************************
+
+// Publish mapping_out / mapping_in as the startup table; called once they are known.
+// canRescan: the mappings come from the bus (not from a replay), so 'rescan' is possible.
+// Returns 1 on success, 0 if out of memory.
+int maptable_boot(int canRescan);
+
+// Enter a read section and get the current table, or NULL if there is none yet.
+// The table, including the names, stays valid until maptable_exit(epoch);
+// read sections must not be nested, and should be short (a rescan waits for them).
+struct mapping_table* maptable_enter(int* epoch);
+void maptable_exit(int epoch);
+
+// Format the lines of 'meta all' for out and in (either may be NULL), with one reference.
+// Returns NULL if out of memory.
+struct mapping_text* maptext_new(struct mapping_arena* out, struct mapping_arena* in);
+// Returns text; NULL is ignored.
+struct mapping_text* maptext_hold(struct mapping_text* text);
+// Frees the text with the last reference; NULL is ignored.
+void maptext_release(struct mapping_text* text);
+
+// Rebuild the mappings from the bus, and publish them if the process image layout is unchanged.
+// Writes the result ('  rescan ...' or 'err: ...') to the connection.
+void maptable_rescan(int connfd);
+
+#endif
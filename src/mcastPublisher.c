@@ -0,0 +1,249 @@
+#include "mcastPublisher.h"
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <endian.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+
+#include <pthread.h>
+
+#include "ethercat.h" // The full input image is taken from ec_group[0]
+
+#include "EtherCatDaemon.h"
+#include "ecatDriver.h"
+#include "networkServer.h"
+
+// File-global data ************************************************************************
+
+int mcast_sockfd = -1; // -1 if the publisher is disabled
+struct sockaddr_in mcast_addr;
+
+// Payload layout
+struct mcast_entry* mcast_entries = NULL;
+int mcast_numEntries = 0;
+char mcast_subset = 0;
+
+// The datagram; filled by mcast_capture(), sent by mcast_send()
+char  mcast_datagram[sizeof(struct mcast_header) + MCAST_MAXPAYLOAD];
+int   mcast_datagramLen = 0;   // 0 if there is nothing to send
+uint64 mcast_seq = 0;
+
+// Statistics
+uint64 mcast_sendErrors = 0;
+
+// Functions        ************************************************************************
+
+uint32 mcast_hash(uint32 hash, const void* data, size_t len) {
+    //FNV-1a, used to make the layoutId
+    const uint8* bytes = (const uint8*) data;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+int mcast_setup() {
+    if (config_file.mcast_addr == NULL) return 1; // Disabled
+
+    // Compute the payload layout
+    struct mappings_PDO* mapping;
+    int payloadLen = 0;
+
+    mcast_subset = config_file.mcastPDOs->next != NULL;
+    if (mcast_subset) {
+        struct pdo_address* addr;
+        for (addr = config_file.mcastPDOs; addr->next != NULL; addr = addr->next) {
+            mcast_numEntries++;
+        }
+        mcast_entries = malloc(mcast_numEntries*sizeof(struct mcast_entry));
+        memset(mcast_entries, 0, mcast_numEntries*sizeof(struct mcast_entry));
+
+        int i = 0;
+        for (addr = config_file.mcastPDOs; addr->next != NULL; addr = addr->next) {
+            mapping = get_address(addr->slaveIdx, addr->idx, addr->subidx, mapping_in);
+            if (mapping == NULL) {
+                mapping = get_address(addr->slaveIdx, addr->idx, addr->subidx, mapping_out);
+            }
+            if (mapping == NULL) {
+                log_error("Error in mcast_setup(): MCAST_PDO %d:%x:%x not found\n",
+                          addr->slaveIdx, addr->idx, addr->subidx);
+                return 0;
+            }
+            mcast_entries[i].mapping       = mapping;
+            mcast_entries[i].payloadOffset = payloadLen;
+            mcast_entries[i].numBytes      = (mapping->bitoff + mapping->bitlen + 7) / 8;
+            payloadLen += mcast_entries[i].numBytes;
+            i++;
+        }
+    }
+    else {
+        // Full input image; describe all inputs relative to the start of it
+        size_t inputsOffset = (size_t)(ec_group[0].inputs - (uint8 *)&IOmap[0]);
+        mcast_numEntries = mapping_in->num;
+        mcast_entries = malloc((mcast_numEntries+1)*sizeof(struct mcast_entry)); //+1 to never malloc(0)
+        memset(mcast_entries, 0, (mcast_numEntries+1)*sizeof(struct mcast_entry));
+
+        for (int i = 0; i < mcast_numEntries; i++) {
+            mapping = &(mapping_in->records[i]);
+            mcast_entries[i].mapping       = mapping;
+            mcast_entries[i].payloadOffset = mapping->offset - inputsOffset;
+            mcast_entries[i].numBytes      = (mapping->bitoff + mapping->bitlen + 7) / 8;
+        }
+        payloadLen = ec_group[0].Ibytes;
+    }
+
+    if (payloadLen > MCAST_MAXPAYLOAD) {
+        log_error("Error in mcast_setup(): payload size %d > MCAST_MAXPAYLOAD = %d\n",
+                  payloadLen, MCAST_MAXPAYLOAD);
+        return 0;
+    }
+
+    // Prepare the static parts of the header
+    struct mcast_header* header = (struct mcast_header*) mcast_datagram;
+    memset(mcast_datagram, 0, sizeof(mcast_datagram));
+    memcpy(header->magic, "ECDM", 4);
+    header->version    = htole16(MCAST_VERSION);
+    header->payloadLen = htole32(payloadLen);
+
+    uint32 layoutId = 2166136261u;
+    layoutId = mcast_hash(layoutId, &payloadLen, sizeof(payloadLen));
+    for (int i = 0; i < mcast_numEntries; i++) {
+        mapping  = mcast_entries[i].mapping;
+        layoutId = mcast_hash(layoutId, &(mapping->slaveIdx), sizeof(mapping->slaveIdx));
+        layoutId = mcast_hash(layoutId, &(mapping->idx),      sizeof(mapping->idx));
+        layoutId = mcast_hash(layoutId, &(mapping->subidx),   sizeof(mapping->subidx));
+        layoutId = mcast_hash(layoutId, &(mapping->bitoff),   sizeof(mapping->bitoff));
+        layoutId = mcast_hash(layoutId, &(mapping->bitlen),   sizeof(mapping->bitlen));
+        layoutId = mcast_hash(layoutId, &(mcast_entries[i].payloadOffset), sizeof(int));
+    }
+    header->layoutId = htole32(layoutId);
+
+    // Open the socket
+    mcast_sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (mcast_sockfd == -1) {
+        log_error("ERROR when opening multicast socket: %m\n");
+        return 0;
+    }
+
+    unsigned char ttl = config_file.mcast_ttl;
+    if (setsockopt(mcast_sockfd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0) {
+        log_error("ERROR: setsockopt(IP_MULTICAST_TTL) failed: %m\n");
+        return 0;
+    }
+    unsigned char loop = 1; // Allow receivers on the same host
+    if (setsockopt(mcast_sockfd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) < 0) {
+        log_error("ERROR: setsockopt(IP_MULTICAST_LOOP) failed: %m\n");
+        return 0;
+    }
+    if (config_file.mcast_interface != NULL) {
+        struct in_addr ifaddr;
+        if (inet_aton(config_file.mcast_interface, &ifaddr) == 0 ||
+            setsockopt(mcast_sockfd, IPPROTO_IP, IP_MULTICAST_IF, &ifaddr, sizeof(ifaddr)) < 0) {
+            log_error("Error in mcast_setup(): could not use MCAST_INTERFACE '%s'\n", config_file.mcast_interface);
+            return 0;
+        }
+    }
+
+    memset(&mcast_addr, 0, sizeof(mcast_addr));
+    mcast_addr.sin_family = AF_INET;
+    mcast_addr.sin_port   = htons(config_file.mcast_port);
+    if (inet_aton(config_file.mcast_addr, &(mcast_addr.sin_addr)) == 0 ||
+        !IN_MULTICAST(ntohl(mcast_addr.sin_addr.s_addr))) {
+        log_error("Error in mcast_setup(): MCAST_GROUP '%s' is not a multicast address\n", config_file.mcast_addr);
+        return 0;
+    }
+
+    log_info("Publishing %s to %s:%d every %d cycle(s), %d bytes, layout 0x%8.8x\n",
+             mcast_subset ? "MCAST_PDOs" : "input image",
+             config_file.mcast_addr, config_file.mcast_port, config_file.mcast_decimate,
+             payloadLen, layoutId);
+
+    return 1;
+}
+
+void mcast_capture(uint64 cycle, int wkc, int expectedWKC) {
+    if (mcast_sockfd < 0) return;
+    if (cycle % config_file.mcast_decimate != 0) return;
+
+    struct mcast_header* header = (struct mcast_header*) mcast_datagram;
+    char* payload = mcast_datagram + sizeof(struct mcast_header);
+
+    uint16 flags = mcast_subset ? MCAST_FLAG_SUBSET : 0;
+    if (wkc < expectedWKC) flags |= MCAST_FLAG_WKCERROR;
+
+    header->flags       = htole16(flags);
+    header->seq         = htole64(mcast_seq);
+    header->cycle       = htole64(cycle);
+    header->DCtime      = htole64(ec_DCtime);
+    header->wkc         = htole32(wkc);
+    header->expectedWKC = htole32(expectedWKC);
+
+    uint32 payloadLen = le32toh(header->payloadLen);
+    if (mcast_subset) {
+        for (int i = 0; i < mcast_numEntries; i++) {
+            memcpy(payload + mcast_entries[i].payloadOffset,
+                   &(IOmap[mcast_entries[i].mapping->offset]), mcast_entries[i].numBytes);
+        }
+    }
+    else {
+        memcpy(payload, ec_group[0].inputs, payloadLen);
+    }
+
+    mcast_datagramLen = sizeof(struct mcast_header) + payloadLen;
+    mcast_seq++;
+}
+
+void mcast_send() {
+    if (mcast_datagramLen == 0) return;
+
+    // One sendto() per datagram, no matter how many have joined the group.
+    // MSG_DONTWAIT: drop the datagram rather than ever stalling the cycle.
+    if (sendto(mcast_sockfd, mcast_datagram, mcast_datagramLen, MSG_DONTWAIT,
+               (struct sockaddr*) &mcast_addr, sizeof(mcast_addr)) < 0) {
+        mcast_sendErrors++;
+    }
+    mcast_datagramLen = 0;
+}
+
+void mcast_describe(int connfd) {
+    char buff_out[BUFFLEN];
+    memset(buff_out, 0, BUFFLEN);
+    char hstr[BUFFLEN]; // String buffer for conversion functions
+    int numChars;
+
+    if (mcast_sockfd < 0) {
+        numChars = snprintf(buff_out, BUFFLEN, "err: multicast publisher not enabled (MCAST_GROUP)\n");
+        write(connfd, buff_out, BUFFLEN);
+        memset(buff_out, 0, BUFFLEN);
+        return;
+    }
+
+    struct mcast_header* header = (struct mcast_header*) mcast_datagram;
+    numChars = snprintf(buff_out, BUFFLEN,
+                        "  group %s:%d decimate %d layout 0x%8.8x payload %u %s seq %" PRIu64 " senderrors %" PRIu64 "\n",
+                        config_file.mcast_addr, config_file.mcast_port, config_file.mcast_decimate,
+                        le32toh(header->layoutId), le32toh(header->payloadLen),
+                        mcast_subset ? "subset" : "image", mcast_seq, mcast_sendErrors);
+    write(connfd, buff_out, BUFFLEN);
+    memset(buff_out, 0, BUFFLEN);
+
+    for (int i = 0; i < mcast_numEntries; i++) {
+        struct mappings_PDO* mapping = mcast_entries[i].mapping;
+        numChars = snprintf(buff_out, BUFFLEN,
+                            "  [0x%4.4X.%1d] %d:0x%4.4X:0x%2.2X 0x%2.2X %-12s %s\n",
+                            mcast_entries[i].payloadOffset, mapping->bitoff,
+                            mapping->slaveIdx, mapping->idx, mapping->subidx,
+                            mapping->bitlen, dtype2string(mapping->dataType, hstr, BUFFLEN), mapping->name);
+        if (numChars < 0 || numChars >= BUFFLEN) continue;
+        write(connfd, buff_out, BUFFLEN);
+        memset(buff_out, 0, BUFFLEN);
+    }
+}
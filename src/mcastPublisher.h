@@ -0,0 +1,55 @@
+#ifndef mcastPublisher_h
+#define mcastPublisher_h
+
+#include "ecatDriver.h"
+
+// Configuration    ************************************************************************
+#define MCAST_MAXPAYLOAD 8192 // Max size of the process image part of a datagram [bytes]
+#define MCAST_VERSION    1
+
+// Data types       ************************************************************************
+
+// Header of every published datagram. All fields are little-endian.
+// It is followed by payloadLen bytes of process data, either the full input image
+// or the configured MCAST_PDO subset; the 'mcast' command describes the layout.
+struct __attribute__((__packed__)) mcast_header {
+    char   magic[4];      // "ECDM"
+    uint16 version;       // MCAST_VERSION
+    uint16 flags;         // See MCAST_FLAG_*
+    uint32 layoutId;      // Changes whenever the payload layout changes
+    uint64 seq;           // Datagram sequence number, starting at 0
+    uint64 cycle;         // Cycle number of the published exchange
+    int64  DCtime;        // ec_DCtime after the exchange [ns]
+    int32  wkc;           // Working counter of the exchange
+    int32  expectedWKC;
+    uint32 payloadLen;    // [bytes]
+};
+
+#define MCAST_FLAG_SUBSET   0x0001 // Payload is the MCAST_PDO subset, not the full input image
+#define MCAST_FLAG_WKCERROR 0x0002 // wkc < expectedWKC; data may be stale
+
+// One PDO in the published payload
+struct mcast_entry {
+    struct mappings_PDO* mapping;
+    int payloadOffset;    // [bytes] from start of payload
+    int numBytes;         // Bytes copied from the IOmap (covers bitoff+bitlen)
+};
+
+// Functions        ************************************************************************
+
+// Open the socket and compute the payload layout; must be called after ecat_setup_mappings().
+// Does nothing if no MCAST_GROUP was configured.
+// Returns 1 on success, 0 in case of error.
+int mcast_setup();
+
+// Copy the process data into the datagram; called by the cycle thread with IOmap_lock grabbed.
+void mcast_capture(uint64 cycle, int wkc, int expectedWKC);
+
+// Send the datagram captured by mcast_capture(); called by the cycle thread without IOmap_lock.
+// Never blocks; the cost is independent of the number of receivers.
+void mcast_send();
+
+// Write a description of the group and payload layout to a client connection.
+void mcast_describe(int connfd);
+
+#endif
@@ -0,0 +1,555 @@
+#include "metricsServer.h"
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <errno.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+
+#include <pthread.h>
+
+#include "ethercat.h" // Per-slave metrics are read directly from ec_slave[]
+
+#include "EtherCatDaemon.h"
+#include "ecatDriver.h"
+#include "networkServer.h"
+#include "decodedImage.h"
+#include "seqlock.h"
+#include "allocStats.h"
+#include "packetRing.h"
+#include "slaveHealth.h"
+
+// File-global data ************************************************************************
+
+// PDOs exported as gauges
+struct metrics_gauge* metrics_gauges = NULL;
+int metrics_numGauges = 0;
+volatile uint32 metrics_gaugeSeq = 0;
+
+// Connections being served
+struct metrics_conn metrics_conns[METRICS_MAXCONN];
+
+// Scratch buffer for rendering the response body
+char metrics_body[METRICS_BUFFLEN];
+
+// Functions        ************************************************************************
+
+int metrics_resolvePDOs() {
+    struct pdo_address* addr;
+
+    metrics_numGauges = 0;
+    for (addr = config_file.metricsPDOs; addr->next != NULL; addr = addr->next) {
+        metrics_numGauges++;
+    }
+    if (metrics_numGauges == 0) return 1;
+
+    metrics_gauges = malloc(metrics_numGauges*sizeof(struct metrics_gauge));
+    memset(metrics_gauges, 0, metrics_numGauges*sizeof(struct metrics_gauge));
+
+    int i = 0;
+    for (addr = config_file.metricsPDOs; addr->next != NULL; addr = addr->next) {
+        struct mappings_PDO* mapping = get_address(addr->slaveIdx, addr->idx, addr->subidx, mapping_in);
+        if (mapping == NULL) {
+            mapping = get_address(addr->slaveIdx, addr->idx, addr->subidx, mapping_out);
+        }
+        if (mapping == NULL) {
+            log_error("Error in metrics_resolvePDOs(): METRICS_PDO %d:%x:%x not found\n",
+                      addr->slaveIdx, addr->idx, addr->subidx);
+            return 0;
+        }
+        metrics_gauges[i++].mapping = mapping;
+    }
+    return 1;
+}
+
+void metrics_updatePDOs() {
+    if (metrics_numGauges == 0) return;
+
+    seqlock_write_begin(&metrics_gaugeSeq);
+    for (int i = 0; i < metrics_numGauges; i++) {
+        metrics_gauges[i].valid = decode_double(metrics_gauges[i].mapping, &(metrics_gauges[i].value));
+    }
+    seqlock_write_end(&metrics_gaugeSeq);
+}
+
+void metrics_append(char* buff, int* buffUsed, int bufflen, const char* fmt, ...) {
+    //Helper function for metrics_render(); silently truncates when the buffer is full
+    if (*buffUsed >= bufflen-1) return;
+
+    va_list args;
+    va_start(args, fmt);
+    int numChars = vsnprintf(buff + *buffUsed, bufflen - *buffUsed, fmt, args);
+    va_end(args);
+
+    if (numChars < 0) return;
+    *buffUsed += numChars;
+    if (*buffUsed >= bufflen-1) *buffUsed = bufflen-1;
+}
+
+void metrics_escapeLabel(const char* in, char* out, int bufflen) {
+    //Helper function for metrics_render(); escape '\', '"' and newlines in label values
+    int j = 0;
+    for (int i = 0; in[i] != '\0' && j < bufflen-2; i++) {
+        if (in[i] == '\\' || in[i] == '"') {
+            out[j++] = '\\';
+            out[j++] = in[i];
+        }
+        else if (in[i] == '\n') {
+            out[j++] = '\\';
+            out[j++] = 'n';
+        }
+        else {
+            out[j++] = in[i];
+        }
+    }
+    out[j] = '\0';
+}
+
+int metrics_render(char* buff, int bufflen) {
+    int buffUsed = 0;
+    char hstr[2*EC_MAXNAME+2]; // Escaped name buffer
+
+    struct cycle_stats stats;
+    cycleStats_read(&stats);
+
+    metrics_append(buff, &buffUsed, bufflen,
+                   "# HELP ecd_cycles_total Completed process data exchanges.\n"
+                   "# TYPE ecd_cycles_total counter\n"
+                   "ecd_cycles_total %" PRIu64 "\n", stats.cycles);
+    metrics_append(buff, &buffUsed, bufflen,
+                   "# HELP ecd_wkc_errors_total Cycles where the working counter was lower than expected.\n"
+                   "# TYPE ecd_wkc_errors_total counter\n"
+                   "ecd_wkc_errors_total %" PRIu64 "\n", stats.wkcErrors);
+    metrics_append(buff, &buffUsed, bufflen,
+                   "# HELP ecd_cycle_overruns_total Cycles where the period exceeded the deadline.\n"
+                   "# TYPE ecd_cycle_overruns_total counter\n"
+                   "ecd_cycle_overruns_total %" PRIu64 "\n", stats.overruns);
+    metrics_append(buff, &buffUsed, bufflen,
+                   "# HELP ecd_wkc Working counter of the last cycle, and the expected value.\n"
+                   "# TYPE ecd_wkc gauge\n"
+                   "ecd_wkc{stat=\"last\"} %d\n"
+                   "ecd_wkc{stat=\"expected\"} %d\n", stats.lastWKC, stats.expectedWKC);
+    metrics_append(buff, &buffUsed, bufflen,
+                   "# HELP ecd_dc_time_seconds Distributed clock time after the last exchange.\n"
+                   "# TYPE ecd_dc_time_seconds gauge\n"
+                   "ecd_dc_time_seconds %.9f\n", stats.DCtime*1e-9);
+
+    double meanExchange = stats.cycles > 0 ? (double)stats.sumExchange_ns / stats.cycles : 0.0;
+    metrics_append(buff, &buffUsed, bufflen,
+                   "# HELP ecd_exchange_seconds Duration of the process data exchange.\n"
+                   "# TYPE ecd_exchange_seconds gauge\n"
+                   "ecd_exchange_seconds{stat=\"last\"} %.9f\n"
+                   "ecd_exchange_seconds{stat=\"min\"} %.9f\n"
+                   "ecd_exchange_seconds{stat=\"max\"} %.9f\n"
+                   "ecd_exchange_seconds{stat=\"mean\"} %.9f\n",
+                   stats.lastExchange_ns*1e-9, stats.minExchange_ns*1e-9,
+                   stats.maxExchange_ns*1e-9, meanExchange*1e-9);
+    metrics_append(buff, &buffUsed, bufflen,
+                   "# HELP ecd_period_seconds Time between the start of consecutive exchanges.\n"
+                   "# TYPE ecd_period_seconds gauge\n"
+                   "ecd_period_seconds{stat=\"last\"} %.9f\n"
+                   "ecd_period_seconds{stat=\"max\"} %.9f\n",
+                   stats.lastPeriod_ns*1e-9, stats.maxPeriod_ns*1e-9);
+    metrics_append(buff, &buffUsed, bufflen,
+                   "# HELP ecd_lock_wait_seconds Time the cycle thread waited for the IOmap lock.\n"
+                   "# TYPE ecd_lock_wait_seconds gauge\n"
+                   "ecd_lock_wait_seconds{stat=\"last\"} %.9f\n"
+                   "ecd_lock_wait_seconds{stat=\"max\"} %.9f\n",
+                   stats.lastLockWait_ns*1e-9, stats.maxLockWait_ns*1e-9);
+    metrics_append(buff, &buffUsed, bufflen,
+                   "# HELP ecd_in_op Whether the PLC is in OP, and whether the IOmap is updating.\n"
+                   "# TYPE ecd_in_op gauge\n"
+                   "ecd_in_op %d\n"
+                   "# TYPE ecd_updating gauge\n"
+                   "ecd_updating %d\n", inOP ? 1 : 0, updating ? 1 : 0);
+
+    //Per-slave data; these fields are single words, so reading them without the lock is safe enough
+    int slavecount = ec_slavecount;
+    metrics_append(buff, &buffUsed, bufflen,
+                   "# HELP ecd_slaves Number of slaves found on the bus.\n"
+                   "# TYPE ecd_slaves gauge\n"
+                   "ecd_slaves %d\n", slavecount);
+    metrics_append(buff, &buffUsed, bufflen,
+                   "# HELP ecd_slave_state EtherCAT state of each slave (8 = OP).\n"
+                   "# TYPE ecd_slave_state gauge\n");
+    for (int slave = 1; slave <= slavecount; slave++) {
+        metrics_escapeLabel(ec_slave[slave].name, hstr, sizeof(hstr));
+        metrics_append(buff, &buffUsed, bufflen, "ecd_slave_state{slave=\"%d\",name=\"%s\"} %d\n",
+                       slave, hstr, ec_slave[slave].state);
+    }
+    metrics_append(buff, &buffUsed, bufflen,
+                   "# HELP ecd_slave_al_status AL status code of each slave.\n"
+                   "# TYPE ecd_slave_al_status gauge\n");
+    for (int slave = 1; slave <= slavecount; slave++) {
+        metrics_append(buff, &buffUsed, bufflen, "ecd_slave_al_status{slave=\"%d\"} %d\n",
+                       slave, ec_slave[slave].ALstatuscode);
+    }
+    metrics_append(buff, &buffUsed, bufflen,
+                   "# HELP ecd_slave_lost Whether each slave is currently lost.\n"
+                   "# TYPE ecd_slave_lost gauge\n");
+    for (int slave = 1; slave <= slavecount; slave++) {
+        metrics_append(buff, &buffUsed, bufflen, "ecd_slave_lost{slave=\"%d\"} %d\n",
+                       slave, ec_slave[slave].islost ? 1 : 0);
+    }
+
+    //Per-slave health, maintained by the watchdog
+    struct health_slave  health[slavecount > 0 ? slavecount : 1];
+    struct health_totals healthTotals;
+    health_read(health, slavecount, &healthTotals);
+    metrics_append(buff, &buffUsed, bufflen,
+                   "# HELP ecd_wkc_drops_unattributed_total Cycles with a short working counter while all slaves were in OP.\n"
+                   "# TYPE ecd_wkc_drops_unattributed_total counter\n"
+                   "ecd_wkc_drops_unattributed_total %" PRIu64 "\n"
+                   "# HELP ecd_slave_wkc_drops_total Cycles with a short working counter while the slave was not in OP.\n"
+                   "# TYPE ecd_slave_wkc_drops_total counter\n", healthTotals.unattributed);
+    for (int slave = 1; slave <= slavecount; slave++) {
+        metrics_append(buff, &buffUsed, bufflen, "ecd_slave_wkc_drops_total{slave=\"%d\"} %" PRIu64 "\n",
+                       slave, health[slave-1].wkcDrops);
+    }
+    metrics_append(buff, &buffUsed, bufflen,
+                   "# HELP ecd_slave_transitions_total State changes of each slave seen by the watchdog.\n"
+                   "# TYPE ecd_slave_transitions_total counter\n");
+    for (int slave = 1; slave <= slavecount; slave++) {
+        metrics_append(buff, &buffUsed, bufflen, "ecd_slave_transitions_total{slave=\"%d\"} %" PRIu64 "\n",
+                       slave, health[slave-1].transitions);
+    }
+    metrics_append(buff, &buffUsed, bufflen,
+                   "# HELP ecd_slave_losses_total Times each slave was marked lost.\n"
+                   "# TYPE ecd_slave_losses_total counter\n");
+    for (int slave = 1; slave <= slavecount; slave++) {
+        metrics_append(buff, &buffUsed, bufflen, "ecd_slave_losses_total{slave=\"%d\"} %" PRIu64 "\n",
+                       slave, health[slave-1].losses);
+    }
+    metrics_append(buff, &buffUsed, bufflen,
+                   "# HELP ecd_slave_recovery_attempts_total Recovery actions of the watchdog on each slave.\n"
+                   "# TYPE ecd_slave_recovery_attempts_total counter\n");
+    for (int slave = 1; slave <= slavecount; slave++) {
+        struct health_slave* h = &(health[slave-1]);
+        metrics_append(buff, &buffUsed, bufflen,
+                       "ecd_slave_recovery_attempts_total{slave=\"%d\",action=\"ack\"} %" PRIu64 "\n"
+                       "ecd_slave_recovery_attempts_total{slave=\"%d\",action=\"op_request\"} %" PRIu64 "\n"
+                       "ecd_slave_recovery_attempts_total{slave=\"%d\",action=\"reconfig\"} %" PRIu64 "\n"
+                       "ecd_slave_recovery_attempts_total{slave=\"%d\",action=\"recover\"} %" PRIu64 "\n",
+                       slave, h->attempts[HEALTH_ACK], slave, h->attempts[HEALTH_OPREQUEST],
+                       slave, h->attempts[HEALTH_RECONFIG], slave, h->attempts[HEALTH_RECOVER]);
+    }
+    metrics_append(buff, &buffUsed, bufflen,
+                   "# HELP ecd_slave_recovery_successes_total Successful reconfigurations and recoveries of each slave.\n"
+                   "# TYPE ecd_slave_recovery_successes_total counter\n");
+    for (int slave = 1; slave <= slavecount; slave++) {
+        struct health_slave* h = &(health[slave-1]);
+        metrics_append(buff, &buffUsed, bufflen,
+                       "ecd_slave_recovery_successes_total{slave=\"%d\",action=\"reconfig\"} %" PRIu64 "\n"
+                       "ecd_slave_recovery_successes_total{slave=\"%d\",action=\"recover\"} %" PRIu64 "\n",
+                       slave, h->successes[HEALTH_RECONFIG], slave, h->successes[HEALTH_RECOVER]);
+    }
+    metrics_append(buff, &buffUsed, bufflen,
+                   "# HELP ecd_slave_non_op_seconds_total Time each slave spent out of OP, including the current episode.\n"
+                   "# TYPE ecd_slave_non_op_seconds_total counter\n");
+    for (int slave = 1; slave <= slavecount; slave++) {
+        metrics_append(buff, &buffUsed, bufflen, "ecd_slave_non_op_seconds_total{slave=\"%d\"} %.3f\n",
+                       slave, health[slave-1].nonOp_ns*1e-9);
+    }
+    metrics_append(buff, &buffUsed, bufflen,
+                   "# HELP ecd_slave_recovery_seconds Duration of the last and the longest episode out of OP of each slave.\n"
+                   "# TYPE ecd_slave_recovery_seconds gauge\n");
+    for (int slave = 1; slave <= slavecount; slave++) {
+        metrics_append(buff, &buffUsed, bufflen,
+                       "ecd_slave_recovery_seconds{slave=\"%d\",stat=\"last\"} %.3f\n"
+                       "ecd_slave_recovery_seconds{slave=\"%d\",stat=\"max\"} %.3f\n",
+                       slave, health[slave-1].lastRecovery_ns*1e-9, slave, health[slave-1].maxRecovery_ns*1e-9);
+    }
+    metrics_append(buff, &buffUsed, bufflen,
+                   "# HELP ecd_slave_last_al_status Last non-zero AL status code of each slave seen by the watchdog.\n"
+                   "# TYPE ecd_slave_last_al_status gauge\n");
+    for (int slave = 1; slave <= slavecount; slave++) {
+        metrics_append(buff, &buffUsed, bufflen, "ecd_slave_last_al_status{slave=\"%d\"} %d\n",
+                       slave, health[slave-1].ALstatuscode);
+    }
+
+    //Network clients
+    int numClients = 0;
+    for (int i = 0; i < NUMIPSERVERS; i++) {
+        // A free slot is marked inUse while mainIPserver() waits in accept(); only count real connections
+        if (IPservers[i].inUse && IPservers[i].connfd > 0) numClients++;
+    }
+    metrics_append(buff, &buffUsed, bufflen,
+                   "# HELP ecd_clients_connected Number of connected line protocol clients.\n"
+                   "# TYPE ecd_clients_connected gauge\n"
+                   "ecd_clients_connected %d\n"
+                   "# TYPE ecd_clients_max gauge\n"
+                   "ecd_clients_max %d\n", numClients, NUMIPSERVERS);
+
+    //Admission control
+    struct load_counters loadCounters;
+    load_getCounters(&loadCounters);
+    metrics_append(buff, &buffUsed, bufflen,
+                   "# HELP ecd_client_commands_limited_total Client commands deferred or rejected by the admission control.\n"
+                   "# TYPE ecd_client_commands_limited_total counter\n"
+                   "ecd_client_commands_limited_total{reason=\"deferred\"} %" PRIu64 "\n"
+                   "ecd_client_commands_limited_total{reason=\"rate_limited\"} %" PRIu64 "\n"
+                   "ecd_client_commands_limited_total{reason=\"over_budget\"} %" PRIu64 "\n"
+                   "ecd_client_commands_limited_total{reason=\"shed\"} %" PRIu64 "\n"
+                   "# HELP ecd_load_shedding Whether expensive commands are currently shed because of cycle overruns.\n"
+                   "# TYPE ecd_load_shedding gauge\n"
+                   "ecd_load_shedding %d\n",
+                   loadCounters.deferred, loadCounters.rateLimited, loadCounters.overBudget, loadCounters.shed,
+                   load_shedding());
+
+    //Logger
+    metrics_append(buff, &buffUsed, bufflen,
+                   "# HELP ecd_log_dropped_total Log messages dropped because the logger could not keep up.\n"
+                   "# TYPE ecd_log_dropped_total counter\n"
+                   "ecd_log_dropped_total %" PRIu64 "\n", log_droppedTotal());
+
+    //Packet rings on the EtherCAT socket (NIC_RING)
+    struct ring_counters ringCounters;
+    if (ring_read(&ringCounters)) {
+        metrics_append(buff, &buffUsed, bufflen,
+                       "# HELP ecd_nic_ring_frames_total Frames through the packet rings.\n"
+                       "# TYPE ecd_nic_ring_frames_total counter\n"
+                       "ecd_nic_ring_frames_total{dir=\"rx\"} %" PRIu64 "\n"
+                       "ecd_nic_ring_frames_total{dir=\"tx\"} %" PRIu64 "\n"
+                       "# HELP ecd_nic_ring_recv_total Receive calls which found the ring empty, by outcome.\n"
+                       "# TYPE ecd_nic_ring_recv_total counter\n"
+                       "ecd_nic_ring_recv_total{outcome=\"spun\"} %" PRIu64 "\n"
+                       "ecd_nic_ring_recv_total{outcome=\"waited\"} %" PRIu64 "\n"
+                       "ecd_nic_ring_recv_total{outcome=\"empty\"} %" PRIu64 "\n"
+                       "# HELP ecd_nic_ring_tx_busy_total Send calls which found the TX ring full.\n"
+                       "# TYPE ecd_nic_ring_tx_busy_total counter\n"
+                       "ecd_nic_ring_tx_busy_total %" PRIu64 "\n"
+                       "# HELP ecd_nic_ring_drops_total Frames dropped by the kernel because the RX ring was full.\n"
+                       "# TYPE ecd_nic_ring_drops_total counter\n"
+                       "ecd_nic_ring_drops_total %" PRIu64 "\n",
+                       ringCounters.rxFrames, ringCounters.txFrames,
+                       ringCounters.rxSpins, ringCounters.rxWaits, ringCounters.rxEmpty,
+                       ringCounters.txBusy, ringCounters.drops);
+    }
+
+    //Heap allocations, only counted by the instrumented build (ECD_ALLOCSTATS)
+    struct alloc_counters allocCounters;
+    if (alloc_read(&allocCounters)) {
+        metrics_append(buff, &buffUsed, bufflen,
+                       "# HELP ecd_heap_allocations_total Heap allocations (malloc, calloc, realloc) per thread.\n"
+                       "# TYPE ecd_heap_allocations_total counter\n");
+        for (int i = 0; i < ALLOC_NUMTHREADS; i++) {
+            metrics_append(buff, &buffUsed, bufflen, "ecd_heap_allocations_total{thread=\"%s\"} %" PRIu64 "\n",
+                           alloc_threadNames[i], allocCounters.allocs[i]);
+        }
+        metrics_append(buff, &buffUsed, bufflen,
+                       "# HELP ecd_cycle_heap_allocations_in_op_total Heap allocations by the cycle thread since it reached OP; should stay 0.\n"
+                       "# TYPE ecd_cycle_heap_allocations_in_op_total counter\n"
+                       "ecd_cycle_heap_allocations_in_op_total %" PRIu64 "\n"
+                       "# HELP ecd_client_heap_allocations_in_op_total Heap allocations by the client threads since the cycle reached OP; only 'rescan' should allocate.\n"
+                       "# TYPE ecd_client_heap_allocations_in_op_total counter\n"
+                       "ecd_client_heap_allocations_in_op_total %" PRIu64 "\n", allocCounters.cycleInOP, allocCounters.clientInOP);
+    }
+
+    //Selected PDO values
+    if (metrics_numGauges > 0) {
+        double values[metrics_numGauges];
+        char   valid[metrics_numGauges];
+        uint32 s;
+        do {
+            s = seqlock_read_begin(&metrics_gaugeSeq);
+            for (int i = 0; i < metrics_numGauges; i++) {
+                values[i] = metrics_gauges[i].value;
+                valid[i]  = metrics_gauges[i].valid;
+            }
+        } while (seqlock_read_retry(&metrics_gaugeSeq, s));
+
+        metrics_append(buff, &buffUsed, bufflen,
+                       "# HELP ecd_pdo_value Current value of selected PDOs.\n"
+                       "# TYPE ecd_pdo_value gauge\n");
+        for (int i = 0; i < metrics_numGauges; i++) {
+            if (!valid[i]) continue;
+            struct mappings_PDO* mapping = metrics_gauges[i].mapping;
+            metrics_escapeLabel(mapping->name, hstr, sizeof(hstr));
+            metrics_append(buff, &buffUsed, bufflen,
+                           "ecd_pdo_value{slave=\"%d\",index=\"0x%4.4X\",subindex=\"0x%2.2X\",name=\"%s\"} %.10g\n",
+                           mapping->slaveIdx, mapping->idx, mapping->subidx, hstr, values[i]);
+        }
+    }
+
+    return buffUsed;
+}
+
+void metrics_respond(struct metrics_conn* conn) {
+    //Helper function for mainMetricsServer(); build the response once the request header is complete
+    const char* status = "200 OK";
+    int bodyLen = 0;
+
+    if (!strncmp(conn->request, "GET /metrics", 12) || !strncmp(conn->request, "GET / ", 6)) {
+        bodyLen = metrics_render(metrics_body, METRICS_BUFFLEN - 256); // Leave space for the header
+    }
+    else {
+        status  = "404 Not Found";
+        bodyLen = snprintf(metrics_body, METRICS_BUFFLEN, "Only /metrics is served here.\n");
+    }
+
+    int headerLen = snprintf(conn->response, METRICS_BUFFLEN,
+                             "HTTP/1.0 %s\r\n"
+                             "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+                             "Content-Length: %d\r\n"
+                             "Connection: close\r\n"
+                             "\r\n", status, bodyLen);
+    memcpy(conn->response + headerLen, metrics_body, bodyLen);
+    conn->responseLen  = headerLen + bodyLen;
+    conn->responseSent = 0;
+}
+
+void metrics_close(struct metrics_conn* conn) {
+    close(conn->fd);
+    conn->fd = -1;
+}
+
+void mainMetricsServer(void* ptr) {
+    // HTTP server for Prometheus/OpenMetrics scraping.
+    // Single thread serving all connections with poll() and non-blocking sockets,
+    // so that a slow scraper can never hold up anything else.
+
+    (void)ptr; // Not used, reference it to quiet down the compiler
+    alloc_setThread(ALLOC_METRICS);
+
+    for (int i = 0; i < METRICS_MAXCONN; i++) {
+        metrics_conns[i].fd = -1;
+    }
+
+    //Wait for root privs to be dropped
+    pthread_mutex_lock(&rootprivs_lock);
+    pthread_mutex_unlock(&rootprivs_lock);
+
+    int listenfd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listenfd == -1) {
+        log_fatal("ERROR when opening metrics socket: %m\n");
+    }
+
+    int enableReuse = 1;
+    if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &enableReuse, sizeof(int)) < 0){
+        log_warn("WARNING: setsockopt(SO_REUSEADDR) failed for metrics socket: %m\n");
+    }
+
+    struct sockaddr_in metricsaddr;
+    memset(&metricsaddr, 0, sizeof(metricsaddr));
+    metricsaddr.sin_family = AF_INET;
+    metricsaddr.sin_addr.s_addr = htonl(INADDR_ANY);
+    metricsaddr.sin_port = htons(config_file.metrics_port);
+
+    if ((bind(listenfd, (struct sockaddr*)&metricsaddr, sizeof(metricsaddr))) != 0) {
+        log_fatal("ERROR: Metrics socket bind failed: %m\n");
+    }
+    if ((listen(listenfd, METRICS_MAXCONN)) != 0) {
+        log_fatal("ERROR: Metrics socket listen failed: %m\n");
+    }
+    fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+
+    log_info("metrics listen OK on port %d\n", config_file.metrics_port);
+
+    struct pollfd pfds[METRICS_MAXCONN+1];
+    int pfdConn[METRICS_MAXCONN+1]; // Which connection belongs to each pollfd
+
+    while (!gotCtrlC) {
+        int nfds = 0;
+        pfds[nfds].fd     = listenfd;
+        pfds[nfds].events = POLLIN;
+        pfdConn[nfds]     = -1;
+        nfds++;
+        for (int i = 0; i < METRICS_MAXCONN; i++) {
+            if (metrics_conns[i].fd < 0) continue;
+            pfds[nfds].fd     = metrics_conns[i].fd;
+            pfds[nfds].events = metrics_conns[i].responseLen > 0 ? POLLOUT : POLLIN;
+            pfdConn[nfds]     = i;
+            nfds++;
+        }
+
+        if (poll(pfds, nfds, METRICS_POLLTIME) < 0) {
+            if (errno == EINTR) continue;
+            log_error("ERROR: poll() failed in metrics server: %m\n");
+            break;
+        }
+        int64 now = monotonicTime_ns();
+
+        //New connections
+        if (pfds[0].revents & POLLIN) {
+            int connfd;
+            while ( (connfd = accept(listenfd, NULL, NULL)) >= 0 ) {
+                int i;
+                for (i = 0; i < METRICS_MAXCONN; i++) {
+                    if (metrics_conns[i].fd < 0) break;
+                }
+                if (i == METRICS_MAXCONN) { // Too many scrapers; they can retry
+                    close(connfd);
+                    continue;
+                }
+                fcntl(connfd, F_SETFL, fcntl(connfd, F_GETFL) | O_NONBLOCK);
+                metrics_conns[i].fd            = connfd;
+                metrics_conns[i].lastActive_ns = now;
+                metrics_conns[i].requestLen    = 0;
+                metrics_conns[i].responseLen   = 0;
+                metrics_conns[i].responseSent  = 0;
+                memset(metrics_conns[i].request, 0, METRICS_REQLEN);
+            }
+        }
+
+        //Existing connections
+        for (int p = 1; p < nfds; p++) {
+            struct metrics_conn* conn = &(metrics_conns[pfdConn[p]]);
+
+            if (pfds[p].revents & (POLLERR | POLLHUP | POLLNVAL)) {
+                metrics_close(conn);
+                continue;
+            }
+
+            if ((pfds[p].revents & POLLIN) && conn->responseLen == 0) {
+                int numBytes = read(conn->fd, conn->request + conn->requestLen,
+                                    METRICS_REQLEN - 1 - conn->requestLen);
+                if (numBytes <= 0) {
+                    metrics_close(conn);
+                    continue;
+                }
+                conn->requestLen += numBytes;
+                conn->lastActive_ns = now;
+
+                if (strstr(conn->request, "\r\n\r\n") != NULL || strstr(conn->request, "\n\n") != NULL) {
+                    metrics_respond(conn);
+                }
+                else if (conn->requestLen >= METRICS_REQLEN - 1) { // Header too long; give up
+                    metrics_close(conn);
+                    continue;
+                }
+            }
+
+            if ((pfds[p].revents & POLLOUT) && conn->responseLen > 0) {
+                //MSG_NOSIGNAL: a scraper which hangs up early gives EPIPE, not SIGPIPE
+                int numBytes = send(conn->fd, conn->response + conn->responseSent,
+                                    conn->responseLen - conn->responseSent, MSG_NOSIGNAL);
+                if (numBytes < 0) {
+                    if (errno != EAGAIN && errno != EWOULDBLOCK) metrics_close(conn);
+                    continue;
+                }
+                conn->responseSent += numBytes;
+                conn->lastActive_ns = now;
+                if (conn->responseSent >= conn->responseLen) {
+                    metrics_close(conn);
+                }
+            }
+        }
+
+        //Drop stale connections
+        for (int i = 0; i < METRICS_MAXCONN; i++) {
+            if (metrics_conns[i].fd >= 0 &&
+                now - metrics_conns[i].lastActive_ns > (int64)METRICS_TIMEOUT*1000000) {
+                metrics_close(&(metrics_conns[i]));
+            }
+        }
+    }
+
+    close(listenfd);
+}
@@ -0,0 +1,53 @@
+#ifndef metricsServer_h
+#define metricsServer_h
+
+#include "ecatDriver.h"
+
+// Configuration    ************************************************************************
+#define METRICS_MAXCONN  4     // Max simultaneous scrapes being served
+#define METRICS_BUFFLEN  131072 // Max size of one HTTP response [bytes]; ~25 lines per slave
+#define METRICS_REQLEN   2048  // Max size of one HTTP request header [bytes]
+#define METRICS_TIMEOUT  2000  // Drop connections which are idle for longer than this [ms]
+#define METRICS_POLLTIME 200   // How long to wait in poll() before checking gotCtrlC [ms]
+
+// Data types       ************************************************************************
+
+// A PDO exported as a gauge; the value is copied by the cycle thread,
+// so the scrape never has to grab IOmap_lock.
+struct metrics_gauge {
+    struct mappings_PDO* mapping;
+    double value;
+    char   valid;
+};
+
+// One HTTP connection being served
+struct metrics_conn {
+    int   fd;                  // -1 if unused
+    int64 lastActive_ns;
+
+    char  request[METRICS_REQLEN];
+    int   requestLen;
+
+    char  response[METRICS_BUFFLEN];
+    int   responseLen;         // 0 while still reading the request
+    int   responseSent;
+};
+
+// Functions        ************************************************************************
+
+// Resolve config_file.metricsPDOs against mapping_in/mapping_out.
+// Must be called after ecat_setup_mappings().
+// Returns 1 on success, 0 in case of error.
+int metrics_resolvePDOs();
+
+// Copy the values of the exported PDOs; called by the cycle thread with IOmap_lock grabbed.
+void metrics_updatePDOs();
+
+// Format all metrics in the Prometheus text exposition format into the given buffer.
+// Returns the number of characters written (never more than bufflen-1).
+int metrics_render(char* buff, int bufflen);
+
+// Non-blocking HTTP server for the metrics. Runs in it's own thread.
+void mainMetricsServer(void* ptr);
+
+#endif
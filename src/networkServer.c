@@ -6,9 +6,14 @@
 #include <stdlib.h>
 
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include <unistd.h>
+#include <poll.h>
+#include <time.h>
 #include <arpa/inet.h>
 
 #include <pthread.h>
@@ -17,24 +22,110 @@
 
 #include "EtherCatDaemon.h"
 #include "ecatDriver.h"
+#include "mcastPublisher.h"
+#include "derivedChannels.h"
+#include "channelStats.h"
+#include "channelHistory.h"
+#include "triggerCapture.h"
+#include "shmImage.h"
+#include "channelAlarms.h"
+#include "mappingTable.h"
+#include "setpointWaveform.h"
+#include "allocStats.h"
+#include "aggregator.h"
+#include "decodedImage.h"
+#include "slaveHealth.h"
+#include "lockTrace.h"
 
 //Socket on the server
 struct sockaddr_in servaddr;
 int sockfd;
+//Socket for local clients (UNIX_SOCKET), or -1
+int unixSockfd = -1;
 // Array of server connection slots
 struct IPserverThreads IPservers[NUMIPSERVERS];
+// Stacks of the client threads, one per slot, each below a guard page (see CLIENT_STACK)
+char*  IPserverStacks    = NULL;
+size_t IPserverStackSize = 0;
+
+// Text for the 'help' command, one line per entry
+const char* helpText[] = {
+    "  ACCEPTED COMMANDS:\n",
+    "  'bye'                     End this network connection\n",
+    "  'quit'                    Virtual Control+C on the server\n",
+    "  'dump'                    Dump the current IOmap\n",
+    "  'meta all'                Show mappings for all PDOs\n",
+    "  'meta slaves'             Show the slaves and their areas of the IOmap (offset and bits)\n",
+    "  'meta slave:idx:subidx'   Show mappings for given PDO (format int:hex:hex)\n",
+    "  'health'                  Get the communication health counters of each slave (lost, WKC drops, recoveries)\n",
+    "  'rescan'                  Re-read the PDO mappings from the slaves, e.g. after replacing a terminal\n",
+    "  'get slave:idx:subidx'    Get current value for given PDO (format int:hex:hex)\n",
+    "  'get 0:idx:0'             Get current value of a DERIVED channel\n",
+    "  'get slave:idx:subidx fresh'  Wait for the next cycle, then get the value and the cycle number\n",
+    "  'waitcycle N'             Wait until N more cycles are done; returns cycle number and DC time\n",
+    "  'time'                    Get the CLOCK_REALTIME of the daemon [ns] and the DC time\n",
+    "  'subscribe [N]'           Turn this connection into a stream of binary process images, every N cycles\n",
+    "  'nodes'                   Show the upstream daemons (aggregator mode)\n",
+    "  'get node/slave:idx:subidx'  Get the current value of a PDO of an upstream daemon (aggregator mode)\n",
+    "  'meta node/all'           Show the input mappings of an upstream daemon (aggregator mode)\n",
+    "  'stats slave:idx:subidx'  Get min/max/mean/rms over the configured STATS windows\n",
+    "  'history slave:idx:subidx span [points]'  Get min/max/mean of a HISTORY channel over the last span [s],\n",
+    "                            from the finest tier with at most 'points' points (default 1000)\n",
+    "  'stats alloc'             Get the heap allocations per thread (instrumented build, ECD_ALLOCSTATS)\n",
+    "  'locks'                   Get the wait/hold times of IOmap_lock per call site [us] (instrumented build, ECD_LOCKTRACE)\n",
+    "  'locks reset'             Clear the lock histograms\n",
+    "  'mcast'                   Show multicast group and payload layout\n",
+    "  'shm'                     Get the shared memory process image (UNIX_SOCKET only)\n",
+    "  'trigger arm above|below slave:idx:subidx level'\n",
+    "  'trigger arm rising|falling slave:idx:subidx'\n",
+    "  'trigger arm wkc'         Arm the triggered capture of the CAPTURE_PDOs\n",
+    "  'trigger disarm'          Disarm and discard the capture\n",
+    "  'trigger'                 Show the state of the triggered capture\n",
+    "  'capture'                 Get the finished capture (pre- and post-trigger rows)\n",
+    "  'alarm add above|below|rising|falling slave:idx:subidx level [hysteresis]'\n",
+    "                            Get an 'evt alarm ...' line whenever the condition changes state\n",
+    "  'alarm del id'            Delete an alarm\n",
+    "  'alarm'                   List the alarms of this connection\n",
+    "  'wave channels slave:idx:subidx ...'  Take over the waveform player and select output PDOs\n",
+    "  'wave data v1 v2 ...; v1 v2 ...'      Append rows to the next segment (waits while two are queued)\n",
+    "  'wave commit [loop]'      Queue the segment; a loop repeats until the next one is queued\n",
+    "  'wave start' / 'wave stop'  Start / stop playing one row per cycle\n",
+    "  'wave'                    Show the state of the waveform player\n",
+    "  '\\r' or '\\n' (ENTER)      Repeat previous command\n",
+    NULL
+};
+
+// Commands which are subject to the shared budget and to load shedding (matched as prefixes);
+// they hold IOmap_lock for a long time, or send many records
+const char* expensiveCommands[] = {
+    "dump",
+    "meta all",
+    "capture",
+    "rescan",
+    "history",
+    NULL
+};
+
+int64 waitTimeout_ns(int numCycles) {
+    //Helper function for chatCommand(); how long to wait for numCycles cycles before giving up
+    return (int64)numCycles*PLC_deadline*1000 + 1000000000LL;
+}
 
-int writeMapping(char* buff_out, struct mappings_PDO* mapping, int connfd) {
-    //Helper function for chatThread()
-
+int formatMapping(char* buff_out, struct mappings_PDO* mapping) {
+    //Helper function for writeMapping() and maptext_new(); returns the snprintf() result
     char hstr[BUFFLEN]; // String buffer for conversion functions
     memset(hstr,0,BUFFLEN);
 
-    int numChars = snprintf(buff_out, BUFFLEN,
-                            "  [0x%4.4X.%1d] %d:0x%4.4X:0x%2.2X 0x%2.2X %-12s %s\n",
-                            mapping->offset, mapping->bitoff,
-                            mapping->slaveIdx, mapping->idx, mapping->subidx,
-                            mapping->bitlen, dtype2string(mapping->dataType, hstr, BUFFLEN), mapping->name);
+    return snprintf(buff_out, BUFFLEN,
+                    "  [0x%4.4X.%1d] %d:0x%4.4X:0x%2.2X 0x%2.2X %-12s %s\n",
+                    mapping->offset, mapping->bitoff,
+                    mapping->slaveIdx, mapping->idx, mapping->subidx,
+                    mapping->bitlen, dtype2string(mapping->dataType, hstr, BUFFLEN), mapping->name);
+}
+int writeMapping(char* buff_out, struct mappings_PDO* mapping, int connfd) {
+    //Helper function for chatThread()
+
+    int numChars = formatMapping(buff_out, mapping);
     if (numChars < 0 || numChars >= BUFFLEN) {
         memset(buff_out,0,BUFFLEN);
         snprintf(buff_out, BUFFLEN,
@@ -44,258 +135,667 @@ int writeMapping(char* buff_out, struct mappings_PDO* mapping, int connfd) {
     write(connfd, buff_out, numChars);
     memset(buff_out, 0, numChars); //Don't need to zero everything every time
 }
-void chatThread(void* ptr) {
-    //Runs in it's own thread, talking to one client
-    // NOTE: To test with TELNET client, LINEMODE must be used!
-    struct IPserverThreads* myThread = (struct IPserverThreads*) ptr;
-
-    char buff_in[BUFFLEN];
-    char buff_out[BUFFLEN];
-    memset(buff_in,       0, BUFFLEN);
-    memset(buff_out,      0, BUFFLEN);
-
-    char hstr[BUFFLEN]; // String buffer for conversion functions
-    memset(hstr,0,BUFFLEN);
-
-    boolean didRepeat     = FALSE;
-    char    buff_in_prev[BUFFLEN];
-    memset(buff_in_prev,  0, BUFFLEN);
-
-    while (1) {
-        //Check that we didn't get a SIGPIPE
-        if (myThread->gotSIGPIPE == 1) {
-            pthread_mutex_lock(&printf_lock);
-            printf("slot %d got SIGPIPE (client %s) \n", myThread->ipServerNum, inet_ntoa(myThread->client.sin_addr));
-            pthread_mutex_unlock(&printf_lock);
-            goto endcom;
+int chatCommand(struct IPserverThreads* myThread, char* buff_in, char* buff_out, char* hstr) {
+    //Parse and answer one command for chatThread().
+    // Returns 1 if the connection should be closed, else 0.
+    // Kept separate from the socket loop so that it can also be driven by the microbenchmarks.
+
+    //Admission control; 'bye' and 'quit' are always let through
+    if (strncmp(buff_in, "bye", 3) && strncmp(buff_in, "quit", 4)) {
+        int expensive = 0;
+        for (int i = 0; expensiveCommands[i] != NULL; i++) {
+            if (!strncmp(buff_in, expensiveCommands[i], strlen(expensiveCommands[i]))) expensive = 1;
         }
 
-        //Tell the client that we are ready for the next command
-        strncpy(buff_out,"ok\n",BUFFLEN);
-        write(myThread->connfd, buff_out, BUFFLEN);
-        memset(buff_out,0,BUFFLEN);
-
-        int numBytes = read(myThread->connfd, buff_in, BUFFLEN);
-        if (numBytes >= BUFFLEN || buff_in[BUFFLEN-1] != '\0') {
-            //Note: Last byte in buff should always be \0.
-            pthread_mutex_lock(&printf_lock);
-            fprintf(stderr, "ERROR, message too long");
-            pthread_mutex_unlock(&printf_lock);
-            goto endcom;
+        switch (load_admit(&(myThread->bucket), expensive)) {
+        case LOAD_OK:
+            break;
+        case LOAD_RATELIMITED:
+            snprintf(buff_out, BUFFLEN, "err: rate limit, max %d commands/s per connection\n", config_file.client_rate);
+            break;
+        case LOAD_BUDGET:
+            snprintf(buff_out, BUFFLEN, "err: busy, max %d expensive commands/s for all clients; retry later\n",
+                     config_file.expensive_rate);
+            break;
+        case LOAD_SHED:
+            strncpy(buff_out, "err: busy, the bus cycle is missing its deadline; retry later\n", BUFFLEN);
+            break;
         }
-        //printf("GOT: (%d) '%s'\n", strlen(buff_in), buff_in);
-
-        //Replay last command
-        if (buff_in[0] =='\n' || buff_in[0] == '\r')  {  // linebreak -> replay previous cmd
-            if (buff_in_prev[0] == '\0') {
-                strncpy(buff_out, "err: No previous command available.\n", BUFFLEN);
-                write(myThread->connfd, buff_out, BUFFLEN);
-                memset(buff_out,0,BUFFLEN);
-                goto donecmds;
-            }
-            else {
-                memset(buff_in,0,BUFFLEN);
-                memcpy(buff_in, buff_in_prev, BUFFLEN);
-                didRepeat = TRUE;
-            }
+        if (buff_out[0] != '\0') {
+            write(myThread->connfd, buff_out, BUFFLEN);
+            memset(buff_out,0,BUFFLEN);
+            return 0;
         }
+    }
 
-        // Command parsing
-        if      (!strncmp(buff_in, "bye",      3))  {  // bye
-            //Terminate this connection
-            goto endcom;
-        }
-        else if (!strncmp(buff_in, "quit",     4))  {  // quit
-            if ( config_file.allowQuit == 1 ) {
-                pthread_mutex_lock(&printf_lock);
-                printf("quit from slot %d address %s \n", myThread->ipServerNum, inet_ntoa(myThread->client.sin_addr));
-                pthread_mutex_unlock(&printf_lock);
-                close(myThread->connfd);
-                close(sockfd);
-                gotCtrlC=1;
-            }
-            else {
-                strncpy(buff_out, "err: 'quit' disabled in config file. Treating as 'bye'.\n", BUFFLEN);
-                write(myThread->connfd, buff_out, BUFFLEN);
-                memset(buff_out,0,BUFFLEN);
-            }
-            goto endcom;
+    if      (!strncmp(buff_in, "bye",      3))  {  // bye
+        //Terminate this connection
+        return 1;
+    }
+    else if (!strncmp(buff_in, "quit",     4))  {  // quit
+        if ( config_file.allowQuit == 1 ) {
+            log_info("quit from slot %d address %s \n", myThread->ipServerNum, myThread->clientName);
+            close(myThread->connfd);
+            close(sockfd);
+            gotCtrlC=1;
         }
-        else if (!strncmp(buff_in, "help",    4))  {  // help
-            int buffUsed = 0;
-            buffUsed += snprintf(buff_out+buffUsed, BUFFLEN-buffUsed,
-                                 "  ACCEPTED COMMANDS:\n");
-            buffUsed += snprintf(buff_out+buffUsed, BUFFLEN-buffUsed,
-                                 "  'bye'                     End this network connection\n");
-            buffUsed += snprintf(buff_out+buffUsed, BUFFLEN-buffUsed,
-                                 "  'quit'                    Virtual Control+C on the server\n");
-            buffUsed += snprintf(buff_out+buffUsed, BUFFLEN-buffUsed,
-                                 "  'dump'                    Dump the current IOmap\n");
-            buffUsed += snprintf(buff_out+buffUsed, BUFFLEN-buffUsed,
-                                 "  'meta all'                Show mappings for all PDOs\n");
-            buffUsed += snprintf(buff_out+buffUsed, BUFFLEN-buffUsed,
-                                 "  'meta slave:idx:subidx'   Show mappings for given PDO (format int:hex:hex)\n");
-            buffUsed += snprintf(buff_out+buffUsed, BUFFLEN-buffUsed,
-                                 "  'get slave:idx:subidx'    Get current value for given PDO (format int:hex:hex)\n");
-            buffUsed += snprintf(buff_out+buffUsed, BUFFLEN-buffUsed,
-                                 "  '\\r' or '\\n' (ENTER)      Repeat previous command\n");
-            if (buffUsed >= BUFFLEN) {
-                pthread_mutex_lock(&printf_lock);
-                fprintf(stderr, "ERROR: buff_out overextended\n");
-                pthread_mutex_unlock(&printf_lock);
-                exit(1);
-            }
-
+        else {
+            strncpy(buff_out, "err: 'quit' disabled in config file. Treating as 'bye'.\n", BUFFLEN);
             write(myThread->connfd, buff_out, BUFFLEN);
-            memset(buff_out, 0, BUFFLEN);
+            memset(buff_out,0,BUFFLEN);
         }
-        else if (!strncmp(buff_in, "dump",    4))  {  // dump
-            //Dump the current raw IOmap content
-            if (!inOP || !updating) {
-                strncpy(buff_out, "err: not inOP or not updating\n", BUFFLEN);
+        return 1;
+    }
+    else if (!strncmp(buff_in, "help",    4))  {  // help
+        //Send the help text, filling buff_out as much as possible for each write
+        int buffUsed = 0;
+        for (int i = 0; helpText[i] != NULL; i++) {
+            int lineLen = strlen(helpText[i]);
+            if (buffUsed + lineLen >= BUFFLEN) {
                 write(myThread->connfd, buff_out, BUFFLEN);
                 memset(buff_out, 0, BUFFLEN);
-                goto donecmds;
+                buffUsed = 0;
             }
+            memcpy(buff_out+buffUsed, helpText[i], lineLen);
+            buffUsed += lineLen;
+        }
 
-            pthread_mutex_lock(&IOmap_lock);
-
-            snprintf(buff_out, BUFFLEN, "  T:%" PRId64 ";\n",ec_DCtime);
+        write(myThread->connfd, buff_out, BUFFLEN);
+        memset(buff_out, 0, BUFFLEN);
+    }
+    else if (!strncmp(buff_in, "dump",    4))  {  // dump
+        //Dump the current raw IOmap content
+        if (!inOP || !updating) {
+            strncpy(buff_out, "err: not inOP or not updating\n", BUFFLEN);
             write(myThread->connfd, buff_out, BUFFLEN);
             memset(buff_out, 0, BUFFLEN);
+            return 0;
+        }
 
-            for (uint16 slave = 1; slave <= ec_slavecount; slave++) {
-                int buffUsed = 0;
+        locktrace_lock(&IOmap_lock, "dump");
 
-                buffUsed += snprintf(buff_out+buffUsed, BUFFLEN-buffUsed, "  slave[%d]:", slave);
-                buffUsed += snprintf(buff_out+buffUsed, BUFFLEN-buffUsed, " O:");
+        snprintf(buff_out, BUFFLEN, "  T:%" PRId64 ";\n",ec_DCtime);
+        write(myThread->connfd, buff_out, BUFFLEN);
+        memset(buff_out, 0, BUFFLEN);
 
-                int nChars = ec_slave[slave].Obytes;
-                if (nChars==0 && ec_slave[slave].Obits > 0) nChars = 1;
-                for(int j = 0 ; j < nChars ; j++) {
-                    buffUsed +=snprintf(buff_out+buffUsed, BUFFLEN-buffUsed,
-                                        " %2.2x", *(ec_slave[slave].outputs + j));
-                }
+        for (uint16 slave = 1; slave <= ec_slavecount; slave++) {
+            int buffUsed = 0;
 
-                buffUsed += snprintf(buff_out+buffUsed, BUFFLEN-buffUsed, " I:");
+            buffUsed += snprintf(buff_out+buffUsed, BUFFLEN-buffUsed, "  slave[%d]:", slave);
+            buffUsed += snprintf(buff_out+buffUsed, BUFFLEN-buffUsed, " O:");
 
-                nChars = ec_slave[slave].Ibytes;
-                if (nChars==0 && ec_slave[slave].Ibits > 0) nChars = 1;
-                for(int j = 0 ; j < nChars ; j++) {
-                    buffUsed +=snprintf(buff_out+buffUsed, BUFFLEN-buffUsed,
-                                        " %2.2x", *(ec_slave[slave].inputs + j));
-                }
+            int nChars = ec_slave[slave].Obytes;
+            if (nChars==0 && ec_slave[slave].Obits > 0) nChars = 1;
+            for(int j = 0 ; j < nChars ; j++) {
+                buffUsed +=snprintf(buff_out+buffUsed, BUFFLEN-buffUsed,
+                                    " %2.2x", *(ec_slave[slave].outputs + j));
+            }
 
-                buffUsed += snprintf(buff_out+buffUsed, BUFFLEN-buffUsed, "\n", slave);
+            buffUsed += snprintf(buff_out+buffUsed, BUFFLEN-buffUsed, " I:");
 
-                if (buffUsed >= BUFFLEN) {
-                    pthread_mutex_lock(&printf_lock);
-                    printf("ERROR: buff_out overextended\n");
-                    pthread_mutex_unlock(&printf_lock);
-                    exit(1);
-                }
-                write(myThread->connfd, buff_out, BUFFLEN);
-                memset(buff_out, 0, BUFFLEN);
+            nChars = ec_slave[slave].Ibytes;
+            if (nChars==0 && ec_slave[slave].Ibits > 0) nChars = 1;
+            for(int j = 0 ; j < nChars ; j++) {
+                buffUsed +=snprintf(buff_out+buffUsed, BUFFLEN-buffUsed,
+                                    " %2.2x", *(ec_slave[slave].inputs + j));
             }
-            pthread_mutex_unlock(&IOmap_lock);
 
-        }
-        else if (!strncmp(buff_in, "meta all", 8))  {  // meta all
-            //Metadata about all slaves/indexes/subindexes
-            struct mappings_PDO* mapping_active;
+            buffUsed += snprintf(buff_out+buffUsed, BUFFLEN-buffUsed, "\n", slave);
 
-            strncpy(buff_out, "  OUTPUTS:\n", BUFFLEN);
-            write(myThread->connfd, buff_out, BUFFLEN);
-
-            mapping_active = mapping_out;
-            while (mapping_active->bitlen > 0) {
-                writeMapping(buff_out, mapping_active, myThread->connfd);
-                mapping_active = mapping_active->next;
+            if (buffUsed >= BUFFLEN) {
+                log_fatal("ERROR: buff_out overextended\n");
             }
+            write(myThread->connfd, buff_out, BUFFLEN);
+            memset(buff_out, 0, BUFFLEN);
+        }
+        locktrace_unlock(&IOmap_lock);
 
-            strncpy(buff_out, "  INPUTS:\n", BUFFLEN);
+    }
+    else if (!strncmp(buff_in, "stats alloc", 11))  {  // stats alloc
+        //Heap allocation accounting; the cycle and the client threads should not allocate once in OP
+        struct alloc_counters counters;
+        if (!alloc_read(&counters)) {
+            strncpy(buff_out, "err: allocations are only counted by the instrumented build (cmake -DECD_ALLOCSTATS=ON)\n", BUFFLEN);
             write(myThread->connfd, buff_out, BUFFLEN);
             memset(buff_out,0,BUFFLEN);
-
-            mapping_active = mapping_in;
-            while (mapping_active->bitlen > 0) {
-                writeMapping(buff_out, mapping_active, myThread->connfd);
-                mapping_active = mapping_active->next;
-            }
+            return 0;
         }
-        else if (!strncmp(buff_in, "meta ",    5))  {  // meta slave:idx:subidx
-            //Metadata about a given PDO
-            uint16 slave  = 0;
-            uint16 idx    = 0;
-            uint8  subidx = 0;
-            if (sscanf(buff_in,"meta %hi:%hx:%hhx", &slave, &idx, &subidx) == 3){
-                //printf("%d:%x:%x\n", slave,idx,subidx);
-                strncpy(buff_out, "err: meta slave:idx:subidx NOT YET IMPLEMENTED\n", BUFFLEN);
+        snprintf(buff_out, BUFFLEN, "  alloc cycleInOP %" PRIu64 " clientInOP %" PRIu64 " inOP %d\n",
+                 counters.cycleInOP, counters.clientInOP, counters.inOP);
+        write(myThread->connfd, buff_out, BUFFLEN);
+        memset(buff_out,0,BUFFLEN);
+        for (int i = 0; i < ALLOC_NUMTHREADS; i++) {
+            snprintf(buff_out, BUFFLEN, "  thread %s allocs %" PRIu64 " frees %" PRIu64 " bytes %" PRIu64 "\n",
+                     alloc_threadNames[i], counters.allocs[i], counters.frees[i], counters.bytes[i]);
+            write(myThread->connfd, buff_out, BUFFLEN);
+            memset(buff_out,0,BUFFLEN);
+        }
+    }
+    else if (!strncmp(buff_in, "locks",    5))  {  // locks [reset]
+        //Lock wait and hold times per call site
+        if (!strncmp(buff_in, "locks reset", 11)) {
+            locktrace_reset();
+        }
+        if (!locktrace_describe(myThread->connfd)) {
+            strncpy(buff_out, "err: locks are only traced by the instrumented build (cmake -DECD_LOCKTRACE=ON)\n", BUFFLEN);
+            write(myThread->connfd, buff_out, BUFFLEN);
+            memset(buff_out,0,BUFFLEN);
+            return 0;
+        }
+    }
+    else if (!strncmp(buff_in, "stats ",   6))  {  // stats slave:idx:subidx
+        //Windowed aggregates, maintained by the cycle thread
+        uint16 slave  = 0;
+        uint16 idx    = 0;
+        uint8  subidx = 0;
+        if (sscanf(buff_in,"stats %hi:%hx:%hhx", &slave, &idx, &subidx) != 3){
+            strncpy(buff_out, "err: stats got bad args\n", BUFFLEN);
+            write(myThread->connfd, buff_out, BUFFLEN);
+            memset(buff_out,0,BUFFLEN);
+            return 0;
+        }
+        if (stats_describe(slave, idx, subidx, myThread->connfd) == 0) {
+            snprintf(buff_out, BUFFLEN, "err: no STATS configured for %d:%x:%x\n", slave,idx,subidx);
+            write(myThread->connfd, buff_out, BUFFLEN);
+            memset(buff_out,0,BUFFLEN);
+        }
+    }
+    else if (!strncmp(buff_in, "history ", 8))  {  // history slave:idx:subidx span [points]
+        //Downsampled history, maintained by the cycle thread
+        uint16 slave  = 0;
+        uint16 idx    = 0;
+        uint8  subidx = 0;
+        double span   = 0.0;
+        int    points = HISTORY_DEFAULTPOINTS;
+        int gotHits = sscanf(buff_in,"history %hi:%hx:%hhx %lf %d", &slave, &idx, &subidx, &span, &points);
+        if (gotHits < 4 || span <= 0.0 || points < 1 || points > HISTORY_MAXPOINTS) {
+            snprintf(buff_out, BUFFLEN, "err: history got bad args, expected slave:idx:subidx span [points] (span in s, max %d points)\n",
+                     HISTORY_MAXPOINTS);
+            write(myThread->connfd, buff_out, BUFFLEN);
+            memset(buff_out,0,BUFFLEN);
+            return 0;
+        }
+        if (history_describe(slave, idx, subidx, span, points, myThread->connfd) == 0) {
+            snprintf(buff_out, BUFFLEN, "err: no HISTORY configured for %d:%x:%x\n", slave,idx,subidx);
+            write(myThread->connfd, buff_out, BUFFLEN);
+            memset(buff_out,0,BUFFLEN);
+        }
+    }
+    else if (!strncmp(buff_in, "trigger",  7))  {  // trigger [arm mode [slave:idx:subidx [level]] | disarm | status]
+        //Triggered capture, recorded by the cycle thread
+        char   modeStr[10] = "";
+        uint16 slave  = 0;
+        uint16 idx    = 0;
+        uint8  subidx = 0;
+        double level  = 0.0;
+        int    gotArgs = sscanf(buff_in, "trigger arm %9s %hi:%hx:%hhx %lf", modeStr, &slave, &idx, &subidx, &level);
+
+        if (!strncmp(buff_in, "trigger disarm", 14)) {
+            capture_disarm();
+        }
+        else if (!strncmp(buff_in, "trigger arm", 11)) {
+            enum capture_mode mode;
+            int needArgs;
+            if      (!strcmp(modeStr, "above"))   { mode = TRIG_ABOVE;   needArgs = 5; }
+            else if (!strcmp(modeStr, "below"))   { mode = TRIG_BELOW;   needArgs = 5; }
+            else if (!strcmp(modeStr, "rising"))  { mode = TRIG_RISING;  needArgs = 4; }
+            else if (!strcmp(modeStr, "falling")) { mode = TRIG_FALLING; needArgs = 4; }
+            else if (!strcmp(modeStr, "wkc"))     { mode = TRIG_WKC;     needArgs = 1; }
+            else                                  { mode = TRIG_WKC;     needArgs = 99; }
+
+            if (gotArgs < needArgs) {
+                strncpy(buff_out, "err: trigger arm got bad args\n", BUFFLEN);
                 write(myThread->connfd, buff_out, BUFFLEN);
                 memset(buff_out,0,BUFFLEN);
+                return 0;
             }
-            else {
-                strncpy(buff_out, "err: meta got bad args\n", BUFFLEN);
+            if (!capture_arm(mode, slave, idx, subidx, level)) {
+                snprintf(buff_out, BUFFLEN, "err: could not arm; capture not enabled, or %d:%x:%x not recognized\n",
+                         slave, idx, subidx);
                 write(myThread->connfd, buff_out, BUFFLEN);
                 memset(buff_out,0,BUFFLEN);
+                return 0;
             }
-
         }
-        else if (!strncmp(buff_in, "get ",     4))  {  // get slave:idx:subidx
-            //Data from a given PDO
+
+        capture_describe(myThread->connfd);
+    }
+    else if (!strncmp(buff_in, "alarm",    5))  {  // alarm [add mode slave:idx:subidx level [hysteresis] | del id]
+        //Alarm conditions evaluated by the cycle thread; events are sent by chatThread()
+        if (!strncmp(buff_in, "alarm add", 9)) {
+            char   modeStr[10] = "";
             uint16 slave  = 0;
             uint16 idx    = 0;
             uint8  subidx = 0;
-            if (sscanf(buff_in,"get %hi:%hx:%hhx", &slave, &idx, &subidx) != 3){
-                strncpy(buff_out, "err: get got bad args\n", BUFFLEN);
+            double level  = 0.0;
+            double hyst   = 0.0;
+            int    gotArgs = sscanf(buff_in, "alarm add %9s %hi:%hx:%hhx %lf %lf", modeStr, &slave, &idx, &subidx, &level, &hyst);
+
+            enum alarm_mode mode = ALARM_ABOVE;
+            if      (!strcmp(modeStr, "above"))   mode = ALARM_ABOVE;
+            else if (!strcmp(modeStr, "below"))   mode = ALARM_BELOW;
+            else if (!strcmp(modeStr, "rising"))  mode = ALARM_RISING;
+            else if (!strcmp(modeStr, "falling")) mode = ALARM_FALLING;
+            else                                  gotArgs = 0;
+
+            if (gotArgs < 5 || hyst < 0) {
+                strncpy(buff_out, "err: alarm add got bad args\n", BUFFLEN);
                 write(myThread->connfd, buff_out, BUFFLEN);
                 memset(buff_out,0,BUFFLEN);
-                goto donecmds;
+                return 0;
+            }
+            int id = alarm_add(myThread->ipServerNum, mode, slave, idx, subidx, level, hyst);
+            if (id < 0) {
+                snprintf(buff_out, BUFFLEN, "err: could not add alarm; %d:%x:%x not recognized, or too many alarms (max %d)\n",
+                         slave, idx, subidx, ALARM_MAXPERCLIENT);
+            }
+            else {
+                snprintf(buff_out, BUFFLEN, "  alarm %d\n", id);
             }
+            write(myThread->connfd, buff_out, BUFFLEN);
+            memset(buff_out,0,BUFFLEN);
+        }
+        else if (!strncmp(buff_in, "alarm del", 9)) {
+            int id = -1;
+            if (sscanf(buff_in, "alarm del %d", &id) != 1 || !alarm_delete(myThread->ipServerNum, id)) {
+                strncpy(buff_out, "err: alarm del got bad args or unknown id\n", BUFFLEN);
+                write(myThread->connfd, buff_out, BUFFLEN);
+                memset(buff_out,0,BUFFLEN);
+            }
+        }
+        else {
+            alarm_describe(myThread->ipServerNum, myThread->connfd);
+        }
+    }
+    else if (!strncmp(buff_in, "wave",     4))  {  // wave [channels ... | data ... | commit [loop] | start | stop]
+        //Setpoint waveform playback; the arguments are tokenized in a copy, buff_in is kept for repeats
+        char args[BUFFLEN];
+        const char* error = NULL;
+        if (!strncmp(buff_in, "wave channels", 13)) {
+            strncpy(args, buff_in+13, BUFFLEN);
+            error = wave_channels(myThread->ipServerNum, args);
+        }
+        else if (!strncmp(buff_in, "wave data", 9)) {
+            strncpy(args, buff_in+9, BUFFLEN);
+            error = wave_data(myThread->ipServerNum, args);
+        }
+        else if (!strncmp(buff_in, "wave commit", 11)) {
+            error = wave_commit(myThread->ipServerNum, strstr(buff_in+11, "loop") != NULL);
+        }
+        else if (!strncmp(buff_in, "wave start", 10)) {
+            error = wave_start(myThread->ipServerNum);
+        }
+        else if (!strncmp(buff_in, "wave stop", 9)) {
+            error = wave_stop(myThread->ipServerNum);
+        }
+        else {
+            wave_describe(myThread->connfd);
+        }
+        if (error != NULL) {
+            snprintf(buff_out, BUFFLEN, "err: %s\n", error);
+            write(myThread->connfd, buff_out, BUFFLEN);
+            memset(buff_out,0,BUFFLEN);
+        }
+    }
+    else if (!strncmp(buff_in, "capture",  7))  {  // capture
+        //Bulk transfer of a finished capture
+        if (!capture_send(myThread->connfd)) {
+            strncpy(buff_out, "err: no finished capture; see 'trigger'\n", BUFFLEN);
+            write(myThread->connfd, buff_out, BUFFLEN);
+            memset(buff_out,0,BUFFLEN);
+        }
+    }
+    else if (!strncmp(buff_in, "mcast",    5))  {  // mcast
+        //Multicast publisher description, for receivers to decode the datagrams
+        mcast_describe(myThread->connfd);
+    }
+    else if (!strncmp(buff_in, "shm",      3))  {  // shm
+        //File descriptor of the shared memory process image, passed with SCM_RIGHTS
+        if (!myThread->isLocal || !shm_send(myThread->connfd)) {
+            strncpy(buff_out, "err: shared memory needs UNIX_SHM YES and a connection through UNIX_SOCKET\n", BUFFLEN);
+            write(myThread->connfd, buff_out, BUFFLEN);
+            memset(buff_out,0,BUFFLEN);
+        }
+    }
+    else if (!strncmp(buff_in, "meta all", 8))  {  // meta all
+        //Metadata about all slaves/indexes/subindexes
+        int epoch;
+        struct mapping_table* table = maptable_enter(&epoch);
+        if (table == NULL) {
+            maptable_exit(epoch);
+            strncpy(buff_out, "err: mappings not yet known\n", BUFFLEN);
+            write(myThread->connfd, buff_out, BUFFLEN);
+            memset(buff_out,0,BUFFLEN);
+            return 0;
+        }
+
+        //The lines were formatted when the table was published; hold them, and write them
+        // after the read section, since a slow client must not hold up 'rescan'
+        struct mapping_text* text = maptext_hold(table->text);
+        maptable_exit(epoch);
+
+        strncpy(buff_out, "  OUTPUTS:\n", BUFFLEN);
+        write(myThread->connfd, buff_out, BUFFLEN);
+        write(myThread->connfd, text->lines, text->outLen);
+
+        strncpy(buff_out, "  INPUTS:\n", BUFFLEN);
+        write(myThread->connfd, buff_out, BUFFLEN);
+        memset(buff_out,0,BUFFLEN);
+        write(myThread->connfd, text->lines + text->outLen, text->inLen);
+        maptext_release(text);
+
+        strncpy(buff_out, "  DERIVED:\n", BUFFLEN);
+        write(myThread->connfd, buff_out, BUFFLEN);
+        memset(buff_out,0,BUFFLEN);
 
+        derived_describe(myThread->connfd);
+    }
+    else if (!strncmp(buff_in, "rescan",   6))  {  // rescan
+        //Rebuild the PDO mappings while the bus keeps cycling
+        maptable_rescan(myThread->connfd);
+    }
+    else if (!strncmp(buff_in, "meta slaves", 11))  {  // meta slaves
+        //The topology, e.g. for generating a static mapping (tools/ecd_codegen.py)
+        for (uint16 slave = 1; slave <= ec_slavecount; slave++) {
+            int outOffset = ec_slave[slave].outputs != NULL ? (int)(ec_slave[slave].outputs - (uint8*)&IOmap[0]) : -1;
+            int inOffset  = ec_slave[slave].inputs  != NULL ? (int)(ec_slave[slave].inputs  - (uint8*)&IOmap[0]) : -1;
+            snprintf(buff_out, BUFFLEN, "  slave %d man 0x%8.8X id 0x%8.8X out %d %d in %d %d name %s\n",
+                     slave, ec_slave[slave].eep_man, ec_slave[slave].eep_id,
+                     outOffset, ec_slave[slave].Obits, inOffset, ec_slave[slave].Ibits, ec_slave[slave].name);
+            write(myThread->connfd, buff_out, BUFFLEN);
+            memset(buff_out, 0, BUFFLEN);
+        }
+    }
+    else if (!strncmp(buff_in, "health",   6))  {  // health
+        //Per-slave counters, maintained by the watchdog (ecat_check)
+        int slavecount = ec_slavecount;
+        struct health_slave  slaves[slavecount > 0 ? slavecount : 1];
+        struct health_totals totals;
+        health_read(slaves, slavecount, &totals);
+        int64 now = monotonicTime_ns();
+
+        snprintf(buff_out, BUFFLEN, "  health checks %" PRIu64 " wkcErrors %" PRIu64 " unattributed %" PRIu64 "\n",
+                 totals.checks, totals.wkcErrors, totals.unattributed);
+        write(myThread->connfd, buff_out, BUFFLEN);
+        memset(buff_out, 0, BUFFLEN);
+
+        for (int i = 0; i < slavecount; i++) {
+            struct health_slave* h = &(slaves[i]);
+            uint16 slave = i+1;
+            snprintf(buff_out, BUFFLEN, "  slave %d state 0x%2.2X lost %d wkcDrops %" PRIu64 " transitions %" PRIu64
+                     " losses %" PRIu64 " episodes %" PRIu64 " nonOp %.3f lastRecovery %.3f maxRecovery %.3f"
+                     " acks %" PRIu64 " opRequests %" PRIu64 " reconfigs %" PRIu64 "/%" PRIu64 " recovers %" PRIu64 "/%" PRIu64
+                     " al 0x%4.4X alAge %.1f name %s\n",
+                     slave, ec_slave[slave].state, ec_slave[slave].islost ? 1 : 0, h->wkcDrops, h->transitions,
+                     h->losses, h->episodes, h->nonOp_ns*1e-9, h->lastRecovery_ns*1e-9, h->maxRecovery_ns*1e-9,
+                     h->attempts[HEALTH_ACK], h->attempts[HEALTH_OPREQUEST],
+                     h->successes[HEALTH_RECONFIG], h->attempts[HEALTH_RECONFIG],
+                     h->successes[HEALTH_RECOVER], h->attempts[HEALTH_RECOVER],
+                     h->ALstatuscode, h->ALstatus_ns != 0 ? (now - h->ALstatus_ns)*1e-9 : -1.0, ec_slave[slave].name);
+            write(myThread->connfd, buff_out, BUFFLEN);
+            memset(buff_out, 0, BUFFLEN);
+        }
+    }
+    else if (!strncmp(buff_in, "meta ",    5) && strchr(buff_in, '/') != NULL)  {  // meta node/all
+        //Mappings of an upstream daemon, in the aggregator mode
+        agg_meta(myThread->connfd, buff_in+5);
+    }
+    else if (!strncmp(buff_in, "meta ",    5))  {  // meta slave:idx:subidx
+        //Metadata about a given PDO
+        uint16 slave  = 0;
+        uint16 idx    = 0;
+        uint8  subidx = 0;
+        if (sscanf(buff_in,"meta %hi:%hx:%hhx", &slave, &idx, &subidx) == 3){
             //printf("%d:%x:%x\n", slave,idx,subidx);
+            strncpy(buff_out, "err: meta slave:idx:subidx NOT YET IMPLEMENTED\n", BUFFLEN);
+            write(myThread->connfd, buff_out, BUFFLEN);
+            memset(buff_out,0,BUFFLEN);
+        }
+        else {
+            strncpy(buff_out, "err: meta got bad args\n", BUFFLEN);
+            write(myThread->connfd, buff_out, BUFFLEN);
+            memset(buff_out,0,BUFFLEN);
+        }
 
-            struct mappings_PDO* dataMapping = get_address(slave, idx, subidx, mapping_in);
-            if (dataMapping == NULL) {
-                snprintf(buff_out, BUFFLEN, "err: PDO address %d:%x:%x not recognized (searched for inputs)\n", slave,idx,subidx);
+    }
+    else if (!strncmp(buff_in, "time",     4))  {  // time
+        //Clock of this daemon, for estimating the offset of the clocks (see aggregator.h)
+        struct timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        struct cycle_stats stats;
+        cycleStats_read(&stats);
+        snprintf(buff_out, BUFFLEN, "  time %" PRId64 " DC %" PRId64 "\n",
+                 (int64)(now.tv_sec*1000000000LL + now.tv_nsec), stats.DCtime);
+        write(myThread->connfd, buff_out, BUFFLEN);
+        memset(buff_out,0,BUFFLEN);
+    }
+    else if (!strncmp(buff_in, "subscribe",9))  {  // subscribe [N]
+        //Stream of process images for an aggregator; the connection is closed when it ends
+        int decimate = 1;
+        if (sscanf(buff_in, "subscribe %d", &decimate) == 1 && decimate <= 0) {
+            strncpy(buff_out, "err: subscribe got bad args\n", BUFFLEN);
+            write(myThread->connfd, buff_out, BUFFLEN);
+            memset(buff_out,0,BUFFLEN);
+            return 0;
+        }
+        log_info("slot %d subscribed, every %d cycles\n", myThread->ipServerNum, decimate);
+        agg_subscribe(myThread->connfd, decimate);
+        return 1;
+    }
+    else if (!strncmp(buff_in, "nodes",    5))  {  // nodes
+        //Upstream daemons, in the aggregator mode
+        agg_describe(myThread->connfd);
+    }
+    else if (!strncmp(buff_in, "waitcycle",9))  {  // waitcycle [N]
+        //Block until the cycle thread has done N more exchanges (default 1)
+        int numCycles = 1;
+        if (sscanf(buff_in, "waitcycle %d", &numCycles) == 0 || numCycles < 1 || numCycles > WAITCYCLE_MAX) {
+            snprintf(buff_out, BUFFLEN, "err: waitcycle got bad args, expected 1..%d\n", WAITCYCLE_MAX);
+            write(myThread->connfd, buff_out, BUFFLEN);
+            memset(buff_out,0,BUFFLEN);
+            return 0;
+        }
+        struct cycle_stats stats;
+        uint64 cycle = 0;
+        if (!inOP || !updating ||
+            (cycle = ecat_waitCycles(numCycles, waitTimeout_ns(numCycles), &stats)) == 0) {
+            strncpy(buff_out, "err: not inOP or not updating\n", BUFFLEN);
+            write(myThread->connfd, buff_out, BUFFLEN);
+            memset(buff_out, 0, BUFFLEN);
+            return 0;
+        }
+        snprintf(buff_out, BUFFLEN, "  cycle %" PRIu64 " T:%" PRId64 "\n", cycle, stats.DCtime);
+        write(myThread->connfd, buff_out, BUFFLEN);
+        memset(buff_out,0,BUFFLEN);
+    }
+    else if (!strncmp(buff_in, "get ",     4) && strchr(buff_in, '/') != NULL)  {  // get node/slave:idx:subidx
+        //Cached data of an upstream daemon, in the aggregator mode
+        agg_get(myThread->connfd, buff_in+4);
+    }
+    else if (!strncmp(buff_in, "get ",     4))  {  // get slave:idx:subidx [fresh]
+        //Data from a given PDO
+        uint16 slave  = 0;
+        uint16 idx    = 0;
+        uint8  subidx = 0;
+        if (sscanf(buff_in,"get %hi:%hx:%hhx", &slave, &idx, &subidx) != 3){
+            strncpy(buff_out, "err: get got bad args\n", BUFFLEN);
+            write(myThread->connfd, buff_out, BUFFLEN);
+            memset(buff_out,0,BUFFLEN);
+            return 0;
+        }
+        int fresh = strstr(buff_in, " fresh") != NULL; // Wait for the next cycle
+
+        //printf("%d:%x:%x\n", slave,idx,subidx);
+
+        if (slave == 0) {
+            //Derived channel; the value is kept by the cycle thread, no need for IOmap_lock
+            double value = 0.0;
+            if (derived_get(idx, &value) == NULL || subidx != 0) {
+                snprintf(buff_out, BUFFLEN, "err: PDO address %d:%x:%x not recognized (searched for derived)\n", slave,idx,subidx);
                 write(myThread->connfd, buff_out, BUFFLEN);
                 memset(buff_out,0,BUFFLEN);
-                goto donecmds;
+                return 0;
             }
-
             if (!inOP || !updating) {
                 strncpy(buff_out, "err: not inOP or not updating\n", BUFFLEN);
                 write(myThread->connfd, buff_out, BUFFLEN);
                 memset(buff_out, 0, BUFFLEN);
-                goto donecmds;
+                return 0;
             }
-
-            int buffUsed = 0;
-            pthread_mutex_lock(&IOmap_lock);
-            PDOval2string(dataMapping, hstr, BUFFLEN);
-            pthread_mutex_unlock(&IOmap_lock);
-            buffUsed += snprintf(buff_out, BUFFLEN, "  %s", hstr);
-            memset(hstr,0,BUFFLEN);
-
-            dtype2string(dataMapping->dataType, hstr, BUFFLEN);
-            buffUsed += snprintf(buff_out+buffUsed, BUFFLEN-buffUsed, "  %s\n", hstr);
-            memset(hstr,0,BUFFLEN);
-
-            if (buffUsed >= BUFFLEN) {
-                pthread_mutex_lock(&printf_lock);
-                printf("ERROR: buff_out overextended\n");
-                pthread_mutex_unlock(&printf_lock);
-                exit(1);
+            if (fresh) {
+                uint64 cycle = ecat_waitCycles(1, waitTimeout_ns(1), NULL);
+                if (cycle == 0) {
+                    strncpy(buff_out, "err: not inOP or not updating\n", BUFFLEN);
+                    write(myThread->connfd, buff_out, BUFFLEN);
+                    memset(buff_out, 0, BUFFLEN);
+                    return 0;
+                }
+                derived_get(idx, &value);
+                snprintf(buff_out, BUFFLEN, "  %.10g  REAL64  cycle %" PRIu64 "\n", value, cycle);
+            }
+            else {
+                snprintf(buff_out, BUFFLEN, "  %.10g  REAL64\n", value);
             }
-
             write(myThread->connfd, buff_out, BUFFLEN);
             memset(buff_out,0,BUFFLEN);
+            return 0;
+        }
 
+        //Copy the mapping, so that a concurrent 'rescan' may free the table meanwhile (the name is not used)
+        struct mappings_PDO mappingCopy;
+        struct mappings_PDO* dataMapping = NULL;
+        int epoch;
+        struct mapping_table* table = maptable_enter(&epoch);
+        if (table != NULL) dataMapping = get_address(slave, idx, subidx, table->in);
+        if (dataMapping != NULL) {
+            mappingCopy = *dataMapping;
+            dataMapping = &mappingCopy;
         }
-        else {                                      // (unknown command)
-            snprintf(buff_out, BUFFLEN, "err: unknown command '%s'\n",buff_in);
+        maptable_exit(epoch);
+        if (dataMapping == NULL) {
+            snprintf(buff_out, BUFFLEN, "err: PDO address %d:%x:%x not recognized (searched for inputs)\n", slave,idx,subidx);
             write(myThread->connfd, buff_out, BUFFLEN);
             memset(buff_out,0,BUFFLEN);
+            return 0;
+        }
+
+        if (!inOP || !updating) {
+            strncpy(buff_out, "err: not inOP or not updating\n", BUFFLEN);
+            write(myThread->connfd, buff_out, BUFFLEN);
+            memset(buff_out, 0, BUFFLEN);
+            return 0;
+        }
+
+        if (fresh && ecat_waitCycles(1, waitTimeout_ns(1), NULL) == 0) {
+            strncpy(buff_out, "err: not inOP or not updating\n", BUFFLEN);
+            write(myThread->connfd, buff_out, BUFFLEN);
+            memset(buff_out, 0, BUFFLEN);
+            return 0;
+        }
+
+        int buffUsed = 0;
+        locktrace_lock(&IOmap_lock, "get");
+        if (!decode_string(dataMapping, hstr, BUFFLEN)) PDOval2string(dataMapping, hstr, BUFFLEN);
+        uint64 cycle = imageCycle;
+        locktrace_unlock(&IOmap_lock);
+        buffUsed += snprintf(buff_out, BUFFLEN, "  %s", hstr);
+        memset(hstr,0,BUFFLEN);
+
+        dtype2string(dataMapping->dataType, hstr, BUFFLEN);
+        if (fresh) {
+            buffUsed += snprintf(buff_out+buffUsed, BUFFLEN-buffUsed, "  %s  cycle %" PRIu64 "\n", hstr, cycle);
+        }
+        else {
+            buffUsed += snprintf(buff_out+buffUsed, BUFFLEN-buffUsed, "  %s\n", hstr);
+        }
+        memset(hstr,0,BUFFLEN);
+
+        if (buffUsed >= BUFFLEN) {
+            log_fatal("ERROR: buff_out overextended\n");
+        }
+
+        write(myThread->connfd, buff_out, BUFFLEN);
+        memset(buff_out,0,BUFFLEN);
+
+    }
+    else {                                      // (unknown command)
+        snprintf(buff_out, BUFFLEN, "err: unknown command '%s'\n",buff_in);
+        write(myThread->connfd, buff_out, BUFFLEN);
+        memset(buff_out,0,BUFFLEN);
+    }
+    return 0;
+}
+void chatThread(void* ptr) {
+    //Runs in it's own thread, talking to one client
+    // NOTE: To test with TELNET client, LINEMODE must be used!
+    struct IPserverThreads* myThread = (struct IPserverThreads*) ptr;
+    alloc_setThread(ALLOC_CLIENT);
+
+    char buff_in[BUFFLEN];
+    char buff_out[BUFFLEN];
+    memset(buff_in,       0, BUFFLEN);
+    memset(buff_out,      0, BUFFLEN);
+
+    char hstr[BUFFLEN]; // String buffer for conversion functions
+    memset(hstr,0,BUFFLEN);
+
+    boolean didRepeat     = FALSE;
+    char    buff_in_prev[BUFFLEN];
+    memset(buff_in_prev,  0, BUFFLEN);
+
+    //Alarm events are sent while waiting for the next command
+    int eventfd = alarm_openQueue(myThread->ipServerNum);
+
+    while (1) {
+        //Check that we didn't get a SIGPIPE
+        if (myThread->gotSIGPIPE == 1) {
+            log_info("slot %d got SIGPIPE (client %s) \n", myThread->ipServerNum, myThread->clientName);
+            goto endcom;
+        }
+
+        //Tell the client that we are ready for the next command
+        strncpy(buff_out,"ok\n",BUFFLEN);
+        write(myThread->connfd, buff_out, BUFFLEN);
+        memset(buff_out,0,BUFFLEN);
+
+        //Wait for the next command, sending any alarm events meanwhile
+        struct pollfd waitfds[2];
+        memset(waitfds, 0, sizeof(waitfds));
+        waitfds[0].fd     = myThread->connfd;
+        waitfds[0].events = POLLIN;
+        waitfds[1].fd     = eventfd; // Ignored by poll() if -1
+        waitfds[1].events = POLLIN;
+        while (poll(waitfds, 2, -1) > 0 && !(waitfds[0].revents & (POLLIN|POLLHUP|POLLERR))) {
+            alarm_sendEvents(myThread->ipServerNum, myThread->connfd);
+            if (myThread->gotSIGPIPE == 1) break;
+        }
+
+        int numBytes = read(myThread->connfd, buff_in, BUFFLEN);
+        if (numBytes >= BUFFLEN || buff_in[BUFFLEN-1] != '\0') {
+            //Note: Last byte in buff should always be \0.
+            log_error("ERROR, message too long\n");
+            goto endcom;
+        }
+        //printf("GOT: (%d) '%s'\n", strlen(buff_in), buff_in);
+
+        //Replay last command
+        if (buff_in[0] =='\n' || buff_in[0] == '\r')  {  // linebreak -> replay previous cmd
+            if (buff_in_prev[0] == '\0') {
+                strncpy(buff_out, "err: No previous command available.\n", BUFFLEN);
+                write(myThread->connfd, buff_out, BUFFLEN);
+                memset(buff_out,0,BUFFLEN);
+                goto donecmds;
+            }
+            else {
+                memset(buff_in,0,BUFFLEN);
+                memcpy(buff_in, buff_in_prev, BUFFLEN);
+                didRepeat = TRUE;
+            }
+        }
+
+        // Command parsing
+        if (chatCommand(myThread, buff_in, buff_out, hstr)) {
+            goto endcom;
         }
 
     donecmds: // Escape from inside an input handler
@@ -315,15 +815,15 @@ void chatThread(void* ptr) {
 
 endcom: // Escape from the loop
 
-    pthread_mutex_lock(&printf_lock);
-    printf("Finished: -- slot %d disconnecting from %s \n", myThread->ipServerNum, inet_ntoa(myThread->client.sin_addr));
-    pthread_mutex_unlock(&printf_lock);
+    log_info("Finished: -- slot %d disconnecting from %s \n", myThread->ipServerNum, myThread->clientName);
 
     memset(buff_out, 0, BUFFLEN);
     strncpy(buff_out, "bye\n", BUFFLEN);
     write(myThread->connfd, buff_out, 4);
 
     close(myThread->connfd);
+    alarm_closeQueue(myThread->ipServerNum);
+    wave_release(myThread->ipServerNum);
     myThread->inUse = 0;
 
     pthread_exit(0);
@@ -334,6 +834,7 @@ void mainIPserver( void* ptr ) {
     // Inspired by https://www.geeksforgeeks.org/tcp-server-client-implementation-in-c/
 
     (void)ptr; // Not used, reference it to quiet down the compiler
+    alloc_setThread(ALLOC_CLIENT);
 
     //Setup SIGPIPE handler
     signal(SIGPIPE, &SIGPIPE_handler);
@@ -341,85 +842,154 @@ void mainIPserver( void* ptr ) {
     //Initialize IPservers array
     memset(IPservers, 0, sizeof(struct IPserverThreads)*NUMIPSERVERS);
 
+    //Reserve the stacks of all client threads, so that connecting never allocates;
+    // pages are only committed when touched. A stack overflow hits the guard page below it.
+    long pageSize = sysconf(_SC_PAGESIZE);
+    IPserverStackSize = ((size_t)config_file.client_stack*1024 + pageSize-1) / pageSize * pageSize;
+    IPserverStacks = mmap(NULL, NUMIPSERVERS*(IPserverStackSize + pageSize), PROT_READ|PROT_WRITE,
+                          MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    if (IPserverStacks == MAP_FAILED) {
+        log_fatal("ERROR: could not reserve the client thread stacks (CLIENT_STACK): %m\n");
+    }
+    for (int i = 0; i < NUMIPSERVERS; i++) {
+        mprotect(IPserverStacks + i*(IPserverStackSize + pageSize), pageSize, PROT_NONE);
+    }
+
     //Wait for root privs to be dropped
+    // (pass through, so that other servers waiting on the same lock can also start)
     pthread_mutex_lock(&rootprivs_lock);
+    pthread_mutex_unlock(&rootprivs_lock);
 
     //Create the server socket...
     sockfd = socket(AF_INET, SOCK_STREAM, 0);
     if (sockfd == -1) {
-        perror("ERROR when opening socket");
-        exit(1);
+        log_fatal("ERROR when opening socket: %m\n");
     }
 
     int enableReuse = 1;
     if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &enableReuse, sizeof(int)) < 0){
-        pthread_mutex_lock(&printf_lock);
-        fprintf(stderr, "WARNING: setsockopt(SO_REUSEADDR) failed");
-        pthread_mutex_unlock(&printf_lock);
+        log_warn("WARNING: setsockopt(SO_REUSEADDR) failed: %m\n");
     }
 
     //Set server IP and port
     servaddr.sin_family = AF_INET;
     servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
-    servaddr.sin_port = htons(TCPPORT);
+    servaddr.sin_port = htons(config_file.tcp_port);
 
     // Binding newly created socket to given IP and verification
     if ((bind(sockfd, (struct sockaddr*)&servaddr, sizeof(servaddr))) != 0) {
-        perror("ERROR: Socket bind failed");
-        pthread_mutex_lock(&printf_lock);
-        fprintf(stderr, "if 'netstat | grep %d' shows TIME_WAIT, please wait for the OS timeout to finish\n", TCPPORT);
-        pthread_mutex_unlock(&printf_lock);
-        close(sockfd);
-        exit(1);
+        log_error("ERROR: Socket bind failed: %m\n");
+        log_fatal("if 'netstat | grep %d' shows TIME_WAIT, please wait for the OS timeout to finish\n", config_file.tcp_port);
     }
 
     //Listen to the socket...
     if ((listen(sockfd, 5)) != 0) {
-        pthread_mutex_lock(&printf_lock);
-        perror("ERROR: Socket listen failed");
-        pthread_mutex_unlock(&printf_lock);
-        exit(1);
+        log_fatal("ERROR: Socket listen failed: %m\n");
     }
-    pthread_mutex_lock(&printf_lock);
-    printf("listen OK\n");
-    pthread_mutex_unlock(&printf_lock);
+    log_info("listen OK\n");
+
+    //Same protocol on a UNIX socket, for clients on this host
+    if (config_file.unix_socket != NULL) {
+        struct sockaddr_un unixaddr;
+        memset(&unixaddr, 0, sizeof(unixaddr));
+        unixaddr.sun_family = AF_UNIX;
+        if (strlen(config_file.unix_socket) >= sizeof(unixaddr.sun_path)) {
+            log_fatal("ERROR: UNIX_SOCKET path '%s' is too long\n", config_file.unix_socket);
+        }
+        strncpy(unixaddr.sun_path, config_file.unix_socket, sizeof(unixaddr.sun_path)-1);
+
+        unixSockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (unixSockfd == -1) {
+            log_fatal("ERROR when opening UNIX socket: %m\n");
+        }
 
+        //Remove a stale socket left by an earlier run, but nothing else
+        struct stat oldFile;
+        if (stat(config_file.unix_socket, &oldFile) == 0 && S_ISSOCK(oldFile.st_mode)) {
+            unlink(config_file.unix_socket);
+        }
+
+        if (bind(unixSockfd, (struct sockaddr*)&unixaddr, sizeof(unixaddr)) != 0) {
+            log_fatal("ERROR: UNIX socket bind to '%s' failed: %m\n", config_file.unix_socket);
+        }
+        if (listen(unixSockfd, 5) != 0) {
+            log_fatal("ERROR: UNIX socket listen failed: %m\n");
+        }
+        log_info("listen OK on '%s'\n", config_file.unix_socket);
+    }
 
     while(1) {
         //Find a free IPservers listing
         int ipServerNum = 0;
         for (ipServerNum = 0; ipServerNum < NUMIPSERVERS; ipServerNum++){
             if (IPservers[ipServerNum].inUse == 0) { // Found a free one; let's zero it and break
+                //The previous thread may still be returning; its stack is reused below
+                if (IPservers[ipServerNum].joinable) pthread_join(IPservers[ipServerNum].thread, NULL);
                 memset(&(IPservers[ipServerNum]), 0, sizeof(struct IPserverThreads));
                 IPservers[ipServerNum].ipServerNum = ipServerNum;
                 break;
             }
         }
         if (ipServerNum == NUMIPSERVERS) {
-            pthread_mutex_lock(&printf_lock);
-            printf("Too many clients!\n");
-            pthread_mutex_unlock(&printf_lock);
+            log_info("Too many clients!\n");
+            goto noSock;
+        }
+        struct IPserverThreads* slot = &(IPservers[ipServerNum]);
+
+        slot->inUse = 1;
+
+        //Wait for a client on either socket
+        struct pollfd listenfds[2];
+        memset(listenfds, 0, sizeof(listenfds));
+        listenfds[0].fd     = sockfd;
+        listenfds[0].events = POLLIN;
+        listenfds[1].fd     = unixSockfd; // Ignored by poll() if -1
+        listenfds[1].events = POLLIN;
+        if (poll(listenfds, 2, -1) < 0) {
+            log_error("ERROR: poll on the server sockets failed: %m\n");
+            slot->inUse = 0;
             goto noSock;
         }
 
-        IPservers[ipServerNum].inUse = 1;
-
-        int addrlen = sizeof(IPservers[ipServerNum].client);
-        IPservers[ipServerNum].connfd = accept(sockfd, (struct sockaddr*)&(IPservers[ipServerNum].client), &addrlen);
+        if (listenfds[0].revents & POLLIN) {
+            socklen_t addrlen = sizeof(slot->client);
+            slot->connfd = accept(sockfd, (struct sockaddr*)&(slot->client), &addrlen);
+            strncpy(slot->clientName, inet_ntoa(slot->client.sin_addr), sizeof(slot->clientName)-1);
+        }
+        else if (listenfds[1].revents & POLLIN) {
+            slot->connfd  = accept(unixSockfd, NULL, NULL);
+            slot->isLocal = 1;
+            strncpy(slot->clientName, "(local)", sizeof(slot->clientName)-1);
+        }
+        else {
+            //e.g. the sockets were closed by 'quit'
+            slot->connfd = -1;
+        }
 
-        if (IPservers[ipServerNum].connfd < 0) {
-            perror("ERROR: Server accept connection failed");
-            IPservers[ipServerNum].inUse == 0;
+        if (slot->connfd < 0) {
+            log_error("ERROR: Server accept connection failed: %m\n");
+            slot->inUse = 0;
             goto noSock;
         }
-        pthread_mutex_lock(&printf_lock);
-        printf("IP server slot %d connected to host %s \n", ipServerNum, inet_ntoa(IPservers[ipServerNum].client.sin_addr));
-        pthread_mutex_unlock(&printf_lock);
+        log_info("IP server slot %d connected to host %s \n", ipServerNum, slot->clientName);
 
         //Here using Linux pthreads, not OSAL,
         // because we want to do more than just creating the threads.
         // When done, these threads close their connection and set inUse = 0.
-        pthread_create(&(IPservers[ipServerNum].thread), NULL, (void*) &chatThread, (void*) &(IPservers[ipServerNum]));
+        // They run on the preallocated stack of their slot, and are joined when the slot is reused.
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setstack(&attr, IPserverStacks + ipServerNum*(IPserverStackSize + pageSize) + pageSize,
+                              IPserverStackSize);
+        if (pthread_create(&(slot->thread), &attr, (void*) &chatThread, (void*) slot) == 0) {
+            slot->joinable = 1;
+        }
+        else {
+            log_error("ERROR: could not start the thread for slot %d\n", ipServerNum);
+            close(slot->connfd);
+            slot->inUse = 0;
+        }
+        pthread_attr_destroy(&attr);
 
     noSock:
         // Probably not needed, may even be harmfull to performance?
@@ -439,7 +1009,7 @@ void SIGPIPE_handler (int signal) {
         if (IPservers[i].thread == thisThread) break;
     }
     if (i == NUMIPSERVERS) {
-        abort(); // The thread wasn't found.
+        return; // Not a client slot; such threads see EPIPE from their write() instead
     }
     IPservers[i].gotSIGPIPE = 1;
 
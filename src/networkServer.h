@@ -6,6 +6,7 @@
 #include <signal.h>
 
 #include "ecatDriver.h"
+#include "loadControl.h"
 
 // Configuration    ************************************************************************
 #ifndef NUMIPSERVERS // Allow setting from CMake
@@ -20,21 +21,35 @@
 
 #define BUFFLEN 1024 // String buffer length
 
+#define WAITCYCLE_MAX 12000 // Max cycles for 'waitcycle N'
+
 // Data types       ************************************************************************
 struct IPserverThreads {
     struct sockaddr_in client;
     int connfd;
+    char isLocal;        // Connected through UNIX_SOCKET instead of TCP
+    char clientName[64]; // For log messages
 
     pthread_t thread;
+    char joinable;       // 'thread' was started and not yet joined; it runs on the stack of this slot
     int  ipServerNum;
     char inUse;
 
     volatile sig_atomic_t gotSIGPIPE;
 
+    struct token_bucket bucket; // Command rate limit, see loadControl.h
+
 };
 
+// Global data      ************************************************************************
+
+// Array of server connection slots
+extern struct IPserverThreads IPservers[NUMIPSERVERS];
+
 // Functions        ************************************************************************
+int formatMapping( char* buff_out, struct mappings_PDO* mapping );
 int writeMapping ( char* buff_out, struct mappings_PDO* mapping, int connfd );
+int chatCommand  ( struct IPserverThreads* myThread, char* buff_in, char* buff_out, char* hstr );
 void chatThread  ( void* ptr );
 void mainIPserver( void* ptr );
 void SIGPIPE_handler (int signal);
@@ -0,0 +1,198 @@
+#define _GNU_SOURCE // ppoll()
+#include "packetRing.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <linux/if_packet.h>
+#include <time.h>
+
+#include "EtherCatDaemon.h"
+
+// Configuration    ************************************************************************
+
+// Where the frame goes in a TX slot, without PACKET_TX_HAS_OFF
+#define RING_TXDATA (TPACKET2_HDRLEN - sizeof(struct sockaddr_ll))
+
+// File-global data ************************************************************************
+
+int   ring_fd = -1;       // The socket with the rings, or -1 if not in use
+char* ring_rx = NULL;     // Mapped RX ring, followed by the TX ring
+char* ring_tx = NULL;
+int   ring_rxPos = 0;     // Next slot to look at; protected by SOEM's rx_mutex / tx_mutex,
+int   ring_txPos = 0;     // which are held around every recv() / send() on its socket
+int64 ring_busyPoll_ns = 0;
+
+// Written with atomic adds by the cycle thread (or whichever thread SOEM lets use the socket)
+struct ring_counters ring_counters;
+
+// Functions        ************************************************************************
+
+int ring_setup(int sockfd, int busyPoll_us) {
+    int version = TPACKET_V2;
+    if (setsockopt(sockfd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) != 0) {
+        log_error("ERROR in ring_setup(): TPACKET_V2 not supported: %m\n");
+        return 0;
+    }
+    int bypass = 1;
+    if (setsockopt(sockfd, SOL_PACKET, PACKET_QDISC_BYPASS, &bypass, sizeof(bypass)) != 0) {
+        log_warn("WARNING in ring_setup(): could not bypass the qdisc: %m\n");
+    }
+
+    struct tpacket_req req;
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = RING_BLOCKSIZE;
+    req.tp_frame_size = RING_FRAMESIZE;
+    req.tp_frame_nr   = RING_RXFRAMES;
+    req.tp_block_nr   = RING_RXFRAMES * RING_FRAMESIZE / RING_BLOCKSIZE;
+    if (setsockopt(sockfd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) != 0) {
+        log_error("ERROR in ring_setup(): could not set up the RX ring: %m\n");
+        return 0;
+    }
+    req.tp_frame_nr   = RING_TXFRAMES;
+    req.tp_block_nr   = RING_TXFRAMES * RING_FRAMESIZE / RING_BLOCKSIZE;
+    if (setsockopt(sockfd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) != 0) {
+        log_error("ERROR in ring_setup(): could not set up the TX ring: %m\n");
+        return 0;
+    }
+
+    size_t rxSize = RING_RXFRAMES * RING_FRAMESIZE;
+    size_t txSize = RING_TXFRAMES * RING_FRAMESIZE;
+    char* mem = mmap(NULL, rxSize + txSize, PROT_READ|PROT_WRITE, MAP_SHARED, sockfd, 0);
+    if (mem == MAP_FAILED) {
+        log_error("ERROR in ring_setup(): mmap failed: %m\n");
+        return 0;
+    }
+
+    if (busyPoll_us > 0) {
+        //Let the kernel also poll the device queue while we wait in ppoll(), if the driver supports it
+        if (setsockopt(sockfd, SOL_SOCKET, SO_BUSY_POLL, &busyPoll_us, sizeof(busyPoll_us)) != 0) {
+            log_warn("WARNING in ring_setup(): SO_BUSY_POLL not set: %m\n");
+        }
+    }
+
+    memset(&ring_counters, 0, sizeof(ring_counters));
+    ring_rx    = mem;
+    ring_tx    = mem + rxSize;
+    ring_rxPos = 0;
+    ring_txPos = 0;
+    ring_busyPoll_ns = (int64)busyPoll_us * 1000;
+    ring_fd    = sockfd;
+
+    log_info("NIC rings: TPACKET_V2, %d RX and %d TX frames of %d bytes, busy poll %d us\n",
+             RING_RXFRAMES, RING_TXFRAMES, RING_FRAMESIZE, busyPoll_us);
+    return 1;
+}
+
+int ring_read(struct ring_counters* copy) {
+    if (ring_fd < 0) {
+        memset(copy, 0, sizeof(struct ring_counters));
+        return 0;
+    }
+
+    //The kernel resets its counters on every read
+    struct tpacket_stats stats;
+    socklen_t statsLen = sizeof(stats);
+    if (getsockopt(ring_fd, SOL_PACKET, PACKET_STATISTICS, &stats, &statsLen) == 0) {
+        __atomic_add_fetch(&(ring_counters.drops), stats.tp_drops, __ATOMIC_RELAXED);
+    }
+
+    copy->rxFrames = __atomic_load_n(&(ring_counters.rxFrames), __ATOMIC_RELAXED);
+    copy->txFrames = __atomic_load_n(&(ring_counters.txFrames), __ATOMIC_RELAXED);
+    copy->rxWaits  = __atomic_load_n(&(ring_counters.rxWaits),  __ATOMIC_RELAXED);
+    copy->rxSpins  = __atomic_load_n(&(ring_counters.rxSpins),  __ATOMIC_RELAXED);
+    copy->rxEmpty  = __atomic_load_n(&(ring_counters.rxEmpty),  __ATOMIC_RELAXED);
+    copy->txBusy   = __atomic_load_n(&(ring_counters.txBusy),   __ATOMIC_RELAXED);
+    copy->drops    = __atomic_load_n(&(ring_counters.drops),    __ATOMIC_RELAXED);
+    return 1;
+}
+
+// The wrappers, see -Wl,--wrap in CMakeLists.txt
+ssize_t __real_send(int fd, const void* buf, size_t len, int flags);
+ssize_t __real_recv(int fd, void* buf, size_t len, int flags);
+
+static inline void ring_cpuRelax() {
+    //Helper function for __wrap_recv(); tell the core that we are spinning
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+int ring_rxReady(struct tpacket2_hdr* hdr) {
+    //Helper function for __wrap_recv()
+    return (__atomic_load_n(&(hdr->tp_status), __ATOMIC_ACQUIRE) & TP_STATUS_USER) != 0;
+}
+
+ssize_t __wrap_recv(int fd, void* buf, size_t len, int flags) {
+    if (fd != ring_fd || ring_fd < 0) return __real_recv(fd, buf, len, flags);
+
+    struct tpacket2_hdr* hdr = (struct tpacket2_hdr*) (ring_rx + ring_rxPos*RING_FRAMESIZE);
+    if (!ring_rxReady(hdr)) {
+        int got = 0;
+        if (ring_busyPoll_ns > 0) {
+            int64 until = monotonicTime_ns() + ring_busyPoll_ns;
+            while (!(got = ring_rxReady(hdr)) && monotonicTime_ns() < until) {
+                ring_cpuRelax();
+            }
+            if (got) __atomic_add_fetch(&(ring_counters.rxSpins), 1, __ATOMIC_RELAXED);
+        }
+        if (!got) {
+            struct pollfd waitfd = { .fd = fd, .events = POLLIN };
+            struct timespec timeout = { .tv_sec = 0, .tv_nsec = RING_WAIT };
+            ppoll(&waitfd, 1, &timeout, NULL);
+            __atomic_add_fetch(&(ring_counters.rxWaits), 1, __ATOMIC_RELAXED);
+            got = ring_rxReady(hdr);
+        }
+        if (!got) {
+            //Same as a timed out recv() on the plain socket
+            __atomic_add_fetch(&(ring_counters.rxEmpty), 1, __ATOMIC_RELAXED);
+            errno = EAGAIN;
+            return -1;
+        }
+    }
+
+    size_t numBytes = hdr->tp_snaplen < len ? hdr->tp_snaplen : len;
+    memcpy(buf, (char*)hdr + hdr->tp_mac, numBytes);
+    __atomic_store_n(&(hdr->tp_status), TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+    ring_rxPos = (ring_rxPos + 1) % RING_RXFRAMES;
+
+    __atomic_add_fetch(&(ring_counters.rxFrames), 1, __ATOMIC_RELAXED);
+    return numBytes;
+}
+
+ssize_t __wrap_send(int fd, const void* buf, size_t len, int flags) {
+    if (fd != ring_fd || ring_fd < 0) return __real_send(fd, buf, len, flags);
+
+    if (len > RING_FRAMESIZE - RING_TXDATA) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    struct tpacket2_hdr* hdr = (struct tpacket2_hdr*) (ring_tx + ring_txPos*RING_FRAMESIZE);
+    uint32 status = __atomic_load_n(&(hdr->tp_status), __ATOMIC_ACQUIRE);
+    if (status == TP_STATUS_SEND_REQUEST || status == TP_STATUS_SENDING) {
+        //Not sent yet; like a full socket buffer
+        __atomic_add_fetch(&(ring_counters.txBusy), 1, __ATOMIC_RELAXED);
+        errno = EAGAIN;
+        return -1;
+    }
+    // TP_STATUS_AVAILABLE, or TP_STATUS_WRONG_FORMAT from an earlier frame; the slot is free either way
+
+    memcpy((char*)hdr + RING_TXDATA, buf, len);
+    hdr->tp_len = len;
+    __atomic_store_n(&(hdr->tp_status), TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+    ring_txPos = (ring_txPos + 1) % RING_TXFRAMES;
+
+    //Hand the queued frame(s) to the driver, without waiting for completion
+    if (__real_send(fd, NULL, 0, MSG_DONTWAIT) < 0 && errno != EAGAIN) {
+        return -1;
+    }
+    __atomic_add_fetch(&(ring_counters.txFrames), 1, __ATOMIC_RELAXED);
+    return len;
+}
@@ -0,0 +1,50 @@
+#ifndef packetRing_h
+#define packetRing_h
+
+#include "osal.h" //typedefs for uint8 etc.
+
+// Memory-mapped packet rings for the EtherCAT socket (NIC_RING YES).
+// SOEM exchanges frames with plain send() and recv() on a raw socket, polling recv() with a
+// 1 us timeout until the frame is back, so every cycle costs a series of syscalls and wakeups.
+// Here the socket gets a PACKET_RX_RING and a PACKET_TX_RING (TPACKET_V2), and SOEM's calls are
+// redirected to them at link time (-Wl,--wrap=send,--wrap=recv, see CMakeLists.txt); calls on
+// any other socket go to the C library as before.
+//  - recv() takes the next frame from the RX ring without a syscall; if there is none yet, it
+//    spins on the ring for up to NIC_BUSYPOLL us, and then waits in ppoll() for up to RING_WAIT.
+//  - send() copies the frame into the TX ring and kicks the kernel with one non-blocking send(),
+//    bypassing the qdisc.
+// TPACKET_V3 is not used: its RX ring hands over whole blocks, on a retire timer of at least
+// 1 ms, which does not suit one small frame per cycle. AF_XDP would need an XDP program and
+// driver support, and on veth runs in the same copy mode as these rings.
+// Compare the two with bench/nicbench.c on a veth pair, or ecd_exchange_seconds on /metrics.
+
+// Configuration    ************************************************************************
+#define RING_FRAMESIZE 2048   // Bytes per ring slot; an Ethernet frame plus the tpacket2_hdr
+#define RING_BLOCKSIZE 4096   // Must be a multiple of the page size and of RING_FRAMESIZE
+#define RING_RXFRAMES  64
+#define RING_TXFRAMES  16
+#define RING_WAIT      100000 // Max wait in ppoll() for a frame, per recv() [ns]
+
+// Data types       ************************************************************************
+
+struct ring_counters {
+    uint64 rxFrames;
+    uint64 txFrames;
+    uint64 rxWaits;    // recv() calls which had to wait in ppoll()
+    uint64 rxSpins;    // recv() calls which got their frame while spinning (NIC_BUSYPOLL)
+    uint64 rxEmpty;    // recv() calls which returned nothing (SOEM then calls again, until its timeout)
+    uint64 txBusy;     // send() calls which found the TX ring full
+    uint64 drops;      // Frames dropped by the kernel because the RX ring was full
+};
+
+// Functions        ************************************************************************
+
+// Set up the rings on a raw socket, e.g. SOEM's, after ec_init() and before dropping privileges.
+// busyPoll_us: how long recv() spins on the ring before sleeping (0: do not spin).
+// Returns 1 on success, 0 in case of error (the socket is then unchanged, or unusable).
+int ring_setup(int sockfd, int busyPoll_us);
+
+// Get a copy of the counters. Returns 1, or 0 if the rings are not in use.
+int ring_read(struct ring_counters* copy);
+
+#endif
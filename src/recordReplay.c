@@ -0,0 +1,337 @@
+#include "recordReplay.h"
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include <stdlib.h>
+#include <endian.h>
+
+#include <unistd.h>
+#include <pthread.h>
+
+#include "ethercat.h" // ec_slave[], ec_group[], ec_slavecount
+
+#include "EtherCatDaemon.h"
+#include "ecatDriver.h"
+#include "allocStats.h"
+
+// File-global data ************************************************************************
+
+// Recording; record_file == NULL -> not recording
+FILE*  record_file = NULL;
+int    record_iomapSize = 0;
+size_t record_slotSize  = 0;     // sizeof(struct record_cycle) + record_iomapSize
+char*  record_ring = NULL;       // RECORD_RINGSIZE slots, preallocated
+volatile uint32 record_head = 0; // Next slot to fill; written by the cycle thread only
+volatile uint32 record_tail = 0; // Next slot to write; written by the writer thread only
+volatile uint64 record_dropped = 0;
+uint64 record_written = 0;
+
+pthread_t record_writerThread;
+volatile int record_running = 0;
+
+// Replay
+FILE* replay_file = NULL;
+int   replay_imageSize = 0;
+
+// Functions        ************************************************************************
+
+int record_writeMappings(struct mapping_arena* arena, uint8 direction) {
+    //Helper function for record_setup(); returns the number of mappings written, or -1 on error
+    int numWritten = 0;
+    for (int i = 0; i < arena->num; i++) {
+        struct mappings_PDO* mapping = &(arena->records[i]);
+        struct record_mapping rec;
+        memset(&rec, 0, sizeof(rec));
+        size_t nameLen = mapping->name != NULL ? strnlen(mapping->name, 255) : 0;
+
+        rec.direction = direction;
+        rec.slaveIdx  = htole16(mapping->slaveIdx);
+        rec.idx       = htole16(mapping->idx);
+        rec.subidx    = mapping->subidx;
+        rec.offset    = htole32(mapping->offset);
+        rec.bitoff    = mapping->bitoff;
+        rec.bitlen    = mapping->bitlen;
+        rec.dataType  = htole16(mapping->dataType);
+        rec.nameLen   = nameLen;
+
+        if (fwrite(&rec, sizeof(rec), 1, record_file) != 1) return -1;
+        if (nameLen > 0 && fwrite(mapping->name, nameLen, 1, record_file) != 1) return -1;
+        numWritten++;
+    }
+    return numWritten;
+}
+
+void* record_writerLoop(void* arg) {
+    (void)arg; // Not used
+    alloc_setThread(ALLOC_RECORDER);
+    uint64 droppedReported = 0;
+
+    while (1) {
+        uint32 tail = record_tail;
+        uint32 head = __atomic_load_n(&record_head, __ATOMIC_ACQUIRE);
+
+        if (head == tail) {
+            if (!record_running) break;
+            fflush(record_file);
+            usleep(RECORD_FLUSHTIME);
+            continue;
+        }
+
+        for (; tail != head; tail++) {
+            char* slot = record_ring + (size_t)(tail % RECORD_RINGSIZE)*record_slotSize;
+            if (fwrite(slot, record_slotSize, 1, record_file) != 1) {
+                log_error("Error in record_writerLoop(): write failed, stopping the recording: %m\n");
+                __atomic_store_n(&record_tail, head, __ATOMIC_RELEASE);
+                return NULL;
+            }
+            record_written++;
+            __atomic_store_n(&record_tail, tail + 1, __ATOMIC_RELEASE);
+        }
+
+        uint64 dropped = record_dropped;
+        if (dropped > droppedReported) {
+            log_warn("WARNING: recorder dropped %" PRIu64 " cycles (%" PRIu64 " in total)\n",
+                     dropped - droppedReported, dropped);
+            droppedReported = dropped;
+        }
+    }
+    return NULL;
+}
+
+int record_open() {
+    if (config_file.record_file == NULL) return 1;
+
+    record_file = fopen(config_file.record_file, "wb");
+    if (record_file == NULL) {
+        log_error("Error in record_open(): could not open RECORD_FILE '%s': %m\n", config_file.record_file);
+        return 0;
+    }
+    return 1;
+}
+
+int record_setup(int iomapSize, int expectedWKC) {
+    if (record_file == NULL) return 1;
+
+    record_iomapSize = iomapSize;
+    record_slotSize  = sizeof(struct record_cycle) + iomapSize;
+
+    //Header
+    struct record_fileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, RECORD_MAGIC, 4);
+    header.version           = htole16(RECORD_VERSION);
+    header.numSlaves         = htole16(ec_slavecount);
+    header.iomapSize         = htole32(iomapSize);
+    header.expectedWKC       = htole32(expectedWKC);
+    header.cycleTime_us      = htole32(PLC_waittime);
+    header.groupInputsOffset = htole32((uint32)(ec_group[0].inputs - (uint8 *)&IOmap[0]));
+    header.groupIbytes       = htole32(ec_group[0].Ibytes);
+
+    header.numMappings = htole32(mapping_out->num + mapping_in->num);
+
+    if (fwrite(&header, sizeof(header), 1, record_file) != 1) goto writeFail;
+
+    //Slaves
+    for (int slave = 1; slave <= ec_slavecount; slave++) {
+        struct record_slave rec;
+        memset(&rec, 0, sizeof(rec));
+        rec.outputsOffset = htole32(ec_slave[slave].outputs == NULL ? RECORD_NOIMAGE :
+                                    (uint32)(ec_slave[slave].outputs - (uint8 *)&IOmap[0]));
+        rec.inputsOffset  = htole32(ec_slave[slave].inputs == NULL ? RECORD_NOIMAGE :
+                                    (uint32)(ec_slave[slave].inputs - (uint8 *)&IOmap[0]));
+        rec.Obytes = htole32(ec_slave[slave].Obytes);
+        rec.Ibytes = htole32(ec_slave[slave].Ibytes);
+        rec.Obits  = htole16(ec_slave[slave].Obits);
+        rec.Ibits  = htole16(ec_slave[slave].Ibits);
+        rec.state  = htole16(ec_slave[slave].state);
+        strncpy(rec.name, ec_slave[slave].name, RECORD_MAXNAME);
+        if (fwrite(&rec, sizeof(rec), 1, record_file) != 1) goto writeFail;
+    }
+
+    //Mappings
+    if (record_writeMappings(mapping_out, 0) < 0) goto writeFail;
+    if (record_writeMappings(mapping_in,  1) < 0) goto writeFail;
+
+    //Ring and writer thread
+    record_ring = malloc(RECORD_RINGSIZE*record_slotSize);
+    if (record_ring == NULL) {
+        log_error("Error in record_setup(): could not allocate the ring\n");
+        return 0;
+    }
+    memset(record_ring, 0, RECORD_RINGSIZE*record_slotSize);
+
+    record_running = 1;
+    pthread_create(&record_writerThread, NULL, record_writerLoop, NULL);
+
+    log_info("Recording %d bytes of IOmap per cycle to '%s'\n", iomapSize, config_file.record_file);
+    return 1;
+
+writeFail:
+    log_error("Error in record_setup(): could not write to RECORD_FILE '%s': %m\n", config_file.record_file);
+    fclose(record_file);
+    record_file = NULL;
+    return 0;
+}
+
+void record_capture(int64 time_ns, int wkc) {
+    if (!record_running) return;
+
+    uint32 head = record_head;
+    if (head - __atomic_load_n(&record_tail, __ATOMIC_ACQUIRE) >= RECORD_RINGSIZE) {
+        record_dropped++;
+        return;
+    }
+
+    char* slot = record_ring + (size_t)(head % RECORD_RINGSIZE)*record_slotSize;
+    struct record_cycle cycle;
+    cycle.time_ns = htole64(time_ns);
+    cycle.DCtime  = htole64(ec_DCtime);
+    cycle.wkc     = htole32(wkc);
+    memcpy(slot, &cycle, sizeof(cycle));
+    memcpy(slot + sizeof(cycle), IOmap, record_iomapSize);
+
+    __atomic_store_n(&record_head, head + 1, __ATOMIC_RELEASE);
+}
+
+void record_shutdown() {
+    if (!record_running) return;
+
+    record_running = 0;
+    pthread_join(record_writerThread, NULL);
+    fclose(record_file);
+    record_file = NULL;
+
+    log_info("Recorded %" PRIu64 " cycles to '%s', dropped %" PRIu64 "\n",
+             record_written, config_file.record_file, (uint64)record_dropped);
+}
+
+int replay_open(char* fileName) {
+    struct mapping_builder outputs;
+    struct mapping_builder inputs;
+    mappings_builderInit(&outputs);
+    mappings_builderInit(&inputs);
+
+    replay_file = fopen(fileName, "rb");
+    if (replay_file == NULL) {
+        log_error("Error in replay_open(): could not open '%s': %m\n", fileName);
+        return -1;
+    }
+
+    struct record_fileHeader header;
+    if (fread(&header, sizeof(header), 1, replay_file) != 1 ||
+        memcmp(header.magic, RECORD_MAGIC, 4) != 0 || le16toh(header.version) != RECORD_VERSION) {
+        log_error("Error in replay_open(): '%s' is not a recording (version %d)\n", fileName, RECORD_VERSION);
+        goto fail;
+    }
+
+    int numSlaves     = le16toh(header.numSlaves);
+    replay_imageSize  = le32toh(header.iomapSize);
+    int numMappings   = le32toh(header.numMappings);
+    int inputsOffset  = le32toh(header.groupInputsOffset);
+    int groupIbytes   = le32toh(header.groupIbytes);
+
+    if (numSlaves >= EC_MAXSLAVE || replay_imageSize <= 0 || inputsOffset + groupIbytes > replay_imageSize) {
+        log_error("Error in replay_open(): bad header in '%s'\n", fileName);
+        goto fail;
+    }
+
+    //The IOmap, at least as large as configured, so the daemon behaves as with a real bus
+    int allocSize = replay_imageSize > config_file.iomap_size ? replay_imageSize : config_file.iomap_size;
+    IOmap = malloc(allocSize*sizeof(char));
+    memset(IOmap, 0, allocSize);
+
+    //Slaves
+    memset(&(ec_slave[0]), 0, sizeof(ec_slave[0]));
+    ec_slavecount = numSlaves;
+    ec_slave[0].state = EC_STATE_OPERATIONAL;
+    for (int slave = 1; slave <= numSlaves; slave++) {
+        struct record_slave rec;
+        if (fread(&rec, sizeof(rec), 1, replay_file) != 1) goto truncated;
+
+        uint32 outputsOffset = le32toh(rec.outputsOffset);
+        uint32 inputsOffset  = le32toh(rec.inputsOffset);
+        memset(&(ec_slave[slave]), 0, sizeof(ec_slave[slave]));
+        ec_slave[slave].Obytes  = le32toh(rec.Obytes);
+        ec_slave[slave].Ibytes  = le32toh(rec.Ibytes);
+        ec_slave[slave].Obits   = le16toh(rec.Obits);
+        ec_slave[slave].Ibits   = le16toh(rec.Ibits);
+        ec_slave[slave].state   = le16toh(rec.state);
+        if ((outputsOffset != RECORD_NOIMAGE && outputsOffset + ec_slave[slave].Obytes > (uint32)replay_imageSize) ||
+            (inputsOffset  != RECORD_NOIMAGE && inputsOffset  + ec_slave[slave].Ibytes > (uint32)replay_imageSize)) {
+            log_error("Error in replay_open(): slave %d is outside of the recorded IOmap\n", slave);
+            goto fail;
+        }
+        ec_slave[slave].outputs = outputsOffset == RECORD_NOIMAGE ? NULL : (uint8*) &IOmap[outputsOffset];
+        ec_slave[slave].inputs  = inputsOffset  == RECORD_NOIMAGE ? NULL : (uint8*) &IOmap[inputsOffset];
+        memcpy(ec_slave[slave].name, rec.name, RECORD_MAXNAME < EC_MAXNAME ? RECORD_MAXNAME : EC_MAXNAME);
+    }
+
+    memset(&(ec_group[0]), 0, sizeof(ec_group[0]));
+    ec_group[0].inputs = (uint8*) &IOmap[inputsOffset];
+    ec_group[0].Ibytes = groupIbytes;
+
+    //Mappings
+    for (int i = 0; i < numMappings; i++) {
+        struct record_mapping rec;
+        if (fread(&rec, sizeof(rec), 1, replay_file) != 1) goto truncated;
+
+        char name[256]; // nameLen is a uint8
+        memset(name, 0, sizeof(name));
+        if (rec.nameLen > 0 && fread(name, rec.nameLen, 1, replay_file) != 1) goto truncated;
+
+        if (le32toh(rec.offset) + (rec.bitoff + rec.bitlen + 7)/8 > (uint32)replay_imageSize || rec.bitlen == 0) {
+            log_error("Error in replay_open(): mapping %d:%x:%x is outside of the recorded IOmap\n",
+                      le16toh(rec.slaveIdx), le16toh(rec.idx), rec.subidx);
+            goto fail;
+        }
+
+        mappings_add(rec.direction == 0 ? &outputs : &inputs,
+                     le16toh(rec.slaveIdx), le16toh(rec.idx), rec.subidx,
+                     le32toh(rec.offset), rec.bitoff, rec.bitlen, le16toh(rec.dataType), name);
+        log_info("[0x%4.4X.%1d] %d 0x%4.4X:0x%2.2X 0x%2.2X %s\n",
+                 le32toh(rec.offset), rec.bitoff, le16toh(rec.slaveIdx), le16toh(rec.idx), rec.subidx,
+                 rec.bitlen, name);
+    }
+
+    mapping_out = mappings_finish(&outputs);
+    mapping_in  = mappings_finish(&inputs);
+    if (mapping_out == NULL || mapping_in == NULL) {
+        log_error("Error in replay_open(): out of memory for the PDO mappings\n");
+        return -1;
+    }
+
+    log_info("Replaying '%s': %d slaves, %d PDOs, %d bytes of IOmap per cycle, recorded every %d us\n",
+             fileName, numSlaves, numMappings, replay_imageSize, le32toh(header.cycleTime_us));
+    return (int32) le32toh(header.expectedWKC);
+
+truncated:
+    log_error("Error in replay_open(): '%s' is truncated\n", fileName);
+fail:
+    mappings_free(mappings_finish(&outputs));
+    mappings_free(mappings_finish(&inputs));
+    fclose(replay_file);
+    replay_file = NULL;
+    return -1;
+}
+
+int replay_next(struct record_cycle* cycle, char* image) {
+    if (fread(cycle, sizeof(struct record_cycle), 1, replay_file) != 1) return 0;
+    if (fread(image, replay_imageSize, 1, replay_file) != 1) return 0;
+
+    cycle->time_ns = le64toh(cycle->time_ns);
+    cycle->DCtime  = le64toh(cycle->DCtime);
+    cycle->wkc     = le32toh(cycle->wkc);
+    return 1;
+}
+
+int replay_iomapSize() {
+    return replay_imageSize;
+}
+
+void replay_close() {
+    if (replay_file != NULL) {
+        fclose(replay_file);
+        replay_file = NULL;
+    }
+}
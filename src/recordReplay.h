@@ -0,0 +1,98 @@
+#ifndef recordReplay_h
+#define recordReplay_h
+
+#include "ecatDriver.h"
+
+// Recording of the raw process image of every cycle to a binary file (RECORD_FILE),
+// and replay of such a file instead of a real bus ('daemon --replay file [speed]').
+//
+// File layout (all integers little-endian):
+//   struct record_fileHeader
+//   struct record_slave        x numSlaves     (index 1..numSlaves, as in ec_slave[])
+//   struct record_mapping      x numMappings   (each followed by nameLen bytes of name)
+//   struct record_cycle        x N             (each followed by iomapSize bytes of IOmap)
+
+// Configuration    ************************************************************************
+#define RECORD_RINGSIZE 512   // Cycles buffered between the cycle thread and the writer thread
+#define RECORD_FLUSHTIME 5000 // How long the writer thread sleeps when there is nothing to write [us]
+
+#define RECORD_MAGIC   "ECDR"
+#define RECORD_VERSION 1
+#define RECORD_MAXNAME 40     // Same as EC_MAXNAME, but fixed so the file format does not depend on the SOEM build
+
+// Data types       ************************************************************************
+
+struct __attribute__((packed)) record_fileHeader {
+    char   magic[4];          // RECORD_MAGIC
+    uint16 version;           // RECORD_VERSION
+    uint16 numSlaves;
+    uint32 iomapSize;         // Bytes of IOmap stored per cycle
+    uint32 numMappings;
+    int32  expectedWKC;
+    uint32 cycleTime_us;      // PLC_waittime of the recording daemon
+    uint32 groupInputsOffset; // ec_group[0].inputs - IOmap
+    uint32 groupIbytes;       // ec_group[0].Ibytes
+};
+
+struct __attribute__((packed)) record_slave {
+    uint32 outputsOffset;     // RECORD_NOIMAGE if ec_slave[].outputs == NULL
+    uint32 inputsOffset;      // RECORD_NOIMAGE if ec_slave[].inputs == NULL
+    uint32 Obytes;
+    uint32 Ibytes;
+    uint16 Obits;
+    uint16 Ibits;
+    uint16 state;
+    char   name[RECORD_MAXNAME + 1];
+};
+#define RECORD_NOIMAGE 0xFFFFFFFF
+
+struct __attribute__((packed)) record_mapping {
+    uint8  direction;         // 0: mapping_out, 1: mapping_in
+    uint16 slaveIdx;
+    uint16 idx;
+    uint8  subidx;
+    uint32 offset;
+    uint8  bitoff;
+    uint8  bitlen;
+    uint16 dataType;
+    uint8  nameLen;
+};
+
+struct __attribute__((packed)) record_cycle {
+    int64  time_ns;           // monotonicTime_ns() at the start of the exchange
+    int64  DCtime;            // ec_DCtime after the exchange
+    int32  wkc;
+};
+
+// Functions        ************************************************************************
+
+// Open RECORD_FILE (if configured); called before dropping root privileges.
+// Returns 1 on success, 0 in case of error.
+int record_open();
+
+// Write the header and start the writer thread, if RECORD_FILE was opened.
+// Must be called after ecat_setup_mappings(). Returns 1 on success, 0 in case of error.
+int record_setup(int iomapSize, int expectedWKC);
+
+// Queue the current IOmap for writing; called by the cycle thread with IOmap_lock grabbed.
+// Never blocks; if the writer thread falls behind, the cycle is dropped and counted.
+void record_capture(int64 time_ns, int wkc);
+
+// Write whatever is queued, stop the writer thread and close the file.
+void record_shutdown();
+
+// Open a recording for replay, and set up IOmap, ec_slave[], ec_slavecount, ec_group[0],
+// mapping_out and mapping_in as if the bus had been scanned.
+// Returns the expected WKC of the recording, or -1 in case of error.
+int replay_open(char* fileName);
+
+// Read the next cycle into 'image' (iomapSize bytes, see replay_iomapSize()).
+// Returns 1 on success, 0 at the end of the file.
+int replay_next(struct record_cycle* cycle, char* image);
+
+// Bytes of IOmap per cycle in the opened recording.
+int replay_iomapSize();
+
+void replay_close();
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef seqlock_h
+#define seqlock_h
+
+#include "osal.h" //typedefs for uint8 etc.
+
+// Minimal sequence lock, for data written by a single thread (typically the cycle thread)
+// and read by any number of other threads without ever blocking the writer.
+// The sequence counter is odd while a write is in progress;
+// readers copy the data and retry if the counter changed underneath them.
+//
+// Usage (writer):                      Usage (reader):
+//   seqlock_write_begin(&seq);           uint32 s;
+//   ... update the data ...              do {
+//   seqlock_write_end(&seq);                 s = seqlock_read_begin(&seq);
+//                                            ... copy the data ...
+//                                        } while (seqlock_read_retry(&seq, s));
+
+static inline void seqlock_write_begin(volatile uint32* seq) {
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void seqlock_write_end(volatile uint32* seq) {
+    __atomic_store_n(seq, *seq + 1, __ATOMIC_RELEASE);
+}
+
+static inline uint32 seqlock_read_begin(volatile uint32* seq) {
+    uint32 s;
+    while ( (s = __atomic_load_n(seq, __ATOMIC_ACQUIRE)) & 1 ) {
+        // Writer active; spin
+    }
+    return s;
+}
+
+static inline int seqlock_read_retry(volatile uint32* seq, uint32 s) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(seq, __ATOMIC_RELAXED) != s;
+}
+
+#endif
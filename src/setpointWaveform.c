@@ -0,0 +1,324 @@
+#include "setpointWaveform.h"
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <unistd.h>
+#include <pthread.h>
+
+#include "EtherCatDaemon.h"
+#include "networkServer.h"
+
+// File-global data ************************************************************************
+#include "lockTrace.h"
+
+// The player; everything except the rows of a FREE segment is protected by IOmap_lock.
+// The rows of a FREE segment belong to the owner's client thread.
+int wave_enabled = 0;
+int wave_owner   = -1;  // IPservers slot, or -1
+int wave_numChannels = 0;
+struct mappings_PDO* wave_channelMaps[WAVE_MAXCHANNELS];
+
+struct wave_segment wave_segments[2];
+int wave_fill    = 0;   // Segment which is filled next
+int wave_playing = -1;  // Segment being played, or -1
+int wave_next    = 0;   // Segment which is played next; segments are played in the order they are committed
+int wave_row     = 0;   // Next row of the playing segment
+
+uint8  wave_running  = 0;
+uint8  wave_underrun = 0; // Playback stopped because no segment was queued
+uint64 wave_rowsPlayed     = 0;
+uint64 wave_segmentsPlayed = 0;
+uint64 wave_underruns      = 0;
+
+// Functions        ************************************************************************
+
+int wave_setup() {
+    if (!config_file.allowWaveform) return 1;
+
+    for (int i = 0; i < 2; i++) {
+        memset(&(wave_segments[i]), 0, sizeof(struct wave_segment));
+        wave_segments[i].rows = malloc((size_t)config_file.waveform_len*WAVE_MAXCHANNELS*sizeof(uint64));
+        if (wave_segments[i].rows == NULL) {
+            log_error("ERROR in wave_setup(): could not allocate %d rows\n", config_file.waveform_len);
+            return 0;
+        }
+    }
+    wave_enabled = 1;
+
+    log_warn("Setpoint waveform playback enabled (ALLOWWAVEFORM): clients can drive the outputs\n");
+    return 1;
+}
+
+void wave_reset() {
+    //Helper function; stop playback and discard all segments. IOmap_lock is assumed to be grabbed.
+    for (int i = 0; i < 2; i++) {
+        wave_segments[i].numRows = 0;
+        wave_segments[i].loop    = 0;
+        wave_segments[i].state   = WAVE_FREE;
+    }
+    wave_fill     = 0;
+    wave_next     = 0;
+    wave_playing  = -1;
+    wave_row      = 0;
+    wave_running  = 0;
+}
+
+void wave_stopPlayback() {
+    //Helper function for wave_apply(); stop playback after an underrun and free the played and
+    // queued segments. The FREE one is left alone: its owner may be filling it without IOmap_lock.
+    // IOmap_lock is assumed to be grabbed.
+    for (int i = 0; i < 2; i++) {
+        if (wave_segments[i].state == WAVE_FREE) continue;
+        wave_segments[i].numRows = 0;
+        wave_segments[i].loop    = 0;
+        wave_segments[i].state   = WAVE_FREE;
+    }
+    wave_next     = wave_fill; // Nothing is queued, so the next commit is played next
+    wave_playing  = -1;
+    wave_row      = 0;
+    wave_running  = 0;
+}
+
+void wave_apply() {
+    if (!wave_running) return;
+
+    struct wave_segment* seg = wave_playing < 0 ? NULL : &(wave_segments[wave_playing]);
+    if (seg == NULL || wave_row >= seg->numRows) {
+        //End of the segment: continue with the next one, repeat a loop, or stop
+        if (wave_segments[wave_next].state == WAVE_READY) {
+            if (seg != NULL) {
+                seg->numRows = 0;
+                seg->state   = WAVE_FREE;
+                wave_segmentsPlayed++;
+            }
+            wave_playing = wave_next;
+            wave_next    = 1 - wave_next;
+            seg = &(wave_segments[wave_playing]);
+            seg->state = WAVE_PLAYING;
+        }
+        else if (seg != NULL && seg->loop) {
+            wave_segmentsPlayed++;
+        }
+        else {
+            if (seg != NULL) wave_segmentsPlayed++;
+            wave_stopPlayback();
+            wave_underrun = 1;
+            wave_underruns++;
+            return;
+        }
+        wave_row = 0;
+    }
+
+    uint64* row = &(seg->rows[wave_row*wave_numChannels]);
+    for (int c = 0; c < wave_numChannels; c++) {
+        PDOrawWrite(wave_channelMaps[c], row[c]);
+    }
+    wave_row++;
+    wave_rowsPlayed++;
+}
+
+const char* wave_checkOwner(int slot) {
+    //Helper function; IOmap_lock is assumed to be grabbed
+    if (!wave_enabled)     return "waveform playback not enabled (ALLOWWAVEFORM), or replaying";
+    if (wave_owner == -1)  return "no channels selected; use 'wave channels' first";
+    if (wave_owner != slot) return "the player is owned by another connection";
+    return NULL;
+}
+
+const char* wave_channels(int slot, char* args) {
+    //Resolve the channels first; mapping_out is never changed after startup
+    struct mappings_PDO* maps[WAVE_MAXCHANNELS];
+    int numChannels = 0;
+    char* saveptr;
+    char* token = strtok_r(args, " \t\r\n", &saveptr);
+    while (token != NULL) {
+        uint16 slave  = 0;
+        uint16 idx    = 0;
+        uint8  subidx = 0;
+        if (numChannels == WAVE_MAXCHANNELS) return "too many channels";
+        if (sscanf(token, "%hi:%hx:%hhx", &slave, &idx, &subidx) != 3) return "wave channels got bad args";
+        maps[numChannels] = get_address(slave, idx, subidx, mapping_out);
+        if (maps[numChannels] == NULL) return "channel not recognized (searched for outputs)";
+        uint64 raw;
+        if (!double2PDOraw(maps[numChannels], 0.0, &raw)) return "channel has an unsupported data type";
+        numChannels++;
+        token = strtok_r(NULL, " \t\r\n", &saveptr);
+    }
+    if (numChannels == 0) return "wave channels got bad args";
+
+    const char* error = NULL;
+    locktrace_lock(&IOmap_lock, "wave");
+    if (!wave_enabled) {
+        error = "waveform playback not enabled (ALLOWWAVEFORM), or replaying";
+    }
+    else if (wave_owner != -1 && wave_owner != slot) {
+        error = "the player is owned by another connection";
+    }
+    else if (wave_running) {
+        error = "playback is running; 'wave stop' first";
+    }
+    else {
+        wave_reset();
+        wave_owner       = slot;
+        wave_underrun    = 0;
+        wave_numChannels = numChannels;
+        memcpy(wave_channelMaps, maps, numChannels*sizeof(struct mappings_PDO*));
+    }
+    locktrace_unlock(&IOmap_lock);
+    return error;
+}
+
+const char* wave_data(int slot, char* rows) {
+    //Wait until the segment to fill is free; the cycle thread frees it when it has been played
+    struct wave_segment* seg;
+    while (1) {
+        locktrace_lock(&IOmap_lock, "wave");
+        const char* error = wave_checkOwner(slot);
+        seg = &(wave_segments[wave_fill]);
+        int isFree  = seg->state == WAVE_FREE;
+        int running = wave_running;
+        locktrace_unlock(&IOmap_lock);
+
+        if (error != NULL) return error;
+        if (isFree) break;
+        if (!running) return "both segments are queued; 'wave start' first";
+        if (ecat_waitCycles(1, PLC_deadline*1000 + 1000000000LL, NULL) == 0) return "not inOP or not updating";
+    }
+
+    //The FREE segment belongs to this thread; the rows are only appended if all of them are valid
+    int numRows = seg->numRows;
+    char* rowsSave;
+    char* rowStr = strtok_r(rows, ";", &rowsSave);
+    while (rowStr != NULL) {
+        if (numRows == config_file.waveform_len) return "segment full (WAVEFORM_LEN); 'wave commit' first";
+
+        uint64* row = &(seg->rows[numRows*wave_numChannels]);
+        int numValues = 0;
+        char* valuesSave;
+        char* valueStr = strtok_r(rowStr, " \t\r\n", &valuesSave);
+        while (valueStr != NULL) {
+            char* end;
+            double value = strtod(valueStr, &end);
+            if (*end != '\0' || numValues == wave_numChannels) return "wave data got bad args";
+            if (!double2PDOraw(wave_channelMaps[numValues], value, &(row[numValues]))) {
+                return "value out of range for the data type of its channel";
+            }
+            numValues++;
+            valueStr = strtok_r(NULL, " \t\r\n", &valuesSave);
+        }
+        if (numValues != 0) {
+            if (numValues != wave_numChannels) return "wave data got a row with the wrong number of values";
+            numRows++;
+        }
+        rowStr = strtok_r(NULL, ";", &rowsSave);
+    }
+
+    //Publish the rows under the lock, unless the segment was discarded meanwhile ('wave stop' etc.)
+    const char* error;
+    locktrace_lock(&IOmap_lock, "wave");
+    error = wave_checkOwner(slot);
+    if (error == NULL && (seg != &(wave_segments[wave_fill]) || seg->state != WAVE_FREE)) {
+        error = "the segment was discarded meanwhile; send the rows again";
+    }
+    if (error == NULL) {
+        seg->numRows = numRows;
+    }
+    locktrace_unlock(&IOmap_lock);
+    return error;
+}
+
+const char* wave_commit(int slot, int loop) {
+    const char* error;
+    locktrace_lock(&IOmap_lock, "wave");
+    error = wave_checkOwner(slot);
+    struct wave_segment* seg = &(wave_segments[wave_fill]);
+    if (error == NULL && (seg->state != WAVE_FREE || seg->numRows == 0)) {
+        error = "no rows to commit; 'wave data' first";
+    }
+    if (error == NULL) {
+        seg->loop  = loop;
+        seg->state = WAVE_READY;
+        wave_fill  = 1 - wave_fill;
+    }
+    locktrace_unlock(&IOmap_lock);
+    return error;
+}
+
+const char* wave_start(int slot) {
+    const char* error;
+    locktrace_lock(&IOmap_lock, "wave");
+    error = wave_checkOwner(slot);
+    if (error == NULL && !wave_running && wave_segments[wave_next].state != WAVE_READY) {
+        error = "no segment queued; 'wave commit' first";
+    }
+    if (error == NULL) {
+        wave_running  = 1;
+        wave_underrun = 0;
+    }
+    locktrace_unlock(&IOmap_lock);
+    return error;
+}
+
+const char* wave_stop(int slot) {
+    const char* error;
+    locktrace_lock(&IOmap_lock, "wave");
+    error = wave_checkOwner(slot);
+    if (error == NULL) {
+        wave_reset();
+        wave_underrun = 0;
+    }
+    locktrace_unlock(&IOmap_lock);
+    return error;
+}
+
+void wave_release(int slot) {
+    locktrace_lock(&IOmap_lock, "wave");
+    if (wave_owner == slot) {
+        if (wave_running) log_warn("Waveform playback stopped, slot %d disconnected\n", slot);
+        wave_reset();
+        wave_underrun    = 0;
+        wave_owner       = -1;
+        wave_numChannels = 0;
+    }
+    locktrace_unlock(&IOmap_lock);
+}
+
+void wave_describe(int connfd) {
+    char buff_out[BUFFLEN];
+    char hstr[BUFFLEN];
+    memset(buff_out, 0, BUFFLEN);
+
+    //Consistent copy of the state
+    locktrace_lock(&IOmap_lock, "wave");
+    int    owner       = wave_owner;
+    int    numChannels = wave_numChannels;
+    struct mappings_PDO* maps[WAVE_MAXCHANNELS];
+    memcpy(maps, wave_channelMaps, sizeof(maps));
+    const char* state  = !wave_enabled ? "disabled" : wave_running ? "running" : wave_underrun ? "underrun" : "stopped";
+    int    row         = wave_row;
+    int    rows        = wave_playing < 0 ? 0 : wave_segments[wave_playing].numRows;
+    int    queued      = (wave_segments[0].state == WAVE_READY) + (wave_segments[1].state == WAVE_READY);
+    int    filling     = wave_segments[wave_fill].state == WAVE_FREE ? wave_segments[wave_fill].numRows : 0;
+    uint64 rowsPlayed  = wave_rowsPlayed;
+    uint64 segsPlayed  = wave_segmentsPlayed;
+    uint64 underruns   = wave_underruns;
+    locktrace_unlock(&IOmap_lock);
+
+    snprintf(buff_out, BUFFLEN,
+             "  wave %s owner %d channels %d row %d/%d queued %d filling %d/%d played %" PRIu64
+             " segments %" PRIu64 " underruns %" PRIu64 "\n",
+             state, owner, numChannels, row, rows, queued, filling, config_file.waveform_len,
+             rowsPlayed, segsPlayed, underruns);
+    write(connfd, buff_out, BUFFLEN);
+    memset(buff_out, 0, BUFFLEN);
+
+    for (int c = 0; c < numChannels; c++) {
+        snprintf(buff_out, BUFFLEN, "  channel %d %d:0x%4.4X:0x%2.2X %s\n",
+                 c, maps[c]->slaveIdx, maps[c]->idx, maps[c]->subidx, dtype2string(maps[c]->dataType, hstr, BUFFLEN));
+        write(connfd, buff_out, BUFFLEN);
+        memset(buff_out, 0, BUFFLEN);
+    }
+}
@@ -0,0 +1,67 @@
+#ifndef setpointWaveform_h
+#define setpointWaveform_h
+
+#include "ecatDriver.h"
+
+// Setpoint waveform playback on output PDOs, for deterministic test sequences (ramps, steps,
+// recorded trajectories) which can not be driven over the request/response protocol.
+// A client (the owner) selects up to WAVE_MAXCHANNELS outputs with 'wave channels', uploads
+// rows of setpoints with 'wave data', and queues them as a segment with 'wave commit'.
+// The cycle thread writes one row per cycle into the IOmap, just before the exchange.
+//
+// There are two preallocated segments of WAVEFORM_LEN rows: while one is playing, the next
+// one is uploaded into the other, and playback continues with it seamlessly when the first
+// one ends. 'wave data' blocks while both segments are queued, which paces a streaming client.
+// A looping segment repeats until the next one is queued. If a segment ends and no other one
+// is queued, playback stops (underrun) and the outputs keep the last row.
+// Values are checked and converted to the raw PDO encoding on upload, so the cycle thread only
+// copies bits. Playback stops when the owner disconnects. Needs ALLOWWAVEFORM YES.
+
+// Configuration    ************************************************************************
+#define WAVE_MAXCHANNELS 16
+
+// Data types       ************************************************************************
+
+enum wave_segmentState {
+    WAVE_FREE,     // Can be filled by the owner
+    WAVE_READY,    // Committed, waiting to be played
+    WAVE_PLAYING
+};
+
+struct wave_segment {
+    uint64* rows;      // numRows * numChannels raw values, see double2PDOraw()
+    int     numRows;
+    uint8   loop;
+    uint8   state;     // enum wave_segmentState
+};
+
+// Functions        ************************************************************************
+
+// Allocate the segments, if enabled (ALLOWWAVEFORM); only for a real bus, not for replays.
+// Returns 1 on success, 0 in case of error.
+int wave_setup();
+
+// Write the next row to the IOmap; called by the cycle thread with IOmap_lock grabbed,
+// before sending the process data.
+void wave_apply();
+
+// Commands of a client slot; each returns NULL on success, else the reason for an 'err:' line.
+
+// Take ownership and select the output channels; playback must be stopped.
+const char* wave_channels(int slot, char* args);
+// Append rows ("v1 v2 ...; v1 v2 ...") to the segment being filled, all or none; waits while both are queued.
+const char* wave_data(int slot, char* rows);
+// Queue the segment being filled; it repeats until the next one is queued if loop.
+const char* wave_commit(int slot, int loop);
+// Start playing the queued segments at the next cycle.
+const char* wave_start(int slot);
+// Stop playback and discard all segments; the outputs keep their last values.
+const char* wave_stop(int slot);
+
+// Stop playback and give up ownership, when a client slot disconnects.
+void wave_release(int slot);
+
+// Write the state of the player to a connection.
+void wave_describe(int connfd);
+
+#endif
@@ -0,0 +1,123 @@
+#define _GNU_SOURCE // memfd_create()
+
+#include "shmImage.h"
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "ethercat.h" // ec_group[0], for the size of the image
+
+#include "EtherCatDaemon.h"
+#include "networkServer.h"
+#include "seqlock.h"
+
+// File-global data ************************************************************************
+
+struct shm_header* shm_mem = NULL; // Mapped read-write, for the cycle thread
+char* shm_image  = NULL;           // shm_mem + SHM_HEADERSIZE
+int   shm_imageSize = 0;
+int   shm_roFd   = -1;             // Read-only descriptor, handed to the clients
+
+// Functions        ************************************************************************
+
+int shm_setup() {
+    if (!config_file.unix_shm) return 1;
+
+    //Everything from the start of the IOmap to the end of the inputs
+    shm_imageSize = (ec_group[0].inputs - (uint8*) &IOmap[0]) + ec_group[0].Ibytes;
+    size_t shmSize = SHM_HEADERSIZE + shm_imageSize;
+
+    int fd = memfd_create("ecd_image", MFD_CLOEXEC);
+    if (fd < 0) {
+        log_error("ERROR in shm_setup(): memfd_create failed: %m\n");
+        return 0;
+    }
+    if (ftruncate(fd, shmSize) != 0) {
+        log_error("ERROR in shm_setup(): ftruncate failed: %m\n");
+        close(fd);
+        return 0;
+    }
+    shm_mem = mmap(NULL, shmSize, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    if (shm_mem == MAP_FAILED) {
+        log_error("ERROR in shm_setup(): mmap failed: %m\n");
+        shm_mem = NULL;
+        close(fd);
+        return 0;
+    }
+
+    //Reopen read-only, so that clients cannot map it writable
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+    shm_roFd = open(path, O_RDONLY|O_CLOEXEC);
+    close(fd);
+    if (shm_roFd < 0) {
+        log_error("ERROR in shm_setup(): could not reopen the memfd read-only: %m\n");
+        return 0;
+    }
+
+    memset(shm_mem, 0, shmSize);
+    memcpy(shm_mem->magic, SHM_MAGIC, 4);
+    shm_mem->version    = SHM_VERSION;
+    shm_mem->headerSize = SHM_HEADERSIZE;
+    shm_mem->imageSize  = shm_imageSize;
+    shm_image = ((char*) shm_mem) + SHM_HEADERSIZE;
+
+    log_info("Shared memory process image: %d bytes\n", shm_imageSize);
+    return 1;
+}
+
+void shm_update(uint64 cycle, int64 time_ns, int wkc, int expectedWKC) {
+    if (shm_mem == NULL) return;
+
+    seqlock_write_begin(&(shm_mem->seq));
+    memcpy(shm_image, IOmap, shm_imageSize);
+    shm_mem->cycle       = cycle;
+    shm_mem->DCtime      = ec_DCtime;
+    shm_mem->time_ns     = time_ns;
+    shm_mem->wkc         = wkc;
+    shm_mem->expectedWKC = expectedWKC;
+    seqlock_write_end(&(shm_mem->seq));
+}
+
+int shm_send(int connfd) {
+    if (shm_mem == NULL) return 0;
+
+    char buff_out[BUFFLEN];
+    memset(buff_out, 0, BUFFLEN);
+    snprintf(buff_out, BUFFLEN, "  magic %s version %d header %d image %d\n",
+             SHM_MAGIC, SHM_VERSION, SHM_HEADERSIZE, shm_imageSize);
+
+    //The descriptor travels with the first byte of the record
+    struct iovec iov;
+    iov.iov_base = buff_out;
+    iov.iov_len  = BUFFLEN;
+
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov        = &iov;
+    msg.msg_iovlen     = 1;
+    msg.msg_control    = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type  = SCM_RIGHTS;
+    cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &shm_roFd, sizeof(int));
+
+    if (sendmsg(connfd, &msg, 0) != BUFFLEN) {
+        log_warn("WARNING in shm_send(): sendmsg failed: %m\n");
+        return 0;
+    }
+    return 1;
+}
@@ -0,0 +1,49 @@
+#ifndef shmImage_h
+#define shmImage_h
+
+#include "ecatDriver.h"
+
+// Copy of the process image in shared memory, for clients on the same host.
+// The cycle thread copies the IOmap into a memfd after every exchange; a client on the
+// UNIX_SOCKET gets a read-only file descriptor for it with the 'shm' command (SCM_RIGHTS),
+// maps it, and reads values directly without a round trip to the daemon.
+// Consistency is ensured by a sequence lock in the header (see seqlock.h): the reader copies
+// what it needs, and retries if 'seq' was odd or changed meanwhile.
+// Offsets into the image are the same as in the IOmap, see 'meta all'.
+
+// Configuration    ************************************************************************
+#define SHM_MAGIC      "ECDS"
+#define SHM_VERSION    1
+#define SHM_HEADERSIZE 64 // The image starts here [bytes]
+
+// Data types       ************************************************************************
+
+// Header at the start of the shared memory; native byte order, since it never leaves the host.
+struct shm_header {
+    char   magic[4];          // SHM_MAGIC
+    uint16 version;           // SHM_VERSION
+    uint16 headerSize;        // SHM_HEADERSIZE
+    uint32 imageSize;         // [bytes]
+    volatile uint32 seq;      // Sequence lock; odd while the cycle thread is writing
+    uint64 cycle;             // Cycle number of the exchange
+    int64  DCtime;            // ec_DCtime after the exchange [ns]
+    int64  time_ns;           // CLOCK_MONOTONIC at the start of the exchange [ns]
+    int32  wkc;
+    int32  expectedWKC;
+};
+
+// Functions        ************************************************************************
+
+// Create the shared memory, if enabled (UNIX_SHM); must be called after ecat_setup_mappings().
+// Returns 1 on success, 0 in case of error.
+int shm_setup();
+
+// Copy the IOmap into the shared memory; called by the cycle thread with IOmap_lock grabbed.
+void shm_update(uint64 cycle, int64 time_ns, int wkc, int expectedWKC);
+
+// Send a read-only file descriptor for the shared memory to a client on a UNIX socket,
+// together with a one-record description of the layout.
+// Returns 1 on success, 0 if not enabled or in case of error.
+int shm_send(int connfd);
+
+#endif
@@ -0,0 +1,135 @@
+#include "slaveHealth.h"
+
+#include <string.h>
+
+#include "EtherCatDaemon.h"
+#include "ecatDriver.h"
+#include "seqlock.h"
+
+// File-global data ************************************************************************
+
+struct health_slave  health_slaves[EC_MAXSLAVE]; // Indexed by slave number, [0] unused
+struct health_totals health_counts = {0, 0, 0};
+volatile uint32      health_seq = 0;
+
+// Only used by the watchdog thread
+uint64 health_pendingDrops = 0; // Short cycles not attributed yet
+int    health_attributed   = 0; // Whether a slave took them in this pass
+int64  health_now_ns       = 0; // Time of the current pass
+
+// Functions        ************************************************************************
+
+void health_takeDrops() {
+    //Helper function; the short cycles since the last call
+    struct cycle_stats stats;
+    cycleStats_read(&stats);
+    health_pendingDrops = stats.wkcErrors - health_counts.wkcErrors;
+}
+
+void health_endEpisode(struct health_slave* h) {
+    //Helper function; the slave is back in OP
+    if (h->nonOpSince_ns == 0) return;
+    h->lastRecovery_ns = health_now_ns - h->nonOpSince_ns;
+    if (h->lastRecovery_ns > h->maxRecovery_ns) h->maxRecovery_ns = h->lastRecovery_ns;
+    h->nonOp_ns += h->lastRecovery_ns;
+    h->nonOpSince_ns = 0;
+}
+
+void health_beginCheck() {
+    health_takeDrops();
+    health_attributed = 0;
+    health_now_ns = monotonicTime_ns();
+
+    seqlock_write_begin(&health_seq);
+    health_counts.checks++;
+    seqlock_write_end(&health_seq);
+}
+
+void health_observe(uint16 slave) {
+    if (slave == 0 || slave >= EC_MAXSLAVE) return;
+    struct health_slave* h = &(health_slaves[slave]);
+
+    seqlock_write_begin(&health_seq);
+    uint16 state = ec_slave[slave].state;
+    if (h->state != 0 && state != h->state) h->transitions++;
+    h->state = state;
+
+    if (ec_slave[slave].ALstatuscode != 0) {
+        h->ALstatuscode = ec_slave[slave].ALstatuscode;
+        h->ALstatus_ns  = health_now_ns;
+    }
+
+    if (state == EC_STATE_OPERATIONAL && !ec_slave[slave].islost) {
+        health_endEpisode(h);
+    }
+    else {
+        if (h->nonOpSince_ns == 0) {
+            h->nonOpSince_ns = health_now_ns;
+            h->episodes++;
+        }
+        h->wkcDrops += health_pendingDrops;
+        health_attributed = 1;
+    }
+    seqlock_write_end(&health_seq);
+}
+
+void health_action(uint16 slave, enum health_action action, int success) {
+    if (slave == 0 || slave >= EC_MAXSLAVE) return;
+    seqlock_write_begin(&health_seq);
+    health_slaves[slave].attempts[action]++;
+    if (success) health_slaves[slave].successes[action]++;
+    seqlock_write_end(&health_seq);
+}
+
+void health_lost(uint16 slave) {
+    if (slave == 0 || slave >= EC_MAXSLAVE) return;
+    seqlock_write_begin(&health_seq);
+    health_slaves[slave].losses++;
+    seqlock_write_end(&health_seq);
+}
+
+void health_endCheck(int allOP) {
+    health_now_ns = monotonicTime_ns(); // Reconfiguring may have taken a while
+    seqlock_write_begin(&health_seq);
+    if (!health_attributed) health_counts.unattributed += health_pendingDrops;
+    health_counts.wkcErrors += health_pendingDrops;
+
+    //All slaves confirmed in OP by the pass; the episodes of the slaves which were brought
+    // back to OP since they were last observed end now
+    if (allOP) {
+        for (int slave = 1; slave <= ec_slavecount && slave < EC_MAXSLAVE; slave++) {
+            struct health_slave* h = &(health_slaves[slave]);
+            if (h->nonOpSince_ns == 0) continue;
+            health_endEpisode(h);
+            if (h->state != EC_STATE_OPERATIONAL) h->transitions++;
+            h->state = EC_STATE_OPERATIONAL;
+        }
+    }
+    seqlock_write_end(&health_seq);
+}
+
+void health_noCheck() {
+    health_takeDrops();
+    if (health_pendingDrops == 0) return;
+
+    seqlock_write_begin(&health_seq);
+    health_counts.unattributed += health_pendingDrops;
+    health_counts.wkcErrors    += health_pendingDrops;
+    seqlock_write_end(&health_seq);
+}
+
+void health_read(struct health_slave* copy, int num, struct health_totals* totals) {
+    if (num >= EC_MAXSLAVE) num = EC_MAXSLAVE-1;
+    uint32 s;
+    do {
+        s = seqlock_read_begin(&health_seq);
+        if (copy != NULL && num > 0) memcpy(copy, &(health_slaves[1]), num*sizeof(struct health_slave));
+        if (totals != NULL) *totals = health_counts;
+    } while (seqlock_read_retry(&health_seq, s));
+
+    if (copy == NULL) return;
+    int64 now = monotonicTime_ns();
+    for (int i = 0; i < num; i++) {
+        if (copy[i].nonOpSince_ns != 0) copy[i].nonOp_ns += now - copy[i].nonOpSince_ns;
+    }
+}
@@ -0,0 +1,69 @@
+#ifndef slaveHealth_h
+#define slaveHealth_h
+
+#include "osal.h" //typedefs for uint8 etc.
+#include "ethercat.h" // EC_MAXSLAVE
+
+// Per-slave communication health, so that a flaky terminal or cable can be found from the
+// counters instead of the log. Maintained by ecat_check() (the watchdog thread), never by the
+// cycle thread: it already counts the cycles with a short working counter (cycleStats.wkcErrors),
+// and the watchdog attributes them:
+//  - if a check pass finds slaves which are not in OP (or lost), the short cycles since the
+//    last pass are counted for each of them;
+//  - if not (the working counter had recovered by itself, e.g. a lost frame), they are
+//    counted as unattributed.
+// A slave is non-OP from the first pass which sees it out of OP until a pass (or the end of the
+// check) sees it back in OP; that time is its recovery time.
+// Read by the 'health' command and /metrics through a seqlock; every update is a write section
+// of its own, so that readers never wait for a slow ec_reconfig_slave().
+
+// Data types       ************************************************************************
+
+enum health_action {
+    HEALTH_ACK,        // SAFE_OP + ERROR acknowledged
+    HEALTH_OPREQUEST,  // SAFE_OP, requested OP
+    HEALTH_RECONFIG,   // ec_reconfig_slave()
+    HEALTH_RECOVER,    // ec_recover_slave()
+    HEALTH_NUMACTIONS
+};
+
+struct health_slave {
+    uint64 wkcDrops;                   // Short cycles attributed to this slave
+    uint64 transitions;                // State changes seen by the watchdog
+    uint64 losses;                     // Times the slave was marked lost
+    uint64 attempts[HEALTH_NUMACTIONS];
+    uint64 successes[HEALTH_NUMACTIONS]; // Only for HEALTH_RECONFIG and HEALTH_RECOVER
+    uint64 episodes;                   // Times the slave left OP
+    int64  nonOp_ns;                   // Total time out of OP, of the finished episodes
+    int64  nonOpSince_ns;              // monotonicTime_ns() when the current episode started (0: in OP)
+    int64  lastRecovery_ns;            // Duration of the last finished episode
+    int64  maxRecovery_ns;
+    uint16 state;                      // Last state seen by the watchdog (0: never checked)
+    uint16 ALstatuscode;               // Last non-zero AL status code
+    int64  ALstatus_ns;                // monotonicTime_ns() when it was seen (0: never)
+};
+
+struct health_totals {
+    uint64 checks;                     // Check passes of the watchdog
+    uint64 wkcErrors;                  // Short cycles considered so far
+    uint64 unattributed;               // Short cycles while all slaves were in OP
+};
+
+// Functions        ************************************************************************
+
+// Called by ecat_check() with IOmap_lock grabbed. A check pass is
+//   health_beginCheck(), health_observe() for every slave right after ec_readstate(),
+//   health_action() for what was tried, health_endCheck().
+// health_noCheck() is called instead when the watchdog found nothing to check.
+void health_beginCheck();
+void health_observe(uint16 slave);
+void health_action(uint16 slave, enum health_action action, int success);
+void health_lost(uint16 slave);
+void health_endCheck(int allOP);
+void health_noCheck();
+
+// Get a consistent copy of the counters of slaves 1..num (copy[0] is slave 1). An episode which
+// is still going on is included in nonOp_ns. Either pointer may be NULL.
+void health_read(struct health_slave* copy, int num, struct health_totals* totals);
+
+#endif
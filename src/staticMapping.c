@@ -0,0 +1,86 @@
+#include "staticMapping.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include "ethercat.h" // ec_slave[], to check the topology
+
+#include "EtherCatDaemon.h"
+
+// File-global data ************************************************************************
+
+int staticmap_loaded = 0;
+
+// Functions        ************************************************************************
+
+int staticmap_checkSlaves() {
+    //Helper function for staticmap_load(); logs every difference. Returns 1 if the bus matches
+    int ok = 1;
+    if (ec_slavecount != staticmap_numSlaves) {
+        log_error("ERROR: the static mapping is for %d slaves, but the bus has %d\n",
+                  staticmap_numSlaves, ec_slavecount);
+        return 0;
+    }
+    for (int slave = 1; slave <= ec_slavecount; slave++) {
+        const struct staticmap_slave* expected = &(staticmap_slaves[slave-1]);
+        int outOffset = ec_slave[slave].outputs != NULL ? (int)(ec_slave[slave].outputs - (uint8*)&IOmap[0]) : -1;
+        int inOffset  = ec_slave[slave].inputs  != NULL ? (int)(ec_slave[slave].inputs  - (uint8*)&IOmap[0]) : -1;
+
+        if (ec_slave[slave].eep_man != expected->eep_man || ec_slave[slave].eep_id != expected->eep_id ||
+            strcmp(ec_slave[slave].name, expected->name) != 0) {
+            log_error("ERROR: slave %d is %s (0x%8.8X:0x%8.8X), the static mapping expects %s (0x%8.8X:0x%8.8X)\n",
+                      slave, ec_slave[slave].name, ec_slave[slave].eep_man, ec_slave[slave].eep_id,
+                      expected->name, expected->eep_man, expected->eep_id);
+            ok = 0;
+        }
+        else if (ec_slave[slave].Obits != expected->outBits || ec_slave[slave].Ibits != expected->inBits ||
+                 (expected->outBits > 0 && outOffset != expected->outOffset) ||
+                 (expected->inBits  > 0 && inOffset  != expected->inOffset)) {
+            log_error("ERROR: slave %d %s has outputs %d+%d bits and inputs %d+%d bits in the IOmap, "
+                      "the static mapping expects %d+%d and %d+%d\n",
+                      slave, ec_slave[slave].name, outOffset, ec_slave[slave].Obits, inOffset, ec_slave[slave].Ibits,
+                      expected->outOffset, expected->outBits, expected->inOffset, expected->inBits);
+            ok = 0;
+        }
+    }
+    return ok;
+}
+
+struct mapping_arena* staticmap_arena(const struct staticmap_PDO* PDOs, int num) {
+    //Helper function for staticmap_load()
+    struct mapping_builder builder;
+    mappings_builderInit(&builder);
+    for (int i = 0; i < num; i++) {
+        mappings_add(&builder, PDOs[i].slaveIdx, PDOs[i].idx, PDOs[i].subidx,
+                     PDOs[i].offset, PDOs[i].bitoff, PDOs[i].bitlen, PDOs[i].dataType, PDOs[i].name);
+    }
+    return mappings_finish(&builder);
+}
+
+int staticmap_load(struct mapping_arena** out, struct mapping_arena** in) {
+    log_info("Using the static mapping from %s: %d slaves, %d outputs, %d inputs\n",
+             staticmap_source, staticmap_numSlaves, staticmap_numOutputs, staticmap_numInputs);
+    if (!staticmap_checkSlaves()) {
+        log_error("ERROR: the bus does not match the static mapping; regenerate it (tools/ecd_codegen.py), "
+                  "or build without ECD_STATIC_MAPPING\n");
+        return 0;
+    }
+
+    *out = staticmap_arena(staticmap_outputs, staticmap_numOutputs);
+    *in  = staticmap_arena(staticmap_inputs,  staticmap_numInputs);
+    if (*out == NULL || *in == NULL) {
+        log_error("ERROR: out of memory for the PDO mappings\n");
+        mappings_free(*out);
+        mappings_free(*in);
+        *out = NULL;
+        *in  = NULL;
+        return 0;
+    }
+    staticmap_loaded = 1;
+    return 1;
+}
+
+int staticmap_inUse() {
+    return staticmap_loaded;
+}
@@ -0,0 +1,67 @@
+#ifndef staticMapping_h
+#define staticMapping_h
+
+#include "ecatDriver.h"
+#include "decodedImage.h"
+
+// Build for one fixed topology: instead of discovering the PDO mappings over CoE at every start
+// (fill_mapping_list(), several mailbox transfers per PDO), the daemon takes them from const
+// tables generated at build time, and decodes the inputs (DECODE YES) with one straight-line
+// function which has the offset, width and type of every PDO compiled in.
+//
+//   python3 tools/ecd_codegen.py --host <daemon> -o staticTables.c   (or --input <saved dump>)
+//   cmake -DECD_STATIC_MAPPING=/path/to/staticTables.c ..
+//
+// The tables come from 'meta slaves' and 'meta all' of a daemon running on the same bus.
+// At startup, after ec_config_map(), staticmap_load() checks that the bus is the one the tables
+// were generated for (number of slaves, vendor and product id, name, and IOmap areas of every
+// slave), and refuses to start otherwise. 'rescan' still reads the mappings over CoE.
+
+// Data types       ************************************************************************
+
+struct staticmap_slave {
+    uint32 eep_man;
+    uint32 eep_id;
+    int    outOffset;  // Into the IOmap [bytes], or -1 if none
+    int    outBits;
+    int    inOffset;
+    int    inBits;
+    const char* name;
+};
+
+struct staticmap_PDO {
+    uint16 slaveIdx;
+    uint16 idx;
+    uint8  subidx;
+    int    offset;
+    uint8  bitoff;
+    uint8  bitlen;
+    uint16 dataType;
+    const char* name;
+};
+
+// Global data      ************************************************************************
+
+// Generated by tools/ecd_codegen.py
+extern const char*                  staticmap_source;  // Where the tables came from
+extern const int                    staticmap_numSlaves;
+extern const struct staticmap_slave staticmap_slaves[];
+extern const int                    staticmap_numOutputs;
+extern const struct staticmap_PDO   staticmap_outputs[];
+extern const int                    staticmap_numInputs;
+extern const struct staticmap_PDO   staticmap_inputs[];
+
+// Functions        ************************************************************************
+
+// Generated: decode every input, as decode_update() would, into values[i] for staticmap_inputs[i].
+// Inputs which decode_update() would not decode are left alone.
+void staticmap_decodeInputs(union decode_value* values, const char* image);
+
+// Check the bus against the tables, and build the arenas from them.
+// Returns 1 on success, 0 if the bus does not match (or out of memory).
+int staticmap_load(struct mapping_arena** out, struct mapping_arena** in);
+
+// The startup table came from staticmap_load(), so it is in the order of staticmap_inputs[].
+int staticmap_inUse();
+
+#endif
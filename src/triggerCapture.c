@@ -0,0 +1,291 @@
+#include "triggerCapture.h"
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include <unistd.h>
+#include <pthread.h>
+
+#include "EtherCatDaemon.h"
+#include "ecatDriver.h"
+#include "networkServer.h"
+#include "lockTrace.h"
+
+// Configuration    ************************************************************************
+#define CAPTURE_MAXCHANNELS 32 // Keeps one row of the 'capture' output within BUFFLEN
+
+// File-global data ************************************************************************
+
+// Channels; capture_numChannels == 0 -> capture disabled
+struct value_source* capture_sources = NULL;
+struct pdo_address*  capture_addrs   = NULL;
+int capture_numChannels = 0;
+
+// The ring, preallocated by capture_setup(); row k of the recording is at k % capture_numRowsMax
+int     capture_numRowsMax = 0;
+uint64* capture_cycles = NULL;
+int*    capture_wkcs   = NULL;
+double* capture_values = NULL; // capture_numChannels values per row
+
+// Written by the cycle thread and by capture_arm()/capture_disarm(), with IOmap_lock grabbed.
+// capture_state is also read without the lock; once it is CAPTURE_DONE,
+// the cycle thread no longer touches the ring.
+volatile int capture_state = CAPTURE_IDLE;
+struct capture_trigger capture_trig;
+uint64 capture_numRows      = 0; // Rows recorded since arming
+uint64 capture_triggerRow   = 0;
+uint64 capture_triggerCycle = 0;
+double capture_prevValue    = NAN;
+
+// Serializes the client side: arm/disarm never happen while a capture is being sent
+pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+
+const char* capture_modeNames[] = {"above", "below", "rising", "falling", "wkc"};
+const char* capture_stateNames[] = {"idle", "armed", "triggered", "done"};
+
+// Functions        ************************************************************************
+
+int capture_setup() {
+    struct pdo_address* addr;
+
+    for (addr = config_file.capturePDOs; addr->next != NULL; addr = addr->next) {
+        capture_numChannels++;
+    }
+    if (capture_numChannels == 0) return 1;
+
+    if (capture_numChannels > CAPTURE_MAXCHANNELS) {
+        log_error("Error in capture_setup(): got %d CAPTURE_PDOs, max is %d\n",
+                  capture_numChannels, CAPTURE_MAXCHANNELS);
+        return 0;
+    }
+
+    capture_sources = malloc(capture_numChannels*sizeof(struct value_source));
+    capture_addrs   = malloc(capture_numChannels*sizeof(struct pdo_address));
+
+    int i = 0;
+    for (addr = config_file.capturePDOs; addr->next != NULL; addr = addr->next) {
+        if (!valueSource_resolve(addr->slaveIdx, addr->idx, addr->subidx, &(capture_sources[i]))) {
+            log_error("Error in capture_setup(): CAPTURE_PDO %d:%x:%x is not a numeric PDO or DERIVED channel\n",
+                      addr->slaveIdx, addr->idx, addr->subidx);
+            return 0;
+        }
+        capture_addrs[i] = *addr;
+        i++;
+    }
+
+    // Allocate and touch everything now, so the cycle thread never page faults on it
+    capture_numRowsMax = config_file.capture_pre + config_file.capture_post;
+    capture_cycles = malloc(capture_numRowsMax*sizeof(uint64));
+    capture_wkcs   = malloc(capture_numRowsMax*sizeof(int));
+    capture_values = malloc((size_t)capture_numRowsMax*capture_numChannels*sizeof(double));
+    if (capture_cycles == NULL || capture_wkcs == NULL || capture_values == NULL) {
+        log_error("Error in capture_setup(): could not allocate %d rows\n", capture_numRowsMax);
+        return 0;
+    }
+    memset(capture_cycles, 0, capture_numRowsMax*sizeof(uint64));
+    memset(capture_wkcs,   0, capture_numRowsMax*sizeof(int));
+    memset(capture_values, 0, (size_t)capture_numRowsMax*capture_numChannels*sizeof(double));
+
+    return 1;
+}
+
+int capture_checkTrigger(int wkc, int expectedWKC) {
+    //Helper function for capture_update(); returns 1 if the trigger fires on this cycle
+    if (capture_trig.mode == TRIG_WKC) {
+        return wkc < expectedWKC;
+    }
+
+    double value = valueSource_read(&(capture_trig.src));
+    double prev  = capture_prevValue;
+    capture_prevValue = value;
+    if (isnan(value) || isnan(prev)) return 0; // Need two good values for a crossing
+
+    switch (capture_trig.mode) {
+    case TRIG_ABOVE:
+        return prev <= capture_trig.level && value >  capture_trig.level;
+    case TRIG_BELOW:
+        return prev >= capture_trig.level && value <  capture_trig.level;
+    case TRIG_RISING:
+        return prev == 0.0 && value != 0.0;
+    case TRIG_FALLING:
+        return prev != 0.0 && value == 0.0;
+    default:
+        return 0;
+    }
+}
+
+void capture_update(uint64 cycle, int wkc, int expectedWKC) {
+    if (capture_state != CAPTURE_ARMED && capture_state != CAPTURE_TRIGGERED) return;
+
+    //Record this cycle
+    int row = capture_numRows % capture_numRowsMax;
+    capture_cycles[row] = cycle;
+    capture_wkcs[row]   = wkc;
+    double* values = &(capture_values[(size_t)row*capture_numChannels]);
+    for (int ch = 0; ch < capture_numChannels; ch++) {
+        values[ch] = valueSource_read(&(capture_sources[ch]));
+    }
+    capture_numRows++;
+
+    if (capture_state == CAPTURE_ARMED && capture_checkTrigger(wkc, expectedWKC)) {
+        capture_triggerRow   = capture_numRows - 1;
+        capture_triggerCycle = cycle;
+        capture_state = CAPTURE_TRIGGERED;
+    }
+
+    if (capture_state == CAPTURE_TRIGGERED &&
+        capture_numRows - capture_triggerRow >= (uint64)config_file.capture_post) {
+        //Post-trigger window complete; the ring now holds exactly what we want
+        __atomic_store_n(&capture_state, CAPTURE_DONE, __ATOMIC_RELEASE);
+    }
+}
+
+int capture_arm(enum capture_mode mode, uint16 slave, uint16 idx, uint8 subidx, double level) {
+    if (capture_numChannels == 0) return 0;
+
+    struct capture_trigger trig;
+    memset(&trig, 0, sizeof(trig));
+    trig.mode     = mode;
+    trig.slaveIdx = slave;
+    trig.idx      = idx;
+    trig.subidx   = subidx;
+    trig.level    = level;
+    if (mode != TRIG_WKC && !valueSource_resolve(slave, idx, subidx, &(trig.src))) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&capture_lock);
+    locktrace_lock(&IOmap_lock, "capture");
+    capture_trig         = trig;
+    capture_numRows      = 0;
+    capture_triggerRow   = 0;
+    capture_triggerCycle = 0;
+    capture_prevValue    = NAN;
+    capture_state        = CAPTURE_ARMED;
+    locktrace_unlock(&IOmap_lock);
+    pthread_mutex_unlock(&capture_lock);
+
+    return 1;
+}
+
+void capture_disarm() {
+    pthread_mutex_lock(&capture_lock);
+    locktrace_lock(&IOmap_lock, "capture");
+    capture_state   = CAPTURE_IDLE;
+    capture_numRows = 0;
+    locktrace_unlock(&IOmap_lock);
+    pthread_mutex_unlock(&capture_lock);
+}
+
+int capture_writeTrigger(char* buff, int bufflen, struct capture_trigger* trig) {
+    //Helper function; describe the trigger condition, returns the number of chars written
+    switch (trig->mode) {
+    case TRIG_WKC:
+        return snprintf(buff, bufflen, "wkc");
+    case TRIG_ABOVE:
+    case TRIG_BELOW:
+        return snprintf(buff, bufflen, "%s %d:0x%4.4X:0x%2.2X %.10g", capture_modeNames[trig->mode],
+                        trig->slaveIdx, trig->idx, trig->subidx, trig->level);
+    default:
+        return snprintf(buff, bufflen, "%s %d:0x%4.4X:0x%2.2X", capture_modeNames[trig->mode],
+                        trig->slaveIdx, trig->idx, trig->subidx);
+    }
+}
+
+void capture_describe(int connfd) {
+    char buff_out[BUFFLEN];
+    char trigStr[CAPTURE_TRIGLEN];
+    memset(buff_out, 0, BUFFLEN);
+
+    if (capture_numChannels == 0) {
+        snprintf(buff_out, BUFFLEN, "err: triggered capture not enabled (CAPTURE_PDO)\n");
+        write(connfd, buff_out, BUFFLEN);
+        return;
+    }
+
+    //Consistent copy of the state
+    locktrace_lock(&IOmap_lock, "capture");
+    int    state        = capture_state;
+    uint64 numRows      = capture_numRows;
+    uint64 triggerCycle = capture_triggerCycle;
+    struct capture_trigger trig = capture_trig;
+    locktrace_unlock(&IOmap_lock);
+
+    if (state == CAPTURE_IDLE) {
+        strncpy(trigStr, "none", CAPTURE_TRIGLEN);
+    }
+    else {
+        capture_writeTrigger(trigStr, CAPTURE_TRIGLEN, &trig);
+    }
+
+    snprintf(buff_out, BUFFLEN, "  state %s trigger %s rows %" PRIu64 " pre %d post %d channels %d\n",
+             capture_stateNames[state], trigStr, numRows,
+             config_file.capture_pre, config_file.capture_post, capture_numChannels);
+    write(connfd, buff_out, BUFFLEN);
+    memset(buff_out, 0, BUFFLEN);
+
+    if (state == CAPTURE_TRIGGERED || state == CAPTURE_DONE) {
+        snprintf(buff_out, BUFFLEN, "  triggered at cycle %" PRIu64 "\n", triggerCycle);
+        write(connfd, buff_out, BUFFLEN);
+        memset(buff_out, 0, BUFFLEN);
+    }
+}
+
+int capture_send(int connfd) {
+    char buff_out[BUFFLEN];
+    char trigStr[CAPTURE_TRIGLEN];
+    memset(buff_out, 0, BUFFLEN);
+
+    pthread_mutex_lock(&capture_lock);
+    if (capture_numChannels == 0 || __atomic_load_n(&capture_state, __ATOMIC_ACQUIRE) != CAPTURE_DONE) {
+        pthread_mutex_unlock(&capture_lock);
+        return 0;
+    }
+    //From here on the ring is frozen: the cycle thread leaves it alone in CAPTURE_DONE,
+    // and re-arming has to wait for capture_lock.
+
+    uint64 first = capture_numRows > (uint64)capture_numRowsMax ? capture_numRows - capture_numRowsMax : 0;
+
+    capture_writeTrigger(trigStr, CAPTURE_TRIGLEN, &capture_trig);
+    int buffUsed = snprintf(buff_out, BUFFLEN,
+                            "  trigger %s cycle %" PRIu64 " pre %" PRIu64 " post %" PRIu64 "\n",
+                            trigStr, capture_triggerCycle,
+                            capture_triggerRow - first, capture_numRows - capture_triggerRow);
+    buffUsed += snprintf(buff_out+buffUsed, BUFFLEN-buffUsed, "  columns offset cycle wkc");
+    for (int ch = 0; ch < capture_numChannels; ch++) {
+        buffUsed += snprintf(buff_out+buffUsed, BUFFLEN-buffUsed, " %d:0x%4.4X:0x%2.2X",
+                             capture_addrs[ch].slaveIdx, capture_addrs[ch].idx, capture_addrs[ch].subidx);
+    }
+    buffUsed += snprintf(buff_out+buffUsed, BUFFLEN-buffUsed, "\n");
+    if (buffUsed >= BUFFLEN) buffUsed = BUFFLEN-1;
+
+    //One line per row, packed into as few BUFFLEN records as possible
+    char line[BUFFLEN];
+    for (uint64 k = first; k < capture_numRows; k++) {
+        int row = k % capture_numRowsMax;
+        int lineLen = snprintf(line, BUFFLEN, "  %" PRId64 " %" PRIu64 " %d",
+                               (int64)(k - capture_triggerRow), capture_cycles[row], capture_wkcs[row]);
+        double* values = &(capture_values[(size_t)row*capture_numChannels]);
+        for (int ch = 0; ch < capture_numChannels; ch++) {
+            lineLen += snprintf(line+lineLen, BUFFLEN-lineLen, " %.10g", values[ch]);
+        }
+        lineLen += snprintf(line+lineLen, BUFFLEN-lineLen, "\n");
+
+        if (buffUsed + lineLen >= BUFFLEN) {
+            write(connfd, buff_out, BUFFLEN);
+            memset(buff_out, 0, BUFFLEN);
+            buffUsed = 0;
+        }
+        memcpy(buff_out+buffUsed, line, lineLen);
+        buffUsed += lineLen;
+    }
+    if (buffUsed > 0) {
+        write(connfd, buff_out, BUFFLEN);
+    }
+
+    pthread_mutex_unlock(&capture_lock);
+    return 1;
+}
@@ -0,0 +1,66 @@
+#ifndef triggerCapture_h
+#define triggerCapture_h
+
+#include "ecatDriver.h"
+#include "derivedChannels.h"
+
+// Triggered capture of selected channels at full cycle rate.
+// Once armed, every cycle is recorded into a preallocated ring of CAPTURE_PRE+CAPTURE_POST rows;
+// when the trigger fires, CAPTURE_POST more cycles (including the triggering one) are recorded
+// and the ring is frozen until it is retrieved with 'capture' and re-armed.
+
+// Configuration    ************************************************************************
+#define CAPTURE_TRIGLEN 96  // Longest trigger description, e.g. 'above 65535:0xFFFF:0xFF -1.234567891e+300'
+
+// Data types       ************************************************************************
+
+enum capture_state {
+    CAPTURE_IDLE,      // Not armed, nothing recorded
+    CAPTURE_ARMED,     // Recording, evaluating the trigger every cycle
+    CAPTURE_TRIGGERED, // Recording the post-trigger window
+    CAPTURE_DONE       // Frozen, ready to be retrieved
+};
+
+enum capture_mode {
+    TRIG_ABOVE,   // value crosses upwards through the level
+    TRIG_BELOW,   // value crosses downwards through the level
+    TRIG_RISING,  // value goes from 0 to non-zero (digital input)
+    TRIG_FALLING, // value goes from non-zero to 0
+    TRIG_WKC      // wkc < expectedWKC
+};
+
+struct capture_trigger {
+    enum capture_mode mode;
+    uint16 slaveIdx;
+    uint16 idx;
+    uint8  subidx;
+    struct value_source src; // Not used for TRIG_WKC
+    double level;            // Only for TRIG_ABOVE and TRIG_BELOW
+};
+
+// Functions        ************************************************************************
+
+// Allocate the ring and resolve the CAPTURE_PDOs; must be called after derived_setup().
+// Returns 1 on success, 0 in case of error.
+int capture_setup();
+
+// Record the current cycle and evaluate the trigger;
+// called by the cycle thread with IOmap_lock grabbed, after derived_evaluate().
+void capture_update(uint64 cycle, int wkc, int expectedWKC);
+
+// Arm (or re-arm) the trigger, discarding any previous capture; called by client threads.
+// For TRIG_WKC, the address is ignored.
+// Returns 1 on success, 0 if capture is disabled or the address can not be resolved.
+int capture_arm(enum capture_mode mode, uint16 slave, uint16 idx, uint8 subidx, double level);
+
+// Go back to CAPTURE_IDLE, discarding any capture; called by client threads.
+void capture_disarm();
+
+// Write the state of the trigger to a client connection.
+void capture_describe(int connfd);
+
+// Write the frozen capture to a client connection, in as few writes as possible.
+// Returns 1 on success, 0 if there is no finished capture.
+int capture_send(int connfd);
+
+#endif
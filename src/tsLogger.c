@@ -0,0 +1,382 @@
+#include "tsLogger.h"
+
+#include <stdio.h>
+#include <inttypes.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <endian.h>
+#include <limits.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "EtherCatDaemon.h"
+#include "ecatDriver.h"
+#include "allocStats.h"
+
+// File-global data ************************************************************************
+
+// Files of this run; tslog_numFiles == 0 -> not logging
+char   tslog_path[PATH_MAX];
+int    tslog_numColumns = 0;
+int    tslog_numFiles   = 0;     // 2 + tslog_numColumns: time, cycle, values
+int*   tslog_fds        = NULL;
+int    tslog_indexFd    = -1;
+int    tslog_headerFd   = -1;
+struct tslog_header* tslog_hdr = NULL; // Mapped header.tsl
+size_t tslog_headerSize = 0;
+
+struct value_source* tslog_sources = NULL;
+
+// Ring between the cycle thread and the writer thread
+size_t tslog_rowSize = 0;        // int64 time + uint64 cycle + numColumns doubles
+char*  tslog_ring = NULL;        // TSLOG_RINGSIZE rows, preallocated
+volatile uint32 tslog_head = 0;  // Next row to fill; written by the cycle thread only
+volatile uint32 tslog_tail = 0;  // Next row to write; written by the writer thread only
+volatile uint64 tslog_dropped = 0;
+int    tslog_sinceRow = 0;       // Cycles since the last row, for TSLOG_DECIMATE
+
+pthread_t tslog_writerThread;
+volatile int tslog_running = 0;
+
+// Writer thread state
+size_t  tslog_chunkBytes = 0;    // TSLOG_CHUNK * 8
+uint64  tslog_rows = 0;          // Rows written
+uint64  tslog_chunks = 0;        // Chunks indexed
+int     tslog_inChunk = 0;       // Rows in the current chunk
+uint64** tslog_windows = NULL;   // Mapped window of the current chunk, per file; NULL if unmapped
+struct tslog_chunk  tslog_current; // Host-endian; numRows is tslog_inChunk
+struct tslog_range* tslog_ranges = NULL;
+int     tslog_failed = 0;        // A write failed; rows are discarded from then on
+
+// Functions        ************************************************************************
+
+uint64 tslog_doubleBits(double value) {
+    //Helper function; the little-endian IEEE 754 bits of a double
+    uint64 bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return htole64(bits);
+}
+
+int tslog_openFile(const char* name) {
+    //Helper function for tslog_open(); create a file in the directory of this run
+    char fileName[PATH_MAX];
+    int len = snprintf(fileName, PATH_MAX, "%s/%s", tslog_path, name);
+    if (len < 0 || len >= PATH_MAX) {
+        log_error("Error in tslog_open(): the path of '%s' in '%s' is too long\n", name, tslog_path);
+        return -1;
+    }
+    int fd = open(fileName, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd < 0) {
+        log_error("Error in tslog_open(): could not create '%s': %m\n", fileName);
+    }
+    return fd;
+}
+
+int tslog_mapChunk() {
+    //Helper function for tslog_writeRow(); grow every file by a chunk and map its window
+    off_t offset = (off_t)tslog_chunks*tslog_chunkBytes;
+    for (int f = 0; f < tslog_numFiles; f++) {
+        if (ftruncate(tslog_fds[f], offset + tslog_chunkBytes) != 0) return 0;
+        void* window = mmap(NULL, tslog_chunkBytes, PROT_READ | PROT_WRITE, MAP_SHARED, tslog_fds[f], offset);
+        if (window == MAP_FAILED) return 0;
+        tslog_windows[f] = window;
+    }
+    return 1;
+}
+
+int tslog_endChunk() {
+    //Helper function; append the index record of the current chunk and unmap its windows
+    struct tslog_chunk chunk;
+    chunk.firstRow     = htole64(tslog_current.firstRow);
+    chunk.numRows      = htole32(tslog_inChunk);
+    chunk.reserved     = 0;
+    chunk.firstTime_ns = htole64(tslog_current.firstTime_ns);
+    chunk.lastTime_ns  = htole64(tslog_current.lastTime_ns);
+    chunk.firstCycle   = htole64(tslog_current.firstCycle);
+    chunk.lastCycle    = htole64(tslog_current.lastCycle);
+    for (int c = 0; c < tslog_numColumns; c++) {
+        uint64 min = tslog_doubleBits(tslog_ranges[c].min);
+        uint64 max = tslog_doubleBits(tslog_ranges[c].max);
+        memcpy(&(tslog_ranges[c].min), &min, sizeof(min));
+        memcpy(&(tslog_ranges[c].max), &max, sizeof(max));
+    }
+
+    for (int f = 0; f < tslog_numFiles; f++) {
+        if (tslog_windows[f] == NULL) continue;
+        msync(tslog_windows[f], tslog_chunkBytes, MS_ASYNC);
+        munmap(tslog_windows[f], tslog_chunkBytes);
+        tslog_windows[f] = NULL;
+    }
+
+    if (write(tslog_indexFd, &chunk, sizeof(chunk)) != sizeof(chunk)) return 0;
+    ssize_t rangesSize = tslog_numColumns*sizeof(struct tslog_range);
+    if (write(tslog_indexFd, tslog_ranges, rangesSize) != rangesSize) return 0;
+
+    tslog_chunks++;
+    __atomic_store_n(&(tslog_hdr->chunks), htole64(tslog_chunks), __ATOMIC_RELEASE);
+    tslog_inChunk = 0;
+    return 1;
+}
+
+int tslog_writeRow(const char* slot, int64 toRealtime) {
+    //Helper function for tslog_writerLoop(); copy one row of the ring into the current chunk
+    int64  time  = *(const int64*)slot + toRealtime;
+    uint64 cycle = *(const uint64*)(slot + sizeof(int64));
+    const double* values = (const double*)(slot + 2*sizeof(int64));
+
+    if (tslog_inChunk == 0) {
+        if (!tslog_mapChunk()) return 0;
+        tslog_current.firstRow     = tslog_rows;
+        tslog_current.firstTime_ns = time;
+        tslog_current.firstCycle   = cycle;
+        for (int c = 0; c < tslog_numColumns; c++) {
+            tslog_ranges[c].min = NAN;
+            tslog_ranges[c].max = NAN;
+        }
+    }
+    tslog_current.lastTime_ns = time;
+    tslog_current.lastCycle   = cycle;
+
+    tslog_windows[0][tslog_inChunk] = htole64(time);
+    tslog_windows[1][tslog_inChunk] = htole64(cycle);
+    for (int c = 0; c < tslog_numColumns; c++) {
+        double value = values[c];
+        tslog_windows[2+c][tslog_inChunk] = tslog_doubleBits(value);
+        if (isnan(value)) continue;
+        if (isnan(tslog_ranges[c].min) || value < tslog_ranges[c].min) tslog_ranges[c].min = value;
+        if (isnan(tslog_ranges[c].max) || value > tslog_ranges[c].max) tslog_ranges[c].max = value;
+    }
+    tslog_rows++;
+    tslog_inChunk++;
+
+    if (tslog_inChunk == config_file.tslog_chunk) return tslog_endChunk();
+    return 1;
+}
+
+void* tslog_writerLoop(void* arg) {
+    (void)arg; // Not used
+    alloc_setThread(ALLOC_RECORDER);
+    uint64 droppedReported = 0;
+
+    while (1) {
+        uint32 tail = tslog_tail;
+        uint32 head = __atomic_load_n(&tslog_head, __ATOMIC_ACQUIRE);
+
+        if (head == tail) {
+            if (!tslog_running) break;
+            usleep(TSLOG_FLUSHTIME);
+            continue;
+        }
+
+        //Rows carry monotonicTime_ns(); the files get CLOCK_REALTIME, like 'time'
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        int64 toRealtime = ts.tv_sec*1000000000LL + ts.tv_nsec - monotonicTime_ns();
+
+        for (; tail != head; tail++) {
+            char* slot = tslog_ring + (size_t)(tail % TSLOG_RINGSIZE)*tslog_rowSize;
+            if (!tslog_writeRow(slot, toRealtime)) {
+                log_error("Error in tslog_writerLoop(): write failed, stopping the log: %m\n");
+                tslog_failed = 1;
+                __atomic_store_n(&tslog_tail, head, __ATOMIC_RELEASE);
+                return NULL;
+            }
+            __atomic_store_n(&tslog_tail, tail + 1, __ATOMIC_RELEASE);
+        }
+        __atomic_store_n(&(tslog_hdr->rows), htole64(tslog_rows), __ATOMIC_RELEASE);
+
+        uint64 dropped = tslog_dropped;
+        if (dropped > droppedReported) {
+            log_warn("WARNING: time-series log dropped %" PRIu64 " rows (%" PRIu64 " in total)\n",
+                     dropped - droppedReported, dropped);
+            droppedReported = dropped;
+        }
+    }
+    return NULL;
+}
+
+int tslog_open() {
+    if (config_file.tslog_dir == NULL) return 1;
+
+    struct pdo_address* addr;
+    for (addr = config_file.tslogPDOs; addr->next != NULL; addr = addr->next) {
+        tslog_numColumns++;
+    }
+    if (tslog_numColumns == 0 || tslog_numColumns > TSLOG_MAXCOLUMNS) {
+        log_error("Error in tslog_open(): TSLOG_DIR needs 1 to %d TSLOG_PDOs, got %d\n",
+                  TSLOG_MAXCOLUMNS, tslog_numColumns);
+        return 0;
+    }
+
+    //A new directory for every run
+    time_t now = time(NULL);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    char runName[32];
+    strftime(runName, sizeof(runName), "%Y%m%d-%H%M%S", &tm);
+    int len = snprintf(tslog_path, PATH_MAX, "%s/%s", config_file.tslog_dir, runName);
+    if (len < 0 || len >= PATH_MAX) {
+        log_error("Error in tslog_open(): TSLOG_DIR '%s' is too long\n", config_file.tslog_dir);
+        return 0;
+    }
+    if (mkdir(tslog_path, 0755) != 0) {
+        log_error("Error in tslog_open(): could not create '%s': %m\n", tslog_path);
+        return 0;
+    }
+
+    tslog_headerSize = sizeof(struct tslog_header) + tslog_numColumns*sizeof(struct tslog_column);
+    tslog_headerFd = tslog_openFile("header.tsl");
+    tslog_indexFd  = tslog_openFile("chunks.idx");
+    if (tslog_headerFd < 0 || tslog_indexFd < 0) return 0;
+    if (ftruncate(tslog_headerFd, tslog_headerSize) != 0) {
+        log_error("Error in tslog_open(): could not size the header: %m\n");
+        return 0;
+    }
+    tslog_hdr = mmap(NULL, tslog_headerSize, PROT_READ | PROT_WRITE, MAP_SHARED, tslog_headerFd, 0);
+    if (tslog_hdr == MAP_FAILED) {
+        log_error("Error in tslog_open(): could not map the header: %m\n");
+        tslog_hdr = NULL;
+        return 0;
+    }
+
+    tslog_numFiles = 2 + tslog_numColumns;
+    tslog_fds = malloc(tslog_numFiles*sizeof(int));
+    if (tslog_fds == NULL) {
+        log_error("Error in tslog_open(): out of memory for the column files\n");
+        return 0;
+    }
+    tslog_fds[0] = tslog_openFile("time.col");
+    tslog_fds[1] = tslog_openFile("cycle.col");
+    int i = 2;
+    for (addr = config_file.tslogPDOs; addr->next != NULL; addr = addr->next) {
+        char name[64];
+        snprintf(name, sizeof(name), "%d-0x%4.4X-0x%2.2X.col", addr->slaveIdx, addr->idx, addr->subidx);
+        tslog_fds[i++] = tslog_openFile(name);
+    }
+    for (i = 0; i < tslog_numFiles; i++) {
+        if (tslog_fds[i] < 0) return 0;
+    }
+    return 1;
+}
+
+int tslog_setup() {
+    if (tslog_numFiles == 0) return 1;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+
+    //Header and columns
+    memset(tslog_hdr, 0, tslog_headerSize);
+    memcpy(tslog_hdr->magic, TSLOG_MAGIC, 4);
+    tslog_hdr->version      = htole16(TSLOG_VERSION);
+    tslog_hdr->numColumns   = htole16(tslog_numColumns);
+    tslog_hdr->chunkRows    = htole32(config_file.tslog_chunk);
+    tslog_hdr->cycleTime_us = htole32(PLC_waittime);
+    tslog_hdr->decimate     = htole32(config_file.tslog_decimate);
+    tslog_hdr->startTime_ns = htole64(ts.tv_sec*1000000000LL + ts.tv_nsec);
+
+    tslog_sources = malloc(tslog_numColumns*sizeof(struct value_source));
+    struct tslog_column* columns = (struct tslog_column*)(tslog_hdr + 1);
+    int c = 0;
+    for (struct pdo_address* addr = config_file.tslogPDOs; addr->next != NULL; addr = addr->next, c++) {
+        if (!valueSource_resolve(addr->slaveIdx, addr->idx, addr->subidx, &(tslog_sources[c]))) {
+            log_error("Error in tslog_setup(): TSLOG_PDO %d:%x:%x is not a numeric PDO or DERIVED channel\n",
+                      addr->slaveIdx, addr->idx, addr->subidx);
+            return 0;
+        }
+        columns[c].slaveIdx = htole16(addr->slaveIdx);
+        columns[c].idx      = htole16(addr->idx);
+        columns[c].subidx   = addr->subidx;
+        const char* name = NULL;
+        if (tslog_sources[c].mapping != NULL) {
+            columns[c].dataType = htole16(tslog_sources[c].mapping->dataType);
+            name = tslog_sources[c].mapping->name;
+        }
+        else {
+            double dummy;
+            struct derived_channel* channel = derived_get(addr->idx, &dummy);
+            if (channel != NULL) name = channel->name;
+        }
+        if (name != NULL) strncpy(columns[c].name, name, TSLOG_MAXNAME);
+    }
+    msync(tslog_hdr, tslog_headerSize, MS_ASYNC);
+
+    //Ring, chunk state and writer thread
+    tslog_rowSize    = 2*sizeof(int64) + tslog_numColumns*sizeof(double);
+    tslog_chunkBytes = (size_t)config_file.tslog_chunk*sizeof(uint64);
+    tslog_ring    = malloc(TSLOG_RINGSIZE*tslog_rowSize);
+    tslog_windows = malloc(tslog_numFiles*sizeof(uint64*));
+    tslog_ranges  = malloc(tslog_numColumns*sizeof(struct tslog_range));
+    if (tslog_ring == NULL || tslog_windows == NULL || tslog_ranges == NULL) {
+        log_error("Error in tslog_setup(): could not allocate the ring\n");
+        return 0;
+    }
+    memset(tslog_ring, 0, TSLOG_RINGSIZE*tslog_rowSize);
+    memset(tslog_windows, 0, tslog_numFiles*sizeof(uint64*));
+
+    tslog_running = 1;
+    pthread_create(&tslog_writerThread, NULL, tslog_writerLoop, NULL);
+
+    log_info("Logging %d columns to '%s'\n", tslog_numColumns, tslog_path);
+    return 1;
+}
+
+void tslog_capture(uint64 cycle, int64 time_ns) {
+    if (!tslog_running) return;
+    if (++tslog_sinceRow < config_file.tslog_decimate) return;
+    tslog_sinceRow = 0;
+
+    uint32 head = tslog_head;
+    if (head - __atomic_load_n(&tslog_tail, __ATOMIC_ACQUIRE) >= TSLOG_RINGSIZE) {
+        tslog_dropped++;
+        return;
+    }
+
+    char* slot = tslog_ring + (size_t)(head % TSLOG_RINGSIZE)*tslog_rowSize;
+    int64*  times  = (int64*)slot;
+    uint64* cycles = (uint64*)(slot + sizeof(int64));
+    double* values = (double*)(slot + 2*sizeof(int64));
+    *times  = time_ns;
+    *cycles = cycle;
+    for (int c = 0; c < tslog_numColumns; c++) {
+        values[c] = valueSource_read(&(tslog_sources[c]));
+    }
+
+    __atomic_store_n(&tslog_head, head + 1, __ATOMIC_RELEASE);
+}
+
+void tslog_shutdown() {
+    if (!tslog_running) return;
+
+    tslog_running = 0;
+    pthread_join(tslog_writerThread, NULL);
+
+    //The last chunk is partial; cut the files down to the rows written
+    if (!tslog_failed && tslog_inChunk > 0 && !tslog_endChunk()) {
+        log_error("Error in tslog_shutdown(): could not index the last chunk: %m\n");
+    }
+    for (int f = 0; f < tslog_numFiles; f++) {
+        if (tslog_windows[f] != NULL) munmap(tslog_windows[f], tslog_chunkBytes);
+        if (ftruncate(tslog_fds[f], (off_t)tslog_rows*sizeof(uint64)) != 0) {
+            log_error("Error in tslog_shutdown(): could not truncate a column file: %m\n");
+        }
+        close(tslog_fds[f]);
+    }
+    close(tslog_indexFd);
+
+    tslog_hdr->rows   = htole64(tslog_rows);
+    tslog_hdr->closed = htole32(1);
+    msync(tslog_hdr, tslog_headerSize, MS_SYNC);
+    munmap(tslog_hdr, tslog_headerSize);
+    close(tslog_headerFd);
+    tslog_numFiles = 0;
+
+    log_info("Logged %" PRIu64 " rows in %" PRIu64 " chunks to '%s', dropped %" PRIu64 "\n",
+             tslog_rows, tslog_chunks, tslog_path, (uint64)tslog_dropped);
+}
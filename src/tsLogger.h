@@ -0,0 +1,91 @@
+#ifndef tsLogger_h
+#define tsLogger_h
+
+#include "ecatDriver.h"
+#include "derivedChannels.h"
+
+// Columnar time-series logger of selected channels (TSLOG_PDO) to memory-mapped files, which
+// tools/ecd_tslog.py can range-query without reading them whole.
+// The cycle thread only copies the values of the row into a preallocated ring (every
+// TSLOG_DECIMATE cycles); a writer thread moves the rows into the files, so the disk latency
+// never reaches the cycle. If the writer falls behind, rows are dropped and counted.
+//
+// Every run writes a new directory TSLOG_DIR/YYYYmmdd-HHMMSS with:
+//   header.tsl                struct tslog_header, then struct tslog_column x numColumns;
+//                             memory-mapped, 'rows' is updated as the rows are written
+//   time.col                  int64 CLOCK_REALTIME [ns] of the exchange, one per row
+//   cycle.col                 uint64 cycle number (as in cycleStats.cycles)
+//   <slave>-0x<idx>-0x<subidx>.col   float64 value per row (NaN if it could not be decoded)
+//   chunks.idx                struct tslog_chunk x chunks, each followed by numColumns x
+//                             struct tslog_range; appended when a chunk of TSLOG_CHUNK rows is full
+//                             (and for the last, partial chunk at shutdown)
+// All integers and floats are little-endian. The column files grow one chunk at a time: the
+// writer maps the window of the current chunk, fills it, and unmaps it when it is full. A reader
+// may only use the first 'rows' rows; rows after the last indexed chunk have no min/max yet.
+
+// Configuration    ************************************************************************
+#define TSLOG_RINGSIZE  1024  // Rows buffered between the cycle thread and the writer thread
+#define TSLOG_FLUSHTIME 20000 // How long the writer thread sleeps when there is nothing to write [us]
+#define TSLOG_MAXCOLUMNS 256
+
+#define TSLOG_MAGIC     "ECDT"
+#define TSLOG_VERSION   1
+#define TSLOG_MAXNAME   47    // Column names are truncated to this
+#define TSLOG_CHUNKALIGN 512  // TSLOG_CHUNK must be a multiple of this, so chunks start on a page
+
+// Data types       ************************************************************************
+
+struct __attribute__((packed)) tslog_header {
+    char   magic[4];          // TSLOG_MAGIC
+    uint16 version;           // TSLOG_VERSION
+    uint16 numColumns;        // Value columns, not counting time and cycle
+    uint32 chunkRows;         // TSLOG_CHUNK
+    uint32 cycleTime_us;      // PLC_waittime
+    uint32 decimate;          // TSLOG_DECIMATE
+    uint32 closed;            // 1 once the daemon has shut the log down cleanly
+    int64  startTime_ns;      // CLOCK_REALTIME when the log was opened
+    uint64 rows;              // Rows written; updated while running
+    uint64 chunks;            // Records in chunks.idx
+};
+
+struct __attribute__((packed)) tslog_column {
+    uint16 slaveIdx;          // 0 for a DERIVED channel
+    uint16 idx;
+    uint8  subidx;
+    uint16 dataType;          // Of the PDO, 0 for a DERIVED channel; the file is always float64
+    char   name[TSLOG_MAXNAME + 1];
+};
+
+struct __attribute__((packed)) tslog_chunk {
+    uint64 firstRow;
+    uint32 numRows;
+    uint32 reserved;
+    int64  firstTime_ns;
+    int64  lastTime_ns;
+    uint64 firstCycle;
+    uint64 lastCycle;
+};
+
+struct __attribute__((packed)) tslog_range {
+    double min;               // NaN if the column has no value in the chunk
+    double max;
+};
+
+// Functions        ************************************************************************
+
+// Create the directory and the files of this run (if TSLOG_DIR is configured); called before
+// dropping root privileges. Returns 1 on success, 0 in case of error.
+int tslog_open();
+
+// Resolve the columns, write the header and start the writer thread, if the log was opened.
+// Must be called after derived_setup(). Returns 1 on success, 0 in case of error.
+int tslog_setup();
+
+// Queue a row with the current values; called by the cycle thread with IOmap_lock grabbed.
+// Never blocks; if the writer thread falls behind, the row is dropped and counted.
+void tslog_capture(uint64 cycle, int64 time_ns);
+
+// Write whatever is queued, index the last chunk, stop the writer thread and close the files.
+void tslog_shutdown();
+
+#endif
@@ -0,0 +1,185 @@
+#!/usr/bin/env python3
+"""
+Generate a static PDO mapping for one fixed topology, see src/staticMapping.h.
+
+Reads 'meta slaves' and 'meta all' from a daemon running on the bus (or from a dump saved
+earlier with --save), and writes a C source with the const tables and a straight-line
+decode function for the inputs. Build the daemon with it:
+  cmake -DECD_STATIC_MAPPING=/path/to/staticTables.c ..
+
+Examples:
+  ./ecd_codegen.py --host raspberrypi.local -o staticTables.c --save line3.dump
+  ./ecd_codegen.py --input line3.dump -o staticTables.c
+"""
+
+import argparse
+import os
+import re
+import sys
+
+sys.path.insert(0, os.path.join(os.path.dirname(os.path.abspath(__file__)), '..', 'clientExample'))
+
+# Types which decode_update() handles (see src/decodedImage.c), and their C load types
+BYTE_TYPES = {
+    'INTEGER8':  ('int8',   'i'), 'INTEGER16':  ('int16',  'i'), 'INTEGER32':  ('int32',  'i'),
+    'INTEGER64': ('int64',  'i'), 'UNSIGNED8':  ('uint8',  'i'), 'UNSIGNED16': ('uint16', 'i'),
+    'UNSIGNED32':('uint32', 'i'), 'UNSIGNED64': ('uint64', 'i'), 'REAL32':     ('float',  'd'),
+    'REAL64':    ('double', 'd'),
+}
+BIT_TYPES = ['BOOLEAN'] + ['BIT{}'.format(n) for n in range(1, 9)]
+KNOWN_TYPES = list(BYTE_TYPES) + BIT_TYPES + ['INTEGER24', 'UNSIGNED24', 'VISIBLE_STRING', 'OCTET_STRING']
+
+SLAVE_RE = re.compile(r'^slave (\d+) man 0x([0-9A-Fa-f]+) id 0x([0-9A-Fa-f]+) out (-?\d+) (\d+) in (-?\d+) (\d+) name ?(.*)$')
+PDO_RE   = re.compile(r'^\[0x([0-9A-Fa-f]+)\.(\d)\] (\d+):0x([0-9A-Fa-f]+):0x([0-9A-Fa-f]+) 0x([0-9A-Fa-f]+) '
+                      r'(Type 0x[0-9A-Fa-f]{4}|\S+)(?: +(.*))?$')
+
+def fetch(host, port):
+    "The dump lines, from a running daemon"
+    from ecd_client import ecd_client
+    client = ecd_client(host, port)
+    lines = []
+    for command in (b'meta slaves', b'meta all'):
+        client.sock.send(command)
+        lines += [l.decode('ascii') for l in client.doRead()]
+    return lines
+
+def parse(lines):
+    "Returns (slaves, outputs, inputs); PDOs as dicts, in IOmap order"
+    slaves, outputs, inputs = [], [], []
+    section = None
+    for line in lines:
+        line = line.strip()
+        if line in ('OUTPUTS:', 'INPUTS:', 'DERIVED:'):
+            section = line
+            continue
+        m = SLAVE_RE.match(line)
+        if m:
+            slaves.append({'num': int(m.group(1)), 'man': int(m.group(2), 16), 'id': int(m.group(3), 16),
+                           'outOffset': int(m.group(4)), 'outBits': int(m.group(5)),
+                           'inOffset':  int(m.group(6)), 'inBits':  int(m.group(7)), 'name': m.group(8)})
+            continue
+        m = PDO_RE.match(line)
+        if m and section in ('OUTPUTS:', 'INPUTS:'):
+            pdo = {'offset': int(m.group(1), 16), 'bitoff': int(m.group(2)), 'slave': int(m.group(3)),
+                   'idx': int(m.group(4), 16), 'subidx': int(m.group(5), 16), 'bitlen': int(m.group(6), 16),
+                   'type': m.group(7), 'name': m.group(8) or ''}
+            (outputs if section == 'OUTPUTS:' else inputs).append(pdo)
+
+    if len(slaves) == 0 or [s['num'] for s in slaves] != list(range(1, len(slaves)+1)):
+        raise ValueError("no complete 'meta slaves' in the dump")
+    if section is None:
+        raise ValueError("no 'meta all' in the dump")
+    return slaves, outputs, inputs
+
+def cString(s):
+    return '"' + s.replace('\\', '\\\\').replace('"', '\\"') + '"'
+
+def cType(typeName):
+    if typeName in KNOWN_TYPES:
+        return 'ECT_' + typeName
+    m = re.match(r'Type (0x[0-9A-Fa-f]{4})$', typeName)
+    if not m:
+        raise ValueError("unknown data type '{}'".format(typeName))
+    return m.group(1)
+
+def decodeLine(i, pdo):
+    "One statement of staticmap_decodeInputs(), or None if decode_update() would not decode this PDO"
+    t, off, bitoff, bitlen = pdo['type'], pdo['offset'], pdo['bitoff'], pdo['bitlen']
+    if t in BIT_TYPES:
+        if bitoff + bitlen > 16:
+            return None
+        mask = (1 << bitlen) - 1
+        if bitoff + bitlen <= 8:
+            return 'values[{}].i = ((uint8)image[0x{:04X}] >> {}) & 0x{:X};'.format(i, off, bitoff, mask)
+        return 'values[{}].i = (((uint8)image[0x{:04X}] | ((uint16)(uint8)image[0x{:04X}] << 8)) >> {}) & 0x{:X};' \
+               .format(i, off, off+1, bitoff, mask)
+    if bitoff != 0:
+        return None
+    if t in BYTE_TYPES:
+        ctype, member = BYTE_TYPES[t]
+        return '{{ {} v; memcpy(&v, image + 0x{:04X}, sizeof(v)); values[{}].{} = v; }}'.format(ctype, off, i, member)
+    if t == 'INTEGER24':
+        return '{{ uint32 v = 0; memcpy(&v, image + 0x{:04X}, 3); values[{}].i = ((int32)(v << 8)) >> 8; }}'.format(off, i)
+    if t == 'UNSIGNED24':
+        return '{{ uint32 v = 0; memcpy(&v, image + 0x{:04X}, 3); values[{}].i = v; }}'.format(off, i)
+    return None
+
+def pdoTable(name, pdos):
+    out = ['const int staticmap_num{} = {};'.format(name.capitalize(), len(pdos)),
+           'const struct staticmap_PDO staticmap_{}[] = {{'.format(name)]
+    for p in pdos:
+        out.append('    {{ {:3d}, 0x{:04X}, 0x{:02X}, 0x{:04X}, {}, 0x{:02X}, {}, {} }},'.format(
+            p['slave'], p['idx'], p['subidx'], p['offset'], p['bitoff'], p['bitlen'], cType(p['type']), cString(p['name'])))
+    if len(pdos) == 0:
+        out.append('    { 0, 0, 0, 0, 0, 0, 0, "" } // Placeholder; not counted')
+    out.append('};')
+    return out
+
+def generate(source, slaves, outputs, inputs):
+    out = ['// Static PDO mapping, generated by tools/ecd_codegen.py from {}; do not edit.'.format(source),
+           '// Build with: cmake -DECD_STATIC_MAPPING=/path/to/this/file.c, see src/staticMapping.h',
+           '',
+           '#include <string.h>',
+           '',
+           '#include "ethercat.h" // ECT_* data types',
+           '',
+           '#include "staticMapping.h"',
+           '',
+           'const char* staticmap_source = {};'.format(cString(source)),
+           '',
+           'const int staticmap_numSlaves = {};'.format(len(slaves)),
+           'const struct staticmap_slave staticmap_slaves[] = {']
+    for s in slaves:
+        out.append('    {{ 0x{:08X}, 0x{:08X}, {:5d}, {:4d}, {:5d}, {:4d}, {} }}, // slave {}'.format(
+            s['man'], s['id'], s['outOffset'], s['outBits'], s['inOffset'], s['inBits'], cString(s['name']), s['num']))
+    out += ['};', '']
+    out += pdoTable('outputs', outputs) + ['']
+    out += pdoTable('inputs', inputs) + ['']
+
+    out += ['void staticmap_decodeInputs(union decode_value* values, const char* image) {']
+    numDecoded = 0
+    for i, p in enumerate(inputs):
+        line = decodeLine(i, p)
+        comment = '// {}:0x{:04X}:0x{:02X} {} {}'.format(p['slave'], p['idx'], p['subidx'], p['type'], p['name']).rstrip()
+        if line is None:
+            out.append('    ' + comment + ' (not decoded)')
+            continue
+        out.append('    ' + line + ' ' + comment)
+        numDecoded += 1
+    out += ['}', '']
+    return out, numDecoded
+
+def main():
+    parser = argparse.ArgumentParser(description="Generate a static PDO mapping for one fixed topology (see src/staticMapping.h)")
+    parser.add_argument('--host', help="daemon to read 'meta slaves' and 'meta all' from")
+    parser.add_argument('--port', type=int, default=4200)
+    parser.add_argument('--input', help="dump saved earlier with --save, instead of --host")
+    parser.add_argument('--save', help="also save the dump to this file")
+    parser.add_argument('-o', '--output', required=True, help="C source to write")
+    args = parser.parse_args()
+
+    if (args.host is None) == (args.input is None):
+        parser.error("give either --host or --input")
+
+    if args.host is not None:
+        lines  = fetch(args.host, args.port)
+        source = '{}:{}'.format(args.host, args.port)
+    else:
+        with open(args.input) as f:
+            lines = f.read().splitlines()
+        source = os.path.basename(args.input)
+
+    if args.save is not None:
+        with open(args.save, 'w') as f:
+            f.write('\n'.join(lines) + '\n')
+
+    slaves, outputs, inputs = parse(lines)
+    code, numDecoded = generate(source, slaves, outputs, inputs)
+    with open(args.output, 'w') as f:
+        f.write('\n'.join(code))
+
+    print("Wrote {}: {} slaves, {} outputs, {} inputs ({} decoded)".format(
+        args.output, len(slaves), len(outputs), len(inputs), numDecoded))
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,188 @@
+#!/usr/bin/env python3
+"""
+Read a columnar time-series log written by the daemon (TSLOG_DIR, see src/tsLogger.h).
+
+Only the chunks which overlap the requested time range are touched: the chunk index gives
+their time ranges, and the column files are memory-mapped, so a query of a few seconds out of
+a log of several days reads a few pages. With --where, chunks whose min/max cannot match are
+skipped too. The log may be read while the daemon is still writing it.
+
+Examples:
+  ./ecd_tslog.py /var/log/ecd/20240611-081500 info
+  ./ecd_tslog.py /var/log/ecd/20240611-081500 csv --from 2024-06-11T08:20:00 --to 2024-06-11T08:21:00
+  ./ecd_tslog.py /var/log/ecd/20240611-081500 csv --columns 2:0x6000:0x11 --where 2:0x6000:0x11:100:inf
+"""
+
+import argparse
+import bisect
+import datetime
+import math
+import mmap
+import os
+import struct
+import sys
+
+# Must match src/tsLogger.h
+MAGIC   = b'ECDT'
+VERSION = 1
+HEADER  = struct.Struct('<4sHHIIIIqQQ')
+COLUMN  = struct.Struct('<HHBH48s')
+CHUNK   = struct.Struct('<QIIqqQQ')
+RANGE   = struct.Struct('<dd')
+
+class Column:
+    def __init__(self, raw):
+        self.slave, self.idx, self.subidx, self.dataType, name = COLUMN.unpack(raw)
+        self.name = name.split(b'\0', 1)[0].decode('ascii', 'replace')
+        self.key  = '{}:0x{:04X}:0x{:02X}'.format(self.slave, self.idx, self.subidx)
+        self.file = '{}-0x{:04X}-0x{:02X}.col'.format(self.slave, self.idx, self.subidx)
+
+class Chunk:
+    def __init__(self, firstRow, numRows, firstTime, lastTime, firstCycle, lastCycle, ranges):
+        self.firstRow, self.numRows = firstRow, numRows
+        self.firstTime, self.lastTime = firstTime, lastTime
+        self.firstCycle, self.lastCycle = firstCycle, lastCycle
+        self.ranges = ranges # (min, max) per column; None if the chunk is not indexed yet
+
+class TsLog:
+    def __init__(self, path):
+        if sys.byteorder != 'little':
+            raise RuntimeError("the column files are little-endian, and are read in place")
+        self.path = path
+        with open(os.path.join(path, 'header.tsl'), 'rb') as f:
+            raw = f.read()
+        (magic, version, numColumns, self.chunkRows, self.cycleTime_us, self.decimate,
+         self.closed, self.startTime, self.rows, numChunks) = HEADER.unpack_from(raw)
+        if magic != MAGIC or version != VERSION:
+            raise RuntimeError("{} is not a version {} log".format(path, VERSION))
+        self.columns = [Column(raw[HEADER.size + n*COLUMN.size : HEADER.size + (n+1)*COLUMN.size])
+                        for n in range(numColumns)]
+
+        #Only the chunks which the header counts; a record may be half written while running
+        self.chunks = []
+        recordSize = CHUNK.size + numColumns*RANGE.size
+        with open(os.path.join(path, 'chunks.idx'), 'rb') as f:
+            raw = f.read(numChunks*recordSize)
+        for n in range(len(raw) // recordSize):
+            fields = CHUNK.unpack_from(raw, n*recordSize)
+            ranges = [RANGE.unpack_from(raw, n*recordSize + CHUNK.size + c*RANGE.size) for c in range(numColumns)]
+            self.chunks.append(Chunk(fields[0], fields[1], *fields[3:], ranges))
+        indexed = self.chunks[-1].firstRow + self.chunks[-1].numRows if self.chunks else 0
+        if self.rows > indexed:
+            self.chunks.append(Chunk(indexed, self.rows - indexed, None, None, None, None, None))
+
+        self._maps = {}
+
+    def _values(self, fileName, fmt):
+        "The first 'rows' values of a column file, memory-mapped"
+        if fileName not in self._maps:
+            with open(os.path.join(self.path, fileName), 'rb') as f:
+                size = os.fstat(f.fileno()).st_size
+                data = mmap.mmap(f.fileno(), size, access=mmap.ACCESS_READ) if size > 0 else b''
+            self._maps[fileName] = memoryview(data)[:self.rows*8].cast(fmt)
+        return self._maps[fileName]
+
+    def times(self):
+        return self._values('time.col', 'q')
+
+    def cycles(self):
+        return self._values('cycle.col', 'Q')
+
+    def column(self, key):
+        "The Column with this 'slave:idx:subidx' key or name"
+        for n, col in enumerate(self.columns):
+            if key.lower() in (col.key.lower(), col.name.lower()):
+                return n, col
+        raise KeyError("no column '{}' in the log".format(key))
+
+    def values(self, col):
+        return self._values(col.file, 'd')
+
+    def rowRange(self, chunk, fromTime, toTime):
+        "The rows of a chunk with fromTime <= time < toTime [ns], as a range"
+        times = self.times()
+        end = chunk.firstRow + chunk.numRows
+        first = bisect.bisect_left(times, fromTime, chunk.firstRow, end) if fromTime is not None else chunk.firstRow
+        last  = bisect.bisect_left(times, toTime, first, end) if toTime is not None else end
+        return range(first, last)
+
+    def query(self, columns, fromTime=None, toTime=None, where=None):
+        """Yields (time [ns], cycle, values) of the rows with fromTime <= time < toTime and, if
+        where = (column, low, high) is given, low <= value <= high"""
+        if where is not None:
+            whereNum, whereCol, low, high = where
+            whereValues = self.values(whereCol)
+        times, cycles = self.times(), self.cycles()
+        columnValues = [self.values(col) for col in columns]
+
+        for chunk in self.chunks:
+            if chunk.lastTime is not None:
+                if fromTime is not None and chunk.lastTime < fromTime: continue
+                if toTime is not None and chunk.firstTime >= toTime: continue
+                if where is not None:
+                    low_, high_ = chunk.ranges[whereNum]
+                    if math.isnan(low_) or high_ < low or low_ > high: continue
+            for row in self.rowRange(chunk, fromTime, toTime):
+                if where is not None and not (low <= whereValues[row] <= high): continue
+                yield times[row], cycles[row], [values[row] for values in columnValues]
+
+def parseTime(text):
+    "Unix time [s], or local ISO time, to ns"
+    try:
+        return int(float(text)*1e9)
+    except ValueError:
+        return int(datetime.datetime.fromisoformat(text).timestamp()*1e9)
+
+def formatTime(time_ns):
+    return datetime.datetime.fromtimestamp(time_ns/1e9).isoformat(timespec='microseconds')
+
+def info(log):
+    print("{}: {} rows in {} chunks of {}, every {} cycles of {} us{}".format(
+        log.path, log.rows, len(log.chunks), log.chunkRows, log.decimate, log.cycleTime_us,
+        '' if log.closed else ' (still open)'))
+    print("started {}".format(formatTime(log.startTime)))
+    if log.rows > 0:
+        times, cycles = log.times(), log.cycles()
+        print("rows from {} (cycle {}) to {} (cycle {})".format(
+            formatTime(times[0]), cycles[0], formatTime(times[log.rows-1]), cycles[log.rows-1]))
+    for n, col in enumerate(log.columns):
+        ranges = [chunk.ranges[n] for chunk in log.chunks if chunk.ranges is not None and not math.isnan(chunk.ranges[n][0])]
+        span = "min {:.7g} max {:.7g}".format(min(r[0] for r in ranges), max(r[1] for r in ranges)) if ranges else "no values indexed"
+        print("  {:<18} {:<24} {}".format(col.key, col.name, span))
+
+def main():
+    parser = argparse.ArgumentParser(description="Read a columnar time-series log (TSLOG_DIR, see src/tsLogger.h)")
+    parser.add_argument('path', help="directory of one run, TSLOG_DIR/YYYYmmdd-HHMMSS")
+    parser.add_argument('command', choices=['info', 'csv'])
+    parser.add_argument('--from', dest='fromTime', help="first time, unix [s] or local ISO")
+    parser.add_argument('--to', dest='toTime', help="end time (excluded), unix [s] or local ISO")
+    parser.add_argument('--columns', help="comma-separated slave:idx:subidx or names (default: all)")
+    parser.add_argument('--where', help="only rows with low <= column <= high, as column:low:high")
+    args = parser.parse_args()
+
+    log = TsLog(args.path)
+    if args.command == 'info':
+        info(log)
+        return
+
+    try:
+        if args.columns is not None:
+            columns = [log.column(key)[1] for key in args.columns.split(',')]
+        else:
+            columns = log.columns
+        where = None
+        if args.where is not None:
+            key, low, high = args.where.rsplit(':', 2)
+            where = log.column(key) + (float(low), float(high))
+    except (KeyError, ValueError) as e:
+        parser.error(str(e))
+
+    fromTime = parseTime(args.fromTime) if args.fromTime is not None else None
+    toTime   = parseTime(args.toTime) if args.toTime is not None else None
+
+    print(','.join(['time', 'cycle'] + [col.key for col in columns]))
+    for time, cycle, values in log.query(columns, fromTime, toTime, where):
+        print(','.join([formatTime(time), str(cycle)] + ['{:.17g}'.format(v) for v in values]))
+
+if __name__ == '__main__':
+    main()